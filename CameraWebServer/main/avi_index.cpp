@@ -0,0 +1,141 @@
+#include "esp_heap_caps.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Local files
+#include "avi_index.hpp"
+#include "makros.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char *TAG = "avi_index";
+#endif
+
+// Initial number of entries, the capacity is doubled until maxMemoryEntries is reached
+#define AVI_INDEX_INITIAL_CAPACITY 1024
+
+AVIIndex::AVIIndex(size_t maxMemoryEntries) : maxMemoryEntries(maxMemoryEntries) {
+}
+
+AVIIndex::~AVIIndex() {
+    clear();
+}
+
+void AVIIndex::clear() {
+    free(entries);
+    entries = NULL;
+    capacity = 0;
+    memoryCount = 0;
+
+    if (spillFile) {
+        fclose(spillFile);
+        spillFile = NULL;
+    }
+    if (spillPath[0]) {
+        remove(spillPath);
+    }
+    spilledCount = 0;
+}
+
+size_t AVIIndex::attach(const char *spillPath, bool existing) {
+    clear();
+
+    strncpy(this->spillPath, spillPath, sizeof(this->spillPath) - 1);
+
+    if (!existing) {
+        remove(spillPath);
+        return 0;
+    }
+
+    spillFile = fopen(spillPath, "rb+");
+    if (spillFile && fseek(spillFile, 0, SEEK_END) == 0) {
+        spilledCount = ftell(spillFile) / sizeof(AVIIndexEntry);
+    }
+
+    return spilledCount;
+}
+
+void AVIIndex::truncateSpilled(size_t count) {
+    spilledCount = MINEQ(count, spilledCount);
+}
+
+bool AVIIndex::grow() {
+    const size_t newCapacity = capacity ? MINEQ(capacity * 2, maxMemoryEntries) : MINEQ(AVI_INDEX_INITIAL_CAPACITY, maxMemoryEntries);
+
+    AVIIndexEntry *newEntries = (AVIIndexEntry *)heap_caps_realloc(entries, newCapacity * sizeof(AVIIndexEntry), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!newEntries) {
+        newEntries = (AVIIndexEntry *)realloc(entries, newCapacity * sizeof(AVIIndexEntry));
+    }
+    if (!newEntries) {
+        return false;
+    }
+
+    entries = newEntries;
+    capacity = newCapacity;
+
+    return true;
+}
+
+bool AVIIndex::openSpillFile() {
+    if (!spillFile) {
+        spillFile = fopen(spillPath, "wb+");
+    }
+
+    return spillFile != NULL;
+}
+
+bool AVIIndex::spill() {
+    if (!openSpillFile() || fseek(spillFile, spilledCount * sizeof(AVIIndexEntry), SEEK_SET)) {
+        ESP_LOGE(TAG, "Could not open index spill file!");
+        return false;
+    }
+
+    if (fwrite(entries, sizeof(AVIIndexEntry), memoryCount, spillFile) != memoryCount) {
+        ESP_LOGE(TAG, "Could not spill %u index entries!", memoryCount);
+        return false;
+    }
+    fflush(spillFile);
+
+    spilledCount += memoryCount;
+    memoryCount = 0;
+
+    return true;
+}
+
+bool AVIIndex::append(uint32_t offset, uint32_t size) {
+    if (memoryCount == capacity) {
+        // Either grow the buffer or move the buffered entries to the spill file
+        if ((capacity == maxMemoryEntries || !grow()) && (!memoryCount || !spill())) {
+            return false;
+        }
+    }
+
+    AVIIndexEntry &entry = entries[memoryCount++];
+    entry.offset = offset;
+    entry.size = size;
+
+    return true;
+}
+
+size_t AVIIndex::read(size_t first, AVIIndexEntry *out, size_t maxEntries) {
+    if (first >= size()) {
+        return 0;
+    }
+
+    if (first < spilledCount) {
+        const size_t count = MINEQ(maxEntries, spilledCount - first);
+        if (fseek(spillFile, first * sizeof(AVIIndexEntry), SEEK_SET)) {
+            return 0;
+        }
+        return fread(out, sizeof(AVIIndexEntry), count, spillFile);
+    }
+
+    const size_t memoryFirst = first - spilledCount;
+    const size_t count = MINEQ(maxEntries, memoryCount - memoryFirst);
+    memcpy(out, entries + memoryFirst, count * sizeof(AVIIndexEntry));
+
+    return count;
+}
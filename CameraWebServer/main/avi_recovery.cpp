@@ -0,0 +1,258 @@
+#include <string.h>
+
+// Local files
+#include "avi_helper.hpp"
+#include "avi_recovery.hpp"
+#include "makros.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char *TAG = "avi_recovery";
+#endif
+
+// Number of temporary index entries read at once
+#define RECOVERY_INDEX_BATCH 32
+
+static inline bool readAt(FILE *file, size_t offset, char *buf, size_t size) {
+    return fseek(file, offset, SEEK_SET) == 0 && fread(buf, 1, size, file) == size;
+}
+
+static inline size_t paddedChunkSize(size_t size) {
+    // Chunks are padded to an even size
+    return size + (size & 1);
+}
+
+static bool findMoviList(FILE *aviFile, size_t fileSize, size_t *moviSizeOffset) {
+    char buf[RIFF_LIST_HEADER_SIZE];
+
+    if (!readAt(aviFile, 0, buf, RIFF_LIST_HEADER_SIZE) || memcmp(buf, "RIFF", 4) || memcmp(buf + 8, "AVI ", 4)) {
+        return false;
+    }
+
+    // Walk the top level chunks until we reach the movi list
+    for (size_t offset = RIFF_LIST_HEADER_SIZE; offset + RIFF_LIST_HEADER_SIZE <= fileSize;) {
+        if (!readAt(aviFile, offset, buf, RIFF_LIST_HEADER_SIZE)) {
+            return false;
+        }
+
+        if (!memcmp(buf, "LIST", 4) && !memcmp(buf + 8, "movi", 4)) {
+            *moviSizeOffset = offset + 4;
+            return true;
+        }
+
+        offset += RIFF_CHUNK_HEADER_SIZE + paddedChunkSize(readLittleEndian(buf + 4));
+    }
+
+    return false;
+}
+
+// Follows the RIFF list sizes to the last complete 'AVIX' RIFF list header
+static void findLastRiff(FILE *aviFile, AVIRecoveryInfo *info) {
+    char buf[2 * RIFF_LIST_HEADER_SIZE];
+
+    info->riffCount = 1;
+    info->lastRiffStart = 0;
+    info->lastRiffMoviSizeOffset = info->moviSizeOffset;
+
+    // Closed RIFF lists always have their final size, the one of the last list is outdated
+    for (size_t riffStart = 0; readAt(aviFile, riffStart, buf, RIFF_CHUNK_HEADER_SIZE);) {
+        const size_t next = riffStart + RIFF_CHUNK_HEADER_SIZE + paddedChunkSize(readLittleEndian(buf + 4));
+
+        if (next + sizeof(buf) > info->fileSize || !readAt(aviFile, next, buf, sizeof(buf)) ||
+            memcmp(buf, "RIFF", 4) || memcmp(buf + 8, "AVIX", 4) || memcmp(buf + 12, "LIST", 4) || memcmp(buf + 20, "movi", 4)) {
+            break;
+        }
+
+        riffStart = next;
+        ++info->riffCount;
+        info->lastRiffStart = riffStart;
+        info->lastRiffMoviSizeOffset = riffStart + RIFF_LIST_HEADER_SIZE + 4;
+    }
+}
+
+// Returns the id the frames of the recording are tagged with, 0 if they are not tagged
+static uint32_t readRecordingId(FILE *aviFile) {
+    char buf[RIFF_CHUNK_HEADER_SIZE + AVI_DMLH_RECORDING_ID_OFFSET + 4];
+
+    if (!readAt(aviFile, AVI_DMLH_START - RIFF_CHUNK_HEADER_SIZE, buf, sizeof(buf)) || memcmp(buf, "dmlh", 4)) {
+        return 0;
+    }
+
+    return readLittleEndian(buf + RIFF_CHUNK_HEADER_SIZE + AVI_DMLH_RECORDING_ID_OFFSET);
+}
+
+static bool hasFrameTag(FILE *aviFile, size_t offset, size_t fileSize, uint32_t recordingId) {
+    char buf[AVI_FRAME_TAG_SIZE];
+
+    return offset + sizeof(buf) <= fileSize && readAt(aviFile, offset, buf, sizeof(buf)) && !memcmp(buf, "JUNK", 4) &&
+           readLittleEndian(buf + 4) == sizeof(buf) - RIFF_CHUNK_HEADER_SIZE && readLittleEndian(buf + RIFF_CHUNK_HEADER_SIZE) == recordingId;
+}
+
+// Returns true if the chunk at offset marks a repeated frame of the recording, indexOffset is set to the entry it repeats
+static bool readRepeatTag(FILE *aviFile, size_t offset, size_t fileSize, uint32_t recordingId, uint32_t *indexOffset) {
+    char buf[AVI_REPEAT_TAG_SIZE];
+
+    if (!recordingId || offset + sizeof(buf) > fileSize || !readAt(aviFile, offset, buf, sizeof(buf)) || memcmp(buf, "JUNK", 4) ||
+        readLittleEndian(buf + 4) != sizeof(buf) - RIFF_CHUNK_HEADER_SIZE || readLittleEndian(buf + RIFF_CHUNK_HEADER_SIZE) != recordingId) {
+        return false;
+    }
+
+    *indexOffset = readLittleEndian(buf + RIFF_CHUNK_HEADER_SIZE + 4);
+
+    return true;
+}
+
+// Returns the end of the last indexed chunk. Repeated frames at the end of the index are counted in
+// pendingRepeats, their tags are behind that chunk and must not be indexed again.
+static size_t loadSpilledIndex(FILE *aviFile, AVIIndex &index, AVIRecoveryInfo *info, size_t *pendingRepeats) {
+    const size_t moviFourCCOffset = info->moviSizeOffset + 4;
+    const size_t moviDataStart = moviFourCCOffset + 4;
+
+    size_t end = moviDataStart;
+    size_t lastChunk = 0;
+    size_t lastSize = 0;
+    *pendingRepeats = 0;
+
+    AVIIndexEntry entries[RECOVERY_INDEX_BATCH];
+    size_t read;
+    bool valid = true;
+    while (valid && (read = index.read(info->indexedFrames, entries, RECOVERY_INDEX_BATCH)) > 0) {
+        for (size_t i = 0; i < read; ++i) {
+            const size_t chunkOffset = moviFourCCOffset + entries[i].offset;
+            const size_t chunkEnd = chunkOffset + RIFF_CHUNK_HEADER_SIZE + paddedChunkSize(entries[i].size);
+
+            // Repeated frames always point at the chunk indexed last
+            if (info->indexedFrames && chunkOffset == lastChunk && entries[i].size == lastSize) {
+                ++*pendingRepeats;
+            } else if (chunkOffset < end || chunkEnd > info->fileSize) {
+                // Entries are written in file order and the data might not have reached the card yet
+                valid = false;
+                break;
+            } else {
+                *pendingRepeats = 0;
+            }
+
+            end = chunkEnd;
+            lastChunk = chunkOffset;
+            if (chunkOffset < info->lastRiffStart) {
+                ++info->lastRiffFirstFrame;
+            }
+            lastSize = entries[i].size;
+            info->maxFrameBytes = MAXEQ(info->maxFrameBytes, entries[i].size);
+            ++info->indexedFrames;
+        }
+    }
+
+    if (info->indexedFrames) {
+        // Verify that the last entry really points to a frame, else the index does not belong to this avi file
+        char buf[RIFF_CHUNK_HEADER_SIZE];
+        if (!readAt(aviFile, lastChunk, buf, RIFF_CHUNK_HEADER_SIZE) || memcmp(buf, "00dc", 4) || readLittleEndian(buf + 4) != lastSize) {
+            ESP_LOGW(TAG, "Spilled index does not match the avi file, scanning the movi list instead");
+            info->indexedFrames = 0;
+            info->maxFrameBytes = 0;
+            info->lastRiffFirstFrame = 0;
+            *pendingRepeats = 0;
+            end = moviDataStart;
+        } else {
+            info->lastFrameOffset = lastChunk;
+            info->lastFrameSize = lastSize;
+        }
+    }
+
+    index.truncateSpilled(info->indexedFrames);
+
+    return end;
+}
+
+bool recoverAVI(FILE *aviFile, AVIIndex &index, AVIRecoveryInfo *info) {
+    memset(info, 0, sizeof(*info));
+
+    if (fseek(aviFile, 0, SEEK_END)) {
+        return false;
+    }
+    info->fileSize = ftell(aviFile);
+
+    if (!findMoviList(aviFile, info->fileSize, &info->moviSizeOffset)) {
+        ESP_LOGE(TAG, "No movi list found!");
+        return false;
+    }
+
+    findLastRiff(aviFile, info);
+
+    const uint32_t recordingId = readRecordingId(aviFile);
+
+    const size_t moviFourCCOffset = info->moviSizeOffset + 4;
+
+    size_t pendingRepeats;
+    size_t offset = loadSpilledIndex(aviFile, index, info, &pendingRepeats);
+    info->frameCount = info->indexedFrames;
+
+    // Append entries for all complete chunks which are not yet part of the index
+    char buf[RIFF_LIST_HEADER_SIZE];
+    uint32_t indexOffset;
+    while (offset + RIFF_CHUNK_HEADER_SIZE <= info->fileSize && readAt(aviFile, offset, buf, MINEQ(RIFF_LIST_HEADER_SIZE, info->fileSize - offset))) {
+        // The index takes the size of the chunk header, the pad byte only counts for the layout
+        const size_t size = readLittleEndian(buf + 4);
+        const size_t chunkEnd = offset + RIFF_CHUNK_HEADER_SIZE + paddedChunkSize(size);
+
+        // Descend into the lists which follow a closed RIFF list
+        if (offset + RIFF_LIST_HEADER_SIZE <= info->fileSize &&
+            ((!memcmp(buf, "RIFF", 4) && !memcmp(buf + 8, "AVIX", 4)) || (!memcmp(buf, "LIST", 4) && !memcmp(buf + 8, "movi", 4)))) {
+            offset += RIFF_LIST_HEADER_SIZE;
+            continue;
+        }
+
+        if (chunkEnd > info->fileSize) {
+            break;
+        }
+
+        if (!memcmp(buf, "00dc", 4)) {
+            // Preallocated files contain stale data of the card behind the last frame, which might
+            // even be the frames of a deleted recording
+            if (recordingId && !hasFrameTag(aviFile, chunkEnd, info->fileSize, recordingId)) {
+                break;
+            }
+            if (!index.append(offset - moviFourCCOffset, size)) {
+                break;
+            }
+            info->maxFrameBytes = MAXEQ(info->maxFrameBytes, size);
+            info->lastFrameOffset = offset;
+            info->lastFrameSize = size;
+            if (offset < info->lastRiffStart) {
+                ++info->lastRiffFirstFrame;
+            }
+            ++info->frameCount;
+        } else if (readRepeatTag(aviFile, offset, info->fileSize, recordingId, &indexOffset)) {
+            // Repeats point at the last frame, anything else is stale data of an earlier run
+            if (!info->lastFrameSize || indexOffset != info->lastFrameOffset - moviFourCCOffset) {
+                break;
+            }
+            if (pendingRepeats) {
+                --pendingRepeats;
+            } else {
+                if (!index.append(indexOffset, info->lastFrameSize)) {
+                    break;
+                }
+                if (offset < info->lastRiffStart) {
+                    ++info->lastRiffFirstFrame;
+                }
+                ++info->frameCount;
+            }
+        } else if (!memcmp(buf, "idx1", 4) && offset >= info->lastRiffStart) {
+            // The file was already finalized, the index is written again behind the last frame
+            break;
+        } else if (memcmp(buf, "JUNK", 4) && memcmp(buf, "ix00", 4) && memcmp(buf, "idx1", 4)) {
+            // Neither a frame nor padding: this is where the torn tail starts
+            break;
+        }
+
+        offset = chunkEnd;
+    }
+
+    info->endOffset = offset;
+
+    return true;
+}
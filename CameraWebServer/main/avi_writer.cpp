@@ -0,0 +1,812 @@
+#include "esp_heap_caps.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Local files
+#include "avi_writer.hpp"
+#include "makros.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char *TAG = "avi_writer";
+#endif
+
+// Number of index entries converted per staging call when writing the idx1 chunk or a standard index
+#define IDX1_CONVERT_BATCH 64
+
+static void convertIdx1Entries(const AVIIndexEntry *entries, size_t count, char *converted) {
+    for (size_t i = 0; i < count; ++i) {
+        char *entry = converted + i * IDX1_ENTRY_SIZE;
+        memcpy(entry, "00dc", 4);
+        writeLittleEndian(entry + 4, AVIIF_KEYFRAME);
+        writeLittleEndian(entry + 8, entries[i].offset);
+        writeLittleEndian(entry + 12, entries[i].size);
+    }
+}
+
+// Header of a standard index with count entries, returns the size of its chunk data
+static size_t buildStdIndexHeader(char *indexHeader, size_t count, size_t riffStart) {
+    const size_t dataSize = AVI_STD_INDEX_HEADER_SIZE + count * AVI_STD_INDEX_ENTRY_SIZE;
+
+    memset(indexHeader, 0, RIFF_CHUNK_HEADER_SIZE + AVI_STD_INDEX_HEADER_SIZE);
+    memcpy(indexHeader, "ix00", 4);
+    writeLittleEndian(indexHeader + 4, dataSize);
+    // wLongsPerEntry, bIndexSubType and bIndexType
+    writeLittleEndian(indexHeader + 8, (AVI_STD_INDEX_ENTRY_SIZE / 4) | (AVI_INDEX_OF_CHUNKS << 24));
+    writeLittleEndian(indexHeader + 12, count);
+    memcpy(indexHeader + 16, "00dc", 4);
+    // qwBaseOffset, the entries point to the chunk data relative to the start of the RIFF list
+    writeLittleEndian(indexHeader + 20, riffStart);
+
+    return dataSize;
+}
+
+// Converts in place, every entry is a keyframe so bit 31 of the size stays clear
+static void convertStdIndexEntries(AVIIndexEntry *entries, size_t count, size_t moviFourCCOffset, size_t riffStart) {
+    for (size_t i = 0; i < count; ++i) {
+        char *entry = (char *)(entries + i);
+        const uint32_t size = entries[i].size;
+        writeLittleEndian(entry, moviFourCCOffset + entries[i].offset + RIFF_CHUNK_HEADER_SIZE - riffStart);
+        writeLittleEndian(entry + 4, size);
+    }
+}
+
+static void writeSuperIndexEntry(char *header, size_t position, size_t chunkOffset, size_t dataSize, size_t count) {
+    char *superIndexEntry = header + AVI_SUPER_INDEX_START + AVI_SUPER_INDEX_FIRST_ENTRY_OFFSET + position * AVI_SUPER_INDEX_ENTRY_SIZE;
+    // qwOffset, dwSize and dwDuration
+    writeLittleEndian(superIndexEntry, chunkOffset);
+    writeLittleEndian(superIndexEntry + 4, 0);
+    writeLittleEndian(superIndexEntry + 8, RIFF_CHUNK_HEADER_SIZE + dataSize);
+    writeLittleEndian(superIndexEntry + 12, count);
+}
+
+AVIWriter::AVIWriter(size_t stagingSize, size_t headerUpdateInterval, size_t maxIndexMemoryEntries, size_t riffSizeLimit) : index(maxIndexMemoryEntries), stagingSize(stagingSize), headerUpdateInterval(headerUpdateInterval), riffSizeLimit(riffSizeLimit) {
+    memset(&stats, 0, sizeof(stats));
+}
+
+AVIWriter::~AVIWriter() {
+    free(staging);
+}
+
+size_t AVIWriter::fileWrite(const char *data, size_t size) {
+    const int64_t start = esp_timer_get_time();
+    const size_t written = fwrite(data, 1, size, aviFile);
+    stats.ioTimeUs += esp_timer_get_time() - start;
+
+    ++stats.writeCalls;
+    stats.bytesWritten += written;
+
+    return written;
+}
+
+bool AVIWriter::fileSeek(size_t offset) {
+    const int64_t start = esp_timer_get_time();
+    const bool res = fseek(aviFile, offset, SEEK_SET) == 0;
+    stats.ioTimeUs += esp_timer_get_time() - start;
+
+    ++stats.seekCalls;
+
+    return res;
+}
+
+bool AVIWriter::allocateStaging() {
+    if (!staging) {
+        // Prefer PSRAM, the staging buffer is only touched by memcpy and fwrite
+        staging = (char *)heap_caps_malloc(stagingSize, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (!staging) {
+            staging = (char *)malloc(stagingSize);
+        }
+        if (!staging) {
+            ESP_LOGE(TAG, "Could not allocate %u bytes staging buffer!", stagingSize);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool AVIWriter::begin(FILE *aviFile, const char *indexSpillPath, uint32_t width, uint32_t height, uint32_t rate, uint32_t scale) {
+    if (!allocateStaging()) {
+        return false;
+    }
+
+    this->aviFile = aviFile;
+    index.attach(indexSpillPath, false);
+
+    windowOffset = 0;
+    stagingPos = 0;
+    flushedPos = 0;
+    framesSinceHeaderUpdate = 0;
+    frameCount = 0;
+    maxFrameBytes = 0;
+    lastFrameOffset = lastFrameSize = 0;
+    memset(&stats, 0, sizeof(stats));
+
+    openDMLCapable = true;
+    openDML = false;
+    riffStart = 0;
+    riffFirstFrame = 0;
+    firstRiffEnd = firstMoviEnd = firstRiffFrames = 0;
+    superIndexCount = 0;
+
+    videoRate = rate;
+    videoScale = scale;
+
+    AVIMainHeader aviHeader;
+    AVIStreamHeader streamHeader;
+    AVIStreamFormat streamFormat;
+    aviHeader.width = streamFormat.biWidth = width;
+    aviHeader.height = streamFormat.biHeight = height;
+    streamHeader.scale = scale;
+    streamHeader.rate = rate;
+    // (Seconds/Frames) * (Mircoseconds/Seconds) = Mircoseconds/Frame
+    aviHeader.microSecPerFrame = (scale * 1000000) / rate;
+
+    headerSize = writeAVIHeader(header, &moviSizeOffset, aviHeader, streamHeader, streamFormat, AVI_HEADER_RESERVED_SIZE, true);
+    riffMoviSizeOffset = moviSizeOffset;
+
+    // Never 0, which marks untagged recordings
+    recordingId = esp_random() | 1;
+    PATCH_FIELD(header, AVI_DMLH_START + AVI_DMLH_RECORDING_ID_OFFSET, recordingId);
+
+    // Write the header right away, the file must never start with stale data of the card
+    return stage(header, headerSize) && flush();
+}
+
+bool AVIWriter::takeOver(FILE *aviFile, size_t spilledEntries, AVIRecoveryInfo *info) {
+    if (!recoverAVI(aviFile, index, info)) {
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Took over %u of %u spilled index entries", info->indexedFrames, spilledEntries);
+
+    // Files of older versions have a smaller header, it ends right behind the 'movi' FOURCC
+    headerSize = info->moviSizeOffset + 8;
+
+    // The header is rewritten as a whole, so it must not contain any frame data
+    if (headerSize > sizeof(header) || info->endOffset < headerSize) {
+        ESP_LOGE(TAG, "Nothing to resume, the file ends within the header!");
+        return false;
+    }
+
+    if (!allocateStaging()) {
+        return false;
+    }
+
+    this->aviFile = aviFile;
+
+    if (fseek(aviFile, 0, SEEK_SET) || fread(header, 1, headerSize, aviFile) != headerSize) {
+        ESP_LOGE(TAG, "Could not read avi header!");
+        return false;
+    }
+
+    moviSizeOffset = info->moviSizeOffset;
+
+    const char *superIndex = header + AVI_SUPER_INDEX_START;
+    openDMLCapable = headerSize >= AVI_HEADER_RESERVED_SIZE && (!memcmp(superIndex, "JUNK", 4) || !memcmp(superIndex, "indx", 4));
+    openDML = openDMLCapable && !memcmp(superIndex, "indx", 4);
+    superIndexCount = openDML ? readLittleEndian(superIndex + AVI_SUPER_INDEX_ENTRIES_IN_USE_OFFSET) : 0;
+    recordingId = openDMLCapable ? readLittleEndian(header + AVI_DMLH_START + AVI_DMLH_RECORDING_ID_OFFSET) : 0;
+
+    // The header is committed whenever a RIFF list is closed, so it has to describe all but the last one
+    if (info->riffCount != superIndexCount + 1 || superIndexCount >= AVI_SUPER_INDEX_ENTRIES) {
+        ESP_LOGE(TAG, "Header describes %u RIFF lists but the file contains %u!", superIndexCount + 1, info->riffCount);
+        return false;
+    }
+
+    if (openDML) {
+        firstRiffFrames = readLittleEndian(superIndex + AVI_SUPER_INDEX_FIRST_ENTRY_OFFSET + 12);
+        firstRiffEnd = RIFF_CHUNK_HEADER_SIZE + readLittleEndian(header + AVI_RIFF_BLOCK_SIZE_OFFSET);
+        firstMoviEnd = moviSizeOffset + 4 + readLittleEndian(header + moviSizeOffset);
+    }
+    riffStart = info->lastRiffStart;
+    riffMoviSizeOffset = info->lastRiffMoviSizeOffset;
+    riffFirstFrame = info->lastRiffFirstFrame;
+    videoScale = readLittleEndian(header + AVI_STREAM_HEADER_START + PATCH_AVI_STREAM_HEADER_SCALE_OFFSET);
+    videoRate = readLittleEndian(header + AVI_STREAM_HEADER_START + PATCH_AVI_STREAM_HEADER_RATE_OFFSET);
+    if (!videoScale || !videoRate) {
+        videoScale = videoRate = 1;
+    }
+
+    frameCount = info->frameCount;
+    maxFrameBytes = info->maxFrameBytes;
+    lastFrameOffset = info->lastFrameOffset;
+    lastFrameSize = info->lastFrameSize;
+    framesSinceHeaderUpdate = 0;
+    memset(&stats, 0, sizeof(stats));
+
+    // Reload the current window such that the following writes stay aligned and the partial sector is rewritten
+    windowOffset = info->endOffset - info->endOffset % stagingSize;
+    stagingPos = info->endOffset - windowOffset;
+    flushedPos = stagingPos - stagingPos % AVI_SECTOR_SIZE;
+
+    if (fseek(aviFile, windowOffset, SEEK_SET) || fread(staging, 1, stagingPos, aviFile) != stagingPos || fseek(aviFile, windowOffset + flushedPos, SEEK_SET)) {
+        ESP_LOGE(TAG, "Could not reload the last window!");
+        return false;
+    }
+
+    return true;
+}
+
+bool AVIWriter::recover(FILE *aviFile, const char *indexSpillPath, AVIRecoveryInfo *info) {
+    const size_t spilledEntries = index.attach(indexSpillPath, true);
+
+    // Whatever step fails, the index, its spill file and the staging buffer are not held until the next begin
+    if (!takeOver(aviFile, spilledEntries, info)) {
+        discard();
+        return false;
+    }
+
+    return true;
+}
+
+bool AVIWriter::resume(FILE *aviFile, const char *indexSpillPath, size_t *tornBytes) {
+    AVIRecoveryInfo info;
+
+    if (!recover(aviFile, indexSpillPath, &info)) {
+        return false;
+    }
+
+    *tornBytes = info.fileSize - info.endOffset;
+
+    return true;
+}
+
+bool AVIWriter::stage(const char *data, size_t size) {
+    while (size) {
+        const size_t n = MINEQ(size, stagingSize - stagingPos);
+        memcpy(staging + stagingPos, data, n);
+        stagingPos += n;
+        data += n;
+        size -= n;
+
+        if (stagingPos == stagingSize && !flush()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool AVIWriter::stageZeros(size_t size) {
+    while (size) {
+        const size_t n = MINEQ(size, stagingSize - stagingPos);
+        memset(staging + stagingPos, 0, n);
+        stagingPos += n;
+        size -= n;
+
+        if (stagingPos == stagingSize && !flush()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool AVIWriter::padToSector() {
+    const size_t misalignment = currentOffset() % AVI_SECTOR_SIZE;
+
+    if (!misalignment) {
+        return true;
+    }
+
+    size_t gap = AVI_SECTOR_SIZE - misalignment;
+    // The gap has to be large enough to hold the JUNK chunk header
+    if (gap < RIFF_CHUNK_HEADER_SIZE) {
+        gap += AVI_SECTOR_SIZE;
+    }
+
+    char junkHeader[RIFF_CHUNK_HEADER_SIZE];
+    memcpy(junkHeader, "JUNK", 4);
+    writeLittleEndian(junkHeader + 4, gap - RIFF_CHUNK_HEADER_SIZE);
+
+    return stage(junkHeader, RIFF_CHUNK_HEADER_SIZE) && stageZeros(gap - RIFF_CHUNK_HEADER_SIZE);
+}
+
+bool AVIWriter::flush() {
+    if (stagingPos > flushedPos) {
+        const size_t size = stagingPos - flushedPos;
+        if (fileWrite(staging + flushedPos, size) != size) {
+            ESP_LOGE(TAG, "Could not write %u bytes at offset %u!", size, windowOffset + flushedPos);
+            return false;
+        }
+    }
+
+    // Move on to the next window once the current one is completely written
+    if (stagingPos == stagingSize) {
+        windowOffset += stagingSize;
+        stagingPos = 0;
+    }
+    flushedPos = stagingPos;
+
+    return true;
+}
+
+// moviEnd and riffEnd always describe the first RIFF list
+void AVIWriter::patchHeader(char *target, size_t moviEnd, size_t riffEnd) const {
+    AUTO_PATCH_SIZE(target, riffEnd, AVI_RIFF_BLOCK_SIZE_OFFSET);
+    AUTO_PATCH_SIZE(target, moviEnd, moviSizeOffset);
+
+    PATCH_FIELD(target, AVI_MAIN_HEADER_START + PATCH_AVI_MAIN_HEADER_MAX_BYTES_PER_SEC_OFFSET, (maxFrameBytes * videoRate) / videoScale);
+    // The main header only counts the frames of the first RIFF list, the stream header and dmlh count all of them
+    PATCH_FIELD(target, AVI_MAIN_HEADER_START + PATCH_AVI_MAIN_HEADER_TOTAL_FRAMES_OFFSET, openDML ? firstRiffFrames : frameCount);
+    PATCH_FIELD(target, AVI_STREAM_HEADER_START + PATCH_AVI_STREAM_HEADER_LENGTH_OFFSET, frameCount);
+
+    if (openDMLCapable) {
+        PATCH_FIELD(target, AVI_DMLH_START, frameCount);
+        PATCH_FIELD(target, AVI_SUPER_INDEX_START + AVI_SUPER_INDEX_ENTRIES_IN_USE_OFFSET, superIndexCount);
+    }
+}
+
+// Patches a field which might already be written to the file
+bool AVIWriter::patchFileField(size_t offset, uint32_t value) {
+    char buf[4];
+    writeLittleEndian(buf, value);
+
+    // Update the staged copy of every byte still inside the staging buffer
+    for (size_t i = 0; i < sizeof(buf); ++i) {
+        if (offset + i >= windowOffset && offset + i < currentOffset()) {
+            staging[offset + i - windowOffset] = buf[i];
+        }
+    }
+
+    if (offset >= windowOffset + flushedPos) {
+        return true;
+    }
+
+    return fileSeek(offset) &&
+           fileWrite(buf, sizeof(buf)) == sizeof(buf) &&
+           fileSeek(windowOffset + flushedPos);
+}
+
+bool AVIWriter::commitHeader() {
+    // As long as the first window was never written we can simply patch the staged copy
+    if (windowOffset == 0 && flushedPos == 0) {
+        memcpy(staging, header, headerSize);
+        return flush();
+    }
+
+    if (!flush()) {
+        return false;
+    }
+
+    // The header occupies whole sectors so this does not need a read-modify-write
+    return fileSeek(0) &&
+           fileWrite(header, headerSize) == headerSize &&
+           fileSeek(windowOffset + flushedPos);
+}
+
+bool AVIWriter::checkpoint() {
+    framesSinceHeaderUpdate = 0;
+
+    // Keep the partial flush sector aligned
+    if (!padToSector()) {
+        return false;
+    }
+
+    if (openDML) {
+        patchHeader(header, firstMoviEnd, firstRiffEnd);
+    } else {
+        const size_t end = currentOffset();
+        patchHeader(header, end, end);
+    }
+
+    return commitHeader();
+}
+
+// Size of the current RIFF list once it is closed after a frame with paddedSize bytes
+size_t AVIWriter::projectedRiffSize(size_t paddedSize) const {
+    const size_t framesInRiff = frameCount - riffFirstFrame + 1;
+
+    size_t size = currentOffset() - riffStart + RIFF_CHUNK_HEADER_SIZE + paddedSize + (recordingId ? AVI_FRAME_TAG_SIZE : 0);
+    // Standard index
+    size += RIFF_CHUNK_HEADER_SIZE + AVI_STD_INDEX_HEADER_SIZE + framesInRiff * AVI_STD_INDEX_ENTRY_SIZE;
+    // The first RIFF list also carries the legacy index
+    if (riffStart == 0) {
+        size += RIFF_CHUNK_HEADER_SIZE + framesInRiff * IDX1_ENTRY_SIZE;
+    }
+    // Sector padding in front of the next header update
+    return size + 2 * AVI_SECTOR_SIZE;
+}
+
+bool AVIWriter::writeFrame(const char *jpgFrame, size_t size) {
+    // Chunks are padded to an even size
+    const size_t paddedSize = size + (size & 1);
+
+    if (frameCount > riffFirstFrame && projectedRiffSize(paddedSize) > riffSizeLimit) {
+        if (!openDMLCapable || superIndexCount + 1 >= AVI_SUPER_INDEX_ENTRIES) {
+            ESP_LOGE(TAG, "RIFF list is full and no further one can be started!");
+            return false;
+        }
+        if (!startRiff()) {
+            return false;
+        }
+    }
+
+    if (riffStart + projectedRiffSize(paddedSize) > AVI_MAX_FILE_SIZE) {
+        ESP_LOGE(TAG, "Maximum file size reached!");
+        return false;
+    }
+
+    const size_t chunkOffset = currentOffset();
+
+    char chunkHeader[RIFF_CHUNK_HEADER_SIZE];
+    memcpy(chunkHeader, "00dc", 4);
+    writeLittleEndian(chunkHeader + 4, size);
+
+    if (!stage(chunkHeader, RIFF_CHUNK_HEADER_SIZE) || !stage(jpgFrame, size) || !stageZeros(paddedSize - size)) {
+        return false;
+    }
+
+    // Lets the recovery tell the frames of this recording from stale data behind them
+    if (recordingId) {
+        char frameTag[AVI_FRAME_TAG_SIZE];
+        memcpy(frameTag, "JUNK", 4);
+        writeLittleEndian(frameTag + 4, sizeof(frameTag) - RIFF_CHUNK_HEADER_SIZE);
+        writeLittleEndian(frameTag + 8, recordingId);
+
+        if (!stage(frameTag, sizeof(frameTag))) {
+            return false;
+        }
+    }
+
+    // The index offset is relative to the 'movi' FOURCC which directly follows the movi size field, the size
+    // is the one of the chunk header, players would take the pad byte for part of the jpeg
+    if (!index.append(chunkOffset - (moviSizeOffset + 4), size)) {
+        ESP_LOGE(TAG, "Could not store index entry!");
+        return false;
+    }
+
+    lastFrameOffset = chunkOffset;
+    lastFrameSize = size;
+    maxFrameBytes = MAXEQ(maxFrameBytes, size);
+
+    return frameAdded();
+}
+
+bool AVIWriter::repeatFrame() {
+    // Standard indexes can not point into previous RIFF lists and without a recording id the repeats could not be recovered
+    if (!lastFrameSize || lastFrameOffset < riffStart || !recordingId) {
+        return false;
+    }
+
+    // Rather write the frame again, which starts the next RIFF list if needed
+    if (projectedRiffSize(0) > riffSizeLimit || riffStart + projectedRiffSize(0) > AVI_MAX_FILE_SIZE) {
+        return false;
+    }
+
+    const uint32_t indexOffset = lastFrameOffset - (moviSizeOffset + 4);
+
+    char repeatTag[AVI_REPEAT_TAG_SIZE];
+    memcpy(repeatTag, "JUNK", 4);
+    writeLittleEndian(repeatTag + 4, sizeof(repeatTag) - RIFF_CHUNK_HEADER_SIZE);
+    writeLittleEndian(repeatTag + 8, recordingId);
+    writeLittleEndian(repeatTag + 12, indexOffset);
+
+    if (!stage(repeatTag, sizeof(repeatTag))) {
+        return false;
+    }
+
+    if (!index.append(indexOffset, lastFrameSize)) {
+        ESP_LOGE(TAG, "Could not store index entry!");
+        return false;
+    }
+
+    ++stats.repeatedFrames;
+
+    return frameAdded();
+}
+
+bool AVIWriter::frameAdded() {
+    ++frameCount;
+
+    if (headerUpdateInterval && ++framesSinceHeaderUpdate >= headerUpdateInterval) {
+        return checkpoint();
+    }
+
+    return true;
+}
+
+// Writes the legacy index of the first count frames
+bool AVIWriter::writeIndexChunk(size_t count) {
+    char chunkHeader[RIFF_CHUNK_HEADER_SIZE];
+    memcpy(chunkHeader, "idx1", 4);
+    writeLittleEndian(chunkHeader + 4, count * IDX1_ENTRY_SIZE);
+
+    if (!stage(chunkHeader, RIFF_CHUNK_HEADER_SIZE)) {
+        return false;
+    }
+
+    AVIIndexEntry entries[IDX1_CONVERT_BATCH];
+    char converted[IDX1_ENTRY_SIZE * IDX1_CONVERT_BATCH];
+
+    for (size_t first = 0, read; first < count; first += read) {
+        read = index.read(first, entries, MINEQ(IDX1_CONVERT_BATCH, count - first));
+        if (!read) {
+            ESP_LOGE(TAG, "Could not read index entry %u!", first);
+            return false;
+        }
+
+        convertIdx1Entries(entries, read, converted);
+
+        if (!stage(converted, read * IDX1_ENTRY_SIZE)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Closes the movi list of the current RIFF list with a standard index and references it from the super index
+bool AVIWriter::writeStdIndex() {
+    const size_t chunkOffset = currentOffset();
+    const size_t count = frameCount - riffFirstFrame;
+
+    char indexHeader[RIFF_CHUNK_HEADER_SIZE + AVI_STD_INDEX_HEADER_SIZE];
+    const size_t dataSize = buildStdIndexHeader(indexHeader, count, riffStart);
+
+    if (!stage(indexHeader, sizeof(indexHeader))) {
+        return false;
+    }
+
+    const size_t moviFourCCOffset = moviSizeOffset + 4;
+    AVIIndexEntry entries[IDX1_CONVERT_BATCH];
+
+    for (size_t first = riffFirstFrame, read; first < frameCount; first += read) {
+        read = index.read(first, entries, MINEQ(IDX1_CONVERT_BATCH, frameCount - first));
+        if (!read) {
+            ESP_LOGE(TAG, "Could not read index entry %u!", first);
+            return false;
+        }
+
+        convertStdIndexEntries(entries, read, moviFourCCOffset, riffStart);
+
+        if (!stage((const char *)entries, read * AVI_STD_INDEX_ENTRY_SIZE)) {
+            return false;
+        }
+    }
+
+    writeSuperIndexEntry(header, superIndexCount, chunkOffset, dataSize, count);
+    ++superIndexCount;
+
+    return true;
+}
+
+// Closes the current RIFF list and continues the movie in a new 'AVIX' RIFF list
+bool AVIWriter::startRiff() {
+    if (!writeStdIndex()) {
+        return false;
+    }
+
+    const size_t moviEnd = currentOffset();
+
+    if (!openDML) {
+        // Players without OpenDML support still get the frames of the first RIFF list
+        if (!writeIndexChunk(frameCount)) {
+            return false;
+        }
+
+        openDML = true;
+        firstRiffFrames = frameCount;
+        firstMoviEnd = moviEnd;
+        firstRiffEnd = currentOffset();
+
+        char *superIndex = header + AVI_SUPER_INDEX_START;
+        memcpy(superIndex, "indx", 4);
+        // wLongsPerEntry, bIndexSubType and bIndexType
+        writeLittleEndian(superIndex + RIFF_CHUNK_HEADER_SIZE, (AVI_SUPER_INDEX_ENTRY_SIZE / 4) | (AVI_INDEX_OF_INDEXES << 24));
+        memcpy(superIndex + RIFF_CHUNK_HEADER_SIZE + 8, "00dc", 4);
+
+        ESP_LOGI(TAG, "First RIFF list closed after %u frames, switching to OpenDML", frameCount);
+    } else if (!patchFileField(riffMoviSizeOffset, moviEnd - riffMoviSizeOffset - 4) ||
+               !patchFileField(riffStart + AVI_RIFF_BLOCK_SIZE_OFFSET, moviEnd - riffStart - RIFF_CHUNK_HEADER_SIZE)) {
+        return false;
+    }
+
+    riffStart = currentOffset();
+    riffFirstFrame = frameCount;
+
+    char listHeaders[2 * RIFF_LIST_HEADER_SIZE];
+    size_t offset = 0;
+    RIFF(listHeaders, &offset, "AVIX");
+    riffMoviSizeOffset = riffStart + LIST(listHeaders + offset, &offset, "movi");
+    // Sizes of the empty lists, they are patched once the list is closed
+    AUTO_PATCH_SIZE(listHeaders, offset, AVI_RIFF_BLOCK_SIZE_OFFSET);
+    AUTO_PATCH_SIZE(listHeaders, offset, riffMoviSizeOffset - riffStart);
+
+    // The recovery relies on the header describing every closed RIFF list
+    return stage(listHeaders, offset) && checkpoint();
+}
+
+bool AVIWriter::finish() {
+    bool res;
+    if (openDML) {
+        res = writeStdIndex();
+
+        const size_t end = currentOffset();
+        res = res && patchFileField(riffMoviSizeOffset, end - riffMoviSizeOffset - 4) &&
+              patchFileField(riffStart + AVI_RIFF_BLOCK_SIZE_OFFSET, end - riffStart - RIFF_CHUNK_HEADER_SIZE);
+
+        patchHeader(header, firstMoviEnd, firstRiffEnd);
+    } else {
+        const size_t moviEnd = currentOffset();
+        res = writeIndexChunk(frameCount);
+
+        patchHeader(header, moviEnd, currentOffset());
+    }
+    res = commitHeader() && res;
+
+    const int64_t ioTimeUs = MAXEQ(stats.ioTimeUs, 1);
+    ESP_LOGI(TAG, "%u frames (%u repeated): %u bytes in %u writes and %u seeks, %lld us IO time (%llu B/s)",
+             frameCount, stats.repeatedFrames, stats.bytesWritten, stats.writeCalls, stats.seekCalls, ioTimeUs, ((uint64_t)stats.bytesWritten * 1000000) / ioTimeUs);
+
+    discard();
+
+    return res;
+}
+
+void AVIWriter::discard() {
+    free(staging);
+    staging = NULL;
+    aviFile = NULL;
+    index.clear();
+}
+
+bool AVIWriter::snapshot(AVISnapshot *snapshot) {
+    memset(snapshot, 0, sizeof(*snapshot));
+
+    if (!staging) {
+        return false;
+    }
+
+    const size_t stagedSize = stagingPos - flushedPos;
+    // Allocate at least one byte, so a failed allocation is never mistaken for an empty copy
+    snapshot->staged = (char *)heap_caps_malloc(MAXEQ(stagedSize, 1), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    snapshot->entries = (AVIIndexEntry *)heap_caps_malloc(MAXEQ(frameCount, 1) * sizeof(AVIIndexEntry), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!snapshot->staged || !snapshot->entries) {
+        ESP_LOGE(TAG, "Could not allocate the snapshot of %u frames!", frameCount);
+        releaseAVISnapshot(snapshot);
+        return false;
+    }
+
+    for (size_t first = 0, read; first < frameCount; first += read) {
+        read = index.read(first, snapshot->entries + first, frameCount - first);
+        if (!read) {
+            ESP_LOGE(TAG, "Could not read index entry %u!", first);
+            releaseAVISnapshot(snapshot);
+            return false;
+        }
+    }
+
+    memcpy(snapshot->staged, staging + flushedPos, stagedSize);
+    memcpy(snapshot->header, header, headerSize);
+    snapshot->headerSize = headerSize;
+    snapshot->diskEnd = windowOffset + flushedPos;
+    snapshot->moviEnd = currentOffset();
+    snapshot->frameCount = frameCount;
+    snapshot->openDML = openDML;
+    snapshot->moviFourCCOffset = moviSizeOffset + 4;
+    snapshot->riffStart = riffStart;
+    snapshot->riffFirstFrame = riffFirstFrame;
+
+    if (openDML) {
+        // The last RIFF list is closed with a standard index right behind the last frame
+        const size_t count = frameCount - riffFirstFrame;
+        const size_t dataSize = AVI_STD_INDEX_HEADER_SIZE + count * AVI_STD_INDEX_ENTRY_SIZE;
+        const size_t end = snapshot->moviEnd + RIFF_CHUNK_HEADER_SIZE + dataSize;
+
+        patchHeader(snapshot->header, firstMoviEnd, firstRiffEnd);
+        writeSuperIndexEntry(snapshot->header, superIndexCount, snapshot->moviEnd, dataSize, count);
+        PATCH_FIELD(snapshot->header, AVI_SUPER_INDEX_START + AVI_SUPER_INDEX_ENTRIES_IN_USE_OFFSET, superIndexCount + 1);
+
+        snapshot->patches[0] = {riffMoviSizeOffset, (uint32_t)(end - riffMoviSizeOffset - 4)};
+        snapshot->patches[1] = {riffStart + AVI_RIFF_BLOCK_SIZE_OFFSET, (uint32_t)(end - riffStart - RIFF_CHUNK_HEADER_SIZE)};
+        snapshot->patchCount = 2;
+    } else {
+        patchHeader(snapshot->header, snapshot->moviEnd, snapshot->moviEnd + RIFF_CHUNK_HEADER_SIZE + frameCount * IDX1_ENTRY_SIZE);
+    }
+
+    return true;
+}
+
+void releaseAVISnapshot(AVISnapshot *snapshot) {
+    free(snapshot->staged);
+    free(snapshot->entries);
+    snapshot->staged = NULL;
+    snapshot->entries = NULL;
+}
+
+// Applies the size fields of the snapshot to a part of the file starting at offset
+static void applySnapshotPatches(const AVISnapshot &snapshot, size_t offset, char *data, size_t size) {
+    for (size_t p = 0; p < snapshot.patchCount; ++p) {
+        char buf[4];
+        writeLittleEndian(buf, snapshot.patches[p].value);
+
+        for (size_t i = 0; i < sizeof(buf); ++i) {
+            const size_t fieldOffset = snapshot.patches[p].offset + i;
+            if (fieldOffset >= offset && fieldOffset < offset + size) {
+                data[fieldOffset - offset] = buf[i];
+            }
+        }
+    }
+}
+
+bool writeAVISnapshot(const AVISnapshot &snapshot, FILE *aviFile, char *buf, size_t bufSize, AVISnapshotSink sink, void *arg) {
+    if (!sink(arg, snapshot.header, snapshot.headerSize)) {
+        return false;
+    }
+
+    if (fseek(aviFile, snapshot.headerSize, SEEK_SET) != 0) {
+        ESP_LOGE(TAG, "Could not seek to the first frame!");
+        return false;
+    }
+
+    bool res = true;
+    for (size_t offset = snapshot.headerSize; res && offset < snapshot.diskEnd;) {
+        const size_t size = MINEQ(bufSize, snapshot.diskEnd - offset);
+        if (fread(buf, 1, size, aviFile) != size) {
+            ESP_LOGE(TAG, "Could not read %u bytes at offset %u!", size, offset);
+            res = false;
+            break;
+        }
+
+        applySnapshotPatches(snapshot, offset, buf, size);
+        res = sink(arg, buf, size);
+        offset += size;
+    }
+
+    if (!res) {
+        return false;
+    }
+
+    // The staged bytes are a private copy, so they can be patched before they are sent
+    const size_t stagedSize = snapshot.moviEnd - snapshot.diskEnd;
+    applySnapshotPatches(snapshot, snapshot.diskEnd, snapshot.staged, stagedSize);
+    if (stagedSize && !sink(arg, snapshot.staged, stagedSize)) {
+        return false;
+    }
+
+    AVIIndexEntry entries[IDX1_CONVERT_BATCH];
+
+    if (snapshot.openDML) {
+        char indexHeader[RIFF_CHUNK_HEADER_SIZE + AVI_STD_INDEX_HEADER_SIZE];
+        buildStdIndexHeader(indexHeader, snapshot.frameCount - snapshot.riffFirstFrame, snapshot.riffStart);
+        if (!sink(arg, indexHeader, sizeof(indexHeader))) {
+            return false;
+        }
+
+        for (size_t first = snapshot.riffFirstFrame; first < snapshot.frameCount; first += IDX1_CONVERT_BATCH) {
+            const size_t count = MINEQ(IDX1_CONVERT_BATCH, snapshot.frameCount - first);
+            memcpy(entries, snapshot.entries + first, count * sizeof(AVIIndexEntry));
+            convertStdIndexEntries(entries, count, snapshot.moviFourCCOffset, snapshot.riffStart);
+
+            if (!sink(arg, (const char *)entries, count * AVI_STD_INDEX_ENTRY_SIZE)) {
+                return false;
+            }
+        }
+    } else {
+        char chunkHeader[RIFF_CHUNK_HEADER_SIZE];
+        memcpy(chunkHeader, "idx1", 4);
+        writeLittleEndian(chunkHeader + 4, snapshot.frameCount * IDX1_ENTRY_SIZE);
+        if (!sink(arg, chunkHeader, sizeof(chunkHeader))) {
+            return false;
+        }
+
+        char converted[IDX1_ENTRY_SIZE * IDX1_CONVERT_BATCH];
+        for (size_t first = 0; first < snapshot.frameCount; first += IDX1_CONVERT_BATCH) {
+            const size_t count = MINEQ(IDX1_CONVERT_BATCH, snapshot.frameCount - first);
+            convertIdx1Entries(snapshot.entries + first, count, converted);
+
+            if (!sink(arg, converted, count * IDX1_ENTRY_SIZE)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
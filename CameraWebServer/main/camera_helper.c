@@ -105,7 +105,8 @@ int initCamera() {
     //init with high specs to pre-allocate larger buffers
     config.frame_size = FRAMESIZE_UXGA;
     config.jpeg_quality = 10;
-    config.fb_count = 2;
+    // One buffer more than the streams and the timelapse usually hold, so a slow viewer does not stall the capture
+    config.fb_count = 3;
 
     // camera init
     esp_err_t err = esp_camera_init(&config);
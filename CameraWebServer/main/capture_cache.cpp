@@ -0,0 +1,37 @@
+#include "esp_heap_caps.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Local files
+#include "capture_cache.hpp"
+
+CaptureCache::~CaptureCache() {
+    free(buffer);
+}
+
+bool CaptureCache::store(const char *jpg, size_t jpgLen, int64_t jpgTimeUs, uint32_t jpgVersion) {
+    if (jpgLen > size) {
+        free(buffer);
+        size = 0;
+        len = 0;
+
+        // Some room, so the next frames of the same resolution fit as well
+        const size_t newSize = jpgLen + jpgLen / 4;
+        buffer = (char *)heap_caps_malloc(newSize, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (!buffer) {
+            return false;
+        }
+        size = newSize;
+    }
+
+    memcpy(buffer, jpg, jpgLen);
+    len = jpgLen;
+    timeUs = jpgTimeUs;
+    version = jpgVersion;
+
+    return true;
+}
+
+bool CaptureCache::fresh(int maxAgeMs, int64_t nowUs, uint32_t currentVersion) const {
+    return len && maxAgeMs > 0 && version == currentVersion && nowUs - timeUs <= maxAgeMs * 1000LL;
+}
@@ -0,0 +1,382 @@
+#include "esp_camera.h"
+#include "esp_timer.h"
+#include <string.h>
+
+// Local files
+#include "flashlight.h"
+#include "frame_broker.hpp"
+#include "makros.h"
+
+//FreeRTOS
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+// Include the config
+#include "config.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char *TAG = "frame_broker";
+#endif
+
+// Every shared frame holds a driver buffer, so there are never more than the driver has
+#define FRAME_BROKER_MAX_FRAMES 4
+/*
+    Stale frames which are skipped for one fresh frame at most. The driver holds fb_count frames which
+    may predate the request, plus the one which was exposing when it arrived.
+*/
+#define FRAME_BROKER_MAX_STALE_FRAMES 4
+// Frames after which the measured frame period is renewed, so it follows framesize and exposure changes
+#define FRAME_PERIOD_WINDOW 16
+
+struct FrameSubscriber {
+    QueueHandle_t queue;
+    FrameDropPolicy policy;
+    bool continuous;
+    volatile bool requested;
+    // Frames which started exposing earlier are not delivered, 0 for any frame
+    int64_t notBeforeUs;
+    bool used;
+    size_t dropped;
+};
+
+static TaskHandle_t brokerTask;
+static SemaphoreHandle_t subscriberLock = NULL;
+static FrameSubscriber subscribers[FRAME_BROKER_MAX_SUBSCRIBERS];
+
+// Only one job at a time, the caller waits for its completion
+static SemaphoreHandle_t jobLock = NULL;
+static SemaphoreHandle_t jobDone = NULL;
+static FrameBrokerJob volatile job = NULL;
+static void *jobArg;
+static int jobResult;
+static size_t jobSettleFrames;
+static size_t settleFrames = 0;
+// Frames which started exposing before the end of the last job were exposed while it changed the sensor
+static int64_t jobEndUs = 0;
+static bool settling = false;
+
+// Shortest time between the starts of two frames, the exposure of a frame starts at most this long before it
+static int64_t framePeriodUs = 0;
+static int64_t windowPeriodUs;
+static size_t periodSamples = 0;
+static int64_t lastStartUs = 0;
+
+static FrameBrokerStats stats;
+
+static portMUX_TYPE frameLock = portMUX_INITIALIZER_UNLOCKED;
+static SharedFrame frames[FRAME_BROKER_MAX_FRAMES];
+
+static SharedFrame *wrapFrame(camera_fb_t *fb) {
+    SharedFrame *frame = NULL;
+
+    portENTER_CRITICAL(&frameLock);
+    for (size_t i = 0; i < FRAME_BROKER_MAX_FRAMES; ++i) {
+        if (!frames[i].refs) {
+            frame = &frames[i];
+            frame->fb = fb;
+            frame->refs = 1;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&frameLock);
+
+    return frame;
+}
+
+void frameBrokerRetain(SharedFrame *frame) {
+    portENTER_CRITICAL(&frameLock);
+    ++frame->refs;
+    portEXIT_CRITICAL(&frameLock);
+}
+
+void frameBrokerRelease(SharedFrame *frame) {
+    // Once refs drops to 0 the broker may reuse the slot, so the buffer is taken while the lock is held
+    portENTER_CRITICAL(&frameLock);
+    const uint32_t refs = --frame->refs;
+    camera_fb_t *fb = frame->fb;
+    portEXIT_CRITICAL(&frameLock);
+
+    if (!refs) {
+        esp_camera_fb_return(fb);
+    }
+}
+
+/*
+    The driver stamps a frame when its readout starts. With a rolling shutter the first line was exposed
+    during the frame before, so the exposure started at most one frame period earlier.
+*/
+static int64_t exposureStartUs(const camera_fb_t *fb) {
+    return fb->timestamp.tv_sec * 1000000LL + fb->timestamp.tv_usec - framePeriodUs;
+}
+
+static void trackFramePeriod(const camera_fb_t *fb) {
+    const int64_t startUs = fb->timestamp.tv_sec * 1000000LL + fb->timestamp.tv_usec;
+    const int64_t periodUs = startUs - lastStartUs;
+    const bool first = !lastStartUs;
+    lastStartUs = startUs;
+
+    // Frames dropped by the driver or pauses of the broker only make the time longer, the minimum is the period
+    if (first || periodUs <= 0) {
+        return;
+    }
+    windowPeriodUs = periodSamples ? MINEQ(windowPeriodUs, periodUs) : periodUs;
+    if (!framePeriodUs || periodUs < framePeriodUs) {
+        framePeriodUs = periodUs;
+    }
+    if (++periodSamples == FRAME_PERIOD_WINDOW) {
+        framePeriodUs = windowPeriodUs;
+        periodSamples = 0;
+    }
+}
+
+camera_fb_t *frameBrokerFetch(int64_t notBeforeUs) {
+    for (size_t stale = 0;; ++stale) {
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (!fb) {
+            return NULL;
+        }
+        trackFramePeriod(fb);
+
+        if (exposureStartUs(fb) >= notBeforeUs || stale == FRAME_BROKER_MAX_STALE_FRAMES) {
+            return fb;
+        }
+
+        // Hand the buffer back right away, so the driver can capture into it
+        esp_camera_fb_return(fb);
+        ++stats.staleFrames;
+    }
+}
+
+static inline bool accepts(const FrameSubscriber *subscriber, int64_t startUs) {
+    return subscriber->used && (subscriber->continuous || (subscriber->requested && startUs >= subscriber->notBeforeUs));
+}
+
+static void deliver(FrameSubscriber *subscriber, SharedFrame *frame, int64_t startUs) {
+    frameBrokerRetain(frame);
+
+    if (xQueueSend(subscriber->queue, &frame, 0) != pdTRUE) {
+        SharedFrame *oldest;
+        // The subscriber might have taken the oldest frame in the meantime, then there is room anyway
+        if (subscriber->policy == FRAME_DROP_OLDEST && xQueueReceive(subscriber->queue, &oldest, 0) == pdTRUE) {
+            frameBrokerRelease(oldest);
+        }
+        if (subscriber->policy == FRAME_DROP_NEWEST || xQueueSend(subscriber->queue, &frame, 0) != pdTRUE) {
+            frameBrokerRelease(frame);
+        }
+        ++subscriber->dropped;
+    }
+
+    if (subscriber->requested && subscriber->notBeforeUs) {
+        const int64_t latencyUs = startUs - subscriber->notBeforeUs;
+        stats.lastLatencyUs = latencyUs;
+        stats.maxLatencyUs = MAXEQ(stats.maxLatencyUs, stats.lastLatencyUs);
+    }
+    subscriber->requested = false;
+}
+
+// Sets notBeforeUs to the earliest exposure start which any subscriber takes
+static bool wantsFrame(int64_t *notBeforeUs) {
+    bool wanted = false;
+
+    for (size_t i = 0; i < FRAME_BROKER_MAX_SUBSCRIBERS; ++i) {
+        const FrameSubscriber *subscriber = &subscribers[i];
+        if (!subscriber->used || (!subscriber->continuous && !subscriber->requested)) {
+            continue;
+        }
+
+        const int64_t subscriberUs = subscriber->continuous ? 0 : subscriber->notBeforeUs;
+        *notBeforeUs = wanted ? MINEQ(*notBeforeUs, subscriberUs) : subscriberUs;
+        wanted = true;
+    }
+
+    return wanted;
+}
+
+static void brokerTaskRoutine(void *arg) {
+    for (;;) {
+        // The previous frame is delivered and the next one not yet taken
+        if (job) {
+            jobResult = job(jobArg);
+            job = NULL;
+            jobEndUs = esp_timer_get_time();
+            settleFrames = jobSettleFrames;
+            settling = true;
+            xSemaphoreGive(jobDone);
+        }
+
+        int64_t notBeforeUs;
+        if (!wantsFrame(&notBeforeUs)) {
+            // Woken by new subscribers and requests
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        // Frames which are thrown away are taken without the flash
+        camera_fb_t *fb = settleFrames ? frameBrokerFetch(jobEndUs) : takePicture(MAXEQ(notBeforeUs, jobEndUs));
+        if (!fb) {
+            ESP_LOGE(TAG, "Camera capture failed!");
+            vTaskDelay(pdMS_TO_TICKS(100));
+            continue;
+        }
+
+        if (settleFrames) {
+            --settleFrames;
+            esp_camera_fb_return(fb);
+            continue;
+        }
+
+        SharedFrame *frame = wrapFrame(fb);
+        if (!frame) {
+            ESP_LOGE(TAG, "No free frame slot!");
+            esp_camera_fb_return(fb);
+            continue;
+        }
+
+        if (settling) {
+            settling = false;
+            stats.lastSettleUs = esp_timer_get_time() - jobEndUs;
+        }
+
+        // Fresh requests which came after the exposure started keep waiting for the next frame
+        const int64_t startUs = exposureStartUs(fb);
+        xSemaphoreTake(subscriberLock, portMAX_DELAY);
+        for (size_t i = 0; i < FRAME_BROKER_MAX_SUBSCRIBERS; ++i) {
+            FrameSubscriber *subscriber = &subscribers[i];
+            if (accepts(subscriber, startUs)) {
+                deliver(subscriber, frame, startUs);
+            }
+        }
+        xSemaphoreGive(subscriberLock);
+
+        // Drop the reference of the broker, the subscribers hold their own
+        frameBrokerRelease(frame);
+    }
+}
+
+FrameSubscriber *frameBrokerSubscribe(size_t depth, FrameDropPolicy policy, bool continuous) {
+    FrameSubscriber *subscriber = NULL;
+
+    xSemaphoreTake(subscriberLock, portMAX_DELAY);
+    for (size_t i = 0; i < FRAME_BROKER_MAX_SUBSCRIBERS; ++i) {
+        if (!subscribers[i].used) {
+            subscriber = &subscribers[i];
+            break;
+        }
+    }
+
+    if (subscriber) {
+        subscriber->queue = xQueueCreate(depth, sizeof(SharedFrame *));
+        if (subscriber->queue) {
+            subscriber->policy = policy;
+            subscriber->continuous = continuous;
+            subscriber->requested = false;
+            subscriber->notBeforeUs = 0;
+            subscriber->dropped = 0;
+            subscriber->used = true;
+        } else {
+            subscriber = NULL;
+        }
+    }
+    xSemaphoreGive(subscriberLock);
+
+    if (!subscriber) {
+        ESP_LOGE(TAG, "Could not add a frame subscriber!");
+    } else if (continuous) {
+        xTaskNotifyGive(brokerTask);
+    }
+
+    return subscriber;
+}
+
+// Must be called with the subscriber lock held
+static void drainSubscriber(FrameSubscriber *subscriber) {
+    subscriber->requested = false;
+
+    SharedFrame *frame;
+    while (xQueueReceive(subscriber->queue, &frame, 0) == pdTRUE) {
+        frameBrokerRelease(frame);
+    }
+}
+
+void frameBrokerCancel(FrameSubscriber *subscriber) {
+    xSemaphoreTake(subscriberLock, portMAX_DELAY);
+    drainSubscriber(subscriber);
+    xSemaphoreGive(subscriberLock);
+}
+
+void frameBrokerUnsubscribe(FrameSubscriber *subscriber) {
+    xSemaphoreTake(subscriberLock, portMAX_DELAY);
+    subscriber->used = false;
+    drainSubscriber(subscriber);
+    vQueueDelete(subscriber->queue);
+    subscriber->queue = NULL;
+    xSemaphoreGive(subscriberLock);
+}
+
+void frameBrokerRequest(FrameSubscriber *subscriber) {
+    subscriber->notBeforeUs = 0;
+    subscriber->requested = true;
+    xTaskNotifyGive(brokerTask);
+}
+
+void frameBrokerRequestFresh(FrameSubscriber *subscriber) {
+    // Set before the request becomes visible to the broker
+    subscriber->notBeforeUs = esp_timer_get_time();
+    subscriber->requested = true;
+    xTaskNotifyGive(brokerTask);
+}
+
+SharedFrame *frameBrokerReceive(FrameSubscriber *subscriber, TickType_t wait) {
+    SharedFrame *frame;
+
+    return xQueueReceive(subscriber->queue, &frame, wait) == pdTRUE ? frame : NULL;
+}
+
+size_t frameBrokerDropped(const FrameSubscriber *subscriber) {
+    return subscriber->dropped;
+}
+
+FrameBrokerStats getFrameBrokerStats() {
+    return stats;
+}
+
+int frameBrokerRunBetweenFrames(FrameBrokerJob fn, void *arg, size_t settle) {
+    xSemaphoreTake(jobLock, portMAX_DELAY);
+    jobArg = arg;
+    jobSettleFrames = settle;
+    job = fn;
+    xTaskNotifyGive(brokerTask);
+    xSemaphoreTake(jobDone, portMAX_DELAY);
+    const int result = jobResult;
+    xSemaphoreGive(jobLock);
+
+    return result;
+}
+
+void frameBrokerSetup() {
+    subscriberLock = xSemaphoreCreateMutex();
+    jobLock = xSemaphoreCreateMutex();
+    jobDone = xSemaphoreCreateBinary();
+
+    xTaskCreatePinnedToCore(
+        brokerTaskRoutine,
+        "FrameBroker",
+        3072,
+        NULL,
+        2,
+        &brokerTask,
+#if CAM_FETCH_TASK_CORE0
+        0
+#elif CAM_FETCH_TASK_CORE1
+        1
+#else
+        -1
+#endif
+    );
+}
@@ -0,0 +1,93 @@
+#include "esp_heap_caps.h"
+#include "img_converters.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Local files
+#include "frame_buffer.hpp"
+#include "makros.h"
+
+// Include the config
+#include "config.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char *TAG = "frame_buffer";
+#endif
+
+FrameBuffer::~FrameBuffer() {
+    free(buffer);
+}
+
+void FrameBuffer::release() {
+    free(buffer);
+    buffer = NULL;
+    capacity = len = 0;
+}
+
+// Some room on top, so the next frames of the same resolution fit as well
+bool FrameBuffer::grow(size_t size, bool keep) {
+    if (size <= capacity) {
+        return true;
+    }
+
+    const size_t newCapacity = size + size / 4;
+    char *newBuffer;
+    if (keep) {
+        newBuffer = (char *)heap_caps_realloc(buffer, newCapacity, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    } else {
+        release();
+        newBuffer = (char *)heap_caps_malloc(newCapacity, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    }
+
+    if (!newBuffer) {
+        ESP_LOGE(TAG, "Could not allocate %u bytes for a frame!", newCapacity);
+        return false;
+    }
+
+    buffer = newBuffer;
+    capacity = newCapacity;
+    return true;
+}
+
+bool FrameBuffer::reserve(size_t size) {
+    headroom = len = 0;
+    return grow(size, false);
+}
+
+size_t FrameBuffer::append(void *arg, size_t index, const void *data, size_t size) {
+    FrameBuffer *frame = (FrameBuffer *)arg;
+
+    if (!frame->grow(frame->headroom + frame->len + size, true)) {
+        return 0;
+    }
+
+    memcpy(frame->buffer + frame->headroom + frame->len, data, size);
+    frame->len += size;
+    return size;
+}
+
+bool FrameBuffer::copy(camera_fb_t *fb, size_t headroom) {
+    this->headroom = headroom;
+    len = 0;
+
+    if (fb->format == PIXFORMAT_JPEG) {
+        if (!grow(headroom + fb->len, false)) {
+            return false;
+        }
+        memcpy(buffer + headroom, fb->buf, fb->len);
+        len = fb->len;
+        return true;
+    }
+
+    if (!frame2jpg_cb(fb, JPG_QUALITY, append, this)) {
+        ESP_LOGE(TAG, "JPEG compression failed");
+        len = 0;
+        return false;
+    }
+
+    return true;
+}
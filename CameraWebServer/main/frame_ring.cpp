@@ -0,0 +1,121 @@
+#include "esp_heap_caps.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Local files
+#include "frame_ring.hpp"
+#include "makros.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char *TAG = "frame_ring";
+#endif
+
+// Frames start word aligned
+#define FRAME_RING_ALIGNMENT 4
+
+FrameRing::FrameRing(size_t size) : size(size) {
+    memset(&stats, 0, sizeof(stats));
+}
+
+FrameRing::~FrameRing() {
+    free(buffer);
+}
+
+bool FrameRing::allocate() {
+    if (!buffer && size) {
+        // Only PSRAM is large enough for more than a few frames
+        buffer = (char *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (!buffer) {
+            ESP_LOGW(TAG, "Could not allocate %u bytes frame ring, frames keep their broker frame!", size);
+        }
+    }
+
+    return buffer != NULL;
+}
+
+void FrameRing::resetStats() {
+    portENTER_CRITICAL(&lock);
+    memset(&stats, 0, sizeof(stats));
+    stats.highWaterBytes = usedBytes;
+    stats.highWaterFrames = usedFrames;
+    portEXIT_CRITICAL(&lock);
+}
+
+// Finds len contiguous bytes behind the newest frame, wrapping around to the start if the end is too short
+bool FrameRing::reserve(size_t len, size_t *offset, size_t *span) {
+    bool res = true;
+
+    portENTER_CRITICAL(&lock);
+
+    if (!usedBytes) {
+        // Start over at the beginning, so the whole ring is contiguous again
+        head = tail = 0;
+    }
+
+    if (usedBytes && head <= tail) {
+        // The free space is the gap between the newest and the oldest frame
+        *offset = head;
+        *span = len;
+        res = head + len <= tail;
+    } else if (head + len <= size) {
+        *offset = head;
+        *span = len;
+    } else {
+        // The frame takes the unused end of the ring as well
+        *offset = 0;
+        *span = size - head + len;
+        res = len <= tail;
+    }
+
+    if (res) {
+        head = (*offset + len) % size;
+        usedBytes += *span;
+        ++usedFrames;
+
+        ++stats.copiedFrames;
+        stats.highWaterBytes = MAXEQ(stats.highWaterBytes, usedBytes);
+        stats.highWaterFrames = MAXEQ(stats.highWaterFrames, usedFrames);
+    } else {
+        ++stats.overflowFrames;
+    }
+
+    portEXIT_CRITICAL(&lock);
+
+    return res;
+}
+
+void FrameRing::put(SharedFrame *shared, RingFrame *frame) {
+    const camera_fb_t *fb = shared->fb;
+    const size_t len = (fb->len + FRAME_RING_ALIGNMENT - 1) & ~(FRAME_RING_ALIGNMENT - 1);
+    size_t offset;
+
+    frame->fb = *fb;
+    frame->shared = shared;
+    frame->span = 0;
+
+    // The copy happens outside the lock, the reserved bytes are not touched by the consumer yet
+    if (buffer && len <= size && reserve(len, &offset, &frame->span)) {
+        memcpy(buffer + offset, fb->buf, fb->len);
+        frame->fb.buf = (uint8_t *)buffer + offset;
+        frame->shared = NULL;
+
+        frameBrokerRelease(shared);
+    }
+}
+
+void FrameRing::release(RingFrame *frame) {
+    if (frame->shared) {
+        frameBrokerRelease(frame->shared);
+        return;
+    }
+
+    portENTER_CRITICAL(&lock);
+    tail = (tail + frame->span) % size;
+    usedBytes -= frame->span;
+    --usedFrames;
+    portEXIT_CRITICAL(&lock);
+}
@@ -0,0 +1,109 @@
+#include "esp_jpg_decode.h"
+#include <string.h>
+
+// Local files
+#include "frame_signature.hpp"
+#include "makros.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char *TAG = "frame_signature";
+#endif
+
+#define FRAME_SIGNATURE_CELLS (FRAME_SIGNATURE_COLS * FRAME_SIGNATURE_ROWS)
+
+typedef struct {
+    const uint8_t *jpg;
+    // Size of the decoded (1/8 scale) image
+    uint16_t width;
+    uint16_t height;
+    uint32_t sums[FRAME_SIGNATURE_CELLS];
+} SignatureDecoder;
+
+static size_t readJpg(void *arg, size_t index, uint8_t *buf, size_t len) {
+    const SignatureDecoder *decoder = (const SignatureDecoder *)arg;
+
+    // A NULL buffer asks to skip the data
+    if (buf) {
+        memcpy(buf, decoder->jpg + index, len);
+    }
+
+    return len;
+}
+
+// Called with the RGB888 pixels of every decoded block, the first and last call carry no data
+static bool accumulateBlock(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data) {
+    SignatureDecoder *decoder = (SignatureDecoder *)arg;
+
+    if (!data) {
+        if (x == 0 && y == 0) {
+            decoder->width = w;
+            decoder->height = h;
+        }
+        return true;
+    }
+
+    if (!decoder->width || !decoder->height) {
+        return false;
+    }
+
+    for (uint16_t row = y; row < y + h; ++row) {
+        uint32_t *sums = decoder->sums + (row * FRAME_SIGNATURE_ROWS / decoder->height) * FRAME_SIGNATURE_COLS;
+
+        for (uint16_t col = x; col < x + w; ++col, data += 3) {
+            // Integer approximation of BT.601 luma
+            sums[col * FRAME_SIGNATURE_COLS / decoder->width] += (data[0] * 77 + data[1] * 150 + data[2] * 29) >> 8;
+        }
+    }
+
+    return true;
+}
+
+// Number of pixels of the image which fall into the cell, cells do not have the same size if the image size is no multiple of the grid
+static inline uint32_t cellPixels(size_t cell, uint16_t width, uint16_t height) {
+    const size_t col = cell % FRAME_SIGNATURE_COLS;
+    const size_t row = cell / FRAME_SIGNATURE_COLS;
+
+    // First pixel which maps to the cell (and the next one), i.e. the inverse of the mapping above
+    const uint32_t x0 = (col * width + FRAME_SIGNATURE_COLS - 1) / FRAME_SIGNATURE_COLS;
+    const uint32_t x1 = ((col + 1) * width + FRAME_SIGNATURE_COLS - 1) / FRAME_SIGNATURE_COLS;
+    const uint32_t y0 = (row * height + FRAME_SIGNATURE_ROWS - 1) / FRAME_SIGNATURE_ROWS;
+    const uint32_t y1 = ((row + 1) * height + FRAME_SIGNATURE_ROWS - 1) / FRAME_SIGNATURE_ROWS;
+
+    return (x1 - x0) * (y1 - y0);
+}
+
+bool computeFrameSignature(const uint8_t *jpg, size_t len, FrameSignature *signature) {
+    SignatureDecoder decoder;
+    memset(&decoder, 0, sizeof(decoder));
+    decoder.jpg = jpg;
+
+    signature->valid = false;
+
+    if (esp_jpg_decode(len, JPG_SCALE_8X, readJpg, accumulateBlock, &decoder) != ESP_OK) {
+        ESP_LOGW(TAG, "Could not decode the frame!");
+        return false;
+    }
+
+    for (size_t i = 0; i < FRAME_SIGNATURE_CELLS; ++i) {
+        const uint32_t pixels = cellPixels(i, decoder.width, decoder.height);
+        signature->luma[i] = pixels ? decoder.sums[i] / pixels : 0;
+    }
+    signature->valid = true;
+
+    return true;
+}
+
+uint8_t frameSignatureDistance(const FrameSignature &a, const FrameSignature &b) {
+    uint8_t distance = 0;
+
+    for (size_t i = 0; i < FRAME_SIGNATURE_CELLS; ++i) {
+        const uint8_t diff = a.luma[i] >= b.luma[i] ? a.luma[i] - b.luma[i] : b.luma[i] - a.luma[i];
+        distance = MAXEQ(distance, diff);
+    }
+
+    return distance;
+}
@@ -1,5 +1,7 @@
 #include "esp_http_server.h"
 #include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #ifdef CONFIG_FATFS_LFN_NONE
@@ -9,7 +11,9 @@
 // Local files
 #include "config.h"
 #include "fs_browser.h"
+#include "json_writer.hpp"
 #include "makros.h"
+#include "request_arena.hpp"
 #include "web_utils.h"
 
 static inline bool isDir(struct dirent *entry) {
@@ -24,7 +28,7 @@ static inline bool isDir(struct stat *file_stat) {
 #define FILE_TYPE 1
 #define NONE_TYPE 0
 
-static inline int getType(char *absolutePath) {
+static inline int getType(const char *absolutePath) {
     struct stat file_stat;
 
     if (stat(absolutePath, &file_stat)) {
@@ -51,7 +55,7 @@ static inline bool listDirectory(const char *absolutePath, bool (*callback)(cons
     return res;
 }
 
-static inline bool isBlacklisted(const char *restrict file) {
+static inline bool isBlacklisted(const char *file) {
 #ifdef CONFIG_FATFS_LFN_NONE
     // We need to convert to uppercase for comparison
     char cmp[sizeof(CONFIG_FILE_PATH)];
@@ -66,56 +70,37 @@ static inline bool isBlacklisted(const char *restrict file) {
     return !strcmp(cmp, file);
 }
 
+static inline void writeFSEntry(JsonWriter &json, const char *name, bool isDir) {
+    json.beginObject();
+    json.addString("name", name);
+    json.addBool("is_dir", isDir);
+    json.endObject();
+}
+
+// The entries are collected in the buffer of the writer, a chunk is only sent once it is full
 static bool handleFSEntry(const char *name, bool isDir, void *arg) {
-    httpd_req_t *req = (httpd_req_t *)arg;
-
-#define NAME_FIELD ",{\"name\":\""
-#define IS_DIR "\",\"is_dir\":"
-#define IS_DIR_TRUE IS_DIR "true}"
-#define IS_DIR_FALSE IS_DIR "false}"
-    return httpd_resp_send_chunk(req, NAME_FIELD, CONST_STR_LEN(NAME_FIELD)) == ESP_OK &&
-           httpd_resp_sendstr_chunk(req, name) == ESP_OK &&
-           (isDir ? httpd_resp_send_chunk(req, IS_DIR_TRUE, CONST_STR_LEN(IS_DIR_TRUE)) : httpd_resp_send_chunk(req, IS_DIR_FALSE, CONST_STR_LEN(IS_DIR_FALSE))) == ESP_OK;
+    JsonWriter *json = (JsonWriter *)arg;
+    writeFSEntry(*json, name, isDir);
+    return json->ok();
 }
 
 static esp_err_t filesystem_handler(httpd_req_t *req) {
 
-    char *buf = NULL;
-    if (parse_get(req, &buf) != ESP_OK) {
+    char buf[QUERY_BUFFER_SIZE];
+    if (read_query(req, buf, sizeof(buf)) != ESP_OK) {
         return ESP_FAIL;
     }
 
-    //TODO adjustable?
-    char filepath[256];
-
-    if (httpd_query_key_value(buf, "path", filepath, sizeof(filepath)) != ESP_OK) {
-        free(buf);
-        httpd_resp_send_404(req);
-        return ESP_FAIL;
-    }
-
-    char deleteBuf[2];
-
-    esp_err_t delParam = httpd_query_key_value(buf, "del", deleteBuf, sizeof(deleteBuf));
-
-    // We do not need this buffer anymore!
-    free(buf);
-
-    int delete = 0;
-
-    if (delParam == ESP_OK) {
-        if (deleteBuf[0] == '1') {
-            delete = 1;
-        }
-    } else if (delParam != ESP_ERR_NOT_FOUND) {
+    // The path is decoded in place, it points into buf
+    QueryParam params[2];
+    const size_t count = parse_query(buf, params, NUMELEMS(params));
+    const char *filepath = query_value(params, count, "path");
+    if (!filepath) {
         httpd_resp_send_404(req);
         return ESP_FAIL;
     }
 
-    if (!urldecode(filepath, strlen(filepath))) {
-        httpd_resp_send_404(req);
-        return ESP_FAIL;
-    }
+    const bool deleteFile = query_bool(params, count, "del", false);
 
     httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
 
@@ -127,9 +112,19 @@ static esp_err_t filesystem_handler(httpd_req_t *req) {
             // If this is a dir we want to browse that dir else download the file
             httpd_resp_set_type(req, "application/json");
 
-#define PARENT_ENTRY "[{\"name\":\"..\",\"is_dir\":true}"
+            if (deleteFile) {
+                res = ESP_FAIL;
+                break;
+            }
+
+            char jsonBuf[JSON_SEND_BUFFER_SIZE];
+            JsonWriter json(jsonBuf, sizeof(jsonBuf), jsonSendChunk, req);
+            json.beginArray();
+            writeFSEntry(json, "..", true);
+            const bool listed = listDirectory(filepath, handleFSEntry, &json);
+            json.endArray();
 
-            if (delete || httpd_resp_send_chunk(req, PARENT_ENTRY, CONST_STR_LEN(PARENT_ENTRY)) != ESP_OK || !listDirectory(filepath, handleFSEntry, req) || httpd_resp_send_chunk(req, "]", 1) != ESP_OK) {
+            if (!listed || !json.finish()) {
                 res = ESP_FAIL;
             }
             break;
@@ -138,7 +133,7 @@ static esp_err_t filesystem_handler(httpd_req_t *req) {
         case FILE_TYPE: {
             // Else download or delete the file
 
-            if (delete) {
+            if (deleteFile) {
                 if (isBlacklisted(filepath) || remove(filepath)) {
                     res = ESP_FAIL;
                 }
@@ -146,8 +141,8 @@ static esp_err_t filesystem_handler(httpd_req_t *req) {
                 httpd_resp_set_type(req, "text/plain");
                 //TODO remove path and only contain filename
 #define CONTENT_DISPOSITION_VALUE "attachment; filename="
-                char headerBuf[sizeof(filepath) + CONST_STR_LEN(CONTENT_DISPOSITION_VALUE)] = CONTENT_DISPOSITION_VALUE;
-                memcpy(headerBuf + CONST_STR_LEN(CONTENT_DISPOSITION_VALUE), filepath, sizeof(filepath));
+                char headerBuf[QUERY_BUFFER_SIZE + CONST_STR_LEN(CONTENT_DISPOSITION_VALUE)] = CONTENT_DISPOSITION_VALUE;
+                memcpy(headerBuf + CONST_STR_LEN(CONTENT_DISPOSITION_VALUE), filepath, strlen(filepath) + 1);
                 httpd_resp_set_hdr(req, "Content-Disposition", headerBuf);
 
                 FILE *file = fopen(filepath, "rb");
@@ -190,5 +185,5 @@ void registerFSHandler(httpd_handle_t camera_httpd) {
                           .handler = filesystem_handler,
                           .user_ctx = NULL};
 
-    httpd_register_uri_handler(camera_httpd, &fs_uri);
+    registerArenaHandler(camera_httpd, &fs_uri);
 }
\ No newline at end of file
@@ -0,0 +1,144 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "avi_writer.hpp"
+#include "makros.h"
+
+/*
+    Compares the device accesses of the legacy avi helpers with the ones of AVIWriter for the same recording.
+    The file is kept in memory behind a FILE with the 128 byte stdio buffer newlib uses on the ESP32, every
+    write and seek reaching the device is counted. A write that does not start and end on a sector needs a
+    read-modify-write of the sector on the SD card.
+*/
+
+#define BENCH_FRAMES 600
+#define BENCH_STDIO_BUFFER_SIZE 128
+#define BENCH_STAGING_SIZE (64 * 1024)
+#define BENCH_HEADER_UPDATE_INTERVAL 32
+#define BENCH_INDEX_MEMORY_ENTRIES 1024
+
+typedef struct {
+    std::vector<char> data;
+    off64_t position;
+
+    size_t writes;
+    size_t unalignedWrites;
+    size_t seeks;
+    size_t bytes;
+} Device;
+
+static ssize_t deviceWrite(void *cookie, const char *buf, size_t size) {
+    Device *device = (Device *)cookie;
+    if (device->data.size() < device->position + size) {
+        device->data.resize(device->position + size);
+    }
+    memcpy(device->data.data() + device->position, buf, size);
+
+    ++device->writes;
+    device->unalignedWrites += (device->position % AVI_SECTOR_SIZE) || (size % AVI_SECTOR_SIZE);
+    device->bytes += size;
+    device->position += size;
+
+    return size;
+}
+
+static ssize_t deviceRead(void *cookie, char *buf, size_t size) {
+    Device *device = (Device *)cookie;
+    const size_t n = device->position < (off64_t)device->data.size() ? MINEQ(size, device->data.size() - device->position) : 0;
+    memcpy(buf, device->data.data() + device->position, n);
+    device->position += n;
+
+    return n;
+}
+
+static int deviceSeek(void *cookie, off64_t *offset, int whence) {
+    Device *device = (Device *)cookie;
+    ++device->seeks;
+    device->position = *offset + (whence == SEEK_CUR ? device->position : whence == SEEK_END ? device->data.size() : 0);
+    *offset = device->position;
+
+    return 0;
+}
+
+static FILE *openDevice(Device *device) {
+    static const cookie_io_functions_t functions = {deviceRead, deviceWrite, deviceSeek, NULL};
+    FILE *file = fopencookie(device, "w+", functions);
+    setvbuf(file, NULL, _IOFBF, BENCH_STDIO_BUFFER_SIZE);
+
+    return file;
+}
+
+static std::vector<char> makeFrame(size_t n) {
+    std::vector<char> frame(20001 + (n * 7919) % 30000);
+    for (size_t i = 0; i < frame.size(); ++i) {
+        frame[i] = (char)(n * 31 + i);
+    }
+
+    return frame;
+}
+
+static double elapsedMs(const timespec &start) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1e3 + (now.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+static void report(const char *name, const Device &device, double ms) {
+    printf("%-10s %8u bytes %6u writes (%6u unaligned) %6u seeks %8.1f ms\n", name, device.data.size(), device.writes, device.unalignedWrites,
+           device.seeks, ms);
+}
+
+static void benchLegacy() {
+    Device device = {};
+    FILE *aviFile = openDevice(&device);
+    FILE *indexFile = tmpfile();
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t offset = createAVI_File(aviFile, 1600, 1200, 10);
+    size_t maxFrameBytes = 0;
+    for (size_t n = 0; n < BENCH_FRAMES; ++n) {
+        const std::vector<char> frame = makeFrame(n);
+        writeFrameAndUpdate(aviFile, indexFile, &offset, frame.data(), frame.size());
+        maxFrameBytes = MAXEQ(maxFrameBytes, frame.size());
+    }
+    mergeAndPatch(aviFile, indexFile, &offset, BENCH_FRAMES, maxFrameBytes, 10);
+    fclose(aviFile);
+    fclose(indexFile);
+
+    report("legacy", device, elapsedMs(start));
+}
+
+static void benchWriter() {
+    Device device = {};
+    FILE *aviFile = openDevice(&device);
+    char spillPath[] = "/tmp/avi_index_XXXXXX";
+    close(mkstemp(spillPath));
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    AVIWriter writer(BENCH_STAGING_SIZE, BENCH_HEADER_UPDATE_INTERVAL, BENCH_INDEX_MEMORY_ENTRIES, AVI_MAX_FILE_SIZE);
+    writer.begin(aviFile, spillPath, 1600, 1200, 10);
+    for (size_t n = 0; n < BENCH_FRAMES; ++n) {
+        const std::vector<char> frame = makeFrame(n);
+        writer.writeFrame(frame.data(), frame.size());
+    }
+    writer.finish();
+    fclose(aviFile);
+    remove(spillPath);
+
+    report("AVIWriter", device, elapsedMs(start));
+}
+
+int main() {
+    printf("%u frames\n", BENCH_FRAMES);
+    benchLegacy();
+    benchWriter();
+
+    return 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdio.h>
+
+/*
+    Minimal checks for the host tests. A failed check is reported with its location and the test goes on,
+    main returns hostTestResult() so the exit code tells whether any check failed.
+*/
+static int hostTestFailures = 0;
+
+#define CHECK(condition)                                                                  \
+    do {                                                                                  \
+        if (!(condition)) {                                                               \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            ++hostTestFailures;                                                           \
+        }                                                                                 \
+    } while (0)
+
+#define CHECK_EQ(actual, expected)                                                                                  \
+    do {                                                                                                            \
+        const unsigned long long _actual = (unsigned long long)(actual);                                            \
+        const unsigned long long _expected = (unsigned long long)(expected);                                        \
+        if (_actual != _expected) {                                                                                 \
+            fprintf(stderr, "%s:%d: %s is %llu, expected %llu\n", __FILE__, __LINE__, #actual, _actual, _expected); \
+            ++hostTestFailures;                                                                                     \
+        }                                                                                                           \
+    } while (0)
+
+static inline int hostTestResult(const char *name) {
+    printf("%s: %s\n", name, hostTestFailures ? "FAILED" : "passed");
+    return hostTestFailures ? 1 : 0;
+}
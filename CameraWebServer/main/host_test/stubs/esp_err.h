@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+
+// Host replacement of the ESP-IDF header, only what the tested modules use
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
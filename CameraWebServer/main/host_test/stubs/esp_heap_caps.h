@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdlib.h>
+
+// Host replacement of the ESP-IDF header, every capability is served by malloc
+#define MALLOC_CAP_SPIRAM (1 << 10)
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+
+static inline void *heap_caps_malloc(size_t size, unsigned int caps) {
+    (void)caps;
+    return malloc(size);
+}
+
+static inline void *heap_caps_realloc(void *ptr, size_t size, unsigned int caps) {
+    (void)caps;
+    return realloc(ptr, size);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdio.h>
+
+// Host replacement of the ESP-IDF header, errors and warnings go to stderr and the rest is dropped
+#define ESP_LOGE(tag, format, ...) fprintf(stderr, "E %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) fprintf(stderr, "W %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)                              \
+    do {                                                        \
+        if (0) {                                                \
+            fprintf(stderr, "%s: " format, tag, ##__VA_ARGS__); \
+        }                                                       \
+    } while (0)
+#define ESP_LOGD(tag, format, ...) ESP_LOGI(tag, format, ##__VA_ARGS__)
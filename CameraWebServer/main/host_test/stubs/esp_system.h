@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "esp_err.h"
+
+// Host replacement of the ESP-IDF header, deterministic so failures can be reproduced
+static inline uint32_t esp_random(void) {
+    return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+// Host replacement of the generated configuration, config.h falls back to its defaults
@@ -0,0 +1,319 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "avi_writer.hpp"
+#include "host_test.hpp"
+#include "makros.h"
+
+#define TEST_STAGING_SIZE (32 * 1024)
+#define TEST_HEADER_UPDATE_INTERVAL 7
+#define TEST_INDEX_MEMORY_ENTRIES 16
+// Large enough that no test recording needs a second RIFF list
+#define TEST_NO_RIFF_LIMIT (1024 * 1024 * 1024)
+
+// Frame n of a recording, its size (odd ones included) and content depend on n only
+static std::vector<char> makeFrame(size_t n) {
+    std::vector<char> frame(2001 + (n * 7919) % 9000);
+    for (size_t i = 0; i < frame.size(); ++i) {
+        frame[i] = (char)(n * 31 + i);
+    }
+    frame[0] = (char)0xFF;
+    frame[1] = (char)0xD8;
+
+    return frame;
+}
+
+static std::vector<char> readFile(FILE *file) {
+    fflush(file);
+    fseek(file, 0, SEEK_END);
+    std::vector<char> data(ftell(file));
+    fseek(file, 0, SEEK_SET);
+    CHECK_EQ(fread(data.data(), 1, data.size(), file), data.size());
+
+    return data;
+}
+
+// Index entries carry the size of the jpeg without the pad byte of the chunk
+static bool isFrame(const std::vector<char> &file, size_t dataOffset, size_t size, size_t n) {
+    const std::vector<char> expected = makeFrame(n);
+    return size == expected.size() && dataOffset + expected.size() <= file.size() &&
+           !memcmp(file.data() + dataOffset, expected.data(), expected.size());
+}
+
+// Offset of the first child with the given id (and list type) inside [start, end) or 0
+static size_t findChunk(const std::vector<char> &file, size_t start, size_t end, const char *id, const char *listType = NULL) {
+    for (size_t offset = start; offset + RIFF_CHUNK_HEADER_SIZE <= end;) {
+        const size_t size = readLittleEndian(file.data() + offset + 4);
+        if (!memcmp(file.data() + offset, id, 4) && (!listType || !memcmp(file.data() + offset + 8, listType, 4))) {
+            return offset;
+        }
+        offset += RIFF_CHUNK_HEADER_SIZE + size + (size & 1);
+    }
+
+    return 0;
+}
+
+/*
+    Checks the structure of a finished file and that its indexes reference the frames of sequence in order.
+    sequence holds the frame number of every index entry, repeated frames appear more than once.
+    Returns the number of RIFF lists.
+*/
+static size_t checkFile(const std::vector<char> &file, const std::vector<size_t> &sequence, size_t riffSizeLimit) {
+    const char *buf = file.data();
+    CHECK(!memcmp(buf, "RIFF", 4) && !memcmp(buf + 8, "AVI ", 4));
+
+    // The RIFF lists follow each other up to the end of the file
+    std::vector<size_t> riffs;
+    size_t offset = 0;
+    while (offset + RIFF_LIST_HEADER_SIZE <= file.size() && !memcmp(buf + offset, "RIFF", 4)) {
+        riffs.push_back(offset);
+        CHECK(!memcmp(buf + offset + 8, riffs.size() == 1 ? "AVI " : "AVIX", 4));
+        CHECK(readLittleEndian(buf + offset + 4) <= riffSizeLimit);
+        offset += RIFF_CHUNK_HEADER_SIZE + readLittleEndian(buf + offset + 4);
+    }
+    CHECK_EQ(offset, file.size());
+
+    const size_t firstRiffEnd = riffs.size() > 1 ? riffs[1] : file.size();
+    const size_t movi = findChunk(file, RIFF_LIST_HEADER_SIZE, firstRiffEnd, "LIST", "movi");
+    // The header is padded so that the first frame starts on a sector
+    CHECK_EQ(movi + RIFF_LIST_HEADER_SIZE, AVI_HEADER_RESERVED_SIZE);
+    const size_t moviFourCC = movi + RIFF_CHUNK_HEADER_SIZE;
+
+    // The legacy index of the first RIFF list, its offsets are relative to the 'movi' FOURCC
+    const size_t idx1 = findChunk(file, RIFF_LIST_HEADER_SIZE, firstRiffEnd, "idx1");
+    CHECK(idx1 != 0);
+    const size_t idx1Entries = idx1 ? readLittleEndian(buf + idx1 + 4) / IDX1_ENTRY_SIZE : 0;
+    for (size_t i = 0; i < idx1Entries && i < sequence.size(); ++i) {
+        const char *entry = buf + idx1 + RIFF_CHUNK_HEADER_SIZE + i * IDX1_ENTRY_SIZE;
+        const size_t chunk = moviFourCC + readLittleEndian(entry + 8);
+        CHECK(!memcmp(entry, "00dc", 4) && !memcmp(buf + chunk, "00dc", 4));
+        CHECK_EQ(readLittleEndian(entry + 4), AVIIF_KEYFRAME);
+        CHECK(isFrame(file, chunk + RIFF_CHUNK_HEADER_SIZE, readLittleEndian(entry + 12), sequence[i]));
+    }
+
+    size_t indexed = idx1Entries;
+    if (riffs.size() == 1) {
+        CHECK_EQ(idx1Entries, sequence.size());
+        CHECK_EQ(readLittleEndian(buf + AVI_MAIN_HEADER_START + PATCH_AVI_MAIN_HEADER_TOTAL_FRAMES_OFFSET), sequence.size());
+        CHECK_EQ(readLittleEndian(buf + AVI_STREAM_HEADER_START + PATCH_AVI_STREAM_HEADER_LENGTH_OFFSET), sequence.size());
+    } else {
+        // Every further RIFF list has its own movi list with a standard index, whose entries point at the chunk data
+        indexed = 0;
+        for (size_t r = 0; r < riffs.size(); ++r) {
+            const size_t riffEnd = r + 1 < riffs.size() ? riffs[r + 1] : file.size();
+            const size_t riffMovi = findChunk(file, riffs[r] + RIFF_LIST_HEADER_SIZE, riffEnd, "LIST", "movi");
+            CHECK(riffMovi != 0);
+            const size_t moviEnd = riffMovi + RIFF_CHUNK_HEADER_SIZE + readLittleEndian(buf + riffMovi + 4);
+            const size_t ix00 = findChunk(file, riffMovi + RIFF_LIST_HEADER_SIZE, moviEnd, "ix00");
+            CHECK(ix00 != 0);
+            if (!riffMovi || !ix00) {
+                return riffs.size();
+            }
+
+            const size_t count = readLittleEndian(buf + ix00 + 12);
+            CHECK_EQ(readLittleEndian(buf + ix00 + 20), riffs[r]);
+            for (size_t i = 0; i < count && indexed + i < sequence.size(); ++i) {
+                const char *entry = buf + ix00 + RIFF_CHUNK_HEADER_SIZE + AVI_STD_INDEX_HEADER_SIZE + i * AVI_STD_INDEX_ENTRY_SIZE;
+                CHECK(isFrame(file, riffs[r] + readLittleEndian(entry), readLittleEndian(entry + 4), sequence[indexed + i]));
+            }
+            indexed += count;
+        }
+        CHECK_EQ(indexed, sequence.size());
+    }
+
+    return riffs.size();
+}
+
+// Writes frames first to first + count - 1, every repeatEvery-th frame is repeated instead if possible
+static bool writeFrames(AVIWriter &writer, std::vector<size_t> *sequence, size_t first, size_t count, size_t repeatEvery = 0) {
+    for (size_t n = first; n < first + count; ++n) {
+        if (repeatEvery && !sequence->empty() && n % repeatEvery == 0 && writer.repeatFrame()) {
+            sequence->push_back(sequence->back());
+            continue;
+        }
+
+        const std::vector<char> frame = makeFrame(n);
+        if (!writer.writeFrame(frame.data(), frame.size())) {
+            return false;
+        }
+        sequence->push_back(n);
+    }
+
+    return true;
+}
+
+static void testRecording(size_t frames, size_t repeatEvery, size_t riffSizeLimit) {
+    char spillPath[] = "/tmp/avi_index_XXXXXX";
+    close(mkstemp(spillPath));
+    FILE *file = tmpfile();
+    AVIWriter writer(TEST_STAGING_SIZE, TEST_HEADER_UPDATE_INTERVAL, TEST_INDEX_MEMORY_ENTRIES, riffSizeLimit);
+    std::vector<size_t> sequence;
+
+    CHECK(writer.begin(file, spillPath, 640, 480, 10));
+    CHECK(writeFrames(writer, &sequence, 0, frames, repeatEvery));
+    CHECK_EQ(writer.getFrameCount(), frames);
+    CHECK(writer.finish());
+
+    const std::vector<char> data = readFile(file);
+    CHECK_EQ(data.size(), writer.getFileSize());
+    CHECK_EQ(checkFile(data, sequence, riffSizeLimit) > 1, writer.isOpenDML());
+    CHECK_EQ(writer.isOpenDML(), data.size() > riffSizeLimit);
+    size_t repeated = 0;
+    for (size_t i = 1; i < sequence.size(); ++i) {
+        repeated += sequence[i] == sequence[i - 1];
+    }
+    CHECK_EQ(writer.getStats().repeatedFrames, repeated);
+    CHECK(repeatEvery == 0 || repeated > 0);
+    // Frames are collected in the staging buffer instead of being written one by one
+    CHECK(writer.getStats().writeCalls < frames);
+
+    fclose(file);
+    remove(spillPath);
+}
+
+// A recording which stopped without finish is continued behind its last complete frame
+static void testResume(size_t keepTail) {
+    char spillPath[] = "/tmp/avi_index_XXXXXX";
+    close(mkstemp(spillPath));
+    FILE *file = tmpfile();
+    std::vector<size_t> sequence;
+
+    AVIWriter writer(TEST_STAGING_SIZE, TEST_HEADER_UPDATE_INTERVAL, TEST_INDEX_MEMORY_ENTRIES, TEST_NO_RIFF_LIMIT);
+    CHECK(writer.begin(file, spillPath, 640, 480, 10));
+    CHECK(writeFrames(writer, &sequence, 0, 40));
+    // Everything staged is lost and the spill file is deleted, so the index is rebuilt from the frame chunks.
+    // Cutting the tail leaves a torn frame at the end of the file.
+    const size_t written = readFile(file).size();
+    writer.discard();
+    CHECK_EQ(ftruncate(fileno(file), written - keepTail), 0);
+
+    AVIWriter resumed(TEST_STAGING_SIZE, TEST_HEADER_UPDATE_INTERVAL, TEST_INDEX_MEMORY_ENTRIES, TEST_NO_RIFF_LIMIT);
+    size_t tornBytes = 0;
+    CHECK(resumed.resume(file, spillPath, &tornBytes));
+    const size_t recovered = resumed.getFrameCount();
+    CHECK(recovered > 0 && recovered < 40);
+
+    sequence.resize(recovered);
+    CHECK(writeFrames(resumed, &sequence, recovered, 10));
+    CHECK(resumed.finish());
+    CHECK_EQ(ftruncate(fileno(file), resumed.getFileSize()), 0);
+    CHECK_EQ(checkFile(readFile(file), sequence, TEST_NO_RIFF_LIMIT), 1);
+
+    fclose(file);
+    remove(spillPath);
+}
+
+static std::vector<char> readPath(const char *path) {
+    FILE *file = fopen(path, "rb");
+    std::vector<char> data;
+    if (file) {
+        data = readFile(file);
+        fclose(file);
+    }
+
+    return data;
+}
+
+// A recovery which fails behind attaching the index gives the index and its spill file up right away
+static void testResumeFailure() {
+    char spillPath[] = "/tmp/avi_index_XXXXXX";
+    close(mkstemp(spillPath));
+    FILE *file = tmpfile();
+    std::vector<size_t> sequence;
+
+    AVIWriter writer(TEST_STAGING_SIZE, TEST_HEADER_UPDATE_INTERVAL, TEST_INDEX_MEMORY_ENTRIES, TEST_NO_RIFF_LIMIT);
+    CHECK(writer.begin(file, spillPath, 640, 480, 10));
+    CHECK(writeFrames(writer, &sequence, 0, 40));
+    fflush(file);
+    // The spill file survives a crash, discard deletes it
+    const std::vector<char> spilled = readPath(spillPath);
+    CHECK(!spilled.empty());
+    writer.discard();
+    FILE *spill = fopen(spillPath, "wb");
+    CHECK_EQ(fwrite(spilled.data(), 1, spilled.size(), spill), spilled.size());
+    fclose(spill);
+
+    // The header claims more RIFF lists than the file has, which is only noticed after the staging buffer is allocated
+    char superIndex[RIFF_CHUNK_HEADER_SIZE + AVI_SUPER_INDEX_HEADER_SIZE] = {0};
+    memcpy(superIndex, "indx", 4);
+    writeLittleEndian(superIndex + AVI_SUPER_INDEX_ENTRIES_IN_USE_OFFSET, 5);
+    CHECK_EQ(fseek(file, AVI_SUPER_INDEX_START, SEEK_SET), 0);
+    CHECK_EQ(fwrite(superIndex, 1, sizeof(superIndex), file), sizeof(superIndex));
+    fflush(file);
+
+    AVIWriter resumed(TEST_STAGING_SIZE, TEST_HEADER_UPDATE_INTERVAL, TEST_INDEX_MEMORY_ENTRIES, TEST_NO_RIFF_LIMIT);
+    size_t tornBytes = 0;
+    CHECK(!resumed.resume(file, spillPath, &tornBytes));
+    CHECK(access(spillPath, F_OK) != 0);
+
+    // The writer starts over cleanly
+    FILE *next = tmpfile();
+    sequence.clear();
+    CHECK(resumed.begin(next, spillPath, 640, 480, 10));
+    CHECK(writeFrames(resumed, &sequence, 0, 20));
+    CHECK(resumed.finish());
+    CHECK_EQ(checkFile(readFile(next), sequence, TEST_NO_RIFF_LIMIT), 1);
+
+    fclose(next);
+    fclose(file);
+    remove(spillPath);
+}
+
+static void testIndexSpill() {
+    char spillPath[] = "/tmp/avi_index_XXXXXX";
+    close(mkstemp(spillPath));
+    AVIIndex index(4);
+    CHECK_EQ(index.attach(spillPath, false), 0);
+
+    for (uint32_t i = 0; i < 100; ++i) {
+        CHECK(index.append(i * 100, i + 1));
+    }
+    CHECK_EQ(index.size(), 100);
+
+    // Reads cross from the spill file into the memory entries in pieces
+    AVIIndexEntry entries[100];
+    size_t count = 0;
+    while (count < index.size()) {
+        const size_t read = index.read(count, entries + count, 7);
+        CHECK(read > 0);
+        if (!read) {
+            break;
+        }
+        count += read;
+    }
+    CHECK_EQ(count, 100);
+    for (uint32_t i = 0; i < count; ++i) {
+        CHECK(entries[i].offset == i * 100 && entries[i].size == i + 1);
+    }
+    CHECK_EQ(index.read(100, entries, 1), 0);
+
+    // Another index takes the spilled entries over, the ones still in memory are gone
+    AVIIndex recovered(4);
+    const size_t spilled = recovered.attach(spillPath, true);
+    CHECK(spilled > 0 && spilled <= 100);
+    recovered.truncateSpilled(10);
+    CHECK_EQ(recovered.size(), 10);
+    CHECK_EQ(recovered.read(9, entries, 1), 1);
+    CHECK(entries[0].offset == 900 && entries[0].size == 10);
+
+    recovered.clear();
+    CHECK(access(spillPath, F_OK) != 0);
+}
+
+int main() {
+    testRecording(60, 0, TEST_NO_RIFF_LIMIT);
+    testRecording(60, 4, TEST_NO_RIFF_LIMIT);
+    // Small RIFF lists, so the recording continues in OpenDML AVIX lists
+    testRecording(60, 0, 128 * 1024);
+    testRecording(60, 4, 128 * 1024);
+    testResume(100);
+    testResume(TEST_STAGING_SIZE / 2);
+    testResumeFailure();
+    testIndexSpill();
+
+    return hostTestResult("avi_writer");
+}
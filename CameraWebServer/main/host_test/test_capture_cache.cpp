@@ -0,0 +1,94 @@
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "capture_cache.hpp"
+#include "host_test.hpp"
+
+// The failed growth needs a failing PSRAM allocation, which ASan only returns instead of aborting with this option
+extern "C" const char *__asan_default_options() {
+    return "allocator_may_return_null=1";
+}
+
+static std::vector<char> makeJpeg(size_t size, char fill) {
+    return std::vector<char>(size, fill);
+}
+
+static bool holds(const CaptureCache &cache, const std::vector<char> &jpg) {
+    return cache.length() == jpg.size() && !memcmp(cache.data(), jpg.data(), jpg.size());
+}
+
+static void testFreshness() {
+    CaptureCache cache;
+    // Nothing cached yet
+    CHECK(!cache.fresh(1000, 0, 0));
+
+    const std::vector<char> jpg = makeJpeg(1000, 'a');
+    CHECK(cache.store(jpg.data(), jpg.size(), 5000000, 7));
+    CHECK(holds(cache, jpg));
+    CHECK_EQ(cache.timestamp(), 5000000);
+
+    // Requests inside the window reuse the frame, up to its last microsecond
+    CHECK(cache.fresh(500, 5000000, 7));
+    CHECK(cache.fresh(500, 5300000, 7));
+    CHECK(cache.fresh(500, 5500000, 7));
+    // Expired
+    CHECK(!cache.fresh(500, 5500001, 7));
+    // Without max_age every request takes a new frame
+    CHECK(!cache.fresh(0, 5000000, 7));
+    CHECK(!cache.fresh(-1, 5000000, 7));
+    // A changed setting outdates the frame, however young it is
+    CHECK(!cache.fresh(500, 5000000, 8));
+
+    // A new frame refreshes the window and the version
+    const std::vector<char> next = makeJpeg(900, 'b');
+    CHECK(cache.store(next.data(), next.size(), 6000000, 8));
+    CHECK(holds(cache, next));
+    CHECK(cache.fresh(500, 6400000, 8));
+    CHECK(!cache.fresh(500, 6400000, 7));
+
+    // Large max_age values do not overflow
+    CHECK(cache.fresh(INT32_MAX, 6000000 + INT32_MAX * 1000LL, 8));
+}
+
+static void testGrowth() {
+    CaptureCache cache;
+
+    const std::vector<char> first = makeJpeg(1000, 'a');
+    CHECK(cache.store(first.data(), first.size(), 1, 0));
+    CHECK_EQ(cache.capacity(), 1250);
+    const char *buffer = cache.data();
+
+    // Frames which fit stay in the same buffer
+    const std::vector<char> fits = makeJpeg(1250, 'b');
+    CHECK(cache.store(fits.data(), fits.size(), 2, 0));
+    CHECK(cache.data() == buffer && cache.capacity() == 1250);
+    CHECK(holds(cache, fits));
+    const std::vector<char> smaller = makeJpeg(10, 'c');
+    CHECK(cache.store(smaller.data(), smaller.size(), 3, 0));
+    CHECK(cache.data() == buffer && holds(cache, smaller));
+
+    // A larger frame grows the buffer with room on top
+    const std::vector<char> larger = makeJpeg(1251, 'd');
+    CHECK(cache.store(larger.data(), larger.size(), 4, 0));
+    CHECK_EQ(cache.capacity(), 1251 + 1251 / 4);
+    CHECK(holds(cache, larger));
+    CHECK(cache.fresh(1, 4, 0));
+
+    // If the buffer can not grow the cache is empty and serves nothing
+    CHECK(!cache.store(larger.data(), SIZE_MAX / 2, 5, 0));
+    CHECK_EQ(cache.length(), 0);
+    CHECK_EQ(cache.capacity(), 0);
+    CHECK(!cache.fresh(1000, 5, 0));
+
+    // And is filled again by the next frame
+    CHECK(cache.store(first.data(), first.size(), 6, 0));
+    CHECK(holds(cache, first));
+}
+
+int main() {
+    testFreshness();
+    testGrowth();
+
+    return hostTestResult("capture_cache");
+}
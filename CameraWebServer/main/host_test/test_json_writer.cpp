@@ -0,0 +1,178 @@
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+#include "esp_http_server.h"
+#include "host_test.hpp"
+#include "json_writer.hpp"
+
+#define TEST_BUFFER_SIZE 512
+
+// jsonSendChunk sends through the request, whose context collects the chunks
+esp_err_t httpd_resp_send_chunk(httpd_req_t *req, const char *buf, ssize_t len) {
+    std::string *chunks = (std::string *)req->user_ctx;
+    chunks->append(buf, len);
+    chunks->push_back('|');
+    return ESP_OK;
+}
+
+typedef struct {
+    std::string data;
+    size_t calls;
+    // The flush fails from this call on
+    size_t failAt;
+} Sink;
+
+static bool collect(void *arg, const char *data, size_t size) {
+    Sink *sink = (Sink *)arg;
+    if (++sink->calls >= sink->failAt) {
+        return false;
+    }
+    sink->data.append(data, size);
+    return true;
+}
+
+static std::string written(const char *buf, const JsonWriter &json) {
+    return std::string(buf, json.length());
+}
+
+// The document all chunked tests write
+static void writeDocument(JsonWriter &json) {
+    json.beginObject();
+    json.addString("name", "esp32 \"cam\"");
+    json.addNumber("min", INT64_MIN);
+    json.addNumber("max", INT64_MAX);
+    json.addNumber("zero", 0);
+    json.addBool("on", true);
+    json.key("list");
+    json.beginArray();
+    for (int i = 0; i < 50; ++i) {
+        json.beginObject();
+        json.addNumber("i", -i);
+        json.key("empty");
+        json.beginArray();
+        json.endArray();
+        json.endObject();
+    }
+    json.endArray();
+    json.addBool("off", false);
+    json.endObject();
+}
+
+static std::string expectedDocument() {
+    std::string expected = "{\"name\":\"esp32 \\\"cam\\\"\",\"min\":-9223372036854775808,\"max\":9223372036854775807,\"zero\":0,\"on\":true,\"list\":[";
+    for (int i = 0; i < 50; ++i) {
+        expected += (i ? ",{\"i\":" : "{\"i\":") + (i ? "-" + std::to_string(i) : std::string("0")) + ",\"empty\":[]}";
+    }
+    return expected + "],\"off\":false}";
+}
+
+static void testEscaping() {
+    char buf[TEST_BUFFER_SIZE];
+    JsonWriter json(buf, sizeof(buf));
+
+    json.beginArray();
+    json.string("quote\" backslash\\ slash/");
+    json.string("\n\r\t\b\x01\x1f");
+    // Bytes above 0x7F are UTF-8 and stay as they are
+    json.string("\xc3\xa4\x7f");
+    // Strings with a length may contain zeros
+    json.string("a\0b", 3);
+    json.string("");
+    json.endArray();
+
+    CHECK(json.finish());
+    CHECK(written(buf, json) == "[\"quote\\\" backslash\\\\ slash/\",\"\\n\\r\\t\\u0008\\u0001\\u001f\",\"\xc3\xa4\x7f\",\"a\\u0000b\",\"\"]");
+}
+
+static void testNesting() {
+    char buf[TEST_BUFFER_SIZE];
+    JsonWriter json(buf, sizeof(buf));
+
+    // Deeper than the comma bits, the levels behind the last bit share it
+    for (int i = 0; i < JSON_MAX_DEPTH + 4; ++i) {
+        json.beginArray();
+        json.number(i);
+    }
+    for (int i = 0; i < JSON_MAX_DEPTH + 4; ++i) {
+        json.endArray();
+    }
+    json.raw("\n", 1);
+
+    CHECK(json.finish());
+    std::string expected;
+    for (int i = 0; i < JSON_MAX_DEPTH + 4; ++i) {
+        expected += (i ? ",[" : "[") + std::to_string(i);
+    }
+    expected += std::string(JSON_MAX_DEPTH + 4, ']') + "\n";
+    CHECK(written(buf, json) == expected);
+}
+
+static void testFlush() {
+    const std::string expected = expectedDocument();
+
+    // Buffer sizes down to a single byte, so every write is split somewhere
+    for (size_t size : {1, 7, 64, TEST_BUFFER_SIZE}) {
+        char buf[TEST_BUFFER_SIZE];
+        Sink sink = {"", 0, SIZE_MAX};
+        JsonWriter json(buf, size, collect, &sink);
+        writeDocument(json);
+        CHECK(json.finish());
+        CHECK(sink.data == expected);
+        CHECK_EQ(sink.calls, (expected.size() + size - 1) / size);
+    }
+
+    // Once a flush failed nothing is sent anymore
+    char buf[64];
+    Sink sink = {"", 0, 3};
+    JsonWriter json(buf, sizeof(buf), collect, &sink);
+    writeDocument(json);
+    CHECK(!json.ok());
+    CHECK(!json.finish());
+    CHECK_EQ(sink.calls, 3);
+    CHECK(sink.data == expected.substr(0, 2 * sizeof(buf)));
+}
+
+static void testOverflow() {
+    const std::string expected = expectedDocument();
+
+    // Without a flush the document has to fit, the buffers are exactly sized so ASan reports any write past them
+    char *fits = new char[expected.size()];
+    JsonWriter json(fits, expected.size());
+    writeDocument(json);
+    CHECK(json.finish());
+    CHECK(written(fits, json) == expected);
+    delete[] fits;
+
+    // One byte less fails
+    char *tooSmall = new char[expected.size() - 1];
+    JsonWriter overflow(tooSmall, expected.size() - 1);
+    writeDocument(overflow);
+    CHECK(!overflow.ok());
+    CHECK(!overflow.finish());
+    CHECK(written(tooSmall, overflow) == expected.substr(0, expected.size() - 1));
+    delete[] tooSmall;
+}
+
+static void testSendChunk() {
+    std::string chunks;
+    httpd_req_t req = {&chunks};
+    char buf[8];
+    JsonWriter json(buf, sizeof(buf), jsonSendChunk, &req);
+    json.beginObject();
+    json.addString("key", "value");
+    json.endObject();
+
+    CHECK(json.finish());
+    CHECK(chunks == "{\"key\":\"|value\"}|");
+}
+
+int main() {
+    testEscaping();
+    testNesting();
+    testFlush();
+    testOverflow();
+    testSendChunk();
+
+    return hostTestResult("json_writer");
+}
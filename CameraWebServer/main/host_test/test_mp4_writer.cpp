@@ -0,0 +1,354 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "host_test.hpp"
+#include "makros.h"
+#include "mp4_writer.hpp"
+
+#define NO_BOX ((size_t)-1)
+// Fragment buffer which holds 8 of the largest test frames, so every fragment gets exactly 8 frames
+#define TEST_BUFFER_SIZE (128 * 1024)
+#define TEST_FRAGMENT_FRAMES 8
+
+// Returns true if the boxes inside [start, end) follow each other without gap and end exactly at end
+static bool boxesFill(const char *buf, size_t start, size_t end) {
+    size_t offset = start;
+    while (offset + MP4_BOX_HEADER_SIZE <= end) {
+        const size_t size = readBigEndian32(buf + offset);
+        if (size < MP4_BOX_HEADER_SIZE || offset + size > end) {
+            return false;
+        }
+        offset += size;
+    }
+
+    return offset == end;
+}
+
+// Offset of the first box of the given type inside [start, end)
+static size_t findBox(const char *buf, size_t start, size_t end, const char *type) {
+    for (size_t offset = start; offset + MP4_BOX_HEADER_SIZE <= end; offset += readBigEndian32(buf + offset)) {
+        if (readBigEndian32(buf + offset) < MP4_BOX_HEADER_SIZE) {
+            break;
+        }
+        if (!memcmp(buf + offset + 4, type, 4)) {
+            return offset;
+        }
+    }
+
+    return NO_BOX;
+}
+
+static size_t boxEnd(const char *buf, size_t box) {
+    return box + readBigEndian32(buf + box);
+}
+
+// Finds a box and checks that its children fill it, skip is the size of the fields in front of the children
+static size_t containerBox(const char *buf, size_t start, size_t end, const char *type, size_t skip = MP4_BOX_HEADER_SIZE) {
+    const size_t box = findBox(buf, start, end, type);
+    CHECK(box != NO_BOX);
+    if (box == NO_BOX) {
+        return NO_BOX;
+    }
+
+    CHECK(boxesFill(buf, box + skip, boxEnd(buf, box)));
+    return box;
+}
+
+static void testHeader() {
+    char buf[1024];
+    const uint32_t trackId = 0x12345679;
+    const size_t size = writeMP4Header(buf, 800, 600, 25, 3, trackId);
+
+    CHECK(boxesFill(buf, 0, size));
+    CHECK_EQ(findBox(buf, 0, size, "ftyp"), 0);
+
+    const size_t moov = containerBox(buf, 0, size, "moov");
+    const size_t mvhd = findBox(buf, moov + MP4_BOX_HEADER_SIZE, boxEnd(buf, moov), "mvhd");
+    const size_t trak = containerBox(buf, moov + MP4_BOX_HEADER_SIZE, boxEnd(buf, moov), "trak");
+    const size_t mvex = containerBox(buf, moov + MP4_BOX_HEADER_SIZE, boxEnd(buf, moov), "mvex");
+    const size_t tkhd = findBox(buf, trak + MP4_BOX_HEADER_SIZE, boxEnd(buf, trak), "tkhd");
+    const size_t mdia = containerBox(buf, trak + MP4_BOX_HEADER_SIZE, boxEnd(buf, trak), "mdia");
+    const size_t mdhd = findBox(buf, mdia + MP4_BOX_HEADER_SIZE, boxEnd(buf, mdia), "mdhd");
+    const size_t minf = containerBox(buf, mdia + MP4_BOX_HEADER_SIZE, boxEnd(buf, mdia), "minf");
+    const size_t dinf = containerBox(buf, minf + MP4_BOX_HEADER_SIZE, boxEnd(buf, minf), "dinf");
+    const size_t stbl = containerBox(buf, minf + MP4_BOX_HEADER_SIZE, boxEnd(buf, minf), "stbl");
+    const size_t trex = findBox(buf, mvex + MP4_BOX_HEADER_SIZE, boxEnd(buf, mvex), "trex");
+    // Full boxes with an entry count in front of their children
+    containerBox(buf, dinf + MP4_BOX_HEADER_SIZE, boxEnd(buf, dinf), "dref", MP4_FULL_BOX_HEADER_SIZE + 4);
+    const size_t stsd = containerBox(buf, stbl + MP4_BOX_HEADER_SIZE, boxEnd(buf, stbl), "stsd", MP4_FULL_BOX_HEADER_SIZE + 4);
+    CHECK(findBox(buf, stsd + MP4_FULL_BOX_HEADER_SIZE + 4, boxEnd(buf, stsd), "jpeg") != NO_BOX);
+    CHECK(mvhd != NO_BOX && tkhd != NO_BOX && mdhd != NO_BOX && trex != NO_BOX);
+    if (mvhd == NO_BOX || tkhd == NO_BOX || mdhd == NO_BOX || trex == NO_BOX) {
+        return;
+    }
+
+    // The fixed offsets the writer reads back when resuming
+    CHECK_EQ(readBigEndian32(buf + tkhd + MP4_TKHD_TRACK_ID_OFFSET), trackId);
+    CHECK_EQ(readBigEndian32(buf + mdhd + MP4_MDHD_TIMESCALE_OFFSET), 25);
+    CHECK_EQ(readBigEndian32(buf + trex + MP4_TREX_DEFAULT_DURATION_OFFSET), 3);
+    CHECK_EQ(readBigEndian32(buf + trex + MP4_FULL_BOX_HEADER_SIZE), trackId);
+    // Sizes of the fixed boxes and next_track_ID at the end of mvhd
+    CHECK_EQ(readBigEndian32(buf + mvhd), 108);
+    CHECK_EQ(readBigEndian32(buf + tkhd), 92);
+    CHECK_EQ(readBigEndian32(buf + boxEnd(buf, mvhd) - 4), trackId + 1);
+    CHECK_EQ(readBigEndian32(buf + boxEnd(buf, tkhd) - 8), 800 << 16);
+    CHECK_EQ(readBigEndian32(buf + boxEnd(buf, tkhd) - 4), 600 << 16);
+
+    // Padded to full sectors with a trailing free box, the writer reads at most two sectors back
+    char aligned[1024];
+    const size_t alignedSize = writeMP4Header(aligned, 800, 600, 25, 3, trackId, MP4_SECTOR_SIZE);
+    CHECK_EQ(alignedSize % MP4_SECTOR_SIZE, 0);
+    CHECK(alignedSize <= 2 * MP4_SECTOR_SIZE);
+    CHECK(!memcmp(aligned, buf, size));
+    CHECK(boxesFill(aligned, 0, alignedSize));
+    CHECK_EQ(findBox(aligned, 0, alignedSize, "free"), size);
+}
+
+static void testFragmentHeader(size_t sampleCount) {
+    std::vector<uint32_t> sizes(sampleCount);
+    size_t dataSize = 0;
+    for (size_t i = 0; i < sampleCount; ++i) {
+        sizes[i] = 1000 + i * 37;
+        dataSize += sizes[i];
+    }
+
+    std::vector<char> buf(MP4_MOOF_SIZE(sampleCount) + MP4_BOX_HEADER_SIZE);
+    const uint64_t decodeTime = 0x100000002ULL;
+    const size_t size = writeMP4FragmentHeader(buf.data(), 7, 0x2468ACE1, decodeTime, sizes.data(), sampleCount, dataSize);
+    const char *moof = buf.data();
+
+    CHECK_EQ(size, buf.size());
+    CHECK_EQ(readBigEndian32(moof), MP4_MOOF_SIZE(sampleCount));
+    CHECK(!memcmp(moof + 4, "moof", 4));
+
+    const size_t moofEnd = MP4_MOOF_SIZE(sampleCount);
+    CHECK(boxesFill(moof, MP4_BOX_HEADER_SIZE, moofEnd));
+    const size_t mfhd = findBox(moof, MP4_BOX_HEADER_SIZE, moofEnd, "mfhd");
+    const size_t traf = containerBox(moof, MP4_BOX_HEADER_SIZE, moofEnd, "traf");
+    const size_t tfhd = findBox(moof, traf + MP4_BOX_HEADER_SIZE, boxEnd(moof, traf), "tfhd");
+    const size_t tfdt = findBox(moof, traf + MP4_BOX_HEADER_SIZE, boxEnd(moof, traf), "tfdt");
+    const size_t trun = findBox(moof, traf + MP4_BOX_HEADER_SIZE, boxEnd(moof, traf), "trun");
+    CHECK(mfhd != NO_BOX && tfhd != NO_BOX && tfdt != NO_BOX && trun != NO_BOX);
+    if (mfhd == NO_BOX || tfhd == NO_BOX || tfdt == NO_BOX || trun == NO_BOX) {
+        return;
+    }
+
+    // The offsets recovery validates a fragment with, each is the first field behind the full box header
+    CHECK_EQ(mfhd + MP4_FULL_BOX_HEADER_SIZE, MP4_MOOF_SEQUENCE_OFFSET);
+    CHECK_EQ(tfhd + MP4_FULL_BOX_HEADER_SIZE, MP4_MOOF_TRACK_ID_OFFSET);
+    CHECK_EQ(tfdt + MP4_FULL_BOX_HEADER_SIZE, MP4_MOOF_DECODE_TIME_OFFSET);
+    CHECK_EQ(trun + MP4_FULL_BOX_HEADER_SIZE, MP4_MOOF_SAMPLE_COUNT_OFFSET);
+    CHECK_EQ(trun + MP4_FULL_BOX_HEADER_SIZE + 8, MP4_MOOF_FIRST_SAMPLE_SIZE_OFFSET);
+    CHECK_EQ(MP4_MOOF_FIRST_SAMPLE_SIZE_OFFSET, MP4_MOOF_FIXED_SIZE);
+
+    CHECK_EQ(readBigEndian32(moof + MP4_MOOF_SEQUENCE_OFFSET), 7);
+    CHECK_EQ(readBigEndian32(moof + MP4_MOOF_TRACK_ID_OFFSET), 0x2468ACE1);
+    CHECK_EQ(readBigEndian64(moof + MP4_MOOF_DECODE_TIME_OFFSET), decodeTime);
+    CHECK_EQ((uint8_t)moof[tfdt + MP4_BOX_HEADER_SIZE], 1);
+    CHECK_EQ(readBigEndian32(moof + MP4_MOOF_SAMPLE_COUNT_OFFSET), sampleCount);
+    CHECK_EQ(readBigEndian32(moof + trun + MP4_FULL_BOX_HEADER_SIZE + 4), MP4_MOOF_SIZE(sampleCount) + MP4_BOX_HEADER_SIZE);
+    for (size_t i = 0; i < sampleCount; ++i) {
+        CHECK_EQ(readBigEndian32(moof + MP4_MOOF_FIRST_SAMPLE_SIZE_OFFSET + i * MP4_TRUN_ENTRY_SIZE), sizes[i]);
+    }
+
+    CHECK_EQ(readBigEndian32(moof + moofEnd), MP4_BOX_HEADER_SIZE + dataSize);
+    CHECK(!memcmp(moof + moofEnd + 4, "mdat", 4));
+}
+
+// Frame n of a recording, its size and content depend on n only
+static std::vector<char> makeFrame(size_t n) {
+    std::vector<char> frame(3000 + (n * 7919) % 9000);
+    for (size_t i = 0; i < frame.size(); ++i) {
+        frame[i] = (char)(n * 31 + i);
+    }
+    frame[0] = (char)0xFF;
+    frame[1] = (char)0xD8;
+    frame[frame.size() - 2] = (char)0xFF;
+    frame[frame.size() - 1] = (char)0xD9;
+
+    return frame;
+}
+
+static std::vector<char> readFile(FILE *file) {
+    fflush(file);
+    fseek(file, 0, SEEK_END);
+    std::vector<char> data(ftell(file));
+    fseek(file, 0, SEEK_SET);
+    CHECK_EQ(fread(data.data(), 1, data.size(), file), data.size());
+
+    return data;
+}
+
+/*
+    Parses a file of the writer and checks that the fragments continue each other, are sector aligned and
+    carry the frames of makeFrame. Returns the number of frames, fragmentEnds gets the end of every fragment.
+*/
+static size_t checkFile(const std::vector<char> &file, std::vector<size_t> *fragmentEnds = NULL) {
+    const char *buf = file.data();
+    const size_t moov = findBox(buf, 0, MINEQ(file.size(), (size_t)1024), "moov");
+    CHECK(moov != NO_BOX);
+    if (moov == NO_BOX) {
+        return 0;
+    }
+
+    const size_t trak = findBox(buf, moov + MP4_BOX_HEADER_SIZE, boxEnd(buf, moov), "trak");
+    const size_t tkhd = findBox(buf, trak + MP4_BOX_HEADER_SIZE, boxEnd(buf, trak), "tkhd");
+    const uint32_t trackId = readBigEndian32(buf + tkhd + MP4_TKHD_TRACK_ID_OFFSET);
+
+    size_t offset = boxEnd(buf, boxEnd(buf, moov));
+    CHECK_EQ(offset % MP4_SECTOR_SIZE, 0);
+
+    size_t frames = 0;
+    uint32_t sequence = 1;
+    while (offset < file.size()) {
+        const char *moof = buf + offset;
+        CHECK(!memcmp(moof + 4, "moof", 4));
+        CHECK_EQ(readBigEndian32(moof + MP4_MOOF_SEQUENCE_OFFSET), sequence);
+        CHECK_EQ(readBigEndian32(moof + MP4_MOOF_TRACK_ID_OFFSET), trackId);
+        CHECK_EQ(readBigEndian64(moof + MP4_MOOF_DECODE_TIME_OFFSET), frames);
+        if (memcmp(moof + 4, "moof", 4)) {
+            break;
+        }
+
+        const size_t count = readBigEndian32(moof + MP4_MOOF_SAMPLE_COUNT_OFFSET);
+        const char *sample = moof + MP4_MOOF_SIZE(count) + MP4_BOX_HEADER_SIZE;
+        for (size_t i = 0; i < count; ++i, ++frames) {
+            const std::vector<char> expected = makeFrame(frames);
+            CHECK_EQ(readBigEndian32(moof + MP4_MOOF_FIRST_SAMPLE_SIZE_OFFSET + i * MP4_TRUN_ENTRY_SIZE), expected.size());
+            CHECK(!memcmp(sample, expected.data(), expected.size()));
+            sample += expected.size();
+        }
+
+        // Padded up to the next sector
+        offset = sample - buf;
+        if (offset % MP4_SECTOR_SIZE) {
+            CHECK(!memcmp(buf + offset + 4, "free", 4));
+            offset = boxEnd(buf, offset);
+        }
+        CHECK_EQ(offset % MP4_SECTOR_SIZE, 0);
+        if (fragmentEnds) {
+            fragmentEnds->push_back(offset);
+        }
+        ++sequence;
+    }
+    CHECK_EQ(offset, file.size());
+
+    return frames;
+}
+
+static bool writeFrames(MP4Writer &writer, size_t first, size_t count) {
+    for (size_t n = first; n < first + count; ++n) {
+        const std::vector<char> frame = makeFrame(n);
+        if (!writer.writeFrame(frame.data(), frame.size())) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// The small buffer also closes fragments early, once the next frame would not fit anymore
+static void testRecording(size_t bufferSize) {
+    FILE *file = tmpfile();
+    MP4Writer writer(bufferSize, TEST_FRAGMENT_FRAMES);
+
+    CHECK(writer.begin(file, NULL, 640, 480, 10));
+    CHECK(writeFrames(writer, 0, 50));
+    CHECK(writer.finish());
+
+    const std::vector<char> data = readFile(file);
+    CHECK_EQ(writer.getWrittenSize(), data.size());
+    CHECK_EQ(checkFile(data), 50);
+
+    fclose(file);
+}
+
+// A recording which stopped without finish and lost its tail, only keep bytes of the last fragment are left
+static void testResumeTorn(size_t keep) {
+    FILE *file = tmpfile();
+    MP4Writer writer(TEST_BUFFER_SIZE, TEST_FRAGMENT_FRAMES);
+
+    // 5 complete fragments, the 5 frames of the open one are lost with the crash
+    CHECK(writer.begin(file, NULL, 640, 480, 10));
+    CHECK(writeFrames(writer, 0, 45));
+    writer.discard();
+
+    std::vector<size_t> fragmentEnds;
+    CHECK_EQ(checkFile(readFile(file), &fragmentEnds), 40);
+    CHECK_EQ(fragmentEnds.size(), 5);
+    const size_t tornSize = fragmentEnds[3] + keep;
+    CHECK_EQ(ftruncate(fileno(file), tornSize), 0);
+
+    MP4Writer resumed(TEST_BUFFER_SIZE, TEST_FRAGMENT_FRAMES);
+    size_t tornBytes = 0;
+    CHECK(resumed.resume(file, NULL, &tornBytes));
+    CHECK_EQ(resumed.getFrameCount(), 32);
+    CHECK_EQ(resumed.getWrittenSize(), fragmentEnds[3]);
+    CHECK_EQ(tornBytes, tornSize - fragmentEnds[3]);
+
+    // The recording goes on where the last complete fragment ended
+    CHECK(writeFrames(resumed, 32, 20));
+    CHECK(resumed.finish());
+    CHECK_EQ(ftruncate(fileno(file), resumed.getWrittenSize()), 0);
+    CHECK_EQ(checkFile(readFile(file)), 52);
+
+    fclose(file);
+}
+
+// Fragments of an older recording behind the new ones belong to another track and are not taken over
+static void testResumeStale() {
+    FILE *file = tmpfile();
+    MP4Writer old(TEST_BUFFER_SIZE, TEST_FRAGMENT_FRAMES);
+    CHECK(old.begin(file, NULL, 640, 480, 10));
+    CHECK(writeFrames(old, 0, 60));
+    CHECK(old.finish());
+    const size_t oldSize = readFile(file).size();
+
+    fseek(file, 0, SEEK_SET);
+    MP4Writer writer(TEST_BUFFER_SIZE, TEST_FRAGMENT_FRAMES);
+    CHECK(writer.begin(file, NULL, 640, 480, 10));
+    CHECK(writeFrames(writer, 0, 20));
+    writer.discard();
+
+    MP4Writer resumed(TEST_BUFFER_SIZE, TEST_FRAGMENT_FRAMES);
+    size_t tornBytes = 0;
+    CHECK(resumed.resume(file, NULL, &tornBytes));
+    CHECK_EQ(resumed.getFrameCount(), 16);
+    CHECK_EQ(tornBytes, oldSize - resumed.getWrittenSize());
+    resumed.discard();
+
+    fclose(file);
+}
+
+static void testResumeNoHeader() {
+    FILE *file = tmpfile();
+    const char junk[600] = {0};
+    fwrite(junk, 1, sizeof(junk), file);
+
+    MP4Writer writer(TEST_BUFFER_SIZE, TEST_FRAGMENT_FRAMES);
+    size_t tornBytes = 0;
+    CHECK(!writer.resume(file, NULL, &tornBytes));
+
+    fclose(file);
+}
+
+int main() {
+    testHeader();
+    testFragmentHeader(1);
+    testFragmentHeader(3);
+    testFragmentHeader(MP4_MAX_FRAGMENT_FRAMES);
+    testRecording(TEST_BUFFER_SIZE);
+    testRecording(32 * 1024);
+    // Cut inside the moof box, right behind the mdat header and inside the samples of the last fragment
+    testResumeTorn(50);
+    testResumeTorn(MP4_MOOF_SIZE(8) + MP4_BOX_HEADER_SIZE);
+    testResumeTorn(MP4_MOOF_SIZE(8) + MP4_BOX_HEADER_SIZE + 100);
+    testResumeStale();
+    testResumeNoHeader();
+
+    return hostTestResult("mp4_writer");
+}
@@ -0,0 +1,200 @@
+#include <algorithm>
+#include <random>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "host_test.hpp"
+#include "web_utils.h"
+
+#define TEST_RANDOM_QUERIES 200000
+#define TEST_MAX_QUERY_LENGTH 40
+#define TEST_MAX_PARAMS 6
+
+typedef std::vector<std::pair<std::string, std::string>> Params;
+
+// read_query takes the query from the request context and records the error response
+static const char *sentError = NULL;
+
+size_t httpd_req_get_url_query_len(httpd_req_t *req) {
+    return strlen((const char *)req->user_ctx);
+}
+
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *req, char *buf, size_t size) {
+    const char *query = (const char *)req->user_ctx;
+    if (strlen(query) >= size) {
+        return ESP_FAIL;
+    }
+    strcpy(buf, query);
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t error, const char *msg) {
+    sentError = error == HTTPD_400_BAD_REQUEST ? "400" : "other";
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_404(httpd_req_t *req) {
+    sentError = "404";
+    return ESP_OK;
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Reference decoding of a single key or value, it ends at a decoded zero like the C string does
+static std::string decode(const std::string &s) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); ++i) {
+        char c = s[i];
+        if (c == '+') {
+            c = ' ';
+        } else if (c == '%' && i + 2 < s.size() && hexValue(s[i + 1]) >= 0 && hexValue(s[i + 2]) >= 0) {
+            c = (char)(hexValue(s[i + 1]) << 4 | hexValue(s[i + 2]));
+            i += 2;
+        }
+        out += c;
+    }
+
+    return out.substr(0, out.find('\0'));
+}
+
+// Reference parser, which splits the query at '&' and the first '=' before decoding the parts
+static Params reference(const std::string &query) {
+    Params params;
+    for (size_t start = 0; start < query.size();) {
+        size_t end = query.find('&', start);
+        end = end == std::string::npos ? query.size() : end;
+        const std::string pair = query.substr(start, end - start);
+        start = end + 1;
+
+        if (pair.empty()) {
+            continue;
+        }
+        const size_t eq = pair.find('=');
+        params.emplace_back(decode(pair.substr(0, eq)), eq == std::string::npos ? "" : decode(pair.substr(eq + 1)));
+    }
+
+    return params;
+}
+
+// Parses a copy of query in an exactly sized buffer, so ASan reports any access behind it
+static Params parse(const std::string &query, size_t size) {
+    char *buf = (char *)malloc(query.size() + 1);
+    memcpy(buf, query.c_str(), query.size() + 1);
+    QueryParam *table = (QueryParam *)malloc(sizeof(QueryParam) * (size ? size : 1));
+
+    Params params;
+    const size_t count = parse_query(buf, table, size);
+    for (size_t i = 0; i < count; ++i) {
+        params.emplace_back(table[i].key, table[i].value);
+    }
+
+    free(buf);
+    free(table);
+    return params;
+}
+
+static void testExamples() {
+    CHECK(parse("a=1&b=2", 8) == Params({{"a", "1"}, {"b", "2"}}));
+    CHECK(parse("name=a%20b+c&path=%2Fsd%2Fx.avi", 8) == Params({{"name", "a b c"}, {"path", "/sd/x.avi"}}));
+    // Empty pairs are skipped, keys without a value get an empty one
+    CHECK(parse("&&a=1&&flag&=v&", 8) == Params({{"a", "1"}, {"flag", ""}, {"", "v"}}));
+    // Only the first '=' separates
+    CHECK(parse("a==b=c", 8) == Params({{"a", "=b=c"}}));
+    // Incomplete escapes are kept as they are
+    CHECK(parse("a=%&b=%4&c=%G1&d=%", 8) == Params({{"a", "%"}, {"b", "%4"}, {"c", "%G1"}, {"d", "%"}}));
+    // An escaped '&' or '=' does not split
+    CHECK(parse("a%3Db=c%26d", 8) == Params({{"a=b", "c&d"}}));
+    // The parameters behind the table are not parsed
+    CHECK(parse("a=1&b=2&c=3", 2) == Params({{"a", "1"}, {"b", "2"}}));
+    CHECK(parse("a=1", 0).empty());
+    CHECK(parse("", 8).empty());
+}
+
+// Random queries from an alphabet full of separators, escapes and invalid hex digits against the reference
+static void testRandom() {
+    static const char alphabet[] = "ab=&%+0f9Gz\x01\xff";
+    std::mt19937 rng(1);
+
+    for (size_t n = 0; n < TEST_RANDOM_QUERIES; ++n) {
+        std::string query;
+        for (size_t len = rng() % TEST_MAX_QUERY_LENGTH; len; --len) {
+            query += alphabet[rng() % (sizeof(alphabet) - 1)];
+        }
+        const size_t size = rng() % TEST_MAX_PARAMS;
+
+        Params expected = reference(query);
+        expected.resize(std::min(expected.size(), size));
+        const Params actual = parse(query, size);
+        if (actual != expected) {
+            fprintf(stderr, "parse_query(\"%s\", %zu) differs from the reference\n", query.c_str(), size);
+            CHECK(actual == expected);
+            return;
+        }
+    }
+}
+
+static void testLookups() {
+    char query[] = "w=640&h=-20&on=1&off=0&yes=true&no=TRUE&w=800&bad=12x";
+    QueryParam params[16];
+    const size_t count = parse_query(query, params, 16);
+    CHECK_EQ(count, 8);
+
+    // The first parameter with the key counts
+    CHECK(!strcmp(query_value(params, count, "w"), "640"));
+    CHECK(query_value(params, count, "x") == NULL);
+    CHECK_EQ(query_int(params, count, "w", 0), 640);
+    CHECK_EQ(query_int(params, count, "h", 0), -20);
+    CHECK_EQ(query_int(params, count, "bad", 0), 12);
+    CHECK_EQ(query_int(params, count, "x", 7), 7);
+    CHECK(query_bool(params, count, "on", false));
+    CHECK(!query_bool(params, count, "off", true));
+    CHECK(query_bool(params, count, "yes", false));
+    CHECK(!query_bool(params, count, "no", true));
+    CHECK(query_bool(params, count, "x", true));
+    // Only the counted parameters are searched
+    CHECK(query_value(params, 1, "h") == NULL);
+}
+
+static void testReadQuery() {
+    char buf[8];
+    char query[] = "a=1&b=2";
+    httpd_req_t req = {query};
+    sentError = NULL;
+    CHECK_EQ(read_query(&req, buf, sizeof(buf)), ESP_OK);
+    CHECK(!strcmp(buf, query) && sentError == NULL);
+
+    // One byte more does not fit with the terminator
+    char tooLong[] = "a=1&b=22";
+    req.user_ctx = tooLong;
+    CHECK_EQ(read_query(&req, buf, sizeof(buf)), ESP_FAIL);
+    CHECK(sentError && !strcmp(sentError, "400"));
+
+    char empty[] = "";
+    req.user_ctx = empty;
+    sentError = NULL;
+    CHECK_EQ(read_query(&req, buf, sizeof(buf)), ESP_FAIL);
+    CHECK(sentError && !strcmp(sentError, "404"));
+}
+
+int main() {
+    testExamples();
+    testRandom();
+    testLookups();
+    testReadQuery();
+
+    return hostTestResult("parse_query");
+}
@@ -0,0 +1,109 @@
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "config.h"
+#include "host_test.hpp"
+#include "request_arena.hpp"
+
+// The failure path needs a failing PSRAM allocation, which ASan only returns instead of aborting with this option
+extern "C" const char *__asan_default_options() {
+    return "allocator_may_return_null=1";
+}
+
+static std::vector<httpd_uri_t> registered;
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t server, const httpd_uri_t *uri) {
+    registered.push_back(*uri);
+    return ESP_OK;
+}
+
+// Calls the registered handler like the http server does
+static esp_err_t request(const httpd_uri_t &uri) {
+    httpd_req_t req = {uri.user_ctx};
+    return uri.handler(&req);
+}
+
+static int context = 42;
+static uint8_t *firstAllocation = NULL;
+
+static esp_err_t handler(httpd_req_t *req) {
+    // The handler gets the context it was registered with
+    CHECK(req->user_ctx == &context);
+
+    // Arena allocations are aligned and follow each other
+    uint8_t *a = (uint8_t *)requestArenaAlloc(1);
+    uint8_t *b = (uint8_t *)requestArenaAlloc(13);
+    uint8_t *c = (uint8_t *)requestArenaAlloc(0);
+    CHECK(a && b && c);
+    CHECK_EQ((uintptr_t)a % 8, 0);
+    CHECK_EQ(b - a, 8);
+    CHECK_EQ(c - b, 16);
+    memset(b, 0xAA, 13);
+
+    // The same memory is handed out again for every request
+    if (!firstAllocation) {
+        firstAllocation = a;
+    }
+    CHECK(a == firstAllocation);
+
+    // Whatever does not fit goes to PSRAM, which ASan checks for use after the reset
+    uint8_t *large = (uint8_t *)requestArenaAlloc(REQUEST_ARENA_SIZE);
+    CHECK(large && (large < a || large >= a + REQUEST_ARENA_SIZE));
+    CHECK_EQ((uintptr_t)large % 8, 0);
+    memset(large, 0x55, REQUEST_ARENA_SIZE);
+
+    // The rest of the arena is still used
+    uint8_t *rest = (uint8_t *)requestArenaAlloc(REQUEST_ARENA_SIZE - 32);
+    CHECK(rest == c + 8);
+    memset(rest, 0x11, REQUEST_ARENA_SIZE - 32);
+
+    // Failed allocations count no bytes
+    CHECK(requestArenaAlloc(SIZE_MAX / 2) == NULL);
+    // Sizes which would wrap around when aligned or with the fallback header are rejected up front, the
+    // largest one which does not wrap reaches the (failing) PSRAM allocation
+    for (size_t size : {SIZE_MAX, SIZE_MAX - 7, SIZE_MAX - 15, SIZE_MAX - 16}) {
+        CHECK(requestArenaAlloc(size) == NULL);
+    }
+
+    return ESP_FAIL;
+}
+
+static void testRequests() {
+    const httpd_uri_t uri = {"/test", HTTP_GET, handler, &context};
+    CHECK_EQ(registerArenaHandler(NULL, &uri), ESP_OK);
+    CHECK_EQ(registered.size(), 1);
+    // The handler result is passed through
+    CHECK_EQ(request(registered[0]), ESP_FAIL);
+    CHECK_EQ(request(registered[0]), ESP_FAIL);
+
+    const RequestArenaStats &stats = getRequestArenaStats();
+    CHECK_EQ(stats.fallbacks, 2);
+    CHECK_EQ(stats.failures, 2 * 5);
+    // Only the bytes handed out to a single request
+    CHECK_EQ(stats.highWaterBytes, 32 + REQUEST_ARENA_SIZE + REQUEST_ARENA_SIZE - 32);
+
+    // Allocations outside a handler are released by the next reset
+    requestArenaAlloc(REQUEST_ARENA_SIZE + 1);
+    requestArenaReset();
+    CHECK(requestArenaAlloc(1) == firstAllocation);
+    requestArenaReset();
+}
+
+static void testHandlerLimit() {
+    const httpd_uri_t uri = {"/more", HTTP_GET, handler, &context};
+    size_t added = 0;
+    while (registerArenaHandler(NULL, &uri) == ESP_OK) {
+        ++added;
+    }
+    // One handler is registered already
+    CHECK_EQ(added + 1, registered.size());
+    CHECK_EQ(registerArenaHandler(NULL, &uri), ESP_ERR_NO_MEM);
+}
+
+int main() {
+    testRequests();
+    testHandlerLimit();
+
+    return hostTestResult("request_arena");
+}
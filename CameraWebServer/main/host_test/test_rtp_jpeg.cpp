@@ -0,0 +1,228 @@
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "host_test.hpp"
+#include "rtp_jpeg.hpp"
+
+#define TEST_SCAN_SIZE 5000
+#define TEST_PADDING_SIZE 700
+
+typedef struct {
+    uint8_t samplingY;
+    uint16_t width;
+    uint16_t height;
+    uint16_t restartInterval;
+    // Frame header marker, SOF0 for baseline
+    uint8_t frameMarker;
+    uint8_t components;
+} TestJpeg;
+
+static void putSegment(std::vector<uint8_t> *jpg, uint8_t marker, const std::vector<uint8_t> &data) {
+    const size_t size = data.size() + 2;
+    jpg->insert(jpg->end(), {0xFF, marker, (uint8_t)(size >> 8), (uint8_t)size});
+    jpg->insert(jpg->end(), data.begin(), data.end());
+}
+
+static std::vector<uint8_t> makeQuantizationTable(uint8_t id) {
+    std::vector<uint8_t> table(1 + 64);
+    table[0] = id;
+    for (size_t i = 1; i < table.size(); ++i) {
+        table[i] = (uint8_t)(id * 100 + i);
+    }
+
+    return table;
+}
+
+// Entropy coded data with stuffed 0xFF bytes, which must be sent unchanged
+static std::vector<uint8_t> makeScan() {
+    std::vector<uint8_t> scan;
+    for (size_t i = 0; scan.size() < TEST_SCAN_SIZE; ++i) {
+        scan.push_back((uint8_t)(i * 37));
+        if (scan.back() == 0xFF) {
+            scan.push_back(0x00);
+        }
+    }
+
+    return scan;
+}
+
+// A baseline jpeg as the sensors deliver it: APP0, tables, frame and scan header, scan, EOI and zero padding
+static std::vector<uint8_t> makeJpeg(const TestJpeg &params) {
+    std::vector<uint8_t> jpg = {0xFF, 0xD8};
+    putSegment(&jpg, 0xE0, {'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0});
+
+    putSegment(&jpg, 0xDB, makeQuantizationTable(0));
+    putSegment(&jpg, 0xDB, makeQuantizationTable(1));
+
+    std::vector<uint8_t> frameHeader = {8, (uint8_t)(params.height >> 8), (uint8_t)params.height, (uint8_t)(params.width >> 8), (uint8_t)params.width,
+                                        params.components, 1, params.samplingY, 0};
+    for (uint8_t c = 2; c <= params.components; ++c) {
+        frameHeader.insert(frameHeader.end(), {c, 0x11, 1});
+    }
+    putSegment(&jpg, params.frameMarker, frameHeader);
+    // Huffman table, which is not sent
+    putSegment(&jpg, 0xC4, std::vector<uint8_t>(1 + 16 + 12, 1));
+
+    if (params.restartInterval) {
+        putSegment(&jpg, 0xDD, {(uint8_t)(params.restartInterval >> 8), (uint8_t)params.restartInterval});
+    }
+    putSegment(&jpg, 0xDA, {3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0});
+
+    const std::vector<uint8_t> scan = makeScan();
+    jpg.insert(jpg.end(), scan.begin(), scan.end());
+    jpg.insert(jpg.end(), {0xFF, 0xD9});
+    jpg.insert(jpg.end(), TEST_PADDING_SIZE, 0);
+
+    return jpg;
+}
+
+static const TestJpeg defaultJpeg = {0x22, 640, 480, 0, 0xC0, 3};
+
+static void testParse() {
+    RtpJpegFrame frame;
+    std::vector<uint8_t> jpg = makeJpeg(defaultJpeg);
+    const std::vector<uint8_t> scan = makeScan();
+
+    CHECK(rtpJpegParse(jpg.data(), jpg.size(), &frame));
+    CHECK_EQ(frame.type, 1);
+    CHECK(frame.width == 640 && frame.height == 480);
+    CHECK_EQ(frame.restartInterval, 0);
+    CHECK(!memcmp(frame.qtables[0], makeQuantizationTable(0).data() + 1, 64));
+    CHECK(!memcmp(frame.qtables[1], makeQuantizationTable(1).data() + 1, 64));
+    // The padding behind EOI is not part of the scan
+    CHECK_EQ(frame.scanSize, scan.size());
+    CHECK(frame.scan && !memcmp(frame.scan, scan.data(), scan.size()));
+
+    TestJpeg params = defaultJpeg;
+    params.samplingY = 0x21;
+    params.restartInterval = 40;
+    jpg = makeJpeg(params);
+    CHECK(rtpJpegParse(jpg.data(), jpg.size(), &frame));
+    CHECK_EQ(frame.type, 64);
+    CHECK_EQ(frame.restartInterval, 40);
+}
+
+static void testParseRejects() {
+    RtpJpegFrame frame;
+    TestJpeg params;
+
+    // Progressive
+    params = defaultJpeg;
+    params.frameMarker = 0xC2;
+    std::vector<uint8_t> jpg = makeJpeg(params);
+    CHECK(!rtpJpegParse(jpg.data(), jpg.size(), &frame));
+
+    // Grayscale
+    params = defaultJpeg;
+    params.components = 1;
+    jpg = makeJpeg(params);
+    CHECK(!rtpJpegParse(jpg.data(), jpg.size(), &frame));
+
+    // 4:4:4
+    params = defaultJpeg;
+    params.samplingY = 0x11;
+    jpg = makeJpeg(params);
+    CHECK(!rtpJpegParse(jpg.data(), jpg.size(), &frame));
+
+    // Too wide for the 8 bit width field
+    params = defaultJpeg;
+    params.width = RTP_JPEG_MAX_DIMENSION + 8;
+    jpg = makeJpeg(params);
+    CHECK(!rtpJpegParse(jpg.data(), jpg.size(), &frame));
+
+    // Every truncation either fails or yields a scan inside the buffer
+    jpg = makeJpeg(defaultJpeg);
+    for (size_t len = 0; len < jpg.size() - TEST_SCAN_SIZE; ++len) {
+        const std::vector<uint8_t> truncated(jpg.begin(), jpg.begin() + len);
+        if (rtpJpegParse(truncated.data(), truncated.size(), &frame)) {
+            CHECK(frame.scan + frame.scanSize <= truncated.data() + truncated.size());
+        }
+    }
+}
+
+// Packetizes the frame like the streams do and reassembles the scan from the fragment offsets
+static void testPayload(uint16_t restartInterval, size_t maxPayload) {
+    TestJpeg params = defaultJpeg;
+    params.restartInterval = restartInterval;
+    const std::vector<uint8_t> jpg = makeJpeg(params);
+    const std::vector<uint8_t> scan = makeScan();
+    RtpJpegFrame frame;
+    CHECK(rtpJpegParse(jpg.data(), jpg.size(), &frame));
+
+    const size_t headerSize = RTP_JPEG_HEADER_SIZE + (restartInterval ? RTP_JPEG_RESTART_HEADER_SIZE : 0);
+    std::vector<uint8_t> reassembled(scan.size());
+    std::vector<uint8_t> buf(maxPayload);
+    size_t offset = 0;
+    size_t packets = 0;
+    while (offset < frame.scanSize) {
+        size_t scanBytes;
+        const size_t size = rtpJpegPayload(frame, offset, buf.data(), buf.size(), &scanBytes);
+        CHECK(size <= maxPayload && scanBytes > 0);
+        if (!scanBytes) {
+            return;
+        }
+
+        const uint8_t *p = buf.data();
+        CHECK_EQ((p[1] << 16) | (p[2] << 8) | p[3], offset);
+        CHECK(p[4] == frame.type && p[5] == 255 && p[6] == 640 / 8 && p[7] == 480 / 8);
+        p += RTP_JPEG_HEADER_SIZE;
+
+        if (restartInterval) {
+            CHECK_EQ((p[0] << 8) | p[1], restartInterval);
+            CHECK_EQ((p[2] << 8) | p[3], 0xFFFF);
+            p += RTP_JPEG_RESTART_HEADER_SIZE;
+        }
+
+        // Only the first packet carries the tables
+        if (offset == 0) {
+            CHECK(p[0] == 0 && p[1] == 0 && ((p[2] << 8) | p[3]) == 128);
+            CHECK(!memcmp(p + 4, makeQuantizationTable(0).data() + 1, 64));
+            CHECK(!memcmp(p + 4 + 64, makeQuantizationTable(1).data() + 1, 64));
+            p += RTP_JPEG_QTABLE_HEADER_SIZE;
+        }
+
+        CHECK_EQ(size, (p - buf.data()) + scanBytes);
+        CHECK_EQ(headerSize + (offset == 0 ? RTP_JPEG_QTABLE_HEADER_SIZE : 0) + scanBytes, size);
+        memcpy(reassembled.data() + offset, p, scanBytes);
+        offset += scanBytes;
+        ++packets;
+    }
+
+    CHECK_EQ(offset, scan.size());
+    CHECK(reassembled == scan);
+    CHECK_EQ(packets, (scan.size() + RTP_JPEG_QTABLE_HEADER_SIZE + maxPayload - headerSize - 1) / (maxPayload - headerSize));
+}
+
+static void testHeaders() {
+    uint8_t buf[RTP_HEADER_SIZE];
+    rtpWriteHeader(buf, RTP_JPEG_PAYLOAD_TYPE, true, 0xABCD, 0x01020304, 0xDEADBEEF);
+    const uint8_t expected[RTP_HEADER_SIZE] = {0x80, 0x80 | 26, 0xAB, 0xCD, 1, 2, 3, 4, 0xDE, 0xAD, 0xBE, 0xEF};
+    CHECK(!memcmp(buf, expected, sizeof(buf)));
+
+    // Both RTCP packets are a multiple of 32 bit and their length fields add up to the returned size
+    uint8_t report[28 + 8 + 2 + 255 + 4];
+    for (size_t cnameLen = 0; cnameLen < 8; ++cnameLen) {
+        const char *cname = "camera@esp32";
+        char name[16] = {0};
+        memcpy(name, cname, cnameLen);
+        const size_t size = rtcpWriteSenderReport(report, 0x11223344, 0x0102030405060708ULL, 90000, 10, 12345, name);
+        CHECK_EQ(size % 4, 0);
+        CHECK(report[0] == 0x80 && report[1] == 200 && ((report[2] << 8) | report[3]) == 6);
+        CHECK(report[28] == 0x81 && report[29] == 202);
+        CHECK_EQ(28 + 4 * (((report[30] << 8) | report[31]) + 1), size);
+        CHECK(report[36] == 1 && report[37] == cnameLen && !memcmp(report + 38, name, cnameLen) && report[38 + cnameLen] == 0);
+    }
+}
+
+int main() {
+    testParse();
+    testParseRejects();
+    testPayload(0, 1400);
+    testPayload(0, 200);
+    testPayload(40, 1400);
+    testPayload(40, 200);
+    testHeaders();
+
+    return hostTestResult("rtp_jpeg");
+}
@@ -13,21 +13,32 @@
 // limitations under the License.
 #include "driver/ledc.h"
 #include "esp_camera.h"
+#include "esp_heap_caps.h"
 #include "esp_http_server.h"
+#include "esp_system.h"
 #include "esp_timer.h"
 #include "img_converters.h"
+#include <limits.h>
 
 // Include the config
 #include "config.h"
 
 // Local files
 #include "camera_helper.h"
+#include "capture_cache.hpp"
 #include "flashlight.h"
+#include "frame_broker.hpp"
 #include "fs_browser.h"
 #include "http_server.hpp"
+#include "json_writer.hpp"
 #include "lapse_handler.hpp"
 #include "makros.h"
 #include "mdns_helper.h"
+#include "multicast_stream.hpp"
+#include "request_arena.hpp"
+#include "rtsp_server.hpp"
+#include "status_events.hpp"
+#include "stream_server.hpp"
 #include "web_utils.h"
 
 #ifdef OTA_FEATURE
@@ -39,10 +50,12 @@ static inline int handleUpdateCheck() {
 }
 #endif
 
-#define _PART_BOUNDARY "123456789000000000000987654321"
-#define _STREAM_CONTENT_TYPE "multipart/x-mixed-replace;boundary=" _PART_BOUNDARY
-#define _STREAM_BOUNDARY "\r\n--" _PART_BOUNDARY "\r\n"
-#define _STREAM_PART "Content-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n"
+// Longest time a request waits for the broker to deliver a frame
+#define CAPTURE_TIMEOUT_MS 5000
+// Parameters of /capture, max_age, framesize and the cache buster of the pages
+#define CAPTURE_MAX_PARAMS 4
+// Frames of a snapshot which may still have the preview size before it fails
+#define SNAP_MAX_WARMUP_FRAMES 4
 
 #if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
 #include "esp32-hal-log.h"
@@ -57,7 +70,6 @@ extern bool SDCardAvailable;
 extern volatile int isWiFiSTAMode;
 
 // Local status variables
-static bool isStreaming = false;
 static int camLEDStatus = 0;
 static int useFlash = 0;
 static int led_duty = 255;
@@ -68,7 +80,7 @@ static inline void enable_led(bool en) { // Turn LED On or Off
     int duty = 0;
 
     if (en) {
-        if (isStreaming && led_duty > CONFIG_LED_MAX_INTENSITY) {
+        if (streamClientCount() && led_duty > CONFIG_LED_MAX_INTENSITY) {
             duty = CONFIG_LED_MAX_INTENSITY;
         } else {
             duty = led_duty;
@@ -78,15 +90,17 @@ static inline void enable_led(bool en) { // Turn LED On or Off
     ledc_update_duty(CONFIG_LED_LEDC_SPEED_MODE, (ledc_channel_t)CONFIG_LED_LEDC_CHANNEL);
 }
 
-camera_fb_t *takePicture() {
+camera_fb_t *takePicture(int64_t notBeforeUs) {
     bool mustEnableFlashLight = useFlash && !camLEDStatus;
 
     if (mustEnableFlashLight) {
         enable_led(true);
         vTaskDelay(flash_wait);
+        // The driver still holds frames which were exposed before the LED was on or while it ramped up
+        notBeforeUs = MAXEQ(notBeforeUs, esp_timer_get_time());
     }
 
-    camera_fb_t *fb = esp_camera_fb_get();
+    camera_fb_t *fb = frameBrokerFetch(notBeforeUs);
 
     if (mustEnableFlashLight) {
         enable_led(false);
@@ -119,306 +133,729 @@ static size_t jpg_encode_stream(void *arg, size_t index, const void *data, size_
     return len;
 }
 
+static CaptureCache captureCache;
+
+// The header values are kept in the buffers until the response is sent
+static void setCaptureHeaders(httpd_req_t *req, int64_t timeUs, char *timestamp, size_t timestampSize, char *age, size_t ageSize) {
+    snprintf(timestamp, timestampSize, "%lld.%06lld", timeUs / 1000000, timeUs % 1000000);
+    snprintf(age, ageSize, "%lld", (esp_timer_get_time() - timeUs) / 1000);
+
+    httpd_resp_set_type(req, "image/jpeg");
+    httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.jpg");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_set_hdr(req, "Access-Control-Expose-Headers", "X-Timestamp, X-Frame-Age-Ms");
+    httpd_resp_set_hdr(req, "X-Timestamp", timestamp);
+    httpd_resp_set_hdr(req, "X-Frame-Age-Ms", age);
+}
+
+typedef struct {
+    framesize_t framesize;
+    camera_fb_t *fb;
+} Snapshot;
+
+// Time from the start of the last switch to its first usable frame, and the frames it dropped on the way
+static int32_t snapSwitchUs = 0;
+static uint32_t snapWarmupFrames = 0;
+
+// A frame which was captured before the sensor switched has the dimensions of the old framesize
+static bool jpegHasResolution(const camera_fb_t *fb, const resolution_info_t &res) {
+    if (fb->len < 2 || fb->buf[0] != 0xFF || fb->buf[1] != 0xD8) {
+        return false;
+    }
+
+    const uint8_t *p = fb->buf + 2;
+    const uint8_t *end = fb->buf + fb->len;
+    while (end - p >= 4 && p[0] == 0xFF) {
+        const uint8_t marker = p[1];
+        // The frame header (SOF0 to SOF2) stores the precision, the height and the width
+        if (marker >= 0xC0 && marker <= 0xC2) {
+            return end - p >= 9 && ((p[5] << 8) | p[6]) == res.height && ((p[7] << 8) | p[8]) == res.width;
+        }
+        // The scan follows, there is no frame header
+        if (marker == 0xDA) {
+            break;
+        }
+        p += 2 + ((p[2] << 8) | p[3]);
+    }
+
+    return false;
+}
+
+/*
+    Runs on the broker task, so the streams and the timelapse never get a frame of the snapshot size.
+    The sensor drivers write their register tables for the framesize, only the frames which were exposed
+    before are dropped instead of a fixed number.
+*/
+static int takeSnapshot(void *arg) {
+    Snapshot *snap = (Snapshot *)arg;
+    sensor_t *s = esp_camera_sensor_get();
+    const framesize_t preview = s->status.framesize;
+    const int64_t startUs = esp_timer_get_time();
+    const uint32_t staleFrames = getFrameBrokerStats().staleFrames;
+
+    snap->fb = NULL;
+    if (s->set_framesize(s, snap->framesize)) {
+        return -1;
+    }
+
+    // The driver clamps the framesize to the limit of the sensor
+    const resolution_info_t &res = resolution[s->status.framesize];
+    const int64_t switchedUs = esp_timer_get_time();
+    size_t mismatched = 0;
+    for (size_t i = 0; i <= SNAP_MAX_WARMUP_FRAMES; ++i) {
+        camera_fb_t *fb = takePicture(switchedUs);
+        if (!fb) {
+            break;
+        }
+        if (jpegHasResolution(fb, res)) {
+            snap->fb = fb;
+            break;
+        }
+        esp_camera_fb_return(fb);
+        ++mismatched;
+    }
+
+    snapSwitchUs = esp_timer_get_time() - startUs;
+    snapWarmupFrames = getFrameBrokerStats().staleFrames - staleFrames + mismatched;
+
+    // The broker drops the frames of the snapshot size which the driver still holds
+    s->set_framesize(s, preview);
+
+    return snap->fb ? 0 : -1;
+}
+
+static esp_err_t sendSnapshot(httpd_req_t *req, framesize_t framesize) {
+    Snapshot snap = {framesize, NULL};
+
+    // Only the framesize changes and it is restored, so no frames need to settle after the switch back
+    if (frameBrokerRunBetweenFrames(takeSnapshot, &snap, 0)) {
+        ESP_LOGE(TAG, "Snapshot at framesize %d failed", framesize);
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+
+    camera_fb_t *fb = snap.fb;
+    char timestamp[24];
+    char age[16];
+    setCaptureHeaders(req, fb->timestamp.tv_sec * 1000000LL + fb->timestamp.tv_usec, timestamp, sizeof(timestamp), age, sizeof(age));
+
+    const esp_err_t res = httpd_resp_send(req, (const char *)fb->buf, fb->len);
+    esp_camera_fb_return(fb);
+
+    return res;
+}
+
+/*
+    With max_age (ms) the last captured frame is served again while it is young enough, so clients polling
+    many cameras share one grab instead of firing the flash and competing with the streams each time.
+    With framesize the frame is taken at that framesize, e.g. a full resolution still while streaming a
+    preview. The streams continue at their framesize afterwards, it also works while a timelapse runs.
+*/
 static esp_err_t capture_handler(httpd_req_t *req) {
+    int maxAgeMs = 0;
+    int framesize = -1;
+    if (httpd_req_get_url_query_len(req)) {
+        char buf[QUERY_BUFFER_SIZE];
+        if (read_query(req, buf, sizeof(buf)) != ESP_OK) {
+            return ESP_FAIL;
+        }
 
-    camera_fb_t *fb = takePicture();
+        QueryParam params[CAPTURE_MAX_PARAMS];
+        const size_t count = parse_query(buf, params, NUMELEMS(params));
+        maxAgeMs = query_int(params, count, "max_age", 0);
+        framesize = query_int(params, count, "framesize", -1);
+    }
 
-    if (!fb) {
+    if (framesize != -1) {
+        sensor_t *s = esp_camera_sensor_get();
+        if (framesize < 0 || framesize >= FRAMESIZE_INVALID || s->pixformat != PIXFORMAT_JPEG) {
+            return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid framesize");
+        }
+        if (framesize != s->status.framesize) {
+            return sendSnapshot(req, (framesize_t)framesize);
+        }
+    }
+
+    char timestamp[24];
+    char age[16];
+
+    if (captureCache.fresh(maxAgeMs, esp_timer_get_time(), statusVersion())) {
+        setCaptureHeaders(req, captureCache.timestamp(), timestamp, sizeof(timestamp), age, sizeof(age));
+        return httpd_resp_send(req, captureCache.data(), captureCache.length());
+    }
+
+    FrameSubscriber *subscriber = frameBrokerSubscribe(1, FRAME_DROP_NEWEST, false);
+    if (!subscriber) {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+
+    // Shares the frame with the running streams and the timelapse
+    frameBrokerRequestFresh(subscriber);
+    SharedFrame *frame = frameBrokerReceive(subscriber, pdMS_TO_TICKS(CAPTURE_TIMEOUT_MS));
+    frameBrokerUnsubscribe(subscriber);
+
+    if (!frame) {
         ESP_LOGE(TAG, "Camera capture failed");
         httpd_resp_send_500(req);
         return ESP_FAIL;
     }
 
-    httpd_resp_set_type(req, "image/jpeg");
-    httpd_resp_set_hdr(req, "Content-Disposition",
-                       "inline; filename=capture.jpg");
-    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    camera_fb_t *fb = frame->fb;
+    const int64_t timeUs = fb->timestamp.tv_sec * 1000000LL + fb->timestamp.tv_usec;
+    setCaptureHeaders(req, timeUs, timestamp, sizeof(timestamp), age, sizeof(age));
 
     esp_err_t res;
 
-    if (fb->format == PIXFORMAT_JPEG) {
-        res = httpd_resp_send(req, (const char *)fb->buf, fb->len);
-    } else {
+    if (fb->format != PIXFORMAT_JPEG) {
         res = frame2jpg_cb(fb, JPG_QUALITY, jpg_encode_stream, req) ? ESP_OK : ESP_FAIL;
         httpd_resp_send_chunk(req, NULL, 0);
+    } else if (captureCache.store((const char *)fb->buf, fb->len, timeUs, statusVersion())) {
+        // The driver buffer goes back before the slow send
+        frameBrokerRelease(frame);
+        return httpd_resp_send(req, captureCache.data(), captureCache.length());
+    } else {
+        res = httpd_resp_send(req, (const char *)fb->buf, fb->len);
     }
 
-    esp_camera_fb_return(fb);
+    frameBrokerRelease(frame);
 
     return res;
 }
 
-static esp_err_t stream_handler(httpd_req_t *req) {
-    // We do not allow streaming if a timelapse is running
-    if (lapseRunning) {
-        httpd_resp_send_404(req);
-        return ESP_FAIL;
-    }
+// Result of a single setting of a control request
+typedef enum {
+    CONTROL_OK,
+    CONTROL_UNKNOWN,
+    CONTROL_INVALID,
+    // The setting can not be changed while the timelapse is running
+    CONTROL_LOCKED,
+    // Valid, but not applied because another setting of the request was rejected
+    CONTROL_SKIPPED,
+    CONTROL_FAILED,
+} ControlResult;
+
+static const char *const controlResultNames[] = {"ok", "unknown", "invalid", "locked", "skipped", "failed"};
+
+typedef struct {
+    const char *name;
+    int (*set)(sensor_t *s, int val);
+    int min;
+    int max;
+    // Writes sensor registers, which only happens between two frames
+    bool sensor;
+    bool lapseLocked;
+} Control;
+
+// FNV-1a, evaluated by the compiler for the case labels of findControl
+static constexpr uint32_t controlHash(const char *name, uint32_t hash = 2166136261u) {
+    return *name ? controlHash(name + 1, (hash ^ (uint8_t)*name) * 16777619u) : hash;
+}
 
-    camera_fb_t *fb = NULL;
-    esp_err_t res = ESP_OK;
-    size_t _jpg_buf_len = 0;
-    uint8_t *_jpg_buf = NULL;
-    char *part_buf[64];
+#define SENSOR_SETTER(setter) [](sensor_t *s, int val) { return s->setter(s, val); }
 
-    res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
-    if (res != ESP_OK) {
-        return res;
-    }
+static int setFramesize(sensor_t *s, int val) {
+    return s->pixformat == PIXFORMAT_JPEG ? s->set_framesize(s, (framesize_t)val) : 0;
+}
 
-    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+#ifdef OTA_FEATURE
+#define OTA_CONTROLS(X) X(CHECK_UPDATE, "check-update", [](sensor_t *s, int val) { return handleUpdateCheck(); }, INT_MIN, INT_MAX, false, false)
+#else
+#define OTA_CONTROLS(X)
+#endif
 
-    isStreaming = true;
+/*
+    All controls as X(id, name, set, min, max, sensor, lapseLocked). The table, the ids and the cases of
+    findControl are generated from this list, so they can not get out of sync.
+    The ranges cover all supported sensors, the drivers clamp to their own limits.
+*/
+#define CONTROLS(X)                                                                                                         \
+    X(FRAMESIZE, "framesize", setFramesize, 0, FRAMESIZE_INVALID - 1, true, true)                                           \
+    X(QUALITY, "quality", SENSOR_SETTER(set_quality), 0, 63, true, false)                                                   \
+    X(CONTRAST, "contrast", SENSOR_SETTER(set_contrast), -3, 3, true, false)                                                \
+    X(BRIGHTNESS, "brightness", SENSOR_SETTER(set_brightness), -3, 3, true, false)                                          \
+    X(SATURATION, "saturation", SENSOR_SETTER(set_saturation), -4, 4, true, false)                                          \
+    X(SHARPNESS, "sharpness", SENSOR_SETTER(set_sharpness), -3, 3, true, false)                                             \
+    X(DENOISE, "denoise", SENSOR_SETTER(set_denoise), 0, 8, true, false)                                                    \
+    X(GAINCEILING, "gainceiling", [](sensor_t *s, int val) { return s->set_gainceiling(s, (gainceiling_t)val); }, 0, 511, \
+      true, false)                                                                                                          \
+    X(COLORBAR, "colorbar", SENSOR_SETTER(set_colorbar), 0, 1, true, false)                                                 \
+    X(AWB, "awb", SENSOR_SETTER(set_whitebal), 0, 1, true, false)                                                           \
+    X(AGC, "agc", SENSOR_SETTER(set_gain_ctrl), 0, 1, true, false)                                                          \
+    X(AEC, "aec", SENSOR_SETTER(set_exposure_ctrl), 0, 1, true, false)                                                      \
+    X(HMIRROR, "hmirror", SENSOR_SETTER(set_hmirror), 0, 1, true, false)                                                    \
+    X(VFLIP, "vflip", SENSOR_SETTER(set_vflip), 0, 1, true, false)                                                          \
+    X(AWB_GAIN, "awb_gain", SENSOR_SETTER(set_awb_gain), 0, 1, true, false)                                                 \
+    X(AGC_GAIN, "agc_gain", SENSOR_SETTER(set_agc_gain), 0, 64, true, false)                                                \
+    X(AEC_VALUE, "aec_value", SENSOR_SETTER(set_aec_value), 0, 1920, true, false)                                           \
+    X(AEC2, "aec2", SENSOR_SETTER(set_aec2), 0, 1, true, false)                                                             \
+    X(DCW, "dcw", SENSOR_SETTER(set_dcw), 0, 1, true, false)                                                                \
+    X(BPC, "bpc", SENSOR_SETTER(set_bpc), 0, 1, true, false)                                                                \
+    X(WPC, "wpc", SENSOR_SETTER(set_wpc), 0, 1, true, false)                                                                \
+    X(RAW_GMA, "raw_gma", SENSOR_SETTER(set_raw_gma), 0, 1, true, false)                                                    \
+    X(LENC, "lenc", SENSOR_SETTER(set_lenc), 0, 1, true, false)                                                             \
+    X(WB_MODE, "wb_mode", SENSOR_SETTER(set_wb_mode), 0, 4, true, false)                                                    \
+    X(AE_LEVEL, "ae_level", SENSOR_SETTER(set_ae_level), -5, 5, true, false)                                                \
+    X(LED_INTENSITY, "led_intensity", [](sensor_t *s, int val) {                                                            \
+        led_duty = val;                                                                                                     \
+        if (camLEDStatus) {                                                                                                 \
+            enable_led(true);                                                                                               \
+        }                                                                                                                   \
+        return 0;                                                                                                           \
+    }, 0, 255, false, false)                                                                                                \
+    X(LED, "led", [](sensor_t *s, int val) { return handleLED(val); }, 0, 1, false, false)                                  \
+    X(USE_FLASH, "use_flash", [](sensor_t *s, int val) {                                                                    \
+        useFlash = val;                                                                                                     \
+        return 0;                                                                                                           \
+    }, 0, 1, false, false)                                                                                                  \
+    X(FLASH_DURATION, "flash_duration", [](sensor_t *s, int val) {                                                          \
+        flash_duration = val;                                                                                               \
+        flash_wait = pdMS_TO_TICKS(flash_duration);                                                                         \
+        return 0;                                                                                                           \
+    }, 1, 10000, false, false)                                                                                              \
+    X(LAPSE_RUNNING, "lapse-running", [](sensor_t *s, int val) { return SDCardAvailable ? handleLapse(s, val) : 0; }, 0, 1, \
+      false, false)                                                                                                         \
+    X(VIDEO_FPS, "video_fps", [](sensor_t *s, int val) {                                                                    \
+        videoFPS = val;                                                                                                     \
+        return 0;                                                                                                           \
+    }, 1, 120, false, true)                                                                                                 \
+    X(FRAME_DELAY, "frame_delay", [](sensor_t *s, int val) {                                                                \
+        millisBetweenSnapshots = val;                                                                                       \
+        return 0;                                                                                                           \
+    }, 1, INT_MAX, false, true)                                                                                             \
+    X(MULTICAST, "multicast", [](sensor_t *s, int val) { return setMulticastStreaming(val) ? 0 : -1; }, 0, 1, false, false) \
+    X(CONTAINER, "container", [](sensor_t *s, int val) {                                                                    \
+        lapseContainer = (VideoContainer)val;                                                                               \
+        return 0;                                                                                                           \
+    }, VIDEO_CONTAINER_AVI, VIDEO_CONTAINER_MP4, false, true)                                                               \
+    OTA_CONTROLS(X)
+
+#define CONTROL_ID(id, name, ...) CONTROL_##id,
+#define CONTROL_ENTRY(id, name, ...) {name, __VA_ARGS__},
+// Two names with the same hash are rejected by the compiler as duplicate case values
+#define CONTROL_CASE(id, name, ...)        \
+    case controlHash(name):                \
+        control = &controls[CONTROL_##id]; \
+        break;
+
+typedef enum { CONTROLS(CONTROL_ID) CONTROL_COUNT } ControlId;
+
+static const Control controls[CONTROL_COUNT] = {CONTROLS(CONTROL_ENTRY)};
+
+// Settings of one request, a whole profile fits
+#define CONTROL_MAX_SETTINGS CONTROL_COUNT
+// Body of a POST to /control/batch
+#define CONTROL_MAX_BODY 1024
+
+static const Control *findControl(const char *name) {
+    // The compiler turns the switch into a search over the constant hashes, only the match is compared as string
+    const Control *control;
+    switch (controlHash(name)) {
+        CONTROLS(CONTROL_CASE)
+        default:
+            return NULL;
+    }
 
-    do {
-        fb = takePicture();
-        if (!fb) {
-            ESP_LOGE(TAG, "Camera capture failed");
-            res = ESP_FAIL;
-            break;
-        }
+    return strcmp(control->name, name) ? NULL : control;
+}
 
-        const bool notJPEG = fb->format != PIXFORMAT_JPEG;
+typedef struct {
+    const char *name;
+    const Control *control;
+    int value;
+    ControlResult result;
+} ControlSetting;
+
+typedef struct {
+    ControlSetting *settings;
+    size_t count;
+} ControlBatch;
+
+static ControlResult checkSetting(ControlSetting *setting, const char *value) {
+    setting->control = findControl(setting->name);
+    if (!setting->control) {
+        return CONTROL_UNKNOWN;
+    }
 
-        if (notJPEG) {
-            bool jpeg_converted = frame2jpg(fb, JPG_QUALITY, &_jpg_buf, &_jpg_buf_len);
-            if (!jpeg_converted) {
-                ESP_LOGE(TAG, "JPEG compression failed");
-                res = ESP_FAIL;
-            }
-        } else {
-            _jpg_buf_len = fb->len;
-            _jpg_buf = fb->buf;
-        }
+    char *end;
+    const long val = strtol(value, &end, 10);
+    if (end == value || *end || val < setting->control->min || val > setting->control->max) {
+        return CONTROL_INVALID;
+    }
+    setting->value = val;
 
-        if (res == ESP_OK) {
-            res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY, CONST_STR_LEN(_STREAM_BOUNDARY));
+    return setting->control->lapseLocked && lapseRunning ? CONTROL_LOCKED : CONTROL_OK;
+}
 
-            if (res == ESP_OK) {
-                size_t hlen = snprintf((char *)part_buf, sizeof(part_buf), _STREAM_PART, _jpg_buf_len);
-                res = httpd_resp_send_chunk(req, (const char *)part_buf, hlen);
+// Runs on the frame broker task, between two frames
+static int applySensorSettings(void *arg) {
+    ControlBatch *batch = (ControlBatch *)arg;
+    sensor_t *s = esp_camera_sensor_get();
 
-                if (res == ESP_OK) {
-                    res = httpd_resp_send_chunk(req, (const char *)_jpg_buf, _jpg_buf_len);
-                }
-            }
+    for (size_t i = 0; i < batch->count; ++i) {
+        ControlSetting *setting = &batch->settings[i];
+        if (setting->control->sensor) {
+            setting->result = setting->control->set(s, setting->value) ? CONTROL_FAILED : CONTROL_OK;
         }
+    }
 
-        esp_camera_fb_return(fb);
+    return 0;
+}
+
+/*
+    Applies the checked settings, the ones of the sensor all at once between two frames.
+    Returns false if any of them failed.
+*/
+static bool applySettings(ControlSetting *settings, size_t count) {
+    bool sensor = false;
+    bool framesize = false;
+    for (size_t i = 0; i < count; ++i) {
+        sensor |= settings[i].control->sensor;
+        framesize |= settings[i].control->set == setFramesize;
+    }
 
-        if (notJPEG) {
-            free(_jpg_buf);
-            _jpg_buf = NULL;
-            _jpg_buf_len = 0;
+    ControlBatch batch = {settings, count};
+    if (sensor) {
+        frameBrokerRunBetweenFrames(applySensorSettings, &batch);
+    }
+
+    sensor_t *s = esp_camera_sensor_get();
+    bool ok = true;
+    for (size_t i = 0; i < count; ++i) {
+        ControlSetting *setting = &settings[i];
+        if (!setting->control->sensor) {
+            setting->result = setting->control->set(s, setting->value) ? CONTROL_FAILED : CONTROL_OK;
         }
-    } while (res == ESP_OK);
+        ok &= setting->result == CONTROL_OK;
+    }
 
-    isStreaming = false;
+    if (framesize) {
+        app_mdns_update_framesize(s->status.framesize);
+    }
+    statusEventsNotify();
 
-    return res;
+    return ok;
 }
 
 //TODO add feature to stop lapse automatically after certain time/number of frames
 //TODO maybe EEPROM for camera parameters? add option to save/load and load and set at configure phase
 static esp_err_t cmd_handler(httpd_req_t *req) {
-    char variable[32];
-    char value[32];
-
-    char *buf = NULL;
-    if (parse_get(req, &buf) != ESP_OK) {
+    char buf[QUERY_BUFFER_SIZE];
+    if (read_query(req, buf, sizeof(buf)) != ESP_OK) {
         return ESP_FAIL;
     }
-    if (httpd_query_key_value(buf, "var", variable, sizeof(variable)) != ESP_OK ||
-        httpd_query_key_value(buf, "val", value, sizeof(value)) != ESP_OK) {
-        free(buf);
+
+    QueryParam params[2];
+    const size_t count = parse_query(buf, params, NUMELEMS(params));
+    const char *variable = query_value(params, count, "var");
+    const char *value = query_value(params, count, "val");
+    if (!variable || !value) {
         httpd_resp_send_404(req);
         return ESP_FAIL;
     }
-    free(buf);
 
-    int val = atoi(value);
-    sensor_t *s = esp_camera_sensor_get();
-    int res = 0;
+    ControlSetting setting = {variable};
+    if (checkSetting(&setting, value) != CONTROL_OK || !applySettings(&setting, 1)) {
+        return httpd_resp_send_500(req);
+    }
 
-    if (!lapseRunning && !strcmp(variable, "framesize")) {
-        if (s->pixformat == PIXFORMAT_JPEG) {
-            res = s->set_framesize(s, (framesize_t)val);
-            if (res == 0) {
-                app_mdns_update_framesize(val);
-            }
-        }
-    } else if (!strcmp(variable, "quality")) {
-        res = s->set_quality(s, val);
-    } else if (!strcmp(variable, "contrast")) {
-        res = s->set_contrast(s, val);
-    } else if (!strcmp(variable, "brightness")) {
-        res = s->set_brightness(s, val);
-    } else if (!strcmp(variable, "saturation")) {
-        res = s->set_saturation(s, val);
-    } else if (!strcmp(variable, "gainceiling")) {
-        res = s->set_gainceiling(s, (gainceiling_t)val);
-    } else if (!strcmp(variable, "colorbar")) {
-        res = s->set_colorbar(s, val);
-    } else if (!strcmp(variable, "awb")) {
-        res = s->set_whitebal(s, val);
-    } else if (!strcmp(variable, "agc")) {
-        res = s->set_gain_ctrl(s, val);
-    } else if (!strcmp(variable, "aec")) {
-        res = s->set_exposure_ctrl(s, val);
-    } else if (!strcmp(variable, "hmirror")) {
-        res = s->set_hmirror(s, val);
-    } else if (!strcmp(variable, "vflip")) {
-        res = s->set_vflip(s, val);
-    } else if (!strcmp(variable, "awb_gain")) {
-        res = s->set_awb_gain(s, val);
-    } else if (!strcmp(variable, "agc_gain")) {
-        res = s->set_agc_gain(s, val);
-    } else if (!strcmp(variable, "aec_value")) {
-        res = s->set_aec_value(s, val);
-    } else if (!strcmp(variable, "aec2")) {
-        res = s->set_aec2(s, val);
-    } else if (!strcmp(variable, "dcw")) {
-        res = s->set_dcw(s, val);
-    } else if (!strcmp(variable, "bpc")) {
-        res = s->set_bpc(s, val);
-    } else if (!strcmp(variable, "wpc")) {
-        res = s->set_wpc(s, val);
-    } else if (!strcmp(variable, "raw_gma")) {
-        res = s->set_raw_gma(s, val);
-    } else if (!strcmp(variable, "lenc")) {
-        res = s->set_lenc(s, val);
-    } else if (!strcmp(variable, "wb_mode")) {
-        res = s->set_wb_mode(s, val);
-    } else if (!strcmp(variable, "ae_level")) {
-        res = s->set_ae_level(s, val);
-    } else if (!strcmp(variable, "led_intensity")) {
-        led_duty = val;
-        if (camLEDStatus) {
-            enable_led(true);
-        }
-    } else if (!strcmp(variable, "led")) {
-        res = handleLED(val);
-    } else if (!strcmp(variable, "use_flash")) {
-        useFlash = val;
-    } else if (!strcmp(variable, "flash_duration")) {
-        if (val > 0) {
-            flash_duration = val;
-            flash_wait = pdMS_TO_TICKS(flash_duration);
-        }
-    }else if (!strcmp(variable, "lapse-running")) {
-        if (SDCardAvailable) {
-            res = handleLapse(s, val);
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, NULL, 0);
+}
+
+// Reads the urlencoded settings of a POST into the request arena
+static char *readBatchBody(httpd_req_t *req) {
+    if (!req->content_len || req->content_len > CONTROL_MAX_BODY) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid body length");
+        return NULL;
+    }
+
+    char *buf = (char *)requestArenaAlloc(req->content_len + 1);
+    if (!buf) {
+        httpd_resp_send_500(req);
+        return NULL;
+    }
+
+    size_t received = 0;
+    while (received < req->content_len) {
+        const int res = httpd_req_recv(req, buf + received, req->content_len - received);
+        if (res == HTTPD_SOCK_ERR_TIMEOUT) {
+            continue;
         }
-    } else if (!lapseRunning && !strcmp(variable, "video_fps")) {
-        if (val) {
-            videoFPS = val;
-        } else {
-            res = -1;
+        if (res <= 0) {
+            return NULL;
         }
-    } else if (!lapseRunning && !strcmp(variable, "frame_delay")) {
-        if (val) {
-            millisBetweenSnapshots = val;
-        } else {
-            res = -1;
+        received += res;
+    }
+    buf[received] = '\0';
+
+    return buf;
+}
+
+/*
+    Takes any number of name=value pairs, as query or as urlencoded POST body, e.g. a day or night profile.
+    All of them are checked first, if any is rejected none is applied. The response lists the result of each one.
+*/
+static esp_err_t batch_handler(httpd_req_t *req) {
+    char queryBuf[QUERY_BUFFER_SIZE];
+    char *query = queryBuf;
+    if (req->method == HTTP_POST) {
+        query = readBatchBody(req);
+        if (!query) {
+            return ESP_FAIL;
         }
-#ifdef OTA_FEATURE
-    } else if (!strcmp(variable, "check-update")) {
-        res = handleUpdateCheck();
-#endif
-    } else {
-        res = -1;
+    } else if (read_query(req, queryBuf, sizeof(queryBuf)) != ESP_OK) {
+        return ESP_FAIL;
     }
 
-    if (res) {
-        return httpd_resp_send_500(req);
+    // One more than allowed, so a request with too many settings can be told apart
+    QueryParam params[CONTROL_MAX_SETTINGS + 1];
+    const size_t count = parse_query(query, params, NUMELEMS(params));
+    if (count > CONTROL_MAX_SETTINGS) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Too many settings");
+    }
+
+    ControlSetting settings[CONTROL_MAX_SETTINGS];
+    bool valid = true;
+    for (size_t i = 0; i < count; ++i) {
+        settings[i].name = params[i].key;
+        settings[i].result = checkSetting(&settings[i], params[i].value);
+        valid &= settings[i].result == CONTROL_OK;
     }
 
+    if (!valid) {
+        for (size_t i = 0; i < count; ++i) {
+            if (settings[i].result == CONTROL_OK) {
+                settings[i].result = CONTROL_SKIPPED;
+            }
+        }
+        httpd_resp_set_status(req, HTTPD_400);
+    } else if (!applySettings(settings, count)) {
+        httpd_resp_set_status(req, HTTPD_500);
+    }
+
+    httpd_resp_set_type(req, "application/json");
     httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-    return httpd_resp_send(req, NULL, 0);
+
+    char buf[JSON_SEND_BUFFER_SIZE];
+    JsonWriter json(buf, sizeof(buf), jsonSendChunk, req);
+    json.beginObject();
+    json.addBool("applied", valid);
+    json.key("results");
+    json.beginObject();
+    for (size_t i = 0; i < count; ++i) {
+        json.addString(settings[i].name, controlResultNames[settings[i].result]);
+    }
+    json.endObject();
+    json.endObject();
+
+    if (!json.finish()) {
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
 }
 
-static esp_err_t status_handler(httpd_req_t *req) {
-    //TODO reduce size as needed!
-    char json_response[512];
+static inline void addStatusField(StatusField *fields, size_t size, size_t *count, const char *name, int32_t value, bool boolean = false) {
+    if (*count < size) {
+        fields[(*count)++] = {name, value, boolean, false};
+    }
+}
+
+static inline void addStatusCounter(StatusField *fields, size_t size, size_t *count, const char *name, int32_t value) {
+    if (*count < size) {
+        fields[(*count)++] = {name, value, false, true};
+    }
+}
 
+size_t readStatusFields(StatusField *fields, size_t size) {
     sensor_t *s = esp_camera_sensor_get();
-    char *p = json_response;
-    *p++ = '{';
-
-    p += sprintf(p, "\"board\":\"%s\",", CAM_BOARD);
-    p += sprintf(p, "\"xclk\":\"%u\",", s->xclk_freq_hz / 1000000);
-    p += sprintf(p, "\"pixformat\":%u,", s->pixformat);
-    p += sprintf(p, "\"framesize\":%u,", s->status.framesize);
-    p += sprintf(p, "\"quality\":%u,", s->status.quality);
-    p += sprintf(p, "\"brightness\":%d,", s->status.brightness);
-    p += sprintf(p, "\"contrast\":%d,", s->status.contrast);
-    p += sprintf(p, "\"saturation\":%d,", s->status.saturation);
-    p += sprintf(p, "\"sharpness\":%d,", s->status.sharpness);
-    p += sprintf(p, "\"wb_mode\":%u,", s->status.wb_mode);
-    p += sprintf(p, "\"awb\":%u,", s->status.awb);
-    p += sprintf(p, "\"awb_gain\":%u,", s->status.awb_gain);
-    p += sprintf(p, "\"aec\":%u,", s->status.aec);
-    p += sprintf(p, "\"aec2\":%u,", s->status.aec2);
-    p += sprintf(p, "\"ae_level\":%d,", s->status.ae_level);
-    p += sprintf(p, "\"aec_value\":%u,", s->status.aec_value);
-    p += sprintf(p, "\"agc\":%u,", s->status.agc);
-    p += sprintf(p, "\"agc_gain\":%u,", s->status.agc_gain);
-    p += sprintf(p, "\"gainceiling\":%u,", s->status.gainceiling);
-    p += sprintf(p, "\"bpc\":%u,", s->status.bpc);
-    p += sprintf(p, "\"wpc\":%u,", s->status.wpc);
-    p += sprintf(p, "\"raw_gma\":%u,", s->status.raw_gma);
-    p += sprintf(p, "\"lenc\":%u,", s->status.lenc);
-    p += sprintf(p, "\"vflip\":%u,", s->status.vflip);
-    p += sprintf(p, "\"hmirror\":%u,", s->status.hmirror);
-    p += sprintf(p, "\"dcw\":%u,", s->status.dcw);
-    p += sprintf(p, "\"colorbar\":%u,", s->status.colorbar);
-    p += sprintf(p, "\"led\":%u,", camLEDStatus);
-    p += sprintf(p, "\"use_flash\":%u,", useFlash);
-    p += sprintf(p, "\"flash_duration\":%u,", flash_duration);
-    p += sprintf(p, "\"led_intensity\":%u,", led_duty);
-    p += sprintf(p, "\"toggle-lapse\":%s,", BOOL_TO_STR(lapseRunning));
-    p += sprintf(p, "\"sd-avail\":%s,", BOOL_TO_STR(SDCardAvailable));
-    p += sprintf(p, "\"frame_delay\":%u,", millisBetweenSnapshots);
-    p += sprintf(p, "\"video_fps\":%u,", videoFPS);
+    const MulticastStats &multicast = getMulticastStats();
+    const RequestArenaStats &arena = getRequestArenaStats();
+    const FrameBrokerStats &broker = getFrameBrokerStats();
+    size_t count = 0;
+
+    addStatusField(fields, size, &count, "xclk", s->xclk_freq_hz / 1000000);
+    addStatusField(fields, size, &count, "pixformat", s->pixformat);
+    addStatusField(fields, size, &count, "framesize", s->status.framesize);
+    addStatusField(fields, size, &count, "quality", s->status.quality);
+    addStatusField(fields, size, &count, "brightness", s->status.brightness);
+    addStatusField(fields, size, &count, "contrast", s->status.contrast);
+    addStatusField(fields, size, &count, "saturation", s->status.saturation);
+    addStatusField(fields, size, &count, "sharpness", s->status.sharpness);
+    addStatusField(fields, size, &count, "denoise", s->status.denoise);
+    addStatusField(fields, size, &count, "wb_mode", s->status.wb_mode);
+    addStatusField(fields, size, &count, "awb", s->status.awb);
+    addStatusField(fields, size, &count, "awb_gain", s->status.awb_gain);
+    addStatusField(fields, size, &count, "aec", s->status.aec);
+    addStatusField(fields, size, &count, "aec2", s->status.aec2);
+    addStatusField(fields, size, &count, "ae_level", s->status.ae_level);
+    addStatusField(fields, size, &count, "aec_value", s->status.aec_value);
+    addStatusField(fields, size, &count, "agc", s->status.agc);
+    addStatusField(fields, size, &count, "agc_gain", s->status.agc_gain);
+    addStatusField(fields, size, &count, "gainceiling", s->status.gainceiling);
+    addStatusField(fields, size, &count, "bpc", s->status.bpc);
+    addStatusField(fields, size, &count, "wpc", s->status.wpc);
+    addStatusField(fields, size, &count, "raw_gma", s->status.raw_gma);
+    addStatusField(fields, size, &count, "lenc", s->status.lenc);
+    addStatusField(fields, size, &count, "vflip", s->status.vflip);
+    addStatusField(fields, size, &count, "hmirror", s->status.hmirror);
+    addStatusField(fields, size, &count, "dcw", s->status.dcw);
+    addStatusField(fields, size, &count, "colorbar", s->status.colorbar);
+    addStatusField(fields, size, &count, "led", camLEDStatus);
+    addStatusField(fields, size, &count, "use_flash", useFlash);
+    addStatusField(fields, size, &count, "flash_duration", flash_duration);
+    addStatusField(fields, size, &count, "led_intensity", led_duty);
+    addStatusField(fields, size, &count, "toggle-lapse", lapseRunning, true);
+    addStatusField(fields, size, &count, "sd-avail", SDCardAvailable, true);
+    addStatusField(fields, size, &count, "frame_delay", millisBetweenSnapshots);
+    addStatusField(fields, size, &count, "video_fps", videoFPS);
+    addStatusField(fields, size, &count, "container", lapseContainer);
+    addStatusCounter(fields, size, &count, "lapse_frames", lapseFramesTaken());
+    addStatusCounter(fields, size, &count, "stream_clients", streamClientCount());
+    addStatusCounter(fields, size, &count, "rtsp_clients", rtspClientCount());
+    addStatusCounter(fields, size, &count, "stream_latency_us", streamSendLatencyUs());
+    addStatusField(fields, size, &count, "multicast", isMulticastStreaming());
+    addStatusCounter(fields, size, &count, "multicast_seq", multicast.sequence);
+    addStatusCounter(fields, size, &count, "multicast_frames", multicast.frames);
+    addStatusCounter(fields, size, &count, "multicast_lost", multicast.lostPackets);
+    addStatusCounter(fields, size, &count, "arena_high_water", arena.highWaterBytes);
+    addStatusCounter(fields, size, &count, "arena_fallbacks", arena.fallbacks);
+    addStatusCounter(fields, size, &count, "arena_failures", arena.failures);
+    addStatusCounter(fields, size, &count, "capture_latency_us", broker.lastLatencyUs);
+    addStatusCounter(fields, size, &count, "capture_latency_max_us", broker.maxLatencyUs);
+    addStatusCounter(fields, size, &count, "capture_stale_frames", broker.staleFrames);
+    addStatusCounter(fields, size, &count, "frame_settle_us", broker.lastSettleUs);
+    addStatusCounter(fields, size, &count, "snap_switch_us", snapSwitchUs);
+    addStatusCounter(fields, size, &count, "snap_warmup_frames", snapWarmupFrames);
 #ifdef OTA_FEATURE
-    p += sprintf(p, "\"check-update\":%s", BOOL_TO_STR(isWiFiSTAMode));
+    addStatusField(fields, size, &count, "check-update", isWiFiSTAMode, true);
 #else
-    p += sprintf(p, "\"check-update\":false");
+    addStatusField(fields, size, &count, "check-update", false, true);
 #endif
-    *p++ = '}';
-    //*p = '\0';
+
+    return count;
+}
+
+// Adds either the settings or the counters among the fields
+static void addStatusJson(JsonWriter &json, const StatusField *fields, size_t count, bool counters) {
+    for (size_t i = 0; i < count; ++i) {
+        if (fields[i].counter != counters) {
+            continue;
+        }
+
+        if (fields[i].boolean) {
+            json.addBool(fields[i].name, fields[i].value);
+        } else {
+            json.addNumber(fields[i].name, fields[i].value);
+        }
+    }
+}
+
+// Cached /status document, only the control task builds and sends it
+static char statusJson[1280];
+static size_t statusJsonLen = 0;
+static uint32_t statusJsonVersion;
+// Random per boot, so a tag from before a restart never matches the same version count
+static uint32_t statusBootId;
+static char statusETag[20];
+
+/*
+    Only the fields which are changed with a notification are cached, so the document and its tag stay the
+    same until the next change. The counters go out uncached through /stats and the /events feed.
+*/
+static void buildStatus(uint32_t version) {
+    StatusField fields[STATUS_MAX_FIELDS];
+    const size_t count = readStatusFields(fields, NUMELEMS(fields));
+
+    JsonWriter json(statusJson, sizeof(statusJson));
+    json.beginObject();
+    json.addString("board", CAM_BOARD);
+    addStatusJson(json, fields, count, false);
+    json.endObject();
+
+    if (!json.ok()) {
+        ESP_LOGE(TAG, "Status does not fit into %u bytes!", sizeof(statusJson));
+    }
+    statusJsonLen = json.length();
+
+    snprintf(statusETag, sizeof(statusETag), "\"%08x%08x\"", (unsigned int)statusBootId, (unsigned int)version);
+    statusJsonVersion = version;
+}
+
+static esp_err_t status_handler(httpd_req_t *req) {
+    // Read before the fields, a change made while they are read leads to another rebuild
+    const uint32_t version = statusVersion();
+
+    if (!statusJsonLen || version != statusJsonVersion) {
+        buildStatus(version);
+    }
 
     httpd_resp_set_type(req, "application/json");
     httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(req, "ETag", statusETag);
+
+    char ifNoneMatch[sizeof(statusETag)];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", ifNoneMatch, sizeof(ifNoneMatch)) == ESP_OK &&
+        !strcmp(ifNoneMatch, statusETag)) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        return httpd_resp_send(req, NULL, 0);
+    }
 
-    int responseLength = p - json_response;
-    return httpd_resp_send(req, json_response, responseLength);
+    return httpd_resp_send(req, statusJson, statusJsonLen);
+}
+
+// The counters left out of /status, read fresh for every request
+static esp_err_t stats_handler(httpd_req_t *req) {
+    StatusField fields[STATUS_MAX_FIELDS];
+    const size_t count = readStatusFields(fields, NUMELEMS(fields));
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+
+    char buf[JSON_SEND_BUFFER_SIZE];
+    JsonWriter json(buf, sizeof(buf), jsonSendChunk, req);
+    json.beginObject();
+    addStatusJson(json, fields, count, true);
+    json.endObject();
+
+    if (!json.finish()) {
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
 }
 
 static esp_err_t mdns_handler(httpd_req_t *req) {
-    size_t json_len = 0;
-    //TODO replace with malloc instead of static allocation or send chunks...
-    const char *json_response = app_mdns_query(&json_len);
     httpd_resp_set_type(req, "application/json");
     httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-    return httpd_resp_send(req, json_response, json_len);
+
+    // Any number of cameras goes out through the small buffer
+    char buf[JSON_SEND_BUFFER_SIZE];
+    JsonWriter json(buf, sizeof(buf), jsonSendChunk, req);
+    app_mdns_query(json);
+
+    if (!json.finish()) {
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
 }
 
 static esp_err_t xclk_handler(httpd_req_t *req) {
-    char *buf = NULL;
-    char _xclk[32];
-
-    if (parse_get(req, &buf) != ESP_OK) {
+    char buf[QUERY_BUFFER_SIZE];
+    if (read_query(req, buf, sizeof(buf)) != ESP_OK) {
         return ESP_FAIL;
     }
-    if (httpd_query_key_value(buf, "xclk", _xclk, sizeof(_xclk)) != ESP_OK) {
-        free(buf);
+
+    QueryParam params[1];
+    const size_t count = parse_query(buf, params, NUMELEMS(params));
+    const char *value = query_value(params, count, "xclk");
+    if (!value) {
         httpd_resp_send_404(req);
         return ESP_FAIL;
     }
-    free(buf);
 
-    int xclk = atoi(_xclk);
+    int xclk = atoi(value);
     ESP_LOGI(TAG, "Set XCLK: %d MHz", xclk);
 
     sensor_t *s = esp_camera_sensor_get();
@@ -427,30 +864,34 @@ static esp_err_t xclk_handler(httpd_req_t *req) {
         return httpd_resp_send_500(req);
     }
 
+    statusEventsNotify();
+
     httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
     return httpd_resp_send(req, NULL, 0);
 }
 
 static esp_err_t win_handler(httpd_req_t *req) {
-    char *buf = NULL;
-
-    if (parse_get(req, &buf) != ESP_OK) {
+    char buf[QUERY_BUFFER_SIZE];
+    if (read_query(req, buf, sizeof(buf)) != ESP_OK) {
         return ESP_FAIL;
     }
 
-    int startX = parse_get_var(buf, "sx", 0);
-    int startY = parse_get_var(buf, "sy", 0);
-    int endX = parse_get_var(buf, "ex", 0);
-    int endY = parse_get_var(buf, "ey", 0);
-    int offsetX = parse_get_var(buf, "offx", 0);
-    int offsetY = parse_get_var(buf, "offy", 0);
-    int totalX = parse_get_var(buf, "tx", 0);
-    int totalY = parse_get_var(buf, "ty", 0);
-    int outputX = parse_get_var(buf, "ox", 0);
-    int outputY = parse_get_var(buf, "oy", 0);
-    bool scale = parse_get_var(buf, "scale", 0) == 1;
-    bool binning = parse_get_var(buf, "binning", 0) == 1;
-    free(buf);
+    // The query is split once, the values are looked up in the table
+    QueryParam params[12];
+    const size_t count = parse_query(buf, params, NUMELEMS(params));
+
+    int startX = query_int(params, count, "sx", 0);
+    int startY = query_int(params, count, "sy", 0);
+    int endX = query_int(params, count, "ex", 0);
+    int endY = query_int(params, count, "ey", 0);
+    int offsetX = query_int(params, count, "offx", 0);
+    int offsetY = query_int(params, count, "offy", 0);
+    int totalX = query_int(params, count, "tx", 0);
+    int totalY = query_int(params, count, "ty", 0);
+    int outputX = query_int(params, count, "ox", 0);
+    int outputY = query_int(params, count, "oy", 0);
+    bool scale = query_bool(params, count, "scale", false);
+    bool binning = query_bool(params, count, "binning", false);
 
     ESP_LOGI(TAG, "Set Window: Start: %d %d, End: %d %d, Offset: %d %d, Total: %d %d, Output: %d %d, Scale: %u, Binning: %u", startX, startY, endX, endY, offsetX, offsetY, totalX, totalY, outputX, outputY, scale, binning);
     sensor_t *s = esp_camera_sensor_get();
@@ -459,6 +900,8 @@ static esp_err_t win_handler(httpd_req_t *req) {
         return httpd_resp_send_500(req);
     }
 
+    statusEventsNotify();
+
     httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
     return httpd_resp_send(req, NULL, 0);
 }
@@ -500,12 +943,13 @@ static esp_err_t monitor_handler(httpd_req_t *req) {
 }
 
 void startCameraServer() {
+    frameBrokerSetup();
+    statusBootId = esp_random();
 
-    httpd_handle_t stream_httpd = NULL;
     httpd_handle_t camera_httpd = NULL;
 
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-    config.max_uri_handlers = 9;
+    config.max_uri_handlers = 13;
 
 #if HTTP_CONTROL_TASK_CORE0
     config.core_id = 0;
@@ -527,22 +971,34 @@ void startCameraServer() {
         .handler = status_handler,
         .user_ctx = NULL};
 
+    httpd_uri_t stats_uri = {
+        .uri = "/stats",
+        .method = HTTP_GET,
+        .handler = stats_handler,
+        .user_ctx = NULL};
+
     httpd_uri_t cmd_uri = {
         .uri = "/control",
         .method = HTTP_GET,
         .handler = cmd_handler,
         .user_ctx = NULL};
 
-    httpd_uri_t capture_uri = {
-        .uri = "/capture",
+    httpd_uri_t batch_uri = {
+        .uri = "/control/batch",
         .method = HTTP_GET,
-        .handler = capture_handler,
+        .handler = batch_handler,
         .user_ctx = NULL};
 
-    httpd_uri_t stream_uri = {
-        .uri = "/stream",
+    httpd_uri_t batch_post_uri = {
+        .uri = "/control/batch",
+        .method = HTTP_POST,
+        .handler = batch_handler,
+        .user_ctx = NULL};
+
+    httpd_uri_t capture_uri = {
+        .uri = "/capture",
         .method = HTTP_GET,
-        .handler = stream_handler,
+        .handler = capture_handler,
         .user_ctx = NULL};
 
     httpd_uri_t xclk_uri = {
@@ -563,6 +1019,12 @@ void startCameraServer() {
         .handler = mdns_handler,
         .user_ctx = NULL};
 
+    httpd_uri_t tail_uri = {
+        .uri = "/lapse/tail",
+        .method = HTTP_GET,
+        .handler = lapseTailHandler,
+        .user_ctx = NULL};
+
     httpd_uri_t monitor_uri = {
         .uri = "/monitor",
         .method = HTTP_GET,
@@ -573,38 +1035,34 @@ void startCameraServer() {
     config.stack_size = 7148;
     ESP_LOGI(TAG, "Starting web server on port: '%d'\n", config.server_port);
     if (httpd_start(&camera_httpd, &config) == ESP_OK) {
-        httpd_register_uri_handler(camera_httpd, &index_uri);
-        httpd_register_uri_handler(camera_httpd, &cmd_uri);
-        httpd_register_uri_handler(camera_httpd, &status_uri);
-        httpd_register_uri_handler(camera_httpd, &capture_uri);
+        registerArenaHandler(camera_httpd, &index_uri);
+        registerArenaHandler(camera_httpd, &cmd_uri);
+        registerArenaHandler(camera_httpd, &batch_uri);
+        registerArenaHandler(camera_httpd, &batch_post_uri);
+        registerArenaHandler(camera_httpd, &status_uri);
+        registerArenaHandler(camera_httpd, &stats_uri);
+        registerArenaHandler(camera_httpd, &capture_uri);
         if (SDCardAvailable) {
             registerFSHandler(camera_httpd);
+            registerArenaHandler(camera_httpd, &tail_uri);
         }
 
-        httpd_register_uri_handler(camera_httpd, &xclk_uri);
-        httpd_register_uri_handler(camera_httpd, &win_uri);
+        registerArenaHandler(camera_httpd, &xclk_uri);
+        registerArenaHandler(camera_httpd, &win_uri);
 
-        httpd_register_uri_handler(camera_httpd, &mdns_uri);
-        httpd_register_uri_handler(camera_httpd, &monitor_uri);
+        registerArenaHandler(camera_httpd, &mdns_uri);
+        registerArenaHandler(camera_httpd, &monitor_uri);
     }
 
-#if HTTP_STREAM_TASK_CORE0
-    config.core_id = 0;
-#elif HTTP_STREAM_TASK_CORE1
-    config.core_id = 1;
+    // The stream has its own server, which serves any number of clients from a single task
+    startStreamServer(config.server_port + 1);
+    startRtspServer(RTSP_PORT);
+#ifdef MULTICAST_STREAM
+    startMulticastStream(true);
 #else
-    config.core_id = -1;
+    startMulticastStream(false);
 #endif
 
-    config.server_port += 1;
-    config.ctrl_port += 1;
-    config.stack_size = 3072;
-    config.max_uri_handlers = 1;
-    ESP_LOGI(TAG, "Starting stream server on port: '%d'\n", config.server_port);
-    if (httpd_start(&stream_httpd, &config) == ESP_OK) {
-        httpd_register_uri_handler(stream_httpd, &stream_uri);
-    }
-
     if (SDCardAvailable) {
         lapseHandlerSetup();
     }
@@ -64,6 +64,9 @@ typedef struct {
  Fields that needs to be patched: length
  */
 #define PATCH_AVI_STREAM_HEADER_LENGTH_OFFSET (sizeof(uint32_t) * 8)
+// Offsets of the rate fields, which are needed to resume a file
+#define PATCH_AVI_STREAM_HEADER_SCALE_OFFSET (sizeof(uint32_t) * 5)
+#define PATCH_AVI_STREAM_HEADER_RATE_OFFSET (sizeof(uint32_t) * 6)
 typedef struct {
     uint32_t _fccType = AVI_STREAM_HEADER_FCCTYPE_VIDEO;
     uint32_t _fccHandler = CONVERT_TO_FCC("MJPG");
@@ -220,6 +223,14 @@ inline void writeLittleEndian(char *target, uint32_t toBeConverted) {
     }
 }
 
+inline uint32_t readLittleEndian(const char *source) {
+    uint32_t result = 0;
+    for (size_t i = sizeof(result); i > 0; --i) {
+        result = (result << 8) | (uint8_t)source[i - 1];
+    }
+    return result;
+}
+
 inline void writeStruct(char *target, const void *toBeWritten, size_t byteSize) {
     const uint32_t *writeMe = (const uint32_t *)toBeWritten;
 
@@ -374,19 +385,30 @@ typedef struct _AviIndexEntry {
 } AviIndexEntry;
 
 */
-inline void appendIndex(FILE *indexFile, size_t offset, size_t size) {
-    char buffer[8];
+// Index entry flag: the chunk is a key frame, which is true for every MJPEG frame
+#define AVIIF_KEYFRAME 0x00000010
+
+// Size of an entry inside the temporary index file: relative offset + size
+#define TMP_INDEX_ENTRY_SIZE 8
+// Size of an entry inside the idx1 chunk: ckid + flags + relative offset + size
+#define IDX1_ENTRY_SIZE 16
+
+inline void appendIndexEntry(FILE *indexFile, uint32_t relativeOffset, uint32_t size) {
+    char buffer[TMP_INDEX_ENTRY_SIZE];
 
+    writeLittleEndian(buffer, relativeOffset);
+    writeLittleEndian(buffer + 4, size);
+
+    fwrite(buffer, 1, TMP_INDEX_ENTRY_SIZE, indexFile);
+}
+
+inline void appendIndex(FILE *indexFile, size_t offset, size_t size) {
     // We need a relative offset from the start of the 'movi' FOURCC to the fram '00dc' FOURCC
     // AVI_MOVI_BLOCK_SIZE_OFFSET + 4 is the offset of the 'movi' FOURCC
     // variable offset starts after the header so we need to substract RIFF_CHUNK_HEADER_SIZE as well
     // to have a offset at the start of the header
-    writeLittleEndian(buffer, offset - (AVI_MOVI_BLOCK_SIZE_OFFSET + 4 + RIFF_CHUNK_HEADER_SIZE));
-
     // TODO padded size or dataSize? currently: dataSize => includes bytes used for padding
-    writeLittleEndian(buffer + 4, size);
-
-    fwrite(buffer, 1, 8, indexFile);
+    appendIndexEntry(indexFile, offset - (AVI_MOVI_BLOCK_SIZE_OFFSET + 4 + RIFF_CHUNK_HEADER_SIZE), size);
 }
 
 inline size_t writeFrame(FILE *aviFile, FILE *indexFile, size_t *offset, const char *jpgFrame, size_t size) {
@@ -471,12 +493,68 @@ inline void mergeAndPatch(FILE *aviFile, FILE *indexFile, size_t *offset, size_t
     PATCH_FIELD(aviFile, AVI_STREAM_HEADER_START + PATCH_AVI_STREAM_HEADER_LENGTH_OFFSET, framesTaken); //TODO I think this should be framesTaken/videoFPS
 }
 
-inline size_t createAVI_File(FILE *outFile, const AVIMainHeader &aviHeader, const AVIStreamHeader &streamHeader, const AVIStreamFormat &streamFormat) {
-
-#define AVI_BUFFER_SIZE 216
+/* OpenDML (AVI 2.0) extensions:
+RIFF ('AVI '
+      LIST ('hdrl'
+            'avih'(<Main AVI Header>)
+            LIST ('strl'
+                  'strh'(<Stream header>)
+                  'strf'(<Stream format>)
+                  'indx'(<Super index>)
+                 )
+            LIST ('odml'
+                  'dmlh'(<Extended AVI header>)
+                 )
+           )
+      LIST ('movi'
+            ...
+            'ix00'(<Standard index>)
+           )
+      ['idx1' (<AVI Index>) ]
+     )
+RIFF ('AVIX'
+      LIST ('movi'
+            ...
+            'ix00'(<Standard index>)
+           )
+     )
+...
+*/
 
-    char buffer[AVI_BUFFER_SIZE];
+// Number of standard indices the super index can reference, there is one per RIFF list
+#define AVI_SUPER_INDEX_ENTRIES 16
+#define AVI_SUPER_INDEX_HEADER_SIZE 24
+#define AVI_SUPER_INDEX_ENTRY_SIZE 16
+#define AVI_SUPER_INDEX_SIZE (AVI_SUPER_INDEX_HEADER_SIZE + AVI_SUPER_INDEX_ENTRIES * AVI_SUPER_INDEX_ENTRY_SIZE)
+#define AVI_STD_INDEX_HEADER_SIZE 24
+#define AVI_STD_INDEX_ENTRY_SIZE 8
+// dwTotalFrames followed by dwFuture[61]
+#define AVI_DMLH_SIZE 248
+
+// bIndexType values
+#define AVI_INDEX_OF_INDEXES 0x00
+#define AVI_INDEX_OF_CHUNKS 0x01
+
+// Offsets inside a header written with the OpenDML placeholders
+#define AVI_SUPER_INDEX_START (AVI_STREAM_FORMAT_START + sizeof(AVIStreamFormat))
+#define AVI_SUPER_INDEX_ENTRIES_IN_USE_OFFSET (RIFF_CHUNK_HEADER_SIZE + 4)
+#define AVI_SUPER_INDEX_FIRST_ENTRY_OFFSET (RIFF_CHUNK_HEADER_SIZE + AVI_SUPER_INDEX_HEADER_SIZE)
+#define AVI_DMLH_START (AVI_SUPER_INDEX_START + RIFF_CHUNK_HEADER_SIZE + AVI_SUPER_INDEX_SIZE + RIFF_LIST_HEADER_SIZE + RIFF_CHUNK_HEADER_SIZE)
+// The first dwFuture entry of dmlh holds a random id of the recording, every frame is followed by a JUNK chunk carrying it
+#define AVI_DMLH_RECORDING_ID_OFFSET 4
+#define AVI_FRAME_TAG_SIZE (RIFF_CHUNK_HEADER_SIZE + 4)
+// A repeated frame only gets an index entry pointing at the previous chunk. The JUNK chunk marking it
+// carries the recording id and that index offset, such that the recovery can restore the entry.
+#define AVI_REPEAT_TAG_SIZE (RIFF_CHUNK_HEADER_SIZE + 8)
 
+/*
+    Writes the RIFF header, the hdrl list and the start of the movi list into buffer.
+    If openDML is set, a JUNK chunk reserving the space of the super index and an odml list are added to the hdrl list.
+    If reservedSize is given a JUNK chunk is inserted in front of the movi list such that
+    the header occupies exactly reservedSize bytes.
+    Returns the header size and stores the offset of the movi list size field in moviSizeOffset.
+*/
+inline size_t writeAVIHeader(char *buffer, size_t *moviSizeOffset, const AVIMainHeader &aviHeader, const AVIStreamHeader &streamHeader, const AVIStreamFormat &streamFormat, size_t reservedSize = 0, bool openDML = false) {
     size_t offset = 0;
 
     // RIFF start
@@ -500,16 +578,56 @@ inline size_t createAVI_File(FILE *outFile, const AVIMainHeader &aviHeader, cons
     writeStruct(buffer + offset, &streamFormat, sizeof(streamFormat));
     offset += sizeof(streamFormat);
 
+    size_t strlDataSize = strhBlockSize + strfBlockSize;
+    if (openDML) {
+        // Reserve the space of the super index, it is converted to 'indx' once a second RIFF list is started
+        strlDataSize += CHUNK(buffer + offset, &offset, "JUNK", AVI_SUPER_INDEX_SIZE);
+        memset(buffer + offset, 0, AVI_SUPER_INDEX_SIZE);
+        offset += AVI_SUPER_INDEX_SIZE;
+    }
+
     // Patch strl list
-    size_t strlBlockSize = PATCH_LIST_RIFF_SIZE(buffer, strl_size_offset, strhBlockSize + strfBlockSize);
+    size_t strlBlockSize = PATCH_LIST_RIFF_SIZE(buffer, strl_size_offset, strlDataSize);
+
+    size_t hdrlDataSize = strlBlockSize + avihBlockSize;
+    if (openDML) {
+        size_t odml_size_offset = LIST(buffer + offset, &offset, "odml");
+        size_t dmlhBlockSize = CHUNK(buffer + offset, &offset, "dmlh", AVI_DMLH_SIZE);
+        memset(buffer + offset, 0, AVI_DMLH_SIZE);
+        offset += AVI_DMLH_SIZE;
+
+        hdrlDataSize += PATCH_LIST_RIFF_SIZE(buffer, odml_size_offset, dmlhBlockSize);
+    }
+
     // Patch hdrl list containing everything until here
-    PATCH_LIST_RIFF_SIZE(buffer, hdrl_size_offset, strlBlockSize + avihBlockSize);
+    PATCH_LIST_RIFF_SIZE(buffer, hdrl_size_offset, hdrlDataSize);
+
+    // Fill the gap up to the movi list with a JUNK chunk
+    if (reservedSize) {
+        const size_t junkSize = reservedSize - offset - RIFF_CHUNK_HEADER_SIZE - RIFF_LIST_HEADER_SIZE;
+        CHUNK(buffer + offset, &offset, "JUNK", junkSize);
+        memset(buffer + offset, 0, junkSize);
+        offset += junkSize;
+    }
 
     // Create list which will contain the frames
-    LIST(buffer + offset, &offset, "movi");
+    *moviSizeOffset = LIST(buffer + offset, &offset, "movi");
 
     // Ensure that we always have a valid avi file!
-    updateAVISize(buffer, offset);
+    AUTO_PATCH_SIZE(buffer, offset, AVI_RIFF_BLOCK_SIZE_OFFSET);
+    AUTO_PATCH_SIZE(buffer, offset, *moviSizeOffset);
+
+    return offset;
+}
+
+inline size_t createAVI_File(FILE *outFile, const AVIMainHeader &aviHeader, const AVIStreamHeader &streamHeader, const AVIStreamFormat &streamFormat) {
+
+#define AVI_BUFFER_SIZE 216
+
+    char buffer[AVI_BUFFER_SIZE];
+
+    size_t moviSizeOffset;
+    size_t offset = writeAVIHeader(buffer, &moviSizeOffset, aviHeader, streamHeader, streamFormat);
 
     // Finally lets write the file
     fwrite(buffer, 1, offset, outFile);
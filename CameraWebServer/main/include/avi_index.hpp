@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct {
+    // Offset of the chunk relative to the 'movi' FOURCC
+    uint32_t offset;
+    // Size of the chunk data as in its header, without the pad byte
+    uint32_t size;
+} AVIIndexEntry;
+
+/*
+    Index of the frames written so far. Entries are kept in a growable array (preferably in PSRAM)
+    and only spilled to a file once more than maxMemoryEntries entries are buffered.
+
+    The spill file uses the layout of the temporary index file (little endian offset + size per entry),
+    which is also the in-memory layout of AVIIndexEntry on the ESP32. Spilled entries always precede
+    the buffered ones.
+*/
+class AVIIndex {
+  public:
+    AVIIndex(size_t maxMemoryEntries);
+    ~AVIIndex();
+
+    // Drops all entries, releases the memory and deletes the spill file
+    void clear();
+    // Uses spillPath for spilling the following entries. If existing is set the entries of an
+    // existing spill file are taken over, else it is deleted.
+    // Returns the number of entries taken over from the spill file
+    size_t attach(const char *spillPath, bool existing);
+    // Keeps only the first count spilled entries, used when recovering an existing spill file
+    void truncateSpilled(size_t count);
+
+    bool append(uint32_t offset, uint32_t size);
+    // Copies up to maxEntries entries starting at first, returns the number of copied entries
+    size_t read(size_t first, AVIIndexEntry *out, size_t maxEntries);
+
+    inline size_t size() const {
+        return spilledCount + memoryCount;
+    }
+
+  private:
+    bool grow();
+    bool spill();
+    bool openSpillFile();
+
+    const size_t maxMemoryEntries;
+
+    AVIIndexEntry *entries = NULL;
+    size_t capacity = 0;
+    size_t memoryCount = 0;
+
+    char spillPath[32] = {0};
+    FILE *spillFile = NULL;
+    // Number of entries in the spill file which are part of the index
+    size_t spilledCount = 0;
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "avi_index.hpp"
+
+typedef struct {
+    // Offset of the movi list size field
+    size_t moviSizeOffset;
+    // End of the last complete chunk inside the movi list, everything behind it is torn
+    size_t endOffset;
+    // Size of the file before the recovery
+    size_t fileSize;
+    // Number of complete frames
+    size_t frameCount;
+    // Number of frames whose index entry was taken from the spilled index
+    size_t indexedFrames;
+    size_t maxFrameBytes;
+    // Number of RIFF lists, more than one for OpenDML files
+    size_t riffCount;
+    // Start and movi list size field of the last RIFF list
+    size_t lastRiffStart;
+    size_t lastRiffMoviSizeOffset;
+    // Number of frames in front of the last RIFF list
+    size_t lastRiffFirstFrame;
+    // Offset and size of the last frame chunk (without the pad byte), repeated frames point at it
+    size_t lastFrameOffset;
+    size_t lastFrameSize;
+} AVIRecoveryInfo;
+
+/*
+    Rebuilds the index of an unfinished avi file.
+    index must be attached to the existing spill file. Its valid entries are kept, afterwards the movi list
+    is scanned for further complete '00dc' chunks and repeated frames whose entries are appended to the index.
+    OpenDML files are followed into their 'AVIX' RIFF lists.
+    Returns false if the file is not an avi file with a movi list.
+*/
+bool recoverAVI(FILE *aviFile, AVIIndex &index, AVIRecoveryInfo *info);
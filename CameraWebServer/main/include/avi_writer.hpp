@@ -0,0 +1,191 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "avi_helper.hpp"
+#include "avi_index.hpp"
+#include "avi_recovery.hpp"
+#include "video_writer.hpp"
+
+// Smallest unit the SD card can be written without a read-modify-write
+#define AVI_SECTOR_SIZE 512
+// The header (including the OpenDML placeholders) is padded with a JUNK chunk to full sectors so that
+// rewriting it is a single aligned write
+#define AVI_HEADER_RESERVED_SIZE (2 * AVI_SECTOR_SIZE)
+// The VFS uses a signed 32 bit off_t, so nothing behind 2 GB can be seeked to
+#define AVI_MAX_FILE_SIZE (0x7FFFFFFFUL - AVI_HEADER_RESERVED_SIZE)
+
+typedef struct {
+    // Number of fwrite calls issued to the avi file
+    size_t writeCalls;
+    // Number of fseek calls issued to the avi file
+    size_t seekCalls;
+    // Bytes written to the avi file, including header rewrites
+    size_t bytesWritten;
+    // Time spent inside fwrite/fseek in microseconds
+    int64_t ioTimeUs;
+    // Frames which only got an index entry pointing at the previous chunk
+    size_t repeatedFrames;
+} AVIWriterStats;
+
+typedef struct {
+    // File offset and value of a size field which differs between the file and the snapshot
+    size_t offset;
+    uint32_t value;
+} AVISnapshotPatch;
+
+/*
+    Copy of the state of an unfinished recording, which describes it as a complete avi file. The bytes in
+    front of diskEnd are read from the file, the ones still staged are copied. The index is appended behind
+    moviEnd, an idx1 chunk for single RIFF files or the standard index of the last RIFF list for OpenDML files.
+*/
+typedef struct {
+    char header[AVI_HEADER_RESERVED_SIZE];
+    size_t headerSize;
+    size_t diskEnd;
+    char *staged;
+    size_t moviEnd;
+
+    AVIIndexEntry *entries;
+    size_t frameCount;
+
+    bool openDML;
+    size_t moviFourCCOffset;
+    size_t riffStart;
+    size_t riffFirstFrame;
+    // RIFF and movi size of the last RIFF list, which might be inside the file or the staged bytes
+    AVISnapshotPatch patches[2];
+    size_t patchCount;
+} AVISnapshot;
+
+// Receives the bytes of a snapshot in file order, returns false to abort
+typedef bool (*AVISnapshotSink)(void *arg, const char *data, size_t size);
+
+// Streams the complete file described by the snapshot, the file is only read through buf
+bool writeAVISnapshot(const AVISnapshot &snapshot, FILE *aviFile, char *buf, size_t bufSize, AVISnapshotSink sink, void *arg);
+void releaseAVISnapshot(AVISnapshot *snapshot);
+
+/*
+    AVI writer which assembles chunk headers and payloads in a large staging buffer (preferably in PSRAM)
+    and only writes whole staging windows to the file. Because the window size is a multiple of the cluster
+    size every regular write is cluster aligned.
+
+    The on-disk header is only rewritten every headerUpdateInterval frames. Before that happens the movi
+    list is padded with a JUNK chunk up to the next sector boundary so that the partial flush stays aligned.
+
+    Once the first RIFF list would grow beyond riffSizeLimit it is closed with a standard index and the legacy
+    idx1 chunk, and the recording continues in OpenDML 'AVIX' RIFF lists referenced by the super index.
+
+    Repeated frames are not stored again, their index entry points at the chunk of the previous frame.
+*/
+class AVIWriter : public VideoWriter {
+  public:
+    AVIWriter(size_t stagingSize, size_t headerUpdateInterval, size_t maxIndexMemoryEntries, size_t riffSizeLimit);
+    ~AVIWriter();
+
+    // Writes the header, indexSpillPath is only created if the index outgrows its memory buffer
+    bool begin(FILE *aviFile, const char *indexSpillPath, uint32_t width, uint32_t height, uint32_t rate, uint32_t scale = 1) override;
+    // Rebuilds the index of an unfinished avi file and continues writing behind the last complete frame
+    bool recover(FILE *aviFile, const char *indexSpillPath, AVIRecoveryInfo *info);
+    bool resume(FILE *aviFile, const char *indexSpillPath, size_t *tornBytes) override;
+    bool writeFrame(const char *jpgFrame, size_t size) override;
+    // Adds an index entry pointing at the last frame chunk, this is only possible within the same RIFF list
+    bool repeatFrame() override;
+    // Flushes the staged data, appends the idx1 chunk (or the last standard index) and patches the header
+    bool finish() override;
+    // Releases the buffers and the index without writing anything, the file is left to the caller
+    void discard() override;
+    // Copies everything needed to serve the frames written so far while the recording goes on. Must not
+    // run concurrently with the writing calls, but only copies the staged bytes and the index.
+    bool snapshot(AVISnapshot *snapshot);
+
+    inline size_t getFrameCount() const override {
+        return frameCount;
+    }
+
+    inline size_t getFileSize() const override {
+        return currentOffset();
+    }
+
+    inline const AVIWriterStats &getStats() const {
+        return stats;
+    }
+
+    // True once the recording spans more than one RIFF list
+    inline bool isOpenDML() const {
+        return openDML;
+    }
+
+  private:
+    // The part of recover behind attaching the index
+    bool takeOver(FILE *aviFile, size_t spilledEntries, AVIRecoveryInfo *info);
+    bool allocateStaging();
+    bool stage(const char *data, size_t size);
+    bool stageZeros(size_t size);
+    bool padToSector();
+    bool flush();
+    void patchHeader(char *target, size_t moviEnd, size_t riffEnd) const;
+    bool patchFileField(size_t offset, uint32_t value);
+    bool commitHeader();
+    bool checkpoint();
+    bool writeIndexChunk(size_t count);
+    bool writeStdIndex();
+    bool startRiff();
+    size_t projectedRiffSize(size_t paddedSize) const;
+    bool frameAdded();
+
+    size_t fileWrite(const char *data, size_t size);
+    bool fileSeek(size_t offset);
+
+    inline size_t currentOffset() const {
+        return windowOffset + stagingPos;
+    }
+
+    FILE *aviFile = NULL;
+    AVIIndex index;
+
+    char *staging = NULL;
+    const size_t stagingSize;
+    // File offset of the first byte inside the staging buffer
+    size_t windowOffset = 0;
+    // Number of bytes filled in the staging buffer
+    size_t stagingPos = 0;
+    // Number of bytes of the staging buffer that are already written to the file
+    size_t flushedPos = 0;
+
+    const size_t headerUpdateInterval;
+    size_t framesSinceHeaderUpdate = 0;
+
+    char header[AVI_HEADER_RESERVED_SIZE];
+    // Number of bytes in front of the first frame, rewritten on every header update
+    size_t headerSize = 0;
+    // Offset of the size field of the first movi list, the index is relative to its 'movi' FOURCC
+    size_t moviSizeOffset = 0;
+    uint32_t videoRate = 1;
+    uint32_t videoScale = 1;
+
+    size_t frameCount = 0;
+    size_t maxFrameBytes = 0;
+    // Chunk of the last written frame, which repeated frames point at
+    size_t lastFrameOffset = 0;
+    size_t lastFrameSize = 0;
+    // Random id every frame is tagged with, 0 for files of older versions
+    uint32_t recordingId = 0;
+
+    const size_t riffSizeLimit;
+    // The header contains the super index and odml placeholders
+    bool openDMLCapable = false;
+    bool openDML = false;
+    // Current RIFF list
+    size_t riffStart = 0;
+    size_t riffMoviSizeOffset = 0;
+    size_t riffFirstFrame = 0;
+    // Values of the closed first RIFF list once openDML is set
+    size_t firstRiffEnd = 0;
+    size_t firstMoviEnd = 0;
+    size_t firstRiffFrames = 0;
+    size_t superIndexCount = 0;
+
+    AVIWriterStats stats;
+};
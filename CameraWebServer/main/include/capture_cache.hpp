@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Last JPEG taken by /capture in a buffer (preferably in PSRAM) which only grows. Polling clients are
+    served from it while the frame is young enough and the settings did not change since it was taken.
+    Not locked, only the control task reads and writes it.
+*/
+class CaptureCache {
+  public:
+    ~CaptureCache();
+
+    // Copies the jpeg taken at timeUs with the settings of version, the cache is empty if it does not fit
+    bool store(const char *jpg, size_t len, int64_t timeUs, uint32_t version);
+    // True if there is a frame which is at most maxAgeMs old at nowUs and was taken with the current version
+    bool fresh(int maxAgeMs, int64_t nowUs, uint32_t version) const;
+
+    inline const char *data() const {
+        return buffer;
+    }
+
+    inline size_t length() const {
+        return len;
+    }
+
+    inline int64_t timestamp() const {
+        return timeUs;
+    }
+
+    inline size_t capacity() const {
+        return size;
+    }
+
+  private:
+    char *buffer = NULL;
+    size_t size = 0;
+    size_t len = 0;
+    int64_t timeUs = 0;
+    // Changed settings make the cached frame outdated, no matter how young it is
+    uint32_t version = 0;
+};
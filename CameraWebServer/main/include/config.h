@@ -106,6 +106,86 @@
 #define TMP_INDEX_FILE_PATH CONFIG_TMP_INDEX_FILE_PATH
 #endif
 
+#ifdef CONFIG_LAPSE_REPEAT_THRESHOLD
+#define LAPSE_REPEAT_THRESHOLD CONFIG_LAPSE_REPEAT_THRESHOLD
+#endif
+#ifdef CONFIG_LAPSE_FRAME_RING_SIZE
+#define LAPSE_FRAME_RING_SIZE (CONFIG_LAPSE_FRAME_RING_SIZE * 1024)
+#endif
+#ifdef CONFIG_LAPSE_JOURNAL_FILE_PATH
+#define LAPSE_JOURNAL_FILE_PATH CONFIG_LAPSE_JOURNAL_FILE_PATH
+#endif
+#ifdef CONFIG_LAPSE_RESUME_AFTER_REBOOT
+#define LAPSE_RESUME_AFTER_REBOOT
+#endif
+#ifdef CONFIG_AVI_STAGING_BUFFER_SIZE
+#define AVI_STAGING_BUFFER_SIZE (CONFIG_AVI_STAGING_BUFFER_SIZE * 1024)
+#endif
+#ifdef CONFIG_AVI_HEADER_UPDATE_INTERVAL
+#define AVI_HEADER_UPDATE_INTERVAL CONFIG_AVI_HEADER_UPDATE_INTERVAL
+#endif
+#ifdef CONFIG_AVI_INDEX_MEMORY_ENTRIES
+#define AVI_INDEX_MEMORY_ENTRIES CONFIG_AVI_INDEX_MEMORY_ENTRIES
+#endif
+#ifdef CONFIG_LAPSE_SEGMENT_MAX_SIZE
+#define LAPSE_SEGMENT_MAX_SIZE (CONFIG_LAPSE_SEGMENT_MAX_SIZE * 1024 * 1024)
+#endif
+#ifdef CONFIG_LAPSE_SEGMENT_MAX_DURATION
+#define LAPSE_SEGMENT_MAX_DURATION CONFIG_LAPSE_SEGMENT_MAX_DURATION
+#endif
+#ifdef CONFIG_LAPSE_PREALLOCATION_SIZE
+#define LAPSE_PREALLOCATION_SIZE (CONFIG_LAPSE_PREALLOCATION_SIZE * 1024 * 1024)
+#endif
+#ifdef CONFIG_AVI_RIFF_SIZE_LIMIT
+#define AVI_RIFF_SIZE_LIMIT (CONFIG_AVI_RIFF_SIZE_LIMIT * 1024 * 1024)
+#endif
+#ifdef CONFIG_MP4_FRAGMENT_FRAMES
+#define MP4_FRAGMENT_FRAMES CONFIG_MP4_FRAGMENT_FRAMES
+#endif
+#ifdef CONFIG_MP4_FRAGMENT_BUFFER_SIZE
+#define MP4_FRAGMENT_BUFFER_SIZE (CONFIG_MP4_FRAGMENT_BUFFER_SIZE * 1024)
+#endif
+
+#ifdef CONFIG_STREAM_MAX_CLIENTS
+#define STREAM_MAX_CLIENTS CONFIG_STREAM_MAX_CLIENTS
+#endif
+
+#ifdef CONFIG_RTSP_PORT
+#define RTSP_PORT CONFIG_RTSP_PORT
+#endif
+
+#ifdef CONFIG_RTSP_MAX_CLIENTS
+#define RTSP_MAX_CLIENTS CONFIG_RTSP_MAX_CLIENTS
+#endif
+
+#ifdef CONFIG_RTSP_RTP_PORT
+#define RTSP_RTP_PORT CONFIG_RTSP_RTP_PORT
+#endif
+
+#ifdef CONFIG_MULTICAST_STREAM
+#define MULTICAST_STREAM
+#endif
+
+#ifdef CONFIG_MULTICAST_GROUP
+#define MULTICAST_GROUP CONFIG_MULTICAST_GROUP
+#endif
+
+#ifdef CONFIG_MULTICAST_PORT
+#define MULTICAST_PORT CONFIG_MULTICAST_PORT
+#endif
+
+#ifdef CONFIG_MULTICAST_TTL
+#define MULTICAST_TTL CONFIG_MULTICAST_TTL
+#endif
+
+#ifdef CONFIG_MULTICAST_FPS
+#define MULTICAST_FPS CONFIG_MULTICAST_FPS
+#endif
+
+#ifdef CONFIG_REQUEST_ARENA_SIZE
+#define REQUEST_ARENA_SIZE CONFIG_REQUEST_ARENA_SIZE
+#endif
+
 #ifndef CAM_TASK_TIMER_GROUP_NUM
 #define CAM_TASK_TIMER_GROUP_NUM 1
 #endif
@@ -115,6 +195,69 @@
 #ifndef TMP_INDEX_FILE_PATH
 #define TMP_INDEX_FILE_PATH "tmpavi.idx"
 #endif
+#ifndef LAPSE_REPEAT_THRESHOLD
+#define LAPSE_REPEAT_THRESHOLD 3
+#endif
+#ifndef LAPSE_FRAME_RING_SIZE
+#define LAPSE_FRAME_RING_SIZE (1024 * 1024)
+#endif
+#ifndef LAPSE_JOURNAL_FILE_PATH
+#define LAPSE_JOURNAL_FILE_PATH "lapse.jnl"
+#endif
+#ifndef AVI_STAGING_BUFFER_SIZE
+#define AVI_STAGING_BUFFER_SIZE (32 * 1024)
+#endif
+#ifndef AVI_HEADER_UPDATE_INTERVAL
+#define AVI_HEADER_UPDATE_INTERVAL 60
+#endif
+#ifndef AVI_INDEX_MEMORY_ENTRIES
+#define AVI_INDEX_MEMORY_ENTRIES 32768
+#endif
+#ifndef LAPSE_SEGMENT_MAX_SIZE
+#define LAPSE_SEGMENT_MAX_SIZE (256 * 1024 * 1024)
+#endif
+#ifndef LAPSE_SEGMENT_MAX_DURATION
+#define LAPSE_SEGMENT_MAX_DURATION 0
+#endif
+#ifndef LAPSE_PREALLOCATION_SIZE
+#define LAPSE_PREALLOCATION_SIZE (256 * 1024 * 1024)
+#endif
+#ifndef AVI_RIFF_SIZE_LIMIT
+#define AVI_RIFF_SIZE_LIMIT (1024 * 1024 * 1024)
+#endif
+#ifndef MP4_FRAGMENT_FRAMES
+#define MP4_FRAGMENT_FRAMES 10
+#endif
+#ifndef MP4_FRAGMENT_BUFFER_SIZE
+#define MP4_FRAGMENT_BUFFER_SIZE (512 * 1024)
+#endif
+#ifndef STREAM_MAX_CLIENTS
+#define STREAM_MAX_CLIENTS 4
+#endif
+#ifndef RTSP_PORT
+#define RTSP_PORT 554
+#endif
+#ifndef RTSP_MAX_CLIENTS
+#define RTSP_MAX_CLIENTS 2
+#endif
+#ifndef RTSP_RTP_PORT
+#define RTSP_RTP_PORT 6970
+#endif
+#ifndef MULTICAST_GROUP
+#define MULTICAST_GROUP "239.255.0.1"
+#endif
+#ifndef MULTICAST_PORT
+#define MULTICAST_PORT 5004
+#endif
+#ifndef MULTICAST_TTL
+#define MULTICAST_TTL 1
+#endif
+#ifndef MULTICAST_FPS
+#define MULTICAST_FPS 10
+#endif
+#ifndef REQUEST_ARENA_SIZE
+#define REQUEST_ARENA_SIZE 8192
+#endif
 // TODO changable?
 #ifndef TIMER_DIVIDER
 #define TIMER_DIVIDER 65536 //Range is 2 to 65536
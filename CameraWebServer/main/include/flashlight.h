@@ -2,4 +2,10 @@
 
 #include "esp_camera.h"
 
-camera_fb_t *takePicture();
\ No newline at end of file
+#include <stdint.h>
+
+/*
+    Captures a frame which started exposing at or after notBeforeUs (esp_timer time, 0 for any frame).
+    If the flash is used, the frame is also exposed after the LED was on for flash_duration.
+*/
+camera_fb_t *takePicture(int64_t notBeforeUs);
\ No newline at end of file
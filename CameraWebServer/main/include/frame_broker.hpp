@@ -0,0 +1,81 @@
+#pragma once
+
+#include "esp_camera.h"
+
+#include "freertos/FreeRTOS.h"
+
+// Subscribers which may exist at the same time (stream clients, the timelapse and snapshot requests)
+#define FRAME_BROKER_MAX_SUBSCRIBERS 8
+/*
+    Frames dropped after a job changed the sensor, counted from the first one which started exposing after
+    the job. Some settings (exposure, gain) only apply from the frame after the next one.
+*/
+#define FRAME_BROKER_SETTLE_FRAMES 1
+
+typedef enum {
+    // A full queue gives up its oldest frame, for viewers which only care about the latest one
+    FRAME_DROP_OLDEST,
+    // The new frame is dropped while the queue is full, queued frames are never replaced
+    FRAME_DROP_NEWEST,
+} FrameDropPolicy;
+
+// Captured frame shared by all subscribers, the driver buffer is returned once the last reference is released
+typedef struct {
+    camera_fb_t *fb;
+    uint32_t refs;
+} SharedFrame;
+
+typedef struct FrameSubscriber FrameSubscriber;
+
+typedef struct {
+    // Time from a fresh request to the start of the exposure of its frame
+    int32_t lastLatencyUs;
+    int32_t maxLatencyUs;
+    // Frames returned to the driver because they were exposed too early
+    uint32_t staleFrames;
+    // Time from the end of the last job until the next frame went to the subscribers
+    int32_t lastSettleUs;
+} FrameBrokerStats;
+
+// Work for the broker task, e.g. writing sensor registers
+typedef int (*FrameBrokerJob)(void *arg);
+
+// Starts the task which captures the frames, it only captures while a subscriber wants a frame
+void frameBrokerSetup();
+
+/*
+    Continuous subscribers get every captured frame, the others only the next frame after each call
+    of frameBrokerRequest. depth is the number of frames which can wait for the subscriber.
+    Returns NULL if there are already FRAME_BROKER_MAX_SUBSCRIBERS subscribers.
+*/
+FrameSubscriber *frameBrokerSubscribe(size_t depth, FrameDropPolicy policy, bool continuous);
+// Releases the frames still waiting for the subscriber
+void frameBrokerUnsubscribe(FrameSubscriber *subscriber);
+// Withdraws a pending request and releases the frames waiting for the subscriber
+void frameBrokerCancel(FrameSubscriber *subscriber);
+// Asks for the next captured frame
+void frameBrokerRequest(FrameSubscriber *subscriber);
+/*
+    Asks for the first frame which started exposing after the call. The driver keeps frames which were
+    exposed before, those are skipped, so snapshots wait at most about two frame periods.
+*/
+void frameBrokerRequestFresh(FrameSubscriber *subscriber);
+// Returns NULL if no frame arrived within wait, every received frame has to be released
+SharedFrame *frameBrokerReceive(FrameSubscriber *subscriber, TickType_t wait);
+void frameBrokerRetain(SharedFrame *frame);
+/*
+    Takes a frame from the driver which started exposing at or after notBeforeUs (esp_timer time, 0 takes
+    any frame). Only for the broker task, i.e. for takePicture.
+*/
+camera_fb_t *frameBrokerFetch(int64_t notBeforeUs);
+void frameBrokerRelease(SharedFrame *frame);
+// Frames the subscriber missed because of its drop policy
+size_t frameBrokerDropped(const FrameSubscriber *subscriber);
+FrameBrokerStats getFrameBrokerStats();
+/*
+    Runs job on the broker task after the frame which is being captured and waits for its result.
+    No subscriber gets a frame which started exposing before the job ended, and settleFrames more frames
+    are dropped after that. Without subscribers the job runs right away.
+    The job may take frames itself with takePicture, they are not delivered to the subscribers.
+*/
+int frameBrokerRunBetweenFrames(FrameBrokerJob job, void *arg, size_t settleFrames = FRAME_BROKER_SETTLE_FRAMES);
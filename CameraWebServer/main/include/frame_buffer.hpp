@@ -0,0 +1,45 @@
+#pragma once
+
+#include "esp_camera.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    JPEG copy of a camera frame in a buffer (preferably in PSRAM) which is kept for the following frames.
+    It only grows, so the consumers neither allocate per frame nor fragment the heap. Frames of other formats
+    are encoded straight into it. headroom bytes stay free in front of the jpeg, e.g. for a part header.
+*/
+class FrameBuffer {
+  public:
+    ~FrameBuffer();
+
+    // Copies the jpeg of fb, or encodes it if the camera delivers another format
+    bool copy(camera_fb_t *fb, size_t headroom = 0);
+    // Makes room for size bytes, the previous content is lost
+    bool reserve(size_t size);
+    // Gives the memory back, e.g. once nobody streams any more
+    void release();
+
+    // Start of the buffer, i.e. of the headroom
+    inline char *data() {
+        return buffer;
+    }
+
+    inline uint8_t *jpg() {
+        return (uint8_t *)buffer + headroom;
+    }
+
+    inline size_t length() const {
+        return len;
+    }
+
+  private:
+    bool grow(size_t size, bool keep);
+    static size_t append(void *arg, size_t index, const void *data, size_t size);
+
+    char *buffer = NULL;
+    size_t capacity = 0;
+    size_t headroom = 0;
+    size_t len = 0;
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "esp_camera.h"
+
+#include "frame_broker.hpp"
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct {
+    // Copy of the driver frame, buf points into the ring unless shared is set
+    camera_fb_t fb;
+    // Broker frame which did not fit into the ring, it is released by the consumer
+    SharedFrame *shared;
+    // Bytes of the ring taken by the frame, including the unused end skipped to keep it contiguous
+    size_t span;
+} RingFrame;
+
+typedef struct {
+    // Frames copied into the ring
+    size_t copiedFrames;
+    // Frames which kept their broker frame because the ring was full
+    size_t overflowFrames;
+    // Largest number of bytes and frames in use at the same time
+    size_t highWaterBytes;
+    size_t highWaterFrames;
+} FrameRingStats;
+
+/*
+    Ring buffer (preferably in PSRAM) the camera frames are copied into, so the broker frame and its
+    driver buffer are released right after the capture and a slow SD card write does not stall the sensor.
+
+    Every frame is stored contiguously. Frames are taken by a single producer and released by a
+    single consumer in the same order, so the ring only has to track its oldest and newest frame.
+*/
+class FrameRing {
+  public:
+    FrameRing(size_t size);
+    ~FrameRing();
+
+    // Allocates the buffer on first use, returns false if the ring is not available
+    bool allocate();
+    // Copies the frame and releases the broker frame, if the ring is full the frame keeps the broker frame
+    void put(SharedFrame *shared, RingFrame *frame);
+    // Releases the oldest frame or its broker frame
+    void release(RingFrame *frame);
+
+    inline const FrameRingStats &getStats() const {
+        return stats;
+    }
+
+    // The high-water marks start at the current usage again
+    void resetStats();
+
+    inline size_t getSize() const {
+        return size;
+    }
+
+  private:
+    bool reserve(size_t len, size_t *offset, size_t *span);
+
+    char *buffer = NULL;
+    const size_t size;
+
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    // Offset of the oldest frame and behind the newest one
+    size_t tail = 0;
+    size_t head = 0;
+    size_t usedBytes = 0;
+    size_t usedFrames = 0;
+
+    FrameRingStats stats;
+};
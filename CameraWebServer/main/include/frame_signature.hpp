@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The signature is the mean luma of a grid of cells over the whole image
+#define FRAME_SIGNATURE_COLS 16
+#define FRAME_SIGNATURE_ROWS 12
+
+typedef struct {
+    uint8_t luma[FRAME_SIGNATURE_COLS * FRAME_SIGNATURE_ROWS];
+    bool valid;
+} FrameSignature;
+
+/*
+    Computes the signature of a jpeg image. The image is decoded at 1/8 scale, which only evaluates the
+    DC coefficient of every 8x8 block and skips the IDCT. That is still the most expensive part, but far
+    cheaper than a full decode.
+    Returns false (and invalidates the signature) if the image could not be decoded.
+*/
+bool computeFrameSignature(const uint8_t *jpg, size_t len, FrameSignature *signature);
+
+// Largest luma difference of a cell, small changes of a part of the image are not averaged away
+uint8_t frameSignatureDistance(const FrameSignature &a, const FrameSignature &b);
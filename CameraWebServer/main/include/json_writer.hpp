@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Stack buffer of the handlers which send their JSON in chunks
+#define JSON_SEND_BUFFER_SIZE 512
+// Levels of objects and arrays inside each other
+#define JSON_MAX_DEPTH 32
+
+// Takes a full buffer, returns false if the data could not be sent
+typedef bool (*JsonFlush)(void *arg, const char *data, size_t size);
+
+// Flush which sends the data as a chunk of the response, arg is the httpd_req_t
+bool jsonSendChunk(void *arg, const char *data, size_t size);
+
+/*
+    Serializes JSON straight into buf. The commas between members and elements are added by the writer,
+    strings are escaped and numbers are formatted without printf.
+    With a flush the buffer is handed over whenever it is full, so a document of any size goes out through
+    a small buffer. Without one the whole document has to fit, the writer fails otherwise.
+    Once a flush failed or the buffer overflowed everything else is ignored and ok() returns false.
+*/
+class JsonWriter {
+  public:
+    JsonWriter(char *buf, size_t size, JsonFlush flush = NULL, void *arg = NULL);
+
+    void beginObject();
+    void endObject();
+    void beginArray();
+    void endArray();
+
+    // Starts a member of the current object, its value follows
+    void key(const char *name);
+
+    void string(const char *value);
+    // Writes a string of the given length, it does not need to be terminated
+    void string(const char *value, size_t len);
+    void number(int64_t value);
+    void boolean(bool value);
+
+    inline void addString(const char *name, const char *value) {
+        key(name);
+        string(value);
+    }
+
+    inline void addNumber(const char *name, int64_t value) {
+        key(name);
+        number(value);
+    }
+
+    inline void addBool(const char *name, bool value) {
+        key(name);
+        boolean(value);
+    }
+
+    // Appends data as it is, e.g. the framing of a server-sent event
+    void raw(const char *data, size_t len);
+
+    // Hands the rest of the buffer to the flush, returns false if anything failed
+    bool finish();
+
+    inline bool ok() const {
+        return !failed;
+    }
+
+    // Bytes in the buffer, the whole document if there is no flush
+    inline size_t length() const {
+        return len;
+    }
+
+  private:
+    void separate();
+    void write(const char *data, size_t size);
+    void put(char c);
+    bool flushBuffer();
+
+    char *const buf;
+    const size_t size;
+    size_t len = 0;
+    const JsonFlush flush;
+    void *const arg;
+    bool failed = false;
+
+    // One bit per level which is set once the level has an element, the next one needs a comma
+    uint32_t hasElements = 0;
+    size_t depth = 0;
+    bool afterKey = false;
+};
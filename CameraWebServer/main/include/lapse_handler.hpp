@@ -1,12 +1,21 @@
 #pragma once
 
 #include "esp_camera.h"
+#include "esp_http_server.h"
+
+#include "video_writer.hpp"
 
 void lapseHandlerSetup();
 int handleLapse(sensor_t *s, int lapse);
+// Downloads the segment which is currently recorded
+esp_err_t lapseTailHandler(httpd_req_t *req);
+// Frames captured by the running or last timelapse
+size_t lapseFramesTaken();
 
 extern volatile bool lapseRunning;
 // 2 FPS in the resulting video
 extern size_t videoFPS;
 // Take a picture every second
-extern size_t millisBetweenSnapshots;
\ No newline at end of file
+extern size_t millisBetweenSnapshots;
+// Container of the next timelapse
+extern VideoContainer lapseContainer;
\ No newline at end of file
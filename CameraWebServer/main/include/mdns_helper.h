@@ -22,10 +22,14 @@ extern "C" {
 
 int initMDNS(const char *devName);
 void app_mdns_update_framesize(int size);
-const char * app_mdns_query(size_t * out_len);
+void app_mdns_update_multicast(int enabled);
 
 #ifdef __cplusplus
 }
+
+class JsonWriter;
+// Writes this camera and the ones found by the last query as an array
+void app_mdns_query(JsonWriter &json);
 #endif
 
 #endif /* _CAMERA_MDNS_H_ */
@@ -0,0 +1,338 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+    Fragmented MP4 (ISO/IEC 14496-12) layout used for MJPEG timelapses:
+
+    ftyp
+    moov                    track and sample description, no samples
+        mvhd
+        trak
+            tkhd
+            mdia
+                mdhd
+                hdlr
+                minf
+                    vmhd
+                    dinf/dref
+                    stbl    stsd with a 'jpeg' sample entry, empty stts/stsc/stsz/stco
+        mvex/trex           every sample is a sync sample of the same duration
+    free                    pads the header to full sectors
+    moof                    one per fragment
+        mfhd                sequence number, counts up from 1
+        traf
+            tfhd            track id, offsets relative to the moof box
+            tfdt            decode time of the first sample
+            trun            data offset and the size of every sample
+    mdat                    the jpeg frames of the fragment
+    free                    pads the fragment to full sectors
+    ...
+
+    Every fragment is self-contained, so the file stays playable no matter where it is cut off and
+    nothing has to be patched when the recording ends.
+*/
+
+// Size and type of a box
+#define MP4_BOX_HEADER_SIZE 8
+// Box header, version and flags
+#define MP4_FULL_BOX_HEADER_SIZE 12
+// Smallest 'free' box, gaps of less than that are padded to the next sector instead
+#define MP4_MIN_FREE_BOX_SIZE MP4_BOX_HEADER_SIZE
+
+// Up to the trun sample count: mfhd (16), tfhd (16), tfdt (20) and the fixed part of trun (20)
+#define MP4_MOOF_FIXED_SIZE 88
+#define MP4_TRUN_ENTRY_SIZE 4
+#define MP4_MOOF_SIZE(sampleCount) (MP4_MOOF_FIXED_SIZE + MP4_TRUN_ENTRY_SIZE * (sampleCount))
+// Offsets inside the moof box which are validated when recovering
+#define MP4_MOOF_SEQUENCE_OFFSET 20
+#define MP4_MOOF_TRACK_ID_OFFSET 44
+#define MP4_MOOF_DECODE_TIME_OFFSET 60
+#define MP4_MOOF_SAMPLE_COUNT_OFFSET 80
+#define MP4_MOOF_FIRST_SAMPLE_SIZE_OFFSET 88
+
+// tfhd: sample data offsets are relative to the moof box
+#define MP4_TFHD_DEFAULT_BASE_IS_MOOF 0x020000
+// trun: data offset and per sample sizes are present
+#define MP4_TRUN_DATA_OFFSET_PRESENT 0x000001
+#define MP4_TRUN_SAMPLE_SIZE_PRESENT 0x000200
+
+// Fixed layout of the header, the mp4 writer takes these values over when resuming a file
+#define MP4_TKHD_TRACK_ID_OFFSET 20
+#define MP4_MDHD_TIMESCALE_OFFSET 20
+#define MP4_TREX_DEFAULT_DURATION_OFFSET 20
+
+// Packed 'und' language code
+#define MP4_LANGUAGE_UNDETERMINED 0x55C4
+
+inline void writeBigEndian16(char *target, uint16_t value) {
+    target[0] = value >> 8;
+    target[1] = value;
+}
+
+inline void writeBigEndian32(char *target, uint32_t value) {
+    target[0] = value >> 24;
+    target[1] = value >> 16;
+    target[2] = value >> 8;
+    target[3] = value;
+}
+
+inline void writeBigEndian64(char *target, uint64_t value) {
+    writeBigEndian32(target, value >> 32);
+    writeBigEndian32(target + 4, value);
+}
+
+inline uint32_t readBigEndian32(const char *source) {
+    const uint8_t *s = (const uint8_t *)source;
+    return (uint32_t)s[0] << 24 | (uint32_t)s[1] << 16 | (uint32_t)s[2] << 8 | s[3];
+}
+
+inline uint64_t readBigEndian64(const char *source) {
+    return (uint64_t)readBigEndian32(source) << 32 | readBigEndian32(source + 4);
+}
+
+static inline void _put16(char *buf, size_t *offset, uint16_t value) {
+    writeBigEndian16(buf + *offset, value);
+    *offset += 2;
+}
+
+static inline void _put32(char *buf, size_t *offset, uint32_t value) {
+    writeBigEndian32(buf + *offset, value);
+    *offset += 4;
+}
+
+static inline void _put64(char *buf, size_t *offset, uint64_t value) {
+    writeBigEndian64(buf + *offset, value);
+    *offset += 8;
+}
+
+static inline void _putZeros(char *buf, size_t *offset, size_t size) {
+    memset(buf + *offset, 0, size);
+    *offset += size;
+}
+
+// Writes a box header whose size is patched by CLOSE_BOX, returns the offset of the box
+inline size_t BOX(char *buf, size_t *offset, const char type[4]) {
+    const size_t boxOffset = *offset;
+    _put32(buf, offset, 0);
+    memcpy(buf + *offset, type, 4);
+    *offset += 4;
+    return boxOffset;
+}
+
+inline size_t FULL_BOX(char *buf, size_t *offset, const char type[4], uint8_t version = 0, uint32_t flags = 0) {
+    const size_t boxOffset = BOX(buf, offset, type);
+    _put32(buf, offset, (uint32_t)version << 24 | flags);
+    return boxOffset;
+}
+
+// Patches the size of the box starting at boxOffset, everything up to offset belongs to it
+inline size_t CLOSE_BOX(char *buf, size_t boxOffset, size_t offset) {
+    writeBigEndian32(buf + boxOffset, offset - boxOffset);
+    return offset - boxOffset;
+}
+
+// Fills the gap up to the next multiple of alignment with a 'free' box, returns the new offset
+inline size_t FREE_BOX_PADDING(char *buf, size_t offset, size_t alignment) {
+    size_t gap = (alignment - offset % alignment) % alignment;
+    if (gap && gap < MP4_MIN_FREE_BOX_SIZE) {
+        gap += alignment;
+    }
+
+    if (gap) {
+        const size_t box = BOX(buf, &offset, "free");
+        _putZeros(buf, &offset, gap - MP4_BOX_HEADER_SIZE);
+        CLOSE_BOX(buf, box, offset);
+    }
+
+    return offset;
+}
+
+static inline void _putMatrix(char *buf, size_t *offset) {
+    // Unity matrix in 16.16 and 2.30 fixed point
+    static const uint32_t matrix[9] = {0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000};
+    for (size_t i = 0; i < 9; ++i) {
+        _put32(buf, offset, matrix[i]);
+    }
+}
+
+/*
+    Writes ftyp and moov for a single MJPEG track, samples last sampleDuration units of timescale.
+    If alignment is set the header is padded with a 'free' box to a multiple of it.
+    buffer must hold 1024 bytes. Returns the size of the header.
+*/
+inline size_t writeMP4Header(char *buffer, uint32_t width, uint32_t height, uint32_t timescale, uint32_t sampleDuration, uint32_t trackId, size_t alignment = 0) {
+    size_t offset = 0;
+
+    size_t box = BOX(buffer, &offset, "ftyp");
+    memcpy(buffer + offset, "iso6", 4);
+    offset += 4;
+    _put32(buffer, &offset, 0);
+    memcpy(buffer + offset, "iso6iso5isommp41", 16);
+    offset += 16;
+    CLOSE_BOX(buffer, box, offset);
+
+    const size_t moov = BOX(buffer, &offset, "moov");
+
+    // The duration of all fragmented boxes is 0, it results from the fragments
+    box = FULL_BOX(buffer, &offset, "mvhd");
+    _putZeros(buffer, &offset, 8);
+    _put32(buffer, &offset, timescale);
+    _put32(buffer, &offset, 0);
+    _put32(buffer, &offset, 0x00010000);
+    _put16(buffer, &offset, 0x0100);
+    _putZeros(buffer, &offset, 10);
+    _putMatrix(buffer, &offset);
+    _putZeros(buffer, &offset, 24);
+    _put32(buffer, &offset, trackId + 1);
+    CLOSE_BOX(buffer, box, offset);
+
+    const size_t trak = BOX(buffer, &offset, "trak");
+
+    // Track enabled and used in the presentation
+    box = FULL_BOX(buffer, &offset, "tkhd", 0, 0x000003);
+    _putZeros(buffer, &offset, 8);
+    _put32(buffer, &offset, trackId);
+    _putZeros(buffer, &offset, 4 + 4 + 8);
+    _put16(buffer, &offset, 0);
+    _put16(buffer, &offset, 0);
+    _put16(buffer, &offset, 0);
+    _put16(buffer, &offset, 0);
+    _putMatrix(buffer, &offset);
+    _put32(buffer, &offset, width << 16);
+    _put32(buffer, &offset, height << 16);
+    CLOSE_BOX(buffer, box, offset);
+
+    const size_t mdia = BOX(buffer, &offset, "mdia");
+
+    box = FULL_BOX(buffer, &offset, "mdhd");
+    _putZeros(buffer, &offset, 8);
+    _put32(buffer, &offset, timescale);
+    _put32(buffer, &offset, 0);
+    _put16(buffer, &offset, MP4_LANGUAGE_UNDETERMINED);
+    _put16(buffer, &offset, 0);
+    CLOSE_BOX(buffer, box, offset);
+
+    box = FULL_BOX(buffer, &offset, "hdlr");
+    _put32(buffer, &offset, 0);
+    memcpy(buffer + offset, "vide", 4);
+    offset += 4;
+    _putZeros(buffer, &offset, 12);
+    memcpy(buffer + offset, "VideoHandler", sizeof("VideoHandler"));
+    offset += sizeof("VideoHandler");
+    CLOSE_BOX(buffer, box, offset);
+
+    const size_t minf = BOX(buffer, &offset, "minf");
+
+    box = FULL_BOX(buffer, &offset, "vmhd", 0, 0x000001);
+    _putZeros(buffer, &offset, 8);
+    CLOSE_BOX(buffer, box, offset);
+
+    const size_t dinf = BOX(buffer, &offset, "dinf");
+    const size_t dref = FULL_BOX(buffer, &offset, "dref");
+    _put32(buffer, &offset, 1);
+    // The media data is in the same file
+    box = FULL_BOX(buffer, &offset, "url ", 0, 0x000001);
+    CLOSE_BOX(buffer, box, offset);
+    CLOSE_BOX(buffer, dref, offset);
+    CLOSE_BOX(buffer, dinf, offset);
+
+    const size_t stbl = BOX(buffer, &offset, "stbl");
+
+    const size_t stsd = FULL_BOX(buffer, &offset, "stsd");
+    _put32(buffer, &offset, 1);
+    // VisualSampleEntry of Photo-JPEG, every sample is a complete jpeg image
+    box = BOX(buffer, &offset, "jpeg");
+    _putZeros(buffer, &offset, 6);
+    _put16(buffer, &offset, 1);
+    _putZeros(buffer, &offset, 16);
+    _put16(buffer, &offset, width);
+    _put16(buffer, &offset, height);
+    _put32(buffer, &offset, 0x00480000);
+    _put32(buffer, &offset, 0x00480000);
+    _put32(buffer, &offset, 0);
+    _put16(buffer, &offset, 1);
+    // Compressor name as pascal string
+    buffer[offset] = sizeof("Photo - JPEG") - 1;
+    memset(buffer + offset + 1, 0, 31);
+    memcpy(buffer + offset + 1, "Photo - JPEG", sizeof("Photo - JPEG") - 1);
+    offset += 32;
+    _put16(buffer, &offset, 0x0018);
+    _put16(buffer, &offset, 0xFFFF);
+    CLOSE_BOX(buffer, box, offset);
+    CLOSE_BOX(buffer, stsd, offset);
+
+    // Empty sample tables, the samples are described by the fragments
+    static const char *const emptyTables[] = {"stts", "stsc", "stco"};
+    for (size_t i = 0; i < 3; ++i) {
+        box = FULL_BOX(buffer, &offset, emptyTables[i]);
+        _put32(buffer, &offset, 0);
+        CLOSE_BOX(buffer, box, offset);
+    }
+    box = FULL_BOX(buffer, &offset, "stsz");
+    _putZeros(buffer, &offset, 8);
+    CLOSE_BOX(buffer, box, offset);
+
+    CLOSE_BOX(buffer, stbl, offset);
+    CLOSE_BOX(buffer, minf, offset);
+    CLOSE_BOX(buffer, mdia, offset);
+    CLOSE_BOX(buffer, trak, offset);
+
+    const size_t mvex = BOX(buffer, &offset, "mvex");
+    box = FULL_BOX(buffer, &offset, "trex");
+    _put32(buffer, &offset, trackId);
+    // Sample description index, duration, size and flags (sync sample)
+    _put32(buffer, &offset, 1);
+    _put32(buffer, &offset, sampleDuration);
+    _put32(buffer, &offset, 0);
+    _put32(buffer, &offset, 0);
+    CLOSE_BOX(buffer, box, offset);
+    CLOSE_BOX(buffer, mvex, offset);
+
+    CLOSE_BOX(buffer, moov, offset);
+
+    return alignment ? FREE_BOX_PADDING(buffer, offset, alignment) : offset;
+}
+
+/*
+    Writes moof and the mdat header of a fragment whose dataSize bytes of samples follow directly.
+    buffer must hold MP4_MOOF_SIZE(sampleCount) + MP4_BOX_HEADER_SIZE bytes. Returns the number of written bytes.
+*/
+inline size_t writeMP4FragmentHeader(char *buffer, uint32_t sequence, uint32_t trackId, uint64_t baseDecodeTime, const uint32_t *sampleSizes, size_t sampleCount, size_t dataSize) {
+    size_t offset = 0;
+
+    const size_t moof = BOX(buffer, &offset, "moof");
+
+    size_t box = FULL_BOX(buffer, &offset, "mfhd");
+    _put32(buffer, &offset, sequence);
+    CLOSE_BOX(buffer, box, offset);
+
+    const size_t traf = BOX(buffer, &offset, "traf");
+
+    box = FULL_BOX(buffer, &offset, "tfhd", 0, MP4_TFHD_DEFAULT_BASE_IS_MOOF);
+    _put32(buffer, &offset, trackId);
+    CLOSE_BOX(buffer, box, offset);
+
+    box = FULL_BOX(buffer, &offset, "tfdt", 1);
+    _put64(buffer, &offset, baseDecodeTime);
+    CLOSE_BOX(buffer, box, offset);
+
+    box = FULL_BOX(buffer, &offset, "trun", 0, MP4_TRUN_DATA_OFFSET_PRESENT | MP4_TRUN_SAMPLE_SIZE_PRESENT);
+    _put32(buffer, &offset, sampleCount);
+    // The samples start right behind the mdat header
+    _put32(buffer, &offset, MP4_MOOF_SIZE(sampleCount) + MP4_BOX_HEADER_SIZE);
+    for (size_t i = 0; i < sampleCount; ++i) {
+        _put32(buffer, &offset, sampleSizes[i]);
+    }
+    CLOSE_BOX(buffer, box, offset);
+
+    CLOSE_BOX(buffer, traf, offset);
+    CLOSE_BOX(buffer, moof, offset);
+
+    _put32(buffer, &offset, MP4_BOX_HEADER_SIZE + dataSize);
+    memcpy(buffer + offset, "mdat", 4);
+    offset += 4;
+
+    return offset;
+}
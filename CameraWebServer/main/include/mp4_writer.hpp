@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "mp4_helper.hpp"
+#include "video_writer.hpp"
+
+// Fragments are padded with a 'free' box to full sectors, so every write stays aligned
+#define MP4_SECTOR_SIZE 512
+// Upper bound of frames per fragment, the sample sizes of the open fragment are kept in the writer
+#define MP4_MAX_FRAGMENT_FRAMES 64
+// Neither the VFS (signed 32 bit off_t) nor the 32 bit mdat size allow more
+#define MP4_MAX_FILE_SIZE 0x7FFFFFFFUL
+
+/*
+    Writer of fragmented MP4 files with a single MJPEG track.
+
+    The frames of a fragment are collected in a buffer (preferably in PSRAM) behind enough headroom for
+    the moof box. Once fragmentFrames frames are collected, or the next frame would not fit anymore,
+    moof and mdat header are assembled in front of the frames and the whole fragment is written with a
+    single aligned write. The moov box is written up front and never touched again, so a file is
+    playable while it is recorded and finishing it only writes the last fragment.
+*/
+class MP4Writer : public VideoWriter {
+  public:
+    MP4Writer(size_t bufferSize, size_t fragmentFrames);
+    ~MP4Writer();
+
+    bool begin(FILE *mp4File, const char *indexSpillPath, uint32_t width, uint32_t height, uint32_t rate, uint32_t scale = 1) override;
+    // Keeps all complete fragments of the track the header describes, i.e. up to the first torn or foreign one
+    bool resume(FILE *mp4File, const char *indexSpillPath, size_t *tornBytes) override;
+    bool writeFrame(const char *jpgFrame, size_t size) override;
+    bool finish() override;
+    void discard() override;
+
+    inline size_t getFrameCount() const override {
+        return frameCount;
+    }
+
+    inline size_t getFileSize() const override {
+        return fileOffset + (sampleCount ? MP4_MOOF_SIZE(sampleCount) + MP4_BOX_HEADER_SIZE + dataSize : 0);
+    }
+
+    // Size of the complete fragments, which are already in the file
+    inline size_t getWrittenSize() const {
+        return fileOffset;
+    }
+
+  private:
+    bool allocateBuffer();
+    bool readHeader(size_t fileSize, size_t *headerEnd);
+    bool flushFragment();
+    size_t fileWrite(const char *data, size_t size);
+
+    inline char *fragmentData() const {
+        return buffer + MP4_MOOF_SIZE(MP4_MAX_FRAGMENT_FRAMES) + MP4_BOX_HEADER_SIZE;
+    }
+
+    // Bytes of the buffer which are left for frame data
+    inline size_t dataCapacity() const {
+        return bufferSize - (MP4_MOOF_SIZE(MP4_MAX_FRAGMENT_FRAMES) + MP4_BOX_HEADER_SIZE) - 2 * MP4_SECTOR_SIZE;
+    }
+
+    FILE *mp4File = NULL;
+
+    char *buffer = NULL;
+    const size_t bufferSize;
+    const size_t fragmentFrames;
+
+    // Open fragment
+    uint32_t sampleSizes[MP4_MAX_FRAGMENT_FRAMES];
+    size_t sampleCount = 0;
+    size_t dataSize = 0;
+
+    // Bytes written to the file, always a multiple of MP4_SECTOR_SIZE for files of this writer
+    size_t fileOffset = 0;
+    size_t frameCount = 0;
+    size_t fragmentCount = 0;
+    uint32_t sequence = 1;
+    // Random, so fragments of a deleted recording in stale space of the card are not taken over
+    uint32_t trackId = 0;
+    uint32_t sampleDuration = 1;
+
+    // Bytes written since begin or resume and the time spent inside fwrite in microseconds
+    size_t bytesWritten = 0;
+    int64_t ioTimeUs = 0;
+};
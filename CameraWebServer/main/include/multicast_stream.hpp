@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    // Sequence number of the next RTP packet, receivers compare it with their own count to see the loss
+    uint16_t sequence;
+    size_t frames;
+    size_t packets;
+    // Packets which were skipped because lwIP ran out of buffers or the send failed
+    size_t lostPackets;
+} MulticastStats;
+
+/*
+    Sends the frames of the frame broker as RTP/JPEG (RFC 2435) to a multicast group, so every frame crosses
+    the air once no matter how many viewers there are. Players which know the static payload type 26 can open
+    rtp://MULTICAST_GROUP:MULTICAST_PORT directly, sender reports go to the port above.
+    The frame rate is capped at MULTICAST_FPS, the broker only captures for the stream while it is enabled.
+*/
+void startMulticastStream(bool enabled);
+// Returns false if the stream could not be set up, e.g. because MULTICAST_GROUP is invalid
+bool setMulticastStreaming(bool enabled);
+bool isMulticastStreaming();
+const MulticastStats &getMulticastStats();
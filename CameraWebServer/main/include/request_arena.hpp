@@ -0,0 +1,28 @@
+#pragma once
+
+#include "esp_http_server.h"
+
+#include <stddef.h>
+
+typedef struct {
+    // Most bytes a single request took, including the ones which went to PSRAM
+    size_t highWaterBytes;
+    // Allocations which did not fit into the arena and were taken from PSRAM
+    size_t fallbacks;
+    // Allocations which failed altogether
+    size_t failures;
+} RequestArenaStats;
+
+/*
+    Bump allocator for the handlers of the control server. The memory is a fixed block of internal RAM
+    which is handed out front to back and reset as a whole when the handler returns, so the temporary
+    buffers of the requests never fragment the heap. Allocations which do not fit go to PSRAM.
+    Only for handlers registered with registerArenaHandler, which all run on the http server task.
+*/
+void *requestArenaAlloc(size_t size);
+// Releases everything the current request allocated, done by the wrapper after every handler
+void requestArenaReset();
+const RequestArenaStats &getRequestArenaStats();
+
+// Registers the handler so the arena is reset after each of its requests
+esp_err_t registerArenaHandler(httpd_handle_t server, const httpd_uri_t *uri);
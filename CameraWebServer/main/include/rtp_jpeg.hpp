@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RTP_HEADER_SIZE 12
+// Static payload type and clock rate of JPEG video (RFC 3551)
+#define RTP_JPEG_PAYLOAD_TYPE 26
+#define RTP_JPEG_CLOCK_RATE 90000
+// Main JPEG header, restart marker header and quantization table header with two 8 bit tables
+#define RTP_JPEG_HEADER_SIZE 8
+#define RTP_JPEG_RESTART_HEADER_SIZE 4
+#define RTP_JPEG_QTABLE_HEADER_SIZE (4 + 2 * 64)
+// Width and height are sent in units of 8 pixels in a single byte
+#define RTP_JPEG_MAX_DIMENSION 2040
+
+/*
+    The parts of a baseline jpeg which RFC 2435 sends. Everything else (the markers, the huffman tables and
+    the frame and scan headers) is rebuilt by the receiver from type, size and the quantization tables.
+*/
+typedef struct {
+    // 0 for 4:2:2 and 1 for 4:2:0 subsampling, 64 is added if the scan contains restart markers
+    uint8_t type;
+    uint16_t width;
+    uint16_t height;
+    uint16_t restartInterval;
+    // Luma and chroma table in zigzag order as stored in the jpeg
+    const uint8_t *qtables[2];
+    // Entropy coded data between the scan header and EOI
+    const uint8_t *scan;
+    size_t scanSize;
+} RtpJpegFrame;
+
+// Returns false if the jpeg can not be described by RFC 2435 (progressive, grayscale, 16 bit tables or too large)
+bool rtpJpegParse(const uint8_t *jpg, size_t len, RtpJpegFrame *frame);
+
+/*
+    Fills buf with the payload of the packet which starts at scan byte offset: the JPEG header, the restart
+    marker header if needed, the tables in the first packet of a frame and as much scan data as fits.
+    Returns the payload size and stores the number of scan bytes in scanBytes.
+*/
+size_t rtpJpegPayload(const RtpJpegFrame &frame, size_t offset, uint8_t *buf, size_t size, size_t *scanBytes);
+
+// The marker bit is set on the last packet of a frame
+void rtpWriteHeader(uint8_t *buf, uint8_t payloadType, bool marker, uint16_t sequence, uint32_t timestamp, uint32_t ssrc);
+
+/*
+    Writes a compound RTCP packet of a sender report and the CNAME, which maps rtpTime to the NTP
+    timestamp (seconds since 1900 as 32.32 fixed point). Returns its size.
+*/
+size_t rtcpWriteSenderReport(uint8_t *buf, uint32_t ssrc, uint64_t ntpTime, uint32_t rtpTime, uint32_t packets, uint32_t octets, const char *cname);
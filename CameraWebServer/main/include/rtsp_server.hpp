@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    RTSP server which sends the frames of the frame broker as RTP/JPEG (RFC 2435), for NVRs and players
+    which do not understand multipart HTTP. Every connection carries one session with a single video track,
+    the RTP packets either go over UDP (client_port) or interleaved over the RTSP connection (RTP/AVP/TCP).
+    The broker only captures for RTSP while at least one session plays.
+*/
+void startRtspServer(uint16_t port);
+// Sessions which are currently playing
+size_t rtspClientCount();
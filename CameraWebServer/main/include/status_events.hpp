@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Fields which readStatusFields may report
+#define STATUS_MAX_FIELDS 56
+
+typedef struct {
+    const char *name;
+    int32_t value;
+    // Sent as true/false instead of a number
+    bool boolean;
+    // Changes all the time without a notification, so it is reported by /stats instead of the cached /status
+    bool counter;
+} StatusField;
+
+/*
+    Fills fields with the current values of /status and /stats (except the board name) and returns their
+    number. Implemented by the http server, the names and their order must be the same for every call.
+*/
+size_t readStatusFields(StatusField *fields, size_t size);
+
+/*
+    Marks the status as changed. The stream server reads the fields of /status and /stats at most every
+    STATUS_EVENT_COALESCE_MS after a change and every STATUS_EVENT_INTERVAL_MS for the counters,
+    which change all the time, and pushes the fields which differ as server-sent events.
+*/
+void statusEventsNotify();
+// Counts the notifications, so cached copies of /status can tell that they are outdated
+uint32_t statusVersion();
+
+// Reads the fields if it is due, returns true if any of them changed since the previous read
+bool statusEventsUpdate(int64_t now);
+/*
+    Formats an event with the fields which changed on the last read, or with all of them for clients
+    which just connected or missed a change. Returns 0 if buf is too small.
+*/
+size_t statusEventsFormat(char *buf, size_t size, bool all);
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    MJPEG streaming server serving GET /stream to many clients from a single task.
+    Frames come from the frame broker while at least one client is connected. Every client has its own
+    send state, a client which is still busy with an older frame skips the new ones. ?fps=N limits the
+    frame rate of a single client.
+    The multipart response is written to the socket as is, without chunked encoding. Every frame is copied
+    once behind its preformatted part header, so it goes out with one send call per client.
+    GET /ws upgrades to a WebSocket which carries every jpeg as one binary message. The client acknowledges
+    each decoded frame with a message of its own, at most ?window=N (default 2) frames are in flight.
+    While the window is full only the newest frame is kept, so a slow client sees a late frame instead of a
+    growing delay.
+    GET /events is a server-sent event stream with the fields of /status and /stats, all of them first and afterwards
+    only the ones which changed (see status_events.hpp). Event clients share the client slots.
+*/
+void startStreamServer(uint16_t port);
+
+// Number of clients which currently receive the stream
+size_t streamClientCount();
+// Moving average of the time it takes to send a frame to a client
+int64_t streamSendLatencyUs();
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Container a timelapse is recorded in, the value is used by /control and the lapse journal
+typedef enum {
+    VIDEO_CONTAINER_AVI = 0,
+    VIDEO_CONTAINER_MP4 = 1,
+} VideoContainer;
+
+/*
+    Interface of the writers a timelapse segment can be recorded with.
+    All of them write complete jpeg frames into a file opened by the caller.
+*/
+class VideoWriter {
+  public:
+    virtual ~VideoWriter() {}
+
+    // Writes the header, indexSpillPath is only used by writers which keep an index
+    virtual bool begin(FILE *file, const char *indexSpillPath, uint32_t width, uint32_t height, uint32_t rate, uint32_t scale = 1) = 0;
+    // Continues an unfinished file behind its last complete frame, tornBytes is set to the size of the dropped tail
+    virtual bool resume(FILE *file, const char *indexSpillPath, size_t *tornBytes) = 0;
+    virtual bool writeFrame(const char *jpgFrame, size_t size) = 0;
+    // Shows the last written frame once more without storing it again. Returns false if that is not
+    // possible, the frame has to be written with writeFrame then.
+    virtual bool repeatFrame() {
+        return false;
+    }
+    // Writes everything still pending, afterwards the file is complete
+    virtual bool finish() = 0;
+    // Releases the buffers without writing anything, the file is left to the caller
+    virtual void discard() = 0;
+
+    virtual size_t getFrameCount() const = 0;
+    // Size the file has once everything written so far reached it
+    virtual size_t getFileSize() const = 0;
+};
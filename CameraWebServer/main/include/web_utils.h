@@ -2,15 +2,34 @@
 
 #include "esp_http_server.h"
 
+// Stack buffer for the query of a request, the http server limits the whole URI to this length
+#define QUERY_BUFFER_SIZE 512
+
+// One parameter of a query, both point into the parsed query
+typedef struct {
+    const char *key;
+    const char *value;
+} QueryParam;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-bool urldecode(char *str, size_t length);
-esp_err_t parse_get(httpd_req_t *req, char **obuf);
+// Copies the query of the request into buf, responds with 404 if there is none and 400 if it does not fit
+esp_err_t read_query(httpd_req_t *req, char *buf, size_t size);
 
-int parse_get_var(char *buf, const char *key, int def);
+/*
+    Splits query into its parameters and URL-decodes them in place, all in one pass without copies.
+    Returns the number of parameters, the ones after the first size are not parsed.
+*/
+size_t parse_query(char *query, QueryParam *params, size_t size);
+
+// Lookups in the parsed parameters, the first parameter with the key counts
+const char *query_value(const QueryParam *params, size_t count, const char *key);
+int query_int(const QueryParam *params, size_t count, const char *key, int def);
+// "1" and "true" are true, any other value is false
+bool query_bool(const QueryParam *params, size_t count, const char *key, bool def);
 
 #ifdef __cplusplus
 }
-#endif
\ No newline at end of file
+#endif
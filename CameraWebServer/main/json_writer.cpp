@@ -0,0 +1,179 @@
+#include "esp_http_server.h"
+#include <string.h>
+
+// Local files
+#include "json_writer.hpp"
+#include "makros.h"
+
+bool jsonSendChunk(void *arg, const char *data, size_t size) {
+    return httpd_resp_send_chunk((httpd_req_t *)arg, data, size) == ESP_OK;
+}
+
+JsonWriter::JsonWriter(char *buf, size_t size, JsonFlush flush, void *arg) : buf(buf), size(size), flush(flush), arg(arg) {
+}
+
+bool JsonWriter::flushBuffer() {
+    if (failed || !flush || !flush(arg, buf, len)) {
+        failed = true;
+        return false;
+    }
+
+    len = 0;
+    return true;
+}
+
+void JsonWriter::write(const char *data, size_t dataLen) {
+    while (dataLen && !failed) {
+        if (len == size && !flushBuffer()) {
+            return;
+        }
+
+        const size_t part = MINEQ(dataLen, size - len);
+        memcpy(buf + len, data, part);
+        len += part;
+        data += part;
+        dataLen -= part;
+    }
+}
+
+void JsonWriter::put(char c) {
+    if (len == size && !flushBuffer()) {
+        return;
+    }
+    buf[len++] = c;
+}
+
+void JsonWriter::raw(const char *data, size_t dataLen) {
+    write(data, dataLen);
+}
+
+// Every value and key after the first one of its level is preceded by a comma, except the value of a member
+void JsonWriter::separate() {
+    if (afterKey) {
+        afterKey = false;
+        return;
+    }
+
+    const uint32_t bit = 1UL << MINEQ(depth, JSON_MAX_DEPTH - 1);
+    if (hasElements & bit) {
+        put(',');
+    }
+    hasElements |= bit;
+}
+
+void JsonWriter::beginObject() {
+    separate();
+    put('{');
+    ++depth;
+    hasElements &= ~(1UL << MINEQ(depth, JSON_MAX_DEPTH - 1));
+}
+
+void JsonWriter::endObject() {
+    --depth;
+    put('}');
+}
+
+void JsonWriter::beginArray() {
+    separate();
+    put('[');
+    ++depth;
+    hasElements &= ~(1UL << MINEQ(depth, JSON_MAX_DEPTH - 1));
+}
+
+void JsonWriter::endArray() {
+    --depth;
+    put(']');
+}
+
+void JsonWriter::key(const char *name) {
+    string(name);
+    put(':');
+    afterKey = true;
+}
+
+void JsonWriter::string(const char *value) {
+    string(value, strlen(value));
+}
+
+void JsonWriter::string(const char *value, size_t valueLen) {
+    static const char hex[] = "0123456789abcdef";
+
+    separate();
+    put('"');
+
+    const char *end = value + valueLen;
+    while (value < end) {
+        // Characters which need no escaping are copied in one go
+        const char *run = value;
+        while (run < end && *run != '"' && *run != '\\' && (uint8_t)*run >= 0x20) {
+            ++run;
+        }
+        write(value, run - value);
+        if (run == end) {
+            break;
+        }
+
+        char escape[6] = {'\\', *run};
+        size_t escapeLen = 2;
+        switch (*run) {
+            case '"':
+            case '\\':
+                break;
+            case '\n':
+                escape[1] = 'n';
+                break;
+            case '\r':
+                escape[1] = 'r';
+                break;
+            case '\t':
+                escape[1] = 't';
+                break;
+            default:
+                escape[1] = 'u';
+                escape[2] = '0';
+                escape[3] = '0';
+                escape[4] = hex[(uint8_t)*run >> 4];
+                escape[5] = hex[*run & 0xF];
+                escapeLen = 6;
+                break;
+        }
+        write(escape, escapeLen);
+        value = run + 1;
+    }
+
+    put('"');
+}
+
+void JsonWriter::number(int64_t value) {
+    separate();
+
+    // Digits are produced from the end, 20 of them are enough for any 64 bit number
+    char digits[20];
+    char *p = digits + sizeof(digits);
+    uint64_t magnitude = value < 0 ? -(uint64_t)value : value;
+    do {
+        *--p = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+
+    if (value < 0) {
+        put('-');
+    }
+    write(p, digits + sizeof(digits) - p);
+}
+
+void JsonWriter::boolean(bool value) {
+    separate();
+    if (value) {
+        write("true", CONST_STR_LEN("true"));
+    } else {
+        write("false", CONST_STR_LEN("false"));
+    }
+}
+
+bool JsonWriter::finish() {
+    if (len && flush) {
+        flushBuffer();
+    }
+    return !failed;
+}
@@ -1,19 +1,30 @@
 #include "esp_camera.h"
 #include "esp_http_server.h"
+#include "esp_timer.h"
 #include "img_converters.h"
 #include "sensor.h"
 #include <stdio.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 // Local files
-#include "avi_helper.hpp"
+#include "avi_writer.hpp"
 #include "flashlight.h"
+#include "frame_broker.hpp"
+#include "frame_ring.hpp"
+#include "frame_signature.hpp"
 #include "lapse_handler.hpp"
 #include "makros.h"
+#include "mdns_helper.h"
+#include "mp4_writer.hpp"
+#include "request_arena.hpp"
+#include "status_events.hpp"
 
 //FreeRTOS
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 
 //Timer & Interrupts
@@ -39,21 +50,86 @@ static const char *TAG = "timelapse";
 
 #define TIMER_SCALE (TIMER_BASE_CLK / TIMER_DIVIDER) // convert counter value to seconds
 
+#define LAPSE_SEGMENTING (LAPSE_SEGMENT_MAX_SIZE > 0 || LAPSE_SEGMENT_MAX_DURATION > 0)
+
+// A tail download gives up if the current frame takes longer than this to be written
+#define TAIL_LOCK_TIMEOUT pdMS_TO_TICKS(5000)
+// Bytes of the file read per call when streaming the tail of a recording
+#define TAIL_READ_SIZE 4096
+// Frames waiting for the avi task, the entries are small as the frame data lives in the frame ring
+#define FRAME_QUEUE_LENGTH 32
+
 volatile bool lapseRunning = false;
 // 2 FPS in the resulting video
 size_t videoFPS = 2;
 // Take a picture every second
 size_t millisBetweenSnapshots = 1000;
+VideoContainer lapseContainer = VIDEO_CONTAINER_AVI;
 
-static QueueHandle_t frameQueue = xQueueCreate(10, sizeof(camera_fb_t *));
+static QueueHandle_t frameQueue = xQueueCreate(FRAME_QUEUE_LENGTH, sizeof(RingFrame));
+static FrameRing frameRing(LAPSE_FRAME_RING_SIZE);
+// Subscription of the camera task, other consumers of the camera keep working while the lapse runs
+static FrameSubscriber *lapseSubscriber = NULL;
 static TaskHandle_t cameraTask;
 static TaskHandle_t aviTask;
+static TaskHandle_t segmentTask;
 
 static size_t framesTaken = 0;
-static size_t maxFrameBytes = 0;
-static FILE *aviFile = NULL;
-static FILE *indexFile = NULL;
-static size_t aviWriteOffset;
+
+// A recording is split into numbered segments. While one segment is written the next one is
+// already opened by the segment task, which also finalizes the previous one in the background.
+typedef struct {
+    AVIWriter *aviWriter;
+    MP4Writer *mp4Writer;
+    const char *spillPath;
+    // One of the writers above, depending on the container of the recording
+    VideoWriter *writer;
+    FILE *file;
+    size_t number;
+    char path[32];
+} LapseSegment;
+
+static AVIWriter aviWriters[2] = {
+    {AVI_STAGING_BUFFER_SIZE, AVI_HEADER_UPDATE_INTERVAL, AVI_INDEX_MEMORY_ENTRIES, AVI_RIFF_SIZE_LIMIT},
+    {AVI_STAGING_BUFFER_SIZE, AVI_HEADER_UPDATE_INTERVAL, AVI_INDEX_MEMORY_ENTRIES, AVI_RIFF_SIZE_LIMIT},
+};
+
+static MP4Writer mp4Writers[2] = {
+    {MP4_FRAGMENT_BUFFER_SIZE, MP4_FRAGMENT_FRAMES},
+    {MP4_FRAGMENT_BUFFER_SIZE, MP4_FRAGMENT_FRAMES},
+};
+
+// Segment n always uses slot n % 2
+static LapseSegment segments[2] = {
+    {&aviWriters[0], &mp4Writers[0], TMP_INDEX_FILE_PATH},
+    {&aviWriters[1], &mp4Writers[1], TMP_INDEX_FILE_PATH ".1"},
+};
+
+static LapseSegment *currentSegment = &segments[0];
+// Segment handed over to the segment task for finalization
+static LapseSegment *volatile closingSegment = NULL;
+// Set by the segment task once the following segment is opened
+static volatile bool nextSegmentReady = false;
+// The first segment is opened by the control task, the segment task preallocates it afterwards
+static volatile bool firstSegmentPending = false;
+// Serializes the segment task with starting and stopping the lapse
+static SemaphoreHandle_t segmentLock = NULL;
+// Held by the avi task while it writes a frame, tail downloads take their snapshot in between
+static SemaphoreHandle_t frameLock = NULL;
+
+/*
+    File name without segment number and extension. FatFs rejects names longer than CONFIG_FATFS_MAX_LFN (24),
+    so "TL-123456-000.avi" leaves room for segment numbers beyond 999.
+*/
+static char lapseBaseName[24];
+static framesize_t lapseFramesize;
+static uint32_t lapseWidth;
+static uint32_t lapseHeight;
+static size_t segmentMaxFrames = 0;
+
+// Signature of the last written frame, which following frames are compared with
+static FrameSignature referenceSignature;
+static FrameSignature frameSignature;
 
 static IRAM_ATTR void timerISR(void *arg) {
     // Clear the interrupt status and enable arlam again
@@ -81,30 +157,70 @@ static void cameraTaskRoutine(void *arg) {
     for (;;) {
         // Reset the notify count to zero after processing one frame
         if (ulTaskNotifyTake(pdTRUE, xMaxBlockTime)) {
-            camera_fb_t *fb = takePicture();
-            if (!fb) {
+            // The frame shows the moment of the timer, not one which waited in the driver
+            frameBrokerRequestFresh(lapseSubscriber);
+            SharedFrame *shared = frameBrokerReceive(lapseSubscriber, xMaxBlockTime);
+            if (!shared) {
                 ESP_LOGE(TAG, "Camera capture failed!");
-                break;
+                continue;
             }
-            if (xQueueSend(frameQueue, &fb, xMaxBlockTime) == pdTRUE) {
-                ++framesTaken;
-            } else {
+            if (!uxQueueSpacesAvailable(frameQueue)) {
                 ESP_LOGW(TAG, "frame queue is full!");
-                // Return buffer and wait for next timer call
-                esp_camera_fb_return(fb);
+                // Release the frame and wait for next timer call
+                frameBrokerRelease(shared);
+                continue;
             }
+
+            // The broker frame is released right away unless the ring is full
+            RingFrame frame;
+            frameRing.put(shared, &frame);
+
+            // This task is the only producer, so the free entry checked above is still there
+            xQueueSend(frameQueue, &frame, 0);
+            ++framesTaken;
         }
     }
 }
 
+static inline bool segmentFull(size_t frameSize) {
+    const VideoWriter *writer = currentSegment->writer;
+
+    return (LAPSE_SEGMENT_MAX_SIZE > 0 && writer->getFileSize() + frameSize > LAPSE_SEGMENT_MAX_SIZE) ||
+           (segmentMaxFrames && writer->getFrameCount() >= segmentMaxFrames);
+}
+
+// Repeats the last written frame if the new one does not differ noticeably
+static bool repeatIfUnchanged(const uint8_t *jpg, size_t len) {
+    if (LAPSE_REPEAT_THRESHOLD <= 0 || lapseContainer != VIDEO_CONTAINER_AVI) {
+        return false;
+    }
+
+    if (!computeFrameSignature(jpg, len, &frameSignature)) {
+        return false;
+    }
+
+    return referenceSignature.valid && frameSignatureDistance(frameSignature, referenceSignature) <= LAPSE_REPEAT_THRESHOLD &&
+           currentSegment->writer->repeatFrame();
+}
+
+// Only swaps the segments, opening and finalizing files is left to the segment task
+static inline void rotateSegment() {
+    closingSegment = currentSegment;
+    currentSegment = &segments[(currentSegment->number + 1) % 2];
+    nextSegmentReady = false;
+
+    xTaskNotifyGive(segmentTask);
+}
+
 static void aviTaskRoutine(void *arg) {
     // 20s max block time
     const TickType_t xMaxBlockTime = pdMS_TO_TICKS(20000);
-    size_t *offset = &aviWriteOffset;
 
     for (;;) {
-        camera_fb_t *fb;
-        if (xQueueReceive(frameQueue, &fb, xMaxBlockTime) == pdTRUE) {
+        RingFrame frame;
+        // The frame stays queued until it is written, so an empty queue means that no frame is in flight
+        if (xQueuePeek(frameQueue, &frame, xMaxBlockTime) == pdTRUE) {
+            camera_fb_t *fb = &frame.fb;
             size_t _jpg_buf_len = 0;
             uint8_t *_jpg_buf = NULL;
 
@@ -121,18 +237,32 @@ static void aviTaskRoutine(void *arg) {
                 _jpg_buf = fb->buf;
             }
 
-            // Update max frame byte count
-            maxFrameBytes = MAXEQ(maxFrameBytes, _jpg_buf_len);
+            xSemaphoreTake(frameLock, portMAX_DELAY);
+
+            // Roll over to the prepared segment, the frame is the first one of the new segment
+            if (nextSegmentReady && segmentFull(_jpg_buf_len)) {
+                rotateSegment();
+            }
+
+            // Write frame to the video file
+            if (repeatIfUnchanged(_jpg_buf, _jpg_buf_len)) {
+                ESP_LOGD(TAG, "Frame repeated");
+            } else if (currentSegment->writer->writeFrame((const char *)_jpg_buf, _jpg_buf_len)) {
+                // Later frames are compared with the written one, such that slow changes still accumulate
+                referenceSignature = frameSignature;
+            } else {
+                ESP_LOGE(TAG, "Writing frame to %s failed!", currentSegment->path);
+            }
 
-            // Write frame to avi file and create index file
-            writeFrameAndUpdate(aviFile, indexFile, offset, (const char *)_jpg_buf, _jpg_buf_len);
+            xSemaphoreGive(frameLock);
 
             if (needsFree) {
                 free(_jpg_buf);
             }
 
         return_fb:
-            esp_camera_fb_return(fb);
+            frameRing.release(&frame);
+            xQueueReceive(frameQueue, &frame, 0);
         }
     }
 }
@@ -166,6 +296,203 @@ static inline void stopTimer() {
     timer_disable_intr(_CAM_TASK_TIMER_GROUP_NUM, _CAM_TASK_TIMER_NUM);
 }
 
+// Also selects the writer of the current container
+static inline void formatSegmentPath(LapseSegment *segment, size_t number) {
+    const char *extension = lapseContainer == VIDEO_CONTAINER_MP4 ? "mp4" : "avi";
+
+    segment->number = number;
+    segment->writer = lapseContainer == VIDEO_CONTAINER_MP4 ? (VideoWriter *)segment->mp4Writer : segment->aviWriter;
+
+    if (LAPSE_SEGMENTING) {
+        snprintf(segment->path, sizeof(segment->path), "%s-%03u.%s", lapseBaseName, number, extension);
+    } else {
+        snprintf(segment->path, sizeof(segment->path), "%s.%s", lapseBaseName, extension);
+    }
+}
+
+static inline void closeSegmentFile(LapseSegment *segment) {
+    fclose(segment->file);
+    segment->file = NULL;
+}
+
+static inline bool openSegmentFile(LapseSegment *segment, const char *mode) {
+    segment->file = fopen(segment->path, mode);
+
+    if (!segment->file) {
+        ESP_LOGE(TAG, "Could not open %s!", segment->path);
+        return false;
+    }
+
+    // The writers only issue large staged writes, stdio buffering would just add a copy
+    setvbuf(segment->file, NULL, _IONBF, 0);
+
+    return true;
+}
+
+/*
+    Extends the file to LAPSE_PREALLOCATION_SIZE bytes. Seeking behind the end of a file opened
+    for writing makes FatFs allocate the whole cluster chain at once, which is contiguous as long as
+    the free space is. The size is synced right away, so everything written into the preallocated
+    space is reachable after a power loss without touching the FAT again.
+*/
+static void preallocateSegment(LapseSegment *segment) {
+    if (LAPSE_PREALLOCATION_SIZE <= 0) {
+        return;
+    }
+
+    const int64_t start = esp_timer_get_time();
+
+    // The writer may still stage data, it continues at the position of the file
+    const long writeOffset = ftell(segment->file);
+
+    // FatFs stops expanding silently if the card is full, the file is just smaller then
+    if (fseek(segment->file, LAPSE_PREALLOCATION_SIZE, SEEK_SET) || fseek(segment->file, writeOffset, SEEK_SET) || fsync(fileno(segment->file))) {
+        ESP_LOGW(TAG, "Could not preallocate %s!", segment->path);
+        fseek(segment->file, writeOffset, SEEK_SET);
+        return;
+    }
+
+    ESP_LOGI(TAG, "Preallocated %s in %lld ms", segment->path, (esp_timer_get_time() - start) / 1000);
+}
+
+// Opens the file of a new segment and stages its header
+static bool prepareSegment(LapseSegment *segment, size_t number) {
+    formatSegmentPath(segment, number);
+
+    if (!openSegmentFile(segment, "wb")) {
+        return false;
+    }
+
+    if (!segment->writer->begin(segment->file, segment->spillPath, lapseWidth, lapseHeight, videoFPS)) {
+        ESP_LOGE(TAG, "Could not start the writer of %s!", segment->path);
+        closeSegmentFile(segment);
+        remove(segment->path);
+        return false;
+    }
+
+    return true;
+}
+
+// Drops a prepared segment which never received a frame, including its preallocated space
+static inline void discardSegment(LapseSegment *segment) {
+    segment->writer->discard();
+    closeSegmentFile(segment);
+    remove(segment->path);
+}
+
+static void finalizeSegment(LapseSegment *segment) {
+    if (!segment->writer->finish()) {
+        ESP_LOGE(TAG, "Finalizing %s failed!", segment->path);
+    }
+
+    const size_t fileSize = segment->writer->getFileSize();
+    closeSegmentFile(segment);
+
+    // Cut off everything behind the written data, i.e. the unused preallocated space or the torn tail of a recovered recording
+    truncate(segment->path, fileSize);
+
+    ESP_LOGI(TAG, "%s finished", segment->path);
+}
+
+// The journal names the first unfinished segment such that it (and the following ones) can be recovered after a power loss
+static inline void writeJournal() {
+    FILE *journal = fopen(LAPSE_JOURNAL_FILE_PATH, "w");
+
+    if (!journal) {
+        ESP_LOGW(TAG, "Could not write lapse journal, the recording can not be recovered!");
+        return;
+    }
+
+    fprintf(journal, "%s %u %u %u %u %u\n", lapseBaseName, currentSegment->number, lapseFramesize, videoFPS, millisBetweenSnapshots, lapseContainer);
+    fclose(journal);
+}
+
+static void segmentTaskRoutine(void *arg) {
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // The avi task already writes into the first segment, its frames wait while the file is extended
+        if (firstSegmentPending) {
+            xSemaphoreTake(frameLock, portMAX_DELAY);
+            if (lapseRunning) {
+                preallocateSegment(currentSegment);
+            }
+            firstSegmentPending = false;
+            xSemaphoreGive(frameLock);
+        }
+
+        xSemaphoreTake(segmentLock, portMAX_DELAY);
+
+        if (closingSegment) {
+            finalizeSegment(closingSegment);
+            closingSegment = NULL;
+            writeJournal();
+        }
+
+        // Slot of the next segment is only free once the previous segment is finalized
+        if (lapseRunning && LAPSE_SEGMENTING && !nextSegmentReady) {
+            const size_t number = currentSegment->number + 1;
+            LapseSegment *next = &segments[number % 2];
+            if (prepareSegment(next, number)) {
+                // Only behind the header, the preallocated space holds stale data of the card
+                preallocateSegment(next);
+                nextSegmentReady = true;
+            }
+        }
+
+        xSemaphoreGive(segmentLock);
+    }
+}
+
+static inline void setLapseFramesize(framesize_t framesize) {
+    const resolution_info_t &res = resolution[framesize];
+
+    lapseFramesize = framesize;
+    lapseWidth = res.width;
+    lapseHeight = res.height;
+}
+
+static inline void runLapse() {
+    frameSignature.valid = false;
+    referenceSignature.valid = false;
+    segmentMaxFrames = millisBetweenSnapshots ? (LAPSE_SEGMENT_MAX_DURATION * 60000) / millisBetweenSnapshots : 0;
+
+    frameRing.allocate();
+    frameRing.resetStats();
+
+    lapseRunning = true;
+    statusEventsNotify();
+
+    vTaskResume(cameraTask);
+    vTaskResume(aviTask);
+    startTimer();
+
+    // Prepare the following segment
+    xTaskNotifyGive(segmentTask);
+}
+
+static void finalizeLapse() {
+    xSemaphoreTake(segmentLock, portMAX_DELAY);
+
+    if (closingSegment) {
+        finalizeSegment(closingSegment);
+        closingSegment = NULL;
+    }
+    if (nextSegmentReady) {
+        discardSegment(&segments[(currentSegment->number + 1) % 2]);
+        nextSegmentReady = false;
+    }
+    finalizeSegment(currentSegment);
+
+    remove(LAPSE_JOURNAL_FILE_PATH);
+
+    xSemaphoreGive(segmentLock);
+}
+
+size_t lapseFramesTaken() {
+    return framesTaken;
+}
+
 int handleLapse(sensor_t *s, int lapse) {
     bool wantsLapseStart = lapse ? true : false;
 
@@ -178,13 +505,18 @@ int handleLapse(sensor_t *s, int lapse) {
         stopTimer();
         // Suspend camera Task because it is no longer needed!
         vTaskSuspend(cameraTask);
+        // A frame requested right before must not hold a driver buffer until the next lapse
+        frameBrokerCancel(lapseSubscriber);
 
-        // Loop until queue is empty
+        // Loop until queue is empty, the avi task only dequeues a frame once it is written
         const TickType_t xDelay = pdMS_TO_TICKS(500);
         while (uxQueueMessagesWaiting(frameQueue)) {
             vTaskDelay(xDelay);
         }
 
+        // Never suspend the task in the middle of a frame, this also keeps tail downloads away from the finished writers
+        xSemaphoreTake(frameLock, portMAX_DELAY);
+
         // Send task suspend request
         vTaskSuspend(aviTask);
 
@@ -193,57 +525,228 @@ int handleLapse(sensor_t *s, int lapse) {
             vTaskDelay(xDelay);
         }
 
-        mergeAndPatch(aviFile, indexFile, &aviWriteOffset, framesTaken, maxFrameBytes, videoFPS);
-
         lapseRunning = false;
-        fclose(aviFile);
-        fclose(indexFile);
-        aviFile = NULL;
-        indexFile = NULL;
+        statusEventsNotify();
+        finalizeLapse();
 
-        // Delete temporary file
-        remove(TMP_INDEX_FILE_PATH);
+        xSemaphoreGive(frameLock);
+
+        const FrameRingStats &ringStats = frameRing.getStats();
+        ESP_LOGI(TAG, "Frame ring: %u of %u bytes and %u frames used at most, %u frames copied, %u kept their broker frame",
+                 ringStats.highWaterBytes, frameRing.getSize(), ringStats.highWaterFrames, ringStats.copiedFrames, ringStats.overflowFrames);
 
         ESP_LOGI(TAG, "timelapse ended!");
     } else {
         ESP_LOGI(TAG, "starting timelapse!");
 
-        const resolution_info_t &res = resolution[s->status.framesize];
+        setLapseFramesize(s->status.framesize);
 
-        char buf[23];
         time_t now;
         struct tm timeinfo;
         time(&now);
         localtime_r(&now, &timeinfo);
-        strftime(buf, sizeof(buf), "Timelapse-%H-%M-%S.avi", &timeinfo);
-        aviFile = fopen(buf, "wb");
+        strftime(lapseBaseName, sizeof(lapseBaseName), "TL-%H%M%S", &timeinfo);
 
-        if (!aviFile) {
-            ESP_LOGE(TAG, "Could not open avi file!");
+        currentSegment = &segments[0];
+        // Preallocating takes long, so it is left to the segment task
+        if (!prepareSegment(currentSegment, 0)) {
             return 1;
         }
+        firstSegmentPending = true;
 
-        indexFile = fopen(TMP_INDEX_FILE_PATH, "wb+");
+        writeJournal();
 
-        if (!indexFile) {
-            ESP_LOGE(TAG, "Could not open avi index file!");
-            fclose(aviFile);
-            aviFile = NULL;
-            return 1;
+        framesTaken = 0;
+        runLapse();
+    }
+
+    return 0;
+}
+
+static bool sendTailChunk(void *arg, const char *data, size_t size) {
+    return httpd_resp_send_chunk((httpd_req_t *)arg, data, size) == ESP_OK;
+}
+
+static bool sendFileHead(httpd_req_t *req, FILE *file, size_t size, char *buf) {
+    bool res = true;
+    for (size_t sent = 0; res && sent < size;) {
+        const size_t chunk = MINEQ(TAIL_READ_SIZE, size - sent);
+        res = fread(buf, 1, chunk, file) == chunk && sendTailChunk(req, buf, chunk);
+        sent += chunk;
+    }
+
+    return res;
+}
+
+/*
+    Serves the segment which is currently recorded as a complete file. Only taking the snapshot waits for
+    the avi task, the frames are read through a separate file handle afterwards. Everything in front of the
+    snapshot is never rewritten by the writer, except for size fields the snapshot overrides anyway.
+    Fragmented mp4 files are complete after every fragment, so they are served up to the last written one.
+*/
+esp_err_t lapseTailHandler(httpd_req_t *req) {
+    if (xSemaphoreTake(frameLock, TAIL_LOCK_TIMEOUT) != pdTRUE) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    if (!lapseRunning) {
+        xSemaphoreGive(frameLock);
+        return httpd_resp_send_404(req);
+    }
+
+    LapseSegment *segment = currentSegment;
+    const bool mp4 = lapseContainer == VIDEO_CONTAINER_MP4;
+    char path[sizeof(segment->path)];
+    memcpy(path, segment->path, sizeof(path));
+
+    size_t mp4Size = 0;
+    // Both are dropped with the request arena
+    AVISnapshot *snapshot = (AVISnapshot *)requestArenaAlloc(sizeof(AVISnapshot));
+    char *buf = (char *)requestArenaAlloc(TAIL_READ_SIZE);
+    bool res = snapshot && buf;
+    if (snapshot) {
+        memset(snapshot, 0, sizeof(AVISnapshot));
+    }
+    if (res) {
+        if (mp4) {
+            mp4Size = segment->mp4Writer->getWrittenSize();
+        } else {
+            res = segment->aviWriter->snapshot(snapshot);
         }
+    }
+    // The directory entry might not cover everything written so far, the file is opened again below
+    res = res && fsync(fileno(segment->file)) == 0;
 
-        aviWriteOffset = createAVI_File(aviFile, res.width, res.height, videoFPS);
+    xSemaphoreGive(frameLock);
 
-        framesTaken = 0;
-        maxFrameBytes = 0;
-        lapseRunning = true;
+    FILE *file = res ? fopen(path, "rb") : NULL;
+    if (!file) {
+        ESP_LOGE(TAG, "Could not snapshot %s!", path);
+        if (snapshot) {
+            releaseAVISnapshot(snapshot);
+        }
+        return httpd_resp_send_500(req);
+    }
+
+#define TAIL_CONTENT_DISPOSITION_VALUE "attachment; filename="
+    char headerBuf[sizeof(path) + CONST_STR_LEN(TAIL_CONTENT_DISPOSITION_VALUE)] = TAIL_CONTENT_DISPOSITION_VALUE;
+    memcpy(headerBuf + CONST_STR_LEN(TAIL_CONTENT_DISPOSITION_VALUE), path, sizeof(path));
+
+    httpd_resp_set_type(req, mp4 ? "video/mp4" : "video/x-msvideo");
+    httpd_resp_set_hdr(req, "Content-Disposition", headerBuf);
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
 
-        vTaskResume(cameraTask);
-        vTaskResume(aviTask);
-        startTimer();
+    if (mp4) {
+        res = sendFileHead(req, file, mp4Size, buf);
+    } else {
+        res = writeAVISnapshot(*snapshot, file, buf, TAIL_READ_SIZE, sendTailChunk, req);
+        ESP_LOGI(TAG, "Served %u frames of %s", snapshot->frameCount, path);
     }
 
-    return 0;
+    fclose(file);
+    releaseAVISnapshot(snapshot);
+
+    if (!res) {
+        ESP_LOGE(TAG, "Tail download of %s aborted!", path);
+        return ESP_FAIL;
+    }
+
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static inline bool hasData(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && st.st_size > 0;
+}
+
+static void recoverLapse() {
+    FILE *journal = fopen(LAPSE_JOURNAL_FILE_PATH, "r");
+
+    // No journal means the last recording was finished properly
+    if (!journal) {
+        return;
+    }
+
+    // Journals of older versions have no container, they always recorded avi files
+    unsigned int number, framesize, fps, delay, container = VIDEO_CONTAINER_AVI;
+    const int parsed = fscanf(journal, "%23s %u %u %u %u %u", lapseBaseName, &number, &framesize, &fps, &delay, &container);
+    fclose(journal);
+
+    if (parsed < 5 || container > VIDEO_CONTAINER_MP4) {
+        ESP_LOGE(TAG, "Invalid lapse journal, skipping recovery!");
+        remove(LAPSE_JOURNAL_FILE_PATH);
+        return;
+    }
+
+    // Segments behind the journaled one were started before the journal was updated. Every segment
+    // but the last one with data is complete, so only the last one may be resumed.
+    lapseContainer = (VideoContainer)container;
+
+    LapseSegment *segment = NULL;
+    size_t frameCount = 0;
+    for (unsigned int n = number; LAPSE_SEGMENTING || n == number; ++n) {
+        LapseSegment *candidate = &segments[n % 2];
+        formatSegmentPath(candidate, n);
+
+        if (!hasData(candidate->path)) {
+            remove(candidate->path);
+            break;
+        }
+
+        if (segment) {
+            finalizeSegment(segment);
+            segment = NULL;
+        }
+
+        if (!openSegmentFile(candidate, "rb+")) {
+            continue;
+        }
+
+        // The spilled index of an avi file is reused if it exists, its entries are validated against the file
+        size_t tornBytes;
+        if (!candidate->writer->resume(candidate->file, candidate->spillPath, &tornBytes)) {
+            ESP_LOGE(TAG, "Could not recover %s!", candidate->path);
+            closeSegmentFile(candidate);
+            continue;
+        }
+
+        frameCount = candidate->writer->getFrameCount();
+        ESP_LOGI(TAG, "Recovered %u frames of %s, dropped %u torn bytes", frameCount, candidate->path, tornBytes);
+        segment = candidate;
+    }
+
+    if (!segment) {
+        remove(LAPSE_JOURNAL_FILE_PATH);
+        return;
+    }
+
+    currentSegment = segment;
+    setLapseFramesize((framesize_t)framesize);
+
+#ifdef LAPSE_RESUME_AFTER_REBOOT
+    sensor_t *s = esp_camera_sensor_get();
+
+    // The resumed frames must have the same size as the recovered ones
+    if (fps && delay && s->set_framesize(s, lapseFramesize) == 0) {
+        app_mdns_update_framesize(framesize);
+        videoFPS = fps;
+        millisBetweenSnapshots = delay;
+        framesTaken = frameCount;
+        writeJournal();
+
+        ESP_LOGI(TAG, "resuming timelapse!");
+        runLapse();
+        return;
+    }
+#endif
+
+    finalizeLapse();
+
+    // Prepared segment which never received a frame
+    if (!frameCount) {
+        remove(currentSegment->path);
+    }
 }
 
 void lapseHandlerSetup() {
@@ -263,10 +766,11 @@ void lapseHandlerSetup() {
 #endif
     );
 
+    // Comparing frames decodes them at 1/8 scale, which needs some additional stack
     xTaskCreatePinnedToCore(
         aviTaskRoutine,
         "AVI_Task",
-        2048,
+        LAPSE_REPEAT_THRESHOLD > 0 ? 4096 : 2048,
         NULL,
         3,
         &aviTask,
@@ -279,6 +783,30 @@ void lapseHandlerSetup() {
 #endif
     );
 
+    segmentLock = xSemaphoreCreateMutex();
+    frameLock = xSemaphoreCreateMutex();
+
+    // Frames are only captured on request, so they never wait for long
+    lapseSubscriber = frameBrokerSubscribe(2, FRAME_DROP_NEWEST, false);
+
+    xTaskCreatePinnedToCore(
+        segmentTaskRoutine,
+        "SegmentTask",
+        4096,
+        NULL,
+        2,
+        &segmentTask,
+#if AVI_TASK_CORE0
+        0
+#elif AVI_TASK_CORE1
+        1
+#else
+        -1
+#endif
+    );
+
     vTaskSuspend(cameraTask);
     vTaskSuspend(aviTask);
+
+    recoverLapse();
 }
\ No newline at end of file
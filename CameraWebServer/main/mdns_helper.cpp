@@ -29,8 +29,11 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
 #include "freertos/task.h"
+#include "json_writer.hpp"
+#include "makros.h"
 #include "mdns.h"
 #include "wifi_helper.h"
+#include <stdio.h>
 #include <string.h>
 
 #if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
@@ -49,6 +52,9 @@ static char iname[64];
 static char hname[64];
 static char framesize[4];
 static char pixformat[4];
+static char rtsp_port[6];
+static char mcast[2] = "0";
+static char mcast_port[6];
 static const char *model = NULL;
 
 static void mdns_query_for_cams() {
@@ -80,11 +86,18 @@ static void mdns_task(void *arg) {
 *  Public Functions
 */
 
-const char *app_mdns_query(size_t *out_len) {
-    //build JSON
-    static char json_response[2048];
-    char *p = json_response;
-    *p++ = '[';
+// The id of a camera is its address and port
+static void write_cam_address(JsonWriter &json, const char *ip, uint16_t port) {
+    char id[24];
+
+    json.addString("ip", ip);
+    snprintf(id, sizeof(id), "%s:%u", ip, port);
+    json.addString("id", id);
+}
+
+void app_mdns_query(JsonWriter &json) {
+    char buf[80];
+    json.beginArray();
 
     //add own data first
     tcpip_adapter_ip_info_t ip;
@@ -93,74 +106,62 @@ const char *app_mdns_query(size_t *out_len) {
     } else {
         tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_AP, &ip);
     }
-    *p++ = '{';
-    p += sprintf(p, "\"instance\":\"%s\",", iname);
-    p += sprintf(p, "\"host\":\"%s.local\",", hname);
-    p += sprintf(p, "\"port\":80,");
-    p += sprintf(p, "\"txt\":{");
-    p += sprintf(p, "\"pixformat\":\"%s\",", pixformat);
-    p += sprintf(p, "\"framesize\":\"%s\",", framesize);
-    p += sprintf(p, "\"stream_port\":\"81\",");
-    p += sprintf(p, "\"board\":\"%s\",", CAM_BOARD);
-    p += sprintf(p, "\"model\":\"%s\"", model);
-    *p++ = '}';
-    *p++ = ',';
-    p += sprintf(p, "\"ip\":\"" IPSTR "\",", IP2STR(&(ip.ip)));
-    p += sprintf(p, "\"id\":\"" IPSTR ":80\",", IP2STR(&(ip.ip)));
-    p += sprintf(p, "\"service\":\"%s\",", service_name);
-    p += sprintf(p, "\"proto\":\"%s\"", proto);
-    *p++ = '}';
+    json.beginObject();
+    json.addString("instance", iname);
+    snprintf(buf, sizeof(buf), "%s.local", hname);
+    json.addString("host", buf);
+    json.addNumber("port", 80);
+    json.key("txt");
+    json.beginObject();
+    json.addString("pixformat", pixformat);
+    json.addString("framesize", framesize);
+    json.addString("stream_port", "81");
+    json.addString("rtsp_port", rtsp_port);
+    json.addString("mcast", mcast);
+    json.addString("mcast_group", MULTICAST_GROUP);
+    json.addString("mcast_port", mcast_port);
+    json.addString("board", CAM_BOARD);
+    json.addString("model", model);
+    json.endObject();
+    snprintf(buf, sizeof(buf), IPSTR, IP2STR(&ip.ip));
+    write_cam_address(json, buf, 80);
+    json.addString("service", service_name);
+    json.addString("proto", proto);
+    json.endObject();
 
     xSemaphoreTake(query_lock, portMAX_DELAY);
-    if (found_cams) {
-        *p++ = ',';
-    }
-    mdns_result_t *r = found_cams;
-    mdns_ip_addr_t *a = NULL;
-    int t;
-    while (r) {
-        *p++ = '{';
+    for (mdns_result_t *r = found_cams; r; r = r->next) {
+        json.beginObject();
         if (r->instance_name) {
-            p += sprintf(p, "\"instance\":\"%s\",", r->instance_name);
+            json.addString("instance", r->instance_name);
         }
         if (r->hostname) {
-            p += sprintf(p, "\"host\":\"%s.local\",", r->hostname);
-            p += sprintf(p, "\"port\":%u,", r->port);
+            snprintf(buf, sizeof(buf), "%s.local", r->hostname);
+            json.addString("host", buf);
+            json.addNumber("port", r->port);
         }
         if (r->txt_count) {
-            p += sprintf(p, "\"txt\":{");
-            for (t = 0; t < r->txt_count; t++) {
-                if (t > 0) {
-                    *p++ = ',';
-                }
-                p += sprintf(p, "\"%s\":\"%s\"", r->txt[t].key, r->txt[t].value ? r->txt[t].value : "NULL");
+            json.key("txt");
+            json.beginObject();
+            for (size_t t = 0; t < r->txt_count; t++) {
+                json.addString(r->txt[t].key, r->txt[t].value ? r->txt[t].value : "NULL");
             }
-            *p++ = '}';
-            *p++ = ',';
+            json.endObject();
         }
-        a = r->addr;
-        while (a) {
+        for (mdns_ip_addr_t *a = r->addr; a; a = a->next) {
             if (a->addr.type != IPADDR_TYPE_V6) {
-                p += sprintf(p, "\"ip\":\"" IPSTR "\",", IP2STR(&(a->addr.u_addr.ip4)));
-                p += sprintf(p, "\"id\":\"" IPSTR ":%u\",", IP2STR(&(a->addr.u_addr.ip4)), r->port);
+                snprintf(buf, sizeof(buf), IPSTR, IP2STR(&a->addr.u_addr.ip4));
+                write_cam_address(json, buf, r->port);
                 break;
             }
-            a = a->next;
-        }
-        p += sprintf(p, "\"service\":\"%s\",", service_name);
-        p += sprintf(p, "\"proto\":\"%s\"", proto);
-        *p++ = '}';
-        r = r->next;
-        if (r) {
-            *p++ = ',';
         }
+        json.addString("service", service_name);
+        json.addString("proto", proto);
+        json.endObject();
     }
     xSemaphoreGive(query_lock);
-    *p++ = ']';
-    *out_len = (uint32_t)p - (uint32_t)json_response;
-    *p++ = '\0';
-    ESP_LOGI(TAG, "JSON: %uB", *out_len);
-    return (const char *)json_response;
+
+    json.endArray();
 }
 
 void app_mdns_update_framesize(int size) {
@@ -170,6 +171,13 @@ void app_mdns_update_framesize(int size) {
     }
 }
 
+void app_mdns_update_multicast(int enabled) {
+    snprintf(mcast, 2, "%d", enabled ? 1 : 0);
+    if (mdns_service_txt_item_set(service_name, proto, "mcast", (char *)mcast)) {
+        ESP_LOGE(TAG, "mdns_service_txt_item_set() mcast Failed");
+    }
+}
+
 int initMDNS(const char *devName) {
     uint8_t mac[6];
 
@@ -211,6 +219,8 @@ int initMDNS(const char *devName) {
 
     snprintf(framesize, 4, "%d", s->status.framesize);
     snprintf(pixformat, 4, "%d", s->pixformat);
+    snprintf(rtsp_port, 6, "%d", RTSP_PORT);
+    snprintf(mcast_port, 6, "%d", MULTICAST_PORT);
 
     const char *src = iname;
     char *dst = hname;
@@ -250,10 +260,14 @@ int initMDNS(const char *devName) {
         {(char *)"board", (char *)CAM_BOARD},
         {(char *)"model", (char *)model},
         {(char *)"stream_port", (char *)"81"},
+        {(char *)"rtsp_port", (char *)rtsp_port},
+        {(char *)"mcast", (char *)mcast},
+        {(char *)"mcast_group", (char *)MULTICAST_GROUP},
+        {(char *)"mcast_port", (char *)mcast_port},
         {(char *)"framesize", (char *)framesize},
         {(char *)"pixformat", (char *)pixformat}};
 
-    if (mdns_service_add(NULL, service_name, proto, 80, camera_txt_data, 5)) {
+    if (mdns_service_add(NULL, service_name, proto, 80, camera_txt_data, NUMELEMS(camera_txt_data))) {
         ESP_LOGE(TAG, "mdns_service_add() ESP-CAM Failed");
         return -1;
     }
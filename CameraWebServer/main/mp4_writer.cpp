@@ -0,0 +1,285 @@
+#include "esp_heap_caps.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Local files
+#include "makros.h"
+#include "mp4_writer.hpp"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char *TAG = "mp4_writer";
+#endif
+
+// The header is read at once when resuming, the one of this writer fits into two sectors
+#define MP4_MAX_HEADER_SIZE (2 * MP4_SECTOR_SIZE)
+
+MP4Writer::MP4Writer(size_t bufferSize, size_t fragmentFrames) : bufferSize(bufferSize), fragmentFrames(MINEQ(MAXEQ(fragmentFrames, 1), MP4_MAX_FRAGMENT_FRAMES)) {
+}
+
+MP4Writer::~MP4Writer() {
+    free(buffer);
+}
+
+size_t MP4Writer::fileWrite(const char *data, size_t size) {
+    const int64_t start = esp_timer_get_time();
+    const size_t written = fwrite(data, 1, size, mp4File);
+    ioTimeUs += esp_timer_get_time() - start;
+    bytesWritten += written;
+
+    return written;
+}
+
+bool MP4Writer::allocateBuffer() {
+    if (!buffer) {
+        // Prefer PSRAM, the buffer is only touched by memcpy and fwrite
+        buffer = (char *)heap_caps_malloc(bufferSize, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (!buffer) {
+            buffer = (char *)malloc(bufferSize);
+        }
+        if (!buffer) {
+            ESP_LOGE(TAG, "Could not allocate %u bytes fragment buffer!", bufferSize);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool MP4Writer::begin(FILE *mp4File, const char *indexSpillPath, uint32_t width, uint32_t height, uint32_t rate, uint32_t scale) {
+    if (!allocateBuffer()) {
+        return false;
+    }
+
+    this->mp4File = mp4File;
+
+    sampleCount = 0;
+    dataSize = 0;
+    frameCount = 0;
+    fragmentCount = 0;
+    sequence = 1;
+    ioTimeUs = 0;
+    bytesWritten = 0;
+
+    // Never 0 and next_track_ID in mvhd must not overflow
+    trackId = (esp_random() >> 1) | 1;
+    sampleDuration = scale;
+
+    // The header is assembled in the fragment buffer and written right away, the file must never start with stale data of the card
+    fileOffset = writeMP4Header(buffer, width, height, rate, scale, trackId, MP4_SECTOR_SIZE);
+
+    return fileWrite(buffer, fileOffset) == fileOffset;
+}
+
+// Returns the offset of the child box of the given type inside [start, end) or 0 if there is none
+static size_t findBox(const char *buf, size_t start, size_t end, const char type[4]) {
+    for (size_t offset = start; offset + MP4_BOX_HEADER_SIZE <= end;) {
+        const size_t size = readBigEndian32(buf + offset);
+        if (size < MP4_BOX_HEADER_SIZE || offset + size > end) {
+            return 0;
+        }
+        if (!memcmp(buf + offset + 4, type, 4)) {
+            return offset;
+        }
+        offset += size;
+    }
+
+    return 0;
+}
+
+// Content of the box at boxOffset, which starts behind its header
+static inline size_t boxContent(size_t boxOffset) {
+    return boxOffset + MP4_BOX_HEADER_SIZE;
+}
+
+static inline size_t boxEnd(const char *buf, size_t boxOffset) {
+    return boxOffset + readBigEndian32(buf + boxOffset);
+}
+
+bool MP4Writer::readHeader(size_t fileSize, size_t *headerEnd) {
+    const size_t size = MINEQ(fileSize, (size_t)MP4_MAX_HEADER_SIZE);
+
+    if (fseek(mp4File, 0, SEEK_SET) || fread(buffer, 1, size, mp4File) != size || size < MP4_BOX_HEADER_SIZE || memcmp(buffer + 4, "ftyp", 4)) {
+        return false;
+    }
+
+    const size_t moov = boxEnd(buffer, 0);
+    if (moov + MP4_BOX_HEADER_SIZE > size || memcmp(buffer + moov + 4, "moov", 4) || boxEnd(buffer, moov) > size) {
+        return false;
+    }
+
+    const size_t moovEnd = boxEnd(buffer, moov);
+    const size_t trak = findBox(buffer, boxContent(moov), moovEnd, "trak");
+    const size_t tkhd = trak ? findBox(buffer, boxContent(trak), boxEnd(buffer, trak), "tkhd") : 0;
+    const size_t mvex = findBox(buffer, boxContent(moov), moovEnd, "mvex");
+    const size_t trex = mvex ? findBox(buffer, boxContent(mvex), boxEnd(buffer, mvex), "trex") : 0;
+    if (!tkhd || !trex) {
+        return false;
+    }
+
+    trackId = readBigEndian32(buffer + tkhd + MP4_TKHD_TRACK_ID_OFFSET);
+    sampleDuration = readBigEndian32(buffer + trex + MP4_TREX_DEFAULT_DURATION_OFFSET);
+
+    // Skip the padding of the header
+    *headerEnd = moovEnd;
+    if (moovEnd + MP4_BOX_HEADER_SIZE <= size && !memcmp(buffer + moovEnd + 4, "free", 4) && boxEnd(buffer, moovEnd) <= size) {
+        *headerEnd = boxEnd(buffer, moovEnd);
+    }
+
+    return true;
+}
+
+bool MP4Writer::resume(FILE *mp4File, const char *indexSpillPath, size_t *tornBytes) {
+    if (!allocateBuffer()) {
+        return false;
+    }
+
+    this->mp4File = mp4File;
+
+    if (fseek(mp4File, 0, SEEK_END)) {
+        discard();
+        return false;
+    }
+    const size_t fileSize = ftell(mp4File);
+
+    size_t offset;
+    if (!readHeader(fileSize, &offset)) {
+        ESP_LOGE(TAG, "No fragmented mp4 header found!");
+        discard();
+        return false;
+    }
+
+    sampleCount = 0;
+    dataSize = 0;
+    frameCount = 0;
+    fragmentCount = 0;
+    sequence = 1;
+    ioTimeUs = 0;
+    bytesWritten = 0;
+
+    // Only complete fragments which continue the track are kept
+    char *moof = buffer;
+    while (offset + MP4_MOOF_SIZE(1) + MP4_BOX_HEADER_SIZE <= fileSize) {
+        const size_t moofSize = MP4_MOOF_SIZE(MP4_MAX_FRAGMENT_FRAMES) + MP4_BOX_HEADER_SIZE;
+        const size_t readSize = MINEQ(moofSize, fileSize - offset);
+        if (fseek(mp4File, offset, SEEK_SET) || fread(moof, 1, readSize, mp4File) != readSize) {
+            break;
+        }
+
+        const size_t count = readBigEndian32(moof + MP4_MOOF_SAMPLE_COUNT_OFFSET);
+        if (memcmp(moof + 4, "moof", 4) || !count || count > MP4_MAX_FRAGMENT_FRAMES || MP4_MOOF_SIZE(count) + MP4_BOX_HEADER_SIZE > readSize ||
+            readBigEndian32(moof) != MP4_MOOF_SIZE(count) ||
+            readBigEndian32(moof + MP4_MOOF_SEQUENCE_OFFSET) != sequence || readBigEndian32(moof + MP4_MOOF_TRACK_ID_OFFSET) != trackId ||
+            readBigEndian64(moof + MP4_MOOF_DECODE_TIME_OFFSET) != (uint64_t)frameCount * sampleDuration) {
+            break;
+        }
+
+        size_t samplesSize = 0;
+        for (size_t i = 0; i < count; ++i) {
+            samplesSize += readBigEndian32(moof + MP4_MOOF_FIRST_SAMPLE_SIZE_OFFSET + i * MP4_TRUN_ENTRY_SIZE);
+        }
+
+        const char *mdat = moof + MP4_MOOF_SIZE(count);
+        const size_t fragmentEnd = offset + MP4_MOOF_SIZE(count) + MP4_BOX_HEADER_SIZE + samplesSize;
+        if (memcmp(mdat + 4, "mdat", 4) || readBigEndian32(mdat) != MP4_BOX_HEADER_SIZE + samplesSize || fragmentEnd > fileSize) {
+            break;
+        }
+
+        frameCount += count;
+        ++fragmentCount;
+        ++sequence;
+        offset = fragmentEnd;
+
+        // Take over the padding as well, such that the following fragments stay aligned
+        char padding[MP4_BOX_HEADER_SIZE];
+        if (offset + MP4_BOX_HEADER_SIZE <= fileSize && fseek(mp4File, offset, SEEK_SET) == 0 && fread(padding, 1, MP4_BOX_HEADER_SIZE, mp4File) == MP4_BOX_HEADER_SIZE &&
+            !memcmp(padding + 4, "free", 4) && readBigEndian32(padding) < 2 * MP4_SECTOR_SIZE && offset + readBigEndian32(padding) <= fileSize) {
+            offset += readBigEndian32(padding);
+        }
+    }
+
+    if (fseek(mp4File, offset, SEEK_SET)) {
+        discard();
+        return false;
+    }
+
+    fileOffset = offset;
+    *tornBytes = fileSize - offset;
+
+    ESP_LOGI(TAG, "Resuming behind %u fragments with %u frames", fragmentCount, frameCount);
+
+    return true;
+}
+
+bool MP4Writer::flushFragment() {
+    const size_t headerSize = MP4_MOOF_SIZE(sampleCount) + MP4_BOX_HEADER_SIZE;
+    char *fragment = fragmentData() - headerSize;
+
+    writeMP4FragmentHeader(fragment, sequence, trackId, (uint64_t)(frameCount - sampleCount) * sampleDuration, sampleSizes, sampleCount, dataSize);
+    const size_t size = FREE_BOX_PADDING(fragment, headerSize + dataSize, MP4_SECTOR_SIZE);
+
+    if (fileOffset + size > MP4_MAX_FILE_SIZE) {
+        ESP_LOGE(TAG, "Fragment does not fit into the file anymore!");
+        return false;
+    }
+
+    if (fileWrite(fragment, size) != size) {
+        ESP_LOGE(TAG, "Could not write fragment %u!", sequence);
+        return false;
+    }
+
+    fileOffset += size;
+    ++fragmentCount;
+    ++sequence;
+    sampleCount = 0;
+    dataSize = 0;
+
+    return true;
+}
+
+bool MP4Writer::writeFrame(const char *jpgFrame, size_t size) {
+    if (size > dataCapacity()) {
+        ESP_LOGE(TAG, "Frame of %u bytes exceeds the fragment buffer!", size);
+        return false;
+    }
+
+    if (dataSize + size > dataCapacity() && !flushFragment()) {
+        return false;
+    }
+
+    memcpy(fragmentData() + dataSize, jpgFrame, size);
+    dataSize += size;
+    sampleSizes[sampleCount++] = size;
+    ++frameCount;
+
+    if (sampleCount == fragmentFrames) {
+        return flushFragment();
+    }
+
+    return true;
+}
+
+bool MP4Writer::finish() {
+    const bool res = !sampleCount || flushFragment();
+
+    const int64_t ioTimeUs = MAXEQ(this->ioTimeUs, 1);
+    ESP_LOGI(TAG, "%u frames in %u fragments: %u bytes, %lld us IO time (%llu B/s)",
+             frameCount, fragmentCount, bytesWritten, ioTimeUs, ((uint64_t)bytesWritten * 1000000) / ioTimeUs);
+
+    discard();
+
+    return res;
+}
+
+void MP4Writer::discard() {
+    free(buffer);
+    buffer = NULL;
+    mp4File = NULL;
+    sampleCount = 0;
+    dataSize = 0;
+}
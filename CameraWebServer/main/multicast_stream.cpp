@@ -0,0 +1,245 @@
+#include "esp_camera.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+// Local files
+#include "frame_broker.hpp"
+#include "frame_buffer.hpp"
+#include "mdns_helper.h"
+#include "multicast_stream.hpp"
+#include "rtp_jpeg.hpp"
+
+//FreeRTOS
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+// Include the config
+#include "config.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char *TAG = "multicast_stream";
+#endif
+
+// Largest RTP packet, small enough to pass any link without fragmentation
+#define MULTICAST_PACKET_SIZE 1400
+#define MULTICAST_CAPTURE_TIMEOUT_MS 5000
+// A packet which still finds no lwIP buffer after this many attempts is counted as lost
+#define MULTICAST_SEND_RETRIES 5
+#define MULTICAST_REPORT_INTERVAL_US (5 * 1000000LL)
+// Seconds between 1900 (NTP) and 1970 (unix time)
+#define NTP_UNIX_OFFSET 2208988800ULL
+#define MULTICAST_CNAME "esp32-cam"
+
+static TaskHandle_t multicastTask = NULL;
+static volatile bool streaming = false;
+static MulticastStats stats;
+
+static int sendFd = -1;
+static struct sockaddr_in rtpAddr;
+static struct sockaddr_in rtcpAddr;
+static uint32_t ssrc;
+static uint32_t timestampOffset;
+static uint32_t octetCount;
+static uint8_t packet[MULTICAST_PACKET_SIZE];
+// Copy of the current frame, the shared driver buffer is handed back before the frame is packetized
+static FrameBuffer frameBuffer;
+
+bool isMulticastStreaming() {
+    return streaming;
+}
+
+const MulticastStats &getMulticastStats() {
+    return stats;
+}
+
+bool setMulticastStreaming(bool enabled) {
+    if (sendFd < 0) {
+        return false;
+    }
+    if (streaming == enabled) {
+        return true;
+    }
+
+    streaming = enabled;
+    app_mdns_update_multicast(enabled);
+    ESP_LOGI(TAG, "Multicast stream %s", enabled ? "started" : "stopped");
+
+    xTaskNotifyGive(multicastTask);
+    return true;
+}
+
+static bool sendPacket(const struct sockaddr_in *addr, size_t size) {
+    for (size_t i = 0; i < MULTICAST_SEND_RETRIES; ++i) {
+        if (sendto(sendFd, packet, size, 0, (const struct sockaddr *)addr, sizeof(*addr)) >= 0) {
+            return true;
+        }
+        // lwIP runs out of buffers for datagrams instead of blocking, the WiFi driver needs a moment
+        if (errno != ENOMEM && errno != EAGAIN && errno != EWOULDBLOCK) {
+            break;
+        }
+        vTaskDelay(1);
+    }
+
+    return false;
+}
+
+static void sendReport(int64_t now) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    const uint64_t ntpTime = ((tv.tv_sec + NTP_UNIX_OFFSET) << 32) | (((uint64_t)tv.tv_usec << 32) / 1000000);
+    const uint32_t rtpTime = now * RTP_JPEG_CLOCK_RATE / 1000000 + timestampOffset;
+
+    const size_t size = rtcpWriteSenderReport(packet, ssrc, ntpTime, rtpTime, stats.packets, octetCount, MULTICAST_CNAME);
+    sendPacket(&rtcpAddr, size);
+}
+
+// Packetizes the copied frame, retries on a congested link only hold up this task
+static void sendFrame(const RtpJpegFrame &frame, uint32_t timestamp) {
+    size_t offset = 0;
+
+    while (offset < frame.scanSize) {
+        size_t scanBytes;
+        const size_t payloadSize =
+            rtpJpegPayload(frame, offset, packet + RTP_HEADER_SIZE, sizeof(packet) - RTP_HEADER_SIZE, &scanBytes);
+        offset += scanBytes;
+
+        rtpWriteHeader(packet, RTP_JPEG_PAYLOAD_TYPE, offset == frame.scanSize, stats.sequence++, timestamp, ssrc);
+
+        if (sendPacket(&rtpAddr, RTP_HEADER_SIZE + payloadSize)) {
+            ++stats.packets;
+            octetCount += payloadSize;
+        } else {
+            ++stats.lostPackets;
+        }
+    }
+
+    ++stats.frames;
+}
+
+static void multicastTaskRoutine(void *arg) {
+    FrameSubscriber *subscriber = NULL;
+    const int64_t frameIntervalUs = 1000000 / MULTICAST_FPS;
+    int64_t lastFrameUs = 0;
+    int64_t lastReportUs = 0;
+    bool parseFailed = false;
+
+    for (;;) {
+        if (!streaming) {
+            if (subscriber) {
+                frameBrokerUnsubscribe(subscriber);
+                subscriber = NULL;
+                frameBuffer.release();
+            }
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        if (!subscriber) {
+            // Frames are requested one by one, so the broker does not capture faster than the stream sends
+            subscriber = frameBrokerSubscribe(1, FRAME_DROP_NEWEST, false);
+            if (!subscriber) {
+                ESP_LOGE(TAG, "No frame subscription left!");
+                streaming = false;
+                app_mdns_update_multicast(false);
+                continue;
+            }
+        }
+
+        const int64_t waitUs = lastFrameUs + frameIntervalUs - esp_timer_get_time();
+        if (waitUs > 0) {
+            // Stopping the stream wakes the task up early
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(waitUs / 1000) + 1);
+            continue;
+        }
+
+        frameBrokerRequest(subscriber);
+        SharedFrame *shared = frameBrokerReceive(subscriber, pdMS_TO_TICKS(MULTICAST_CAPTURE_TIMEOUT_MS));
+        if (!shared) {
+            ESP_LOGW(TAG, "No frame received!");
+            frameBrokerCancel(subscriber);
+            continue;
+        }
+
+        const int64_t now = esp_timer_get_time();
+        lastFrameUs = now;
+
+        // The other subscribers share the driver buffer, so it is released before any packet is sent
+        const bool copied = frameBuffer.copy(shared->fb);
+        frameBrokerRelease(shared);
+        if (!copied) {
+            ESP_LOGE(TAG, "Could not copy the frame");
+            continue;
+        }
+
+        RtpJpegFrame frame;
+        if (rtpJpegParse(frameBuffer.jpg(), frameBuffer.length(), &frame)) {
+            parseFailed = false;
+            sendFrame(frame, now * RTP_JPEG_CLOCK_RATE / 1000000 + timestampOffset);
+        } else if (!parseFailed) {
+            // Only reported once, the camera keeps sending the same kind of frames
+            ESP_LOGW(TAG, "Frame can not be sent as RTP/JPEG!");
+            parseFailed = true;
+        }
+
+        if (!lastReportUs || now - lastReportUs >= MULTICAST_REPORT_INTERVAL_US) {
+            sendReport(now);
+            lastReportUs = now;
+        }
+    }
+}
+
+void startMulticastStream(bool enabled) {
+    memset(&rtpAddr, 0, sizeof(rtpAddr));
+    rtpAddr.sin_family = AF_INET;
+    rtpAddr.sin_port = htons(MULTICAST_PORT);
+
+    if (!inet_aton(MULTICAST_GROUP, &rtpAddr.sin_addr) || (ntohl(rtpAddr.sin_addr.s_addr) >> 28) != 0xE) {
+        ESP_LOGE(TAG, "%s is no multicast group!", MULTICAST_GROUP);
+        return;
+    }
+    rtcpAddr = rtpAddr;
+    rtcpAddr.sin_port = htons(MULTICAST_PORT + 1);
+
+    sendFd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sendFd < 0) {
+        ESP_LOGE(TAG, "Could not create the multicast socket!");
+        return;
+    }
+
+    const uint8_t ttl = MULTICAST_TTL;
+    setsockopt(sendFd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+    ssrc = esp_random();
+    timestampOffset = esp_random();
+    memset(&stats, 0, sizeof(stats));
+    stats.sequence = esp_random();
+
+    ESP_LOGI(TAG, "Multicast stream to %s:%u", MULTICAST_GROUP, MULTICAST_PORT);
+
+    xTaskCreatePinnedToCore(
+        multicastTaskRoutine,
+        "MulticastStream",
+        3072,
+        NULL,
+        5,
+        &multicastTask,
+#if HTTP_STREAM_TASK_CORE0
+        0
+#elif HTTP_STREAM_TASK_CORE1
+        1
+#else
+        -1
+#endif
+    );
+
+    setMulticastStreaming(enabled);
+}
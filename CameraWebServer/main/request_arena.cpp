@@ -0,0 +1,133 @@
+#include "esp_heap_caps.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+// Include the config
+#include "config.h"
+
+// Local files
+#include "makros.h"
+#include "request_arena.hpp"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char *TAG = "request_arena";
+#endif
+
+// Every allocation starts aligned for any type
+#define REQUEST_ARENA_ALIGNMENT 8
+// Handlers which can be registered with the arena, the control server has fewer uri handlers
+#define REQUEST_ARENA_MAX_HANDLERS 16
+
+// PSRAM allocation of the current request, they are chained so the reset can free them
+typedef struct ArenaFallback {
+    struct ArenaFallback *next;
+} ArenaFallback;
+
+typedef struct {
+    esp_err_t (*handler)(httpd_req_t *req);
+    void *userCtx;
+} ArenaHandler;
+
+static uint8_t arena[REQUEST_ARENA_SIZE] __attribute__((aligned(REQUEST_ARENA_ALIGNMENT)));
+static size_t used = 0;
+static size_t requestBytes = 0;
+static ArenaFallback *fallbacks = NULL;
+static RequestArenaStats stats;
+
+static ArenaHandler handlers[REQUEST_ARENA_MAX_HANDLERS];
+static size_t handlerCount = 0;
+
+static inline size_t alignSize(size_t size) {
+    return (size + REQUEST_ARENA_ALIGNMENT - 1) & ~(size_t)(REQUEST_ARENA_ALIGNMENT - 1);
+}
+
+// Counts the bytes handed out to the current request
+static void *handOut(void *ptr, size_t size) {
+    requestBytes += size;
+    stats.highWaterBytes = MAXEQ(stats.highWaterBytes, requestBytes);
+    return ptr;
+}
+
+void *requestArenaAlloc(size_t size) {
+    // The header keeps the allocation aligned as well
+    const size_t headerSize = alignSize(sizeof(ArenaFallback));
+
+    // Neither the alignment nor the fallback header may wrap the size around
+    if (size > SIZE_MAX - REQUEST_ARENA_ALIGNMENT - headerSize) {
+        ++stats.failures;
+        ESP_LOGE(TAG, "Could not allocate %u bytes!", size);
+        return NULL;
+    }
+    size = alignSize(MAXEQ(size, 1));
+
+    if (size <= sizeof(arena) - used) {
+        void *ptr = arena + used;
+        used += size;
+        return handOut(ptr, size);
+    }
+
+    ArenaFallback *fallback = (ArenaFallback *)heap_caps_malloc(headerSize + size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!fallback) {
+        ++stats.failures;
+        ESP_LOGE(TAG, "Could not allocate %u bytes, %u of %u arena bytes are in use!", size, used, sizeof(arena));
+        return NULL;
+    }
+
+    ++stats.fallbacks;
+    fallback->next = fallbacks;
+    fallbacks = fallback;
+
+    return handOut((uint8_t *)fallback + headerSize, size);
+}
+
+void requestArenaReset() {
+    while (fallbacks) {
+        ArenaFallback *next = fallbacks->next;
+        free(fallbacks);
+        fallbacks = next;
+    }
+
+    used = 0;
+    requestBytes = 0;
+}
+
+const RequestArenaStats &getRequestArenaStats() {
+    return stats;
+}
+
+static esp_err_t runArenaHandler(httpd_req_t *req) {
+    const ArenaHandler *handler = (const ArenaHandler *)req->user_ctx;
+    // The handler sees the context it was registered with
+    req->user_ctx = handler->userCtx;
+
+    const esp_err_t res = handler->handler(req);
+    requestArenaReset();
+
+    return res;
+}
+
+esp_err_t registerArenaHandler(httpd_handle_t server, const httpd_uri_t *uri) {
+    if (handlerCount == REQUEST_ARENA_MAX_HANDLERS) {
+        ESP_LOGE(TAG, "Too many handlers, %s is not registered!", uri->uri);
+        return ESP_ERR_NO_MEM;
+    }
+
+    ArenaHandler *handler = &handlers[handlerCount];
+    handler->handler = uri->handler;
+    handler->userCtx = uri->user_ctx;
+
+    httpd_uri_t wrapped = *uri;
+    wrapped.handler = runArenaHandler;
+    wrapped.user_ctx = handler;
+
+    const esp_err_t res = httpd_register_uri_handler(server, &wrapped);
+    if (res == ESP_OK) {
+        ++handlerCount;
+    }
+
+    return res;
+}
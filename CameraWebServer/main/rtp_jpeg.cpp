@@ -0,0 +1,232 @@
+#include <string.h>
+
+// Local files
+#include "makros.h"
+#include "rtp_jpeg.hpp"
+
+#define JPEG_SOI 0xD8
+#define JPEG_EOI 0xD9
+#define JPEG_SOF0 0xC0
+#define JPEG_DQT 0xDB
+#define JPEG_DRI 0xDD
+#define JPEG_SOS 0xDA
+
+// Flags and count of the restart marker header, the scan is always sent as a whole
+#define RTP_JPEG_RESTART_COUNT 0xFFFF
+// Tables are sent with every frame, as the quality can change at any time
+#define RTP_JPEG_DYNAMIC_Q 255
+
+#define RTCP_SENDER_REPORT 200
+#define RTCP_SOURCE_DESCRIPTION 202
+#define RTCP_SDES_END 0
+#define RTCP_SDES_CNAME 1
+
+static inline uint16_t readBE16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static inline void writeBE16(uint8_t *p, uint16_t value) {
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+static inline void writeBE32(uint8_t *p, uint32_t value) {
+    writeBE16(p, value >> 16);
+    writeBE16(p + 2, value);
+}
+
+// Y has to use table 0 and Cb and Cr table 1, both chroma components are not subsampled any further
+static bool parseFrameHeader(const uint8_t *segment, size_t size, RtpJpegFrame *frame) {
+    if (size < 6 || segment[0] != 8 || segment[5] != 3 || size < 6 + 3 * 3) {
+        return false;
+    }
+
+    frame->height = readBE16(segment + 1);
+    frame->width = readBE16(segment + 3);
+
+    const uint8_t *components = segment + 6;
+    if (components[2] != 0 || components[4] != 0x11 || components[5] != 1 || components[7] != 0x11 || components[8] != 1) {
+        return false;
+    }
+
+    switch (components[1]) {
+        case 0x21:
+            frame->type = 0;
+            return true;
+        case 0x22:
+            frame->type = 1;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool parseQuantizationTables(const uint8_t *segment, size_t size, RtpJpegFrame *frame) {
+    while (size >= 1 + 64) {
+        const uint8_t precision = segment[0] >> 4;
+        const uint8_t id = segment[0] & 0x0F;
+        if (precision != 0 || id > 1) {
+            return false;
+        }
+
+        frame->qtables[id] = segment + 1;
+        segment += 1 + 64;
+        size -= 1 + 64;
+    }
+
+    return size == 0;
+}
+
+bool rtpJpegParse(const uint8_t *jpg, size_t len, RtpJpegFrame *frame) {
+    memset(frame, 0, sizeof(*frame));
+
+    if (len < 4 || jpg[0] != 0xFF || jpg[1] != JPEG_SOI) {
+        return false;
+    }
+
+    bool hasFrameHeader = false;
+    size_t pos = 2;
+
+    while (pos + 4 <= len) {
+        if (jpg[pos] != 0xFF) {
+            return false;
+        }
+
+        const uint8_t marker = jpg[pos + 1];
+        // Fill bytes in front of a marker
+        if (marker == 0xFF) {
+            ++pos;
+            continue;
+        }
+
+        const size_t segmentSize = readBE16(jpg + pos + 2);
+        const uint8_t *segment = jpg + pos + 4;
+        if (segmentSize < 2 || pos + 2 + segmentSize > len) {
+            return false;
+        }
+        pos += 2 + segmentSize;
+
+        switch (marker) {
+            case JPEG_SOF0:
+                if (!parseFrameHeader(segment, segmentSize - 2, frame)) {
+                    return false;
+                }
+                hasFrameHeader = true;
+                break;
+            case JPEG_DQT:
+                if (!parseQuantizationTables(segment, segmentSize - 2, frame)) {
+                    return false;
+                }
+                break;
+            case JPEG_DRI:
+                if (segmentSize != 4) {
+                    return false;
+                }
+                frame->restartInterval = readBE16(segment);
+                break;
+            case JPEG_SOS: {
+                if (!hasFrameHeader || !frame->qtables[0] || !frame->qtables[1] || frame->width > RTP_JPEG_MAX_DIMENSION ||
+                    frame->height > RTP_JPEG_MAX_DIMENSION) {
+                    return false;
+                }
+
+                // The sensors pad their buffers behind EOI
+                size_t end = len;
+                while (end > pos + 1 && !(jpg[end - 2] == 0xFF && jpg[end - 1] == JPEG_EOI)) {
+                    --end;
+                }
+                end = end > pos + 1 ? end - 2 : len;
+
+                if (frame->restartInterval) {
+                    frame->type += 64;
+                }
+                frame->scan = jpg + pos;
+                frame->scanSize = end - pos;
+                return frame->scanSize > 0;
+            }
+            default:
+                // Any other frame header (progressive, arithmetic coding) can not be described
+                if (marker >= 0xC1 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+                    return false;
+                }
+                break;
+        }
+    }
+
+    return false;
+}
+
+size_t rtpJpegPayload(const RtpJpegFrame &frame, size_t offset, uint8_t *buf, size_t size, size_t *scanBytes) {
+    uint8_t *p = buf;
+
+    // Type specific field, fragment offset, type, q, width and height
+    writeBE32(p, offset & 0xFFFFFF);
+    p[4] = frame.type;
+    p[5] = RTP_JPEG_DYNAMIC_Q;
+    p[6] = frame.width / 8;
+    p[7] = frame.height / 8;
+    p += RTP_JPEG_HEADER_SIZE;
+
+    if (frame.restartInterval) {
+        writeBE16(p, frame.restartInterval);
+        writeBE16(p + 2, RTP_JPEG_RESTART_COUNT);
+        p += RTP_JPEG_RESTART_HEADER_SIZE;
+    }
+
+    if (offset == 0) {
+        // MBZ, precision (all tables 8 bit) and length
+        p[0] = 0;
+        p[1] = 0;
+        writeBE16(p + 2, 2 * 64);
+        memcpy(p + 4, frame.qtables[0], 64);
+        memcpy(p + 4 + 64, frame.qtables[1], 64);
+        p += RTP_JPEG_QTABLE_HEADER_SIZE;
+    }
+
+    const size_t headerSize = p - buf;
+    const size_t left = frame.scanSize - offset;
+    *scanBytes = size > headerSize ? MINEQ(left, size - headerSize) : 0;
+
+    memcpy(p, frame.scan + offset, *scanBytes);
+
+    return headerSize + *scanBytes;
+}
+
+void rtpWriteHeader(uint8_t *buf, uint8_t payloadType, bool marker, uint16_t sequence, uint32_t timestamp, uint32_t ssrc) {
+    // Version 2, no padding, extension or contributing sources
+    buf[0] = 0x80;
+    buf[1] = (marker ? 0x80 : 0) | (payloadType & 0x7F);
+    writeBE16(buf + 2, sequence);
+    writeBE32(buf + 4, timestamp);
+    writeBE32(buf + 8, ssrc);
+}
+
+size_t rtcpWriteSenderReport(uint8_t *buf, uint32_t ssrc, uint64_t ntpTime, uint32_t rtpTime, uint32_t packets, uint32_t octets, const char *cname) {
+    // Version 2 without reception report blocks, the length is given in 32 bit words minus one
+    buf[0] = 0x80;
+    buf[1] = RTCP_SENDER_REPORT;
+    writeBE16(buf + 2, 6);
+    writeBE32(buf + 4, ssrc);
+    writeBE32(buf + 8, ntpTime >> 32);
+    writeBE32(buf + 12, ntpTime);
+    writeBE32(buf + 16, rtpTime);
+    writeBE32(buf + 20, packets);
+    writeBE32(buf + 24, octets);
+
+    // Source description with a single chunk, the item list ends with a zero byte and is padded to 32 bit
+    uint8_t *sdes = buf + 28;
+    const size_t cnameLen = MINEQ(strlen(cname), 255);
+    const size_t sdesSize = (8 + 2 + cnameLen + 1 + 3) & ~3;
+
+    memset(sdes, 0, sdesSize);
+    sdes[0] = 0x81;
+    sdes[1] = RTCP_SOURCE_DESCRIPTION;
+    writeBE16(sdes + 2, sdesSize / 4 - 1);
+    writeBE32(sdes + 4, ssrc);
+    sdes[8] = RTCP_SDES_CNAME;
+    sdes[9] = cnameLen;
+    memcpy(sdes + 10, cname, cnameLen);
+    sdes[10 + cnameLen] = RTCP_SDES_END;
+
+    return 28 + sdesSize;
+}
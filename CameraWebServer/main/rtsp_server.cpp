@@ -0,0 +1,886 @@
+#include "esp_camera.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+
+// Local files
+#include "frame_broker.hpp"
+#include "frame_buffer.hpp"
+#include "makros.h"
+#include "rtp_jpeg.hpp"
+#include "rtsp_server.hpp"
+
+//FreeRTOS
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+// Include the config
+#include "config.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char *TAG = "rtsp_server";
+#endif
+
+#define RTSP_REQUEST_SIZE 512
+#define RTSP_RESPONSE_SIZE 768
+#define RTSP_URL_SIZE 128
+// Largest RTP packet, small enough to pass any link without fragmentation
+#define RTSP_PACKET_SIZE 1400
+// Interleaved packets start with '$', the channel and their length
+#define RTSP_INTERLEAVED_HEADER_SIZE 4
+// Longest time select waits, new frames are only picked up in between
+#define RTSP_POLL_INTERVAL_MS 10
+// Sessions without any request (or RTCP report for UDP) are closed after this time
+#define RTSP_SESSION_TIMEOUT_S 60
+// A client which did not accept a single byte for this long is disconnected
+#define RTSP_SEND_TIMEOUT_US (10 * 1000000LL)
+// Sender reports let the client map the RTP timestamps to wall clock time
+#define RTSP_REPORT_INTERVAL_US (5 * 1000000LL)
+// Seconds between 1900 (NTP) and 1970 (unix time)
+#define NTP_UNIX_OFFSET 2208988800ULL
+#define RTSP_CNAME "esp32-cam"
+
+#define RTSP_OK "200 OK"
+#define RTSP_BAD_REQUEST "400 Bad Request"
+#define RTSP_URI_TOO_LONG "414 Request-URI Too Long"
+#define RTSP_SESSION_NOT_FOUND "454 Session Not Found"
+#define RTSP_INVALID_STATE "455 Method Not Valid in This State"
+#define RTSP_UNSUPPORTED_TRANSPORT "461 Unsupported Transport"
+#define RTSP_SERVER_ERROR "500 Internal Server Error"
+#define RTSP_NOT_IMPLEMENTED "501 Not Implemented"
+
+#define RTSP_PUBLIC "Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, GET_PARAMETER, SET_PARAMETER\r\n"
+#define RTSP_SDP                              \
+    "v=0\r\n"                                 \
+    "o=- %u 1 IN IP4 %s\r\n"                  \
+    "s=ESP32 Camera\r\n"                      \
+    "c=IN IP4 0.0.0.0\r\n"                    \
+    "t=0 0\r\n"                               \
+    "a=control:*\r\n"                         \
+    "a=range:npt=0-\r\n"                      \
+    "m=video 0 RTP/AVP %u\r\n"                \
+    "a=rtpmap:%u JPEG/%u\r\n"                 \
+    "a=control:track1\r\n"
+
+// Copy of a captured frame together with the parts RFC 2435 sends
+typedef struct {
+    // Kept for the following frames, it is only given back once no session plays
+    FrameBuffer buffer;
+    RtpJpegFrame info;
+    // Capture time in units of the 90 kHz RTP clock
+    uint32_t timestamp;
+    size_t refs;
+} RtspFrame;
+
+typedef enum {
+    RTSP_FREE,
+    // Connected, but no transport set up
+    RTSP_INIT,
+    RTSP_READY,
+    RTSP_PLAYING,
+} RtspState;
+
+typedef struct {
+    int fd;
+    RtspState state;
+
+    char request[RTSP_REQUEST_SIZE];
+    size_t requestLen;
+    // Rest of a body or interleaved packet which did not fit into the request buffer
+    size_t discardLen;
+    char response[RTSP_RESPONSE_SIZE];
+    size_t responseLen;
+    size_t responseSent;
+
+    uint32_t sessionId;
+    // RTP goes either interleaved over the RTSP connection or to the client ports via UDP
+    bool interleaved;
+    uint8_t channel;
+    int rtpFd;
+    int rtcpFd;
+    struct sockaddr_in rtpAddr;
+    struct sockaddr_in rtcpAddr;
+
+    uint32_t ssrc;
+    uint16_t sequence;
+    uint32_t timestampOffset;
+    uint32_t packetCount;
+    uint32_t octetCount;
+
+    RtspFrame *frame;
+    size_t scanOffset;
+    // Next RTP or RTCP packet behind room for the interleaved header
+    uint8_t packet[RTSP_INTERLEAVED_HEADER_SIZE + RTSP_PACKET_SIZE];
+    size_t packetLen;
+    size_t packetSent;
+    bool packetIsReport;
+
+    int64_t lastActivityUs;
+    int64_t lastProgressUs;
+    int64_t lastReportUs;
+    size_t sentFrames;
+    size_t skippedFrames;
+} RtspClient;
+
+static RtspClient clients[RTSP_MAX_CLIENTS];
+// Every client holds at most one frame, the server itself the one which is handed out
+static RtspFrame frames[RTSP_MAX_CLIENTS + 1];
+static volatile size_t playingClients = 0;
+static bool parseFailed = false;
+
+static FrameSubscriber *subscriber = NULL;
+static int listenFd = -1;
+
+size_t rtspClientCount() {
+    return playingClients;
+}
+
+static inline void releaseFrame(RtspFrame *frame) {
+    --frame->refs;
+}
+
+// Copies (or converts) the broker frame, which is released right away
+static RtspFrame *copyFrame(SharedFrame *shared) {
+    RtspFrame *frame = NULL;
+    for (size_t i = 0; i < NUMELEMS(frames); ++i) {
+        if (!frames[i].refs) {
+            frame = &frames[i];
+            break;
+        }
+    }
+
+    const bool copied = frame && frame->buffer.copy(shared->fb);
+
+    frameBrokerRelease(shared);
+
+    if (!copied) {
+        return NULL;
+    }
+
+    if (!rtpJpegParse(frame->buffer.jpg(), frame->buffer.length(), &frame->info)) {
+        // Only reported once, the camera keeps sending the same kind of frames
+        if (!parseFailed) {
+            ESP_LOGW(TAG, "Frame can not be sent as RTP/JPEG!");
+            parseFailed = true;
+        }
+        return NULL;
+    }
+    parseFailed = false;
+
+    frame->timestamp = esp_timer_get_time() * RTP_JPEG_CLOCK_RATE / 1000000;
+    frame->refs = 1;
+    return frame;
+}
+
+static int openUdpSocket(uint16_t port) {
+    const int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0) {
+        return -1;
+    }
+
+    const int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    return fd;
+}
+
+// Stops the session, the connection stays open for further requests
+static void closeSession(RtspClient *client) {
+    if (client->state == RTSP_PLAYING) {
+        --playingClients;
+        ESP_LOGI(TAG, "Session %08X stopped, %u frames sent, %u frames skipped", client->sessionId, client->sentFrames,
+                 client->skippedFrames);
+    }
+
+    if (client->frame) {
+        releaseFrame(client->frame);
+        client->frame = NULL;
+    }
+    if (client->rtpFd >= 0) {
+        close(client->rtpFd);
+        client->rtpFd = -1;
+    }
+    if (client->rtcpFd >= 0) {
+        close(client->rtcpFd);
+        client->rtcpFd = -1;
+    }
+
+    client->state = RTSP_INIT;
+}
+
+static void closeClient(RtspClient *client) {
+    closeSession(client);
+    close(client->fd);
+    client->fd = -1;
+    client->state = RTSP_FREE;
+}
+
+static inline bool hasPendingPacket(const RtspClient *client) {
+    return client->packetSent < client->packetLen || client->frame;
+}
+
+static inline bool hasPendingResponse(const RtspClient *client) {
+    return client->responseSent < client->responseLen;
+}
+
+// Takes the next packet of the current frame, or a sender report once it is due
+static bool preparePacket(RtspClient *client, int64_t now) {
+    if (client->state != RTSP_PLAYING) {
+        return false;
+    }
+
+    uint8_t *rtp = client->packet + RTSP_INTERLEAVED_HEADER_SIZE;
+    uint8_t channel = client->channel;
+    size_t size;
+
+    if (client->packetCount && now - client->lastReportUs >= RTSP_REPORT_INTERVAL_US) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        const uint64_t ntpTime = ((tv.tv_sec + NTP_UNIX_OFFSET) << 32) | (((uint64_t)tv.tv_usec << 32) / 1000000);
+        const uint32_t rtpTime = now * RTP_JPEG_CLOCK_RATE / 1000000 + client->timestampOffset;
+
+        size = rtcpWriteSenderReport(rtp, client->ssrc, ntpTime, rtpTime, client->packetCount, client->octetCount, RTSP_CNAME);
+        client->lastReportUs = now;
+        client->packetIsReport = true;
+        ++channel;
+    } else if (client->frame) {
+        const RtpJpegFrame &info = client->frame->info;
+        size_t scanBytes;
+        const size_t payloadSize =
+            rtpJpegPayload(info, client->scanOffset, rtp + RTP_HEADER_SIZE, RTSP_PACKET_SIZE - RTP_HEADER_SIZE, &scanBytes);
+
+        client->scanOffset += scanBytes;
+        const bool last = client->scanOffset == info.scanSize;
+        rtpWriteHeader(rtp, RTP_JPEG_PAYLOAD_TYPE, last, client->sequence++, client->frame->timestamp + client->timestampOffset,
+                       client->ssrc);
+
+        size = RTP_HEADER_SIZE + payloadSize;
+        ++client->packetCount;
+        client->octetCount += payloadSize;
+        client->packetIsReport = false;
+
+        if (last) {
+            ++client->sentFrames;
+            releaseFrame(client->frame);
+            client->frame = NULL;
+        }
+    } else {
+        return false;
+    }
+
+    client->packet[0] = '$';
+    client->packet[1] = channel;
+    client->packet[2] = size >> 8;
+    client->packet[3] = size;
+    client->packetLen = RTSP_INTERLEAVED_HEADER_SIZE + size;
+    // Datagrams go out without the interleaved header
+    client->packetSent = client->interleaved ? 0 : RTSP_INTERLEAVED_HEADER_SIZE;
+
+    return true;
+}
+
+// Returns 1 if something was sent, 0 if the socket is busy and -1 if the client has to be closed
+static int sendPacket(RtspClient *client) {
+    int res;
+
+    if (client->interleaved) {
+        res = send(client->fd, client->packet + client->packetSent, client->packetLen - client->packetSent, 0);
+    } else {
+        const int fd = client->packetIsReport ? client->rtcpFd : client->rtpFd;
+        const struct sockaddr_in *addr = client->packetIsReport ? &client->rtcpAddr : &client->rtpAddr;
+        res = sendto(fd, client->packet + client->packetSent, client->packetLen - client->packetSent, 0, (const struct sockaddr *)addr,
+                     sizeof(*addr));
+    }
+
+    if (res < 0) {
+        // lwIP runs out of buffers for datagrams instead of blocking
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOMEM) {
+            return 0;
+        }
+        if (client->interleaved) {
+            return -1;
+        }
+        // An unreachable client port does not end the session, its RTCP timeout does
+        res = client->packetLen - client->packetSent;
+    }
+
+    client->packetSent += res;
+    return 1;
+}
+
+static int sendResponse(RtspClient *client) {
+    const int res = send(client->fd, client->response + client->responseSent, client->responseLen - client->responseSent, 0);
+    if (res < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+
+    client->responseSent += res;
+    return 1;
+}
+
+static void handleInput(RtspClient *client);
+
+// Sends as much as the sockets take without blocking, returns false if the client was closed
+static bool sendPending(RtspClient *client) {
+    const int64_t now = esp_timer_get_time();
+
+    for (;;) {
+        int res;
+
+        // A response must not end up inside an interleaved packet
+        if (client->packetSent < client->packetLen) {
+            res = sendPacket(client);
+        } else if (hasPendingResponse(client)) {
+            res = sendResponse(client);
+            if (res > 0 && !hasPendingResponse(client)) {
+                // Requests which arrived while the response was still on its way
+                handleInput(client);
+                if (client->state == RTSP_FREE) {
+                    return false;
+                }
+            }
+        } else if (preparePacket(client, now)) {
+            continue;
+        } else {
+            return true;
+        }
+
+        if (res < 0) {
+            closeClient(client);
+            return false;
+        }
+        if (res == 0) {
+            return true;
+        }
+        client->lastProgressUs = now;
+    }
+}
+
+// Returns the value of the header up to the end of its line
+static bool getHeader(const char *request, const char *name, char *value, size_t size) {
+    const size_t nameLen = strlen(name);
+
+    for (const char *line = strstr(request, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, name, nameLen) || line[nameLen] != ':') {
+            continue;
+        }
+
+        const char *start = line + nameLen + 1;
+        while (*start == ' ') {
+            ++start;
+        }
+        const size_t len = strcspn(start, "\r\n");
+        if (len >= size) {
+            return false;
+        }
+
+        memcpy(value, start, len);
+        value[len] = '\0';
+        return true;
+    }
+
+    return false;
+}
+
+static void respond(RtspClient *client, const char *cseq, const char *status, const char *headers = "", const char *body = "") {
+    char session[40] = "";
+    if (client->state != RTSP_INIT) {
+        snprintf(session, sizeof(session), "Session: %08X;timeout=%u\r\n", client->sessionId, RTSP_SESSION_TIMEOUT_S);
+    }
+
+    const int len = snprintf(client->response, sizeof(client->response), "RTSP/1.0 %s\r\nCSeq: %s\r\n%s%sContent-Length: %u\r\n\r\n%s",
+                             status, cseq, session, headers, strlen(body), body);
+
+    client->responseLen = MINEQ((size_t)len, sizeof(client->response) - 1);
+    client->responseSent = 0;
+}
+
+static void handleDescribe(RtspClient *client, const char *cseq, const char *url) {
+    struct sockaddr_in local;
+    socklen_t localLen = sizeof(local);
+    getsockname(client->fd, (struct sockaddr *)&local, &localLen);
+    const uint32_t ip = ntohl(local.sin_addr.s_addr);
+
+    char address[16];
+    snprintf(address, sizeof(address), "%u.%u.%u.%u", (ip >> 24) & 0xFF, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF);
+
+    char sdp[320];
+    snprintf(sdp, sizeof(sdp), RTSP_SDP, esp_random(), address, RTP_JPEG_PAYLOAD_TYPE, RTP_JPEG_PAYLOAD_TYPE, RTP_JPEG_CLOCK_RATE);
+
+    // The track is set up relative to the content base
+    char headers[RTSP_URL_SIZE + 64];
+    const size_t urlLen = strlen(url);
+    snprintf(headers, sizeof(headers), "Content-Base: %s%s\r\nContent-Type: application/sdp\r\n", url,
+             urlLen && url[urlLen - 1] == '/' ? "" : "/");
+
+    respond(client, cseq, RTSP_OK, headers, sdp);
+}
+
+static void handleSetup(RtspClient *client, const char *cseq, const char *request) {
+    if (client->state == RTSP_PLAYING) {
+        respond(client, cseq, RTSP_INVALID_STATE);
+        return;
+    }
+
+    char transport[128];
+    if (!getHeader(request, "Transport", transport, sizeof(transport))) {
+        respond(client, cseq, RTSP_UNSUPPORTED_TRANSPORT);
+        return;
+    }
+    // Only the first of the offered transports is considered
+    transport[strcspn(transport, ",")] = '\0';
+
+    const char *interleaved = strstr(transport, "interleaved=");
+    const char *clientPort = strstr(transport, "client_port=");
+    const bool tcp = strstr(transport, "RTP/AVP/TCP") != NULL;
+    unsigned int first = 0;
+    unsigned int second = 0;
+
+    if (strstr(transport, "multicast") || (!tcp && !clientPort)) {
+        respond(client, cseq, RTSP_UNSUPPORTED_TRANSPORT);
+        return;
+    }
+
+    // A repeated SETUP replaces the transport
+    closeSession(client);
+
+    char reply[160];
+
+    if (tcp) {
+        if (interleaved) {
+            sscanf(interleaved, "interleaved=%u", &first);
+        }
+        client->interleaved = true;
+        client->channel = first & 0xFE;
+        snprintf(reply, sizeof(reply), "Transport: RTP/AVP/TCP;unicast;interleaved=%u-%u", client->channel, client->channel + 1);
+    } else {
+        if (sscanf(clientPort, "client_port=%u-%u", &first, &second) < 1 || !first || first > 0xFFFF) {
+            respond(client, cseq, RTSP_UNSUPPORTED_TRANSPORT);
+            return;
+        }
+        if (!second) {
+            second = first + 1;
+        }
+
+        // Every client slot owns a fixed pair of ports
+        const uint16_t serverPort = RTSP_RTP_PORT + 2 * (client - clients);
+        client->rtpFd = openUdpSocket(serverPort);
+        client->rtcpFd = openUdpSocket(serverPort + 1);
+        if (client->rtpFd < 0 || client->rtcpFd < 0) {
+            ESP_LOGE(TAG, "Could not open the RTP ports %u-%u!", serverPort, serverPort + 1);
+            closeSession(client);
+            respond(client, cseq, RTSP_SERVER_ERROR);
+            return;
+        }
+
+        socklen_t addrLen = sizeof(client->rtpAddr);
+        getpeername(client->fd, (struct sockaddr *)&client->rtpAddr, &addrLen);
+        client->rtcpAddr = client->rtpAddr;
+        client->rtpAddr.sin_port = htons(first);
+        client->rtcpAddr.sin_port = htons(second);
+
+        client->interleaved = false;
+        client->channel = 0;
+        snprintf(reply, sizeof(reply), "Transport: RTP/AVP;unicast;client_port=%u-%u;server_port=%u-%u", first, second, serverPort,
+                 serverPort + 1);
+    }
+
+    client->sessionId = esp_random();
+    client->ssrc = esp_random();
+    client->sequence = esp_random();
+    client->timestampOffset = esp_random();
+    client->state = RTSP_READY;
+
+    const size_t len = strlen(reply);
+    snprintf(reply + len, sizeof(reply) - len, ";ssrc=%08X\r\n", client->ssrc);
+    respond(client, cseq, RTSP_OK, reply);
+}
+
+static void handlePlay(RtspClient *client, const char *cseq) {
+    if (client->state == RTSP_READY) {
+        client->state = RTSP_PLAYING;
+        client->packetCount = 0;
+        client->octetCount = 0;
+        client->sentFrames = 0;
+        client->skippedFrames = 0;
+        client->lastReportUs = 0;
+        client->lastProgressUs = esp_timer_get_time();
+        ++playingClients;
+
+        ESP_LOGI(TAG, "Session %08X plays via %s", client->sessionId, client->interleaved ? "TCP" : "UDP");
+    }
+
+    respond(client, cseq, RTSP_OK, "Range: npt=0.000-\r\n");
+}
+
+static void handlePause(RtspClient *client, const char *cseq) {
+    if (client->state == RTSP_PLAYING) {
+        // The packet which is on its way is completed, the rest of the frame is dropped
+        if (client->frame) {
+            releaseFrame(client->frame);
+            client->frame = NULL;
+        }
+        client->state = RTSP_READY;
+        --playingClients;
+    }
+
+    respond(client, cseq, RTSP_OK);
+}
+
+static void handleRequest(RtspClient *client, char *request) {
+    char cseq[16];
+    if (!getHeader(request, "CSeq", cseq, sizeof(cseq))) {
+        strcpy(cseq, "0");
+    }
+
+    // Request line: METHOD rtsp://host:port/path RTSP/1.0
+    char method[16];
+    char url[RTSP_URL_SIZE];
+    const size_t methodLen = strcspn(request, " \r\n");
+    const char *urlStart = request + methodLen + (request[methodLen] == ' ');
+    const size_t urlLen = strcspn(urlStart, " \r\n");
+
+    if (methodLen >= sizeof(method)) {
+        respond(client, cseq, RTSP_BAD_REQUEST);
+        return;
+    }
+    if (urlLen >= sizeof(url)) {
+        respond(client, cseq, RTSP_URI_TOO_LONG);
+        return;
+    }
+    memcpy(method, request, methodLen);
+    method[methodLen] = '\0';
+    memcpy(url, urlStart, urlLen);
+    url[urlLen] = '\0';
+
+    if (!strcmp(method, "OPTIONS")) {
+        respond(client, cseq, RTSP_OK, RTSP_PUBLIC);
+        return;
+    }
+    if (!strcmp(method, "DESCRIBE")) {
+        handleDescribe(client, cseq, url);
+        return;
+    }
+    if (!strcmp(method, "SETUP")) {
+        handleSetup(client, cseq, request);
+        return;
+    }
+
+    const bool play = !strcmp(method, "PLAY");
+    const bool pause = !strcmp(method, "PAUSE");
+    const bool teardown = !strcmp(method, "TEARDOWN");
+    const bool parameter = !strcmp(method, "GET_PARAMETER") || !strcmp(method, "SET_PARAMETER");
+
+    if (!play && !pause && !teardown && !parameter) {
+        respond(client, cseq, RTSP_NOT_IMPLEMENTED);
+        return;
+    }
+
+    // GET_PARAMETER is also used as keep alive without a session
+    char session[16];
+    const bool hasSession = getHeader(request, "Session", session, sizeof(session));
+    if ((hasSession || !parameter) && (client->state == RTSP_INIT || !hasSession || strtoul(session, NULL, 16) != client->sessionId)) {
+        respond(client, cseq, RTSP_SESSION_NOT_FOUND);
+        return;
+    }
+
+    if (play) {
+        handlePlay(client, cseq);
+    } else if (pause) {
+        handlePause(client, cseq);
+    } else if (teardown) {
+        respond(client, cseq, RTSP_OK);
+        closeSession(client);
+    } else {
+        respond(client, cseq, RTSP_OK);
+    }
+}
+
+// Handles the complete requests and interleaved packets in the buffer, one request at a time
+static void handleInput(RtspClient *client) {
+    while (client->requestLen && !hasPendingResponse(client)) {
+        char *buf = client->request;
+        size_t consumed;
+
+        if (client->discardLen) {
+            consumed = MINEQ(client->discardLen, client->requestLen);
+        } else if (buf[0] == '$') {
+            // Interleaved RTCP receiver reports, which only prove that the client is alive
+            if (client->requestLen < RTSP_INTERLEAVED_HEADER_SIZE) {
+                return;
+            }
+            consumed = RTSP_INTERLEAVED_HEADER_SIZE + (((uint8_t)buf[2] << 8) | (uint8_t)buf[3]);
+        } else {
+            char *end = strstr(buf, "\r\n\r\n");
+            if (!end) {
+                if (client->requestLen == sizeof(client->request) - 1) {
+                    ESP_LOGW(TAG, "Request too large!");
+                    respond(client, "0", RTSP_BAD_REQUEST);
+                    client->requestLen = 0;
+                }
+                return;
+            }
+
+            // SET_PARAMETER and similar requests can have a body, which is skipped
+            char length[8];
+            const size_t headerLen = end + 4 - buf;
+            end[2] = '\0';
+            const size_t bodyLen = getHeader(buf, "Content-Length", length, sizeof(length)) ? atoi(length) : 0;
+            consumed = headerLen + bodyLen;
+
+            handleRequest(client, buf);
+        }
+
+        client->discardLen += consumed;
+        consumed = MINEQ(client->discardLen, client->requestLen);
+        client->discardLen -= consumed;
+        client->requestLen -= consumed;
+        memmove(client->request, client->request + consumed, client->requestLen);
+        client->request[client->requestLen] = '\0';
+    }
+
+    if (hasPendingResponse(client)) {
+        sendPending(client);
+    }
+}
+
+static void readClient(RtspClient *client) {
+    const int res = recv(client->fd, client->request + client->requestLen, sizeof(client->request) - 1 - client->requestLen, 0);
+    if (res == 0 || (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        closeClient(client);
+        return;
+    }
+
+    if (res > 0) {
+        client->requestLen += res;
+        client->request[client->requestLen] = '\0';
+        client->lastActivityUs = esp_timer_get_time();
+        handleInput(client);
+    }
+}
+
+// UDP clients report back via RTCP, which keeps their session alive
+static void readReports(RtspClient *client) {
+    char discard[64];
+    while (recv(client->rtcpFd, discard, sizeof(discard), 0) > 0) {
+        client->lastActivityUs = esp_timer_get_time();
+    }
+}
+
+static void acceptClient() {
+    const int fd = accept(listenFd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    const int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    for (size_t i = 0; i < RTSP_MAX_CLIENTS; ++i) {
+        RtspClient *client = &clients[i];
+        if (client->state == RTSP_FREE) {
+            client->fd = fd;
+            client->state = RTSP_INIT;
+            client->requestLen = client->discardLen = 0;
+            client->responseLen = client->responseSent = 0;
+            client->packetLen = client->packetSent = 0;
+            client->rtpFd = client->rtcpFd = -1;
+            client->frame = NULL;
+            client->lastActivityUs = client->lastProgressUs = esp_timer_get_time();
+            return;
+        }
+    }
+
+    ESP_LOGW(TAG, "Too many RTSP clients!");
+    close(fd);
+}
+
+// Hands the frame to every playing client which is done with its last one
+static void distributeFrame(SharedFrame *shared) {
+    RtspFrame *frame = copyFrame(shared);
+    if (!frame) {
+        return;
+    }
+
+    for (size_t i = 0; i < RTSP_MAX_CLIENTS; ++i) {
+        RtspClient *client = &clients[i];
+        if (client->state != RTSP_PLAYING) {
+            continue;
+        }
+
+        if (client->frame) {
+            ++client->skippedFrames;
+            continue;
+        }
+
+        ++frame->refs;
+        client->frame = frame;
+        client->scanOffset = 0;
+
+        sendPending(client);
+    }
+
+    releaseFrame(frame);
+}
+
+static void rtspTaskRoutine(void *arg) {
+    for (;;) {
+        fd_set readSet;
+        fd_set writeSet;
+        FD_ZERO(&readSet);
+        FD_ZERO(&writeSet);
+        FD_SET(listenFd, &readSet);
+        int maxFd = listenFd;
+
+        for (size_t i = 0; i < RTSP_MAX_CLIENTS; ++i) {
+            const RtspClient *client = &clients[i];
+            if (client->state == RTSP_FREE) {
+                continue;
+            }
+
+            FD_SET(client->fd, &readSet);
+            // Datagrams which did not fit into the lwIP buffers are retried on the next poll
+            if (hasPendingResponse(client) || (client->interleaved && hasPendingPacket(client))) {
+                FD_SET(client->fd, &writeSet);
+            }
+            maxFd = MAXEQ(maxFd, client->fd);
+
+            if (client->rtcpFd >= 0) {
+                FD_SET(client->rtcpFd, &readSet);
+                maxFd = MAXEQ(maxFd, client->rtcpFd);
+            }
+        }
+
+        struct timeval timeout = {0, RTSP_POLL_INTERVAL_MS * 1000};
+        if (select(maxFd + 1, &readSet, &writeSet, NULL, &timeout) < 0) {
+            ESP_LOGE(TAG, "select failed: %d", errno);
+            vTaskDelay(pdMS_TO_TICKS(RTSP_POLL_INTERVAL_MS));
+            continue;
+        }
+
+        const int64_t now = esp_timer_get_time();
+
+        for (size_t i = 0; i < RTSP_MAX_CLIENTS; ++i) {
+            RtspClient *client = &clients[i];
+            if (client->state == RTSP_FREE) {
+                continue;
+            }
+
+            if (client->rtcpFd >= 0 && FD_ISSET(client->rtcpFd, &readSet)) {
+                readReports(client);
+            }
+            if (FD_ISSET(client->fd, &readSet)) {
+                readClient(client);
+            }
+            if (client->state != RTSP_FREE && (FD_ISSET(client->fd, &writeSet) || (!client->interleaved && hasPendingPacket(client)))) {
+                sendPending(client);
+            }
+            if (client->state == RTSP_FREE) {
+                continue;
+            }
+
+            if (now - client->lastActivityUs > RTSP_SESSION_TIMEOUT_S * 1000000LL ||
+                ((hasPendingResponse(client) || (client->interleaved && hasPendingPacket(client))) &&
+                 now - client->lastProgressUs > RTSP_SEND_TIMEOUT_US)) {
+                ESP_LOGW(TAG, "Client %d timed out", client->fd);
+                closeClient(client);
+            }
+        }
+
+        if (FD_ISSET(listenFd, &readSet)) {
+            acceptClient();
+        }
+
+        // The broker only captures for RTSP while a session plays
+        if (playingClients && !subscriber) {
+            subscriber = frameBrokerSubscribe(1, FRAME_DROP_OLDEST, true);
+        } else if (!playingClients && subscriber) {
+            frameBrokerUnsubscribe(subscriber);
+            subscriber = NULL;
+
+            // Frames still held by sessions in teardown keep their buffer until the next time
+            for (size_t i = 0; i < NUMELEMS(frames); ++i) {
+                if (!frames[i].refs) {
+                    frames[i].buffer.release();
+                }
+            }
+        }
+
+        SharedFrame *shared;
+        if (subscriber && (shared = frameBrokerReceive(subscriber, 0))) {
+            distributeFrame(shared);
+        }
+    }
+}
+
+void startRtspServer(uint16_t port) {
+    listenFd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listenFd < 0) {
+        ESP_LOGE(TAG, "Could not create the RTSP socket!");
+        return;
+    }
+
+    const int reuse = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenFd, RTSP_MAX_CLIENTS) < 0) {
+        ESP_LOGE(TAG, "Could not listen on port %u!", port);
+        close(listenFd);
+        listenFd = -1;
+        return;
+    }
+    fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL, 0) | O_NONBLOCK);
+
+    for (size_t i = 0; i < RTSP_MAX_CLIENTS; ++i) {
+        clients[i].fd = clients[i].rtpFd = clients[i].rtcpFd = -1;
+        clients[i].state = RTSP_FREE;
+    }
+
+    ESP_LOGI(TAG, "Starting RTSP server on port: '%u'", port);
+
+    xTaskCreatePinnedToCore(
+        rtspTaskRoutine,
+        "RtspServer",
+        4096,
+        NULL,
+        5,
+        NULL,
+#if HTTP_STREAM_TASK_CORE0
+        0
+#elif HTTP_STREAM_TASK_CORE1
+        1
+#else
+        -1
+#endif
+    );
+}
@@ -0,0 +1,77 @@
+#include <string.h>
+
+// Local files
+#include "json_writer.hpp"
+#include "makros.h"
+#include "status_events.hpp"
+
+// Changes which follow each other within this time go out in one event
+#define STATUS_EVENT_COALESCE_MS 200
+// The counters are not notified, they are picked up this often
+#define STATUS_EVENT_INTERVAL_MS 1000
+
+static volatile bool notified = false;
+static volatile uint32_t version = 0;
+static int64_t lastReadUs = 0;
+
+static StatusField fields[STATUS_MAX_FIELDS];
+static bool changed[STATUS_MAX_FIELDS];
+static size_t fieldCount = 0;
+
+void statusEventsNotify() {
+    ++version;
+    notified = true;
+}
+
+uint32_t statusVersion() {
+    return version;
+}
+
+bool statusEventsUpdate(int64_t now) {
+    const int64_t elapsedUs = now - lastReadUs;
+    if (fieldCount && elapsedUs < STATUS_EVENT_INTERVAL_MS * 1000LL &&
+        (!notified || elapsedUs < STATUS_EVENT_COALESCE_MS * 1000LL)) {
+        return false;
+    }
+
+    // Changes made while the fields are read are picked up by the next read
+    notified = false;
+    lastReadUs = now;
+
+    StatusField current[STATUS_MAX_FIELDS];
+    const size_t count = readStatusFields(current, NUMELEMS(current));
+    bool anyChanged = false;
+
+    for (size_t i = 0; i < count; ++i) {
+        changed[i] = i >= fieldCount || current[i].value != fields[i].value;
+        anyChanged |= changed[i];
+    }
+
+    memcpy(fields, current, count * sizeof(StatusField));
+    fieldCount = count;
+
+    return anyChanged;
+}
+
+size_t statusEventsFormat(char *buf, size_t size, bool all) {
+    JsonWriter json(buf, size);
+    json.raw("data: ", CONST_STR_LEN("data: "));
+    json.beginObject();
+
+    for (size_t i = 0; i < fieldCount; ++i) {
+        if (!all && !changed[i]) {
+            continue;
+        }
+
+        if (fields[i].boolean) {
+            json.addBool(fields[i].name, fields[i].value);
+        } else {
+            json.addNumber(fields[i].name, fields[i].value);
+        }
+    }
+
+    json.endObject();
+    json.raw("\n\n", 2);
+
+    return json.ok() ? json.length() : 0;
+}
@@ -0,0 +1,929 @@
+#include "esp_camera.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "mbedtls/base64.h"
+#include "mbedtls/sha1.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// Local files
+#include "frame_broker.hpp"
+#include "frame_buffer.hpp"
+#include "makros.h"
+#include "status_events.hpp"
+#include "stream_server.hpp"
+#include "web_utils.h"
+
+//FreeRTOS
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+// Include the config
+#include "config.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char *TAG = "stream_server";
+#endif
+
+#define STREAM_BOUNDARY "123456789000000000000987654321"
+#define STREAM_RESPONSE                                                  \
+    "HTTP/1.1 200 OK\r\n"                                                \
+    "Content-Type: multipart/x-mixed-replace;boundary=" STREAM_BOUNDARY "\r\n" \
+    "Access-Control-Allow-Origin: *\r\n"                                 \
+    "Cache-Control: no-cache\r\n"                                        \
+    "Connection: close\r\n\r\n"
+#define STREAM_PART "\r\n--" STREAM_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n"
+#define STREAM_EVENTS_RESPONSE           \
+    "HTTP/1.1 200 OK\r\n"                \
+    "Content-Type: text/event-stream\r\n" \
+    "Access-Control-Allow-Origin: *\r\n"  \
+    "Cache-Control: no-cache\r\n"         \
+    "Connection: close\r\n\r\n"
+#define STREAM_EVENTS_KEEPALIVE ":\n\n"
+#define STREAM_NOT_FOUND "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define STREAM_BAD_REQUEST "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define STREAM_BUSY "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define WS_RESPONSE                       \
+    "HTTP/1.1 101 Switching Protocols\r\n" \
+    "Upgrade: websocket\r\n"              \
+    "Connection: Upgrade\r\n"             \
+    "Sec-WebSocket-Accept: %s\r\n\r\n"
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+// Holds one line of the request, the headers are evaluated line by line and longer lines are skipped
+#define STREAM_REQUEST_SIZE 256
+#define STREAM_TARGET_SIZE 96
+#define STREAM_HEAD_SIZE (CONST_STR_LEN(STREAM_RESPONSE) + 1)
+// Space in front of every frame copy the part header is formatted into
+#define STREAM_PART_HEADROOM (CONST_STR_LEN(STREAM_PART) + 8)
+// Weight of a new sample in the average send latency is 1 / 2^STREAM_LATENCY_SHIFT
+#define STREAM_LATENCY_SHIFT 4
+// Longest time select waits, new frames are only picked up in between
+#define STREAM_POLL_INTERVAL_MS 10
+#define STREAM_REQUEST_TIMEOUT_US (5 * 1000000LL)
+// A client which did not accept a single byte for this long is disconnected
+#define STREAM_SEND_TIMEOUT_US (10 * 1000000LL)
+// Largest status event, all fields of /status and /stats
+#define STREAM_EVENT_SIZE 1280
+// An idle event stream gets a comment this often, so broken connections are noticed
+#define STREAM_EVENT_KEEPALIVE_US (15 * 1000000LL)
+
+// Base64 of the 16 byte key
+#define WS_KEY_SIZE 32
+// Frames in flight without acknowledgement, ?window=N
+#define WS_DEFAULT_WINDOW 2
+#define WS_MAX_WINDOW 8
+// Header of a server message with 64 bit length
+#define WS_MAX_HEADER_SIZE 10
+#define WS_MAX_CONTROL_PAYLOAD 125
+#define WS_FIN 0x80
+#define WS_MASK 0x80
+#define WS_OPCODE_CONTINUATION 0x0
+#define WS_OPCODE_TEXT 0x1
+#define WS_OPCODE_BINARY 0x2
+#define WS_OPCODE_CLOSE 0x8
+#define WS_OPCODE_PING 0x9
+#define WS_OPCODE_PONG 0xA
+
+// Copy of a captured frame, so slow clients never hold a driver buffer. The part header is placed
+// right in front of the jpeg, so every client sends a frame with a single send call.
+typedef struct {
+    // Kept for the following frames, it is only given back once nobody streams
+    FrameBuffer buffer;
+    // Start and size of part header and jpeg inside the buffer
+    const char *data;
+    size_t size;
+    const char *jpg;
+    size_t len;
+    // Header of the binary WebSocket message carrying the jpeg
+    char wsHead[WS_MAX_HEADER_SIZE];
+    size_t wsHeadLen;
+    size_t refs;
+} StreamFrame;
+
+typedef enum {
+    STREAM_MJPEG,
+    STREAM_WEBSOCKET,
+    // Server-sent events with the changes of /status and /stats
+    STREAM_EVENTS,
+} StreamType;
+
+typedef enum {
+    CLIENT_FREE,
+    CLIENT_REQUEST,
+    CLIENT_STREAMING,
+} ClientState;
+
+typedef struct {
+    int fd;
+    ClientState state;
+    StreamType type;
+
+    // Current line of the request, or the received WebSocket frames once streaming
+    char request[STREAM_REQUEST_SIZE];
+    size_t requestLen;
+    bool skipLine;
+    char target[STREAM_TARGET_SIZE];
+    bool upgrade;
+    char wsKey[WS_KEY_SIZE];
+
+    // Response header, or the header of the current WebSocket message
+    char head[STREAM_HEAD_SIZE];
+    size_t headLen;
+    size_t headSent;
+    StreamFrame *frame;
+    const char *frameData;
+    size_t frameSize;
+    size_t frameSent;
+
+    // WebSocket flow control: frames sent but not acknowledged, and the newest frame waiting for the window
+    size_t window;
+    size_t unacked;
+    StreamFrame *next;
+    // Pong to a ping which came in while a message was sent, it goes out before the next frame
+    char pong[2 + WS_MAX_CONTROL_PAYLOAD];
+    size_t pongLen;
+    // Rest of a received payload which is not needed
+    size_t skipLen;
+    // Event clients get all fields again if they missed a change
+    bool eventsSynced;
+
+    int64_t minIntervalUs;
+    int64_t lastFrameUs;
+    int64_t lastProgressUs;
+    size_t skippedFrames;
+
+    // Time from handing a frame to the client until its last byte was accepted by the socket
+    size_t sentFrames;
+    int64_t totalLatencyUs;
+    int64_t maxLatencyUs;
+} StreamClient;
+
+static StreamClient clients[STREAM_MAX_CLIENTS];
+// Every client holds at most two frames (WebSocket clients keep the newest one while the window is full),
+// the server itself the one which is handed out. Status events use the same buffers.
+static StreamFrame frames[2 * STREAM_MAX_CLIENTS + 1];
+static volatile size_t streamingClients = 0;
+static size_t eventClients = 0;
+// Moving average of the send latency of all clients
+static volatile int64_t averageLatencyUs = 0;
+
+static FrameSubscriber *subscriber = NULL;
+static int listenFd = -1;
+
+size_t streamClientCount() {
+    return streamingClients;
+}
+
+int64_t streamSendLatencyUs() {
+    return averageLatencyUs;
+}
+
+static inline void releaseFrame(StreamFrame *frame) {
+    --frame->refs;
+}
+
+// The buffers of the frames are only needed while anybody streams
+static void releaseFrameBuffers() {
+    for (size_t i = 0; i < NUMELEMS(frames); ++i) {
+        if (!frames[i].refs) {
+            frames[i].buffer.release();
+        }
+    }
+}
+
+// Copies the jpeg behind the headroom and formats the part header right in front of it
+static bool fillFrame(StreamFrame *frame, camera_fb_t *fb) {
+    if (!frame->buffer.copy(fb, STREAM_PART_HEADROOM)) {
+        return false;
+    }
+
+    const size_t len = frame->buffer.length();
+    char part[STREAM_PART_HEADROOM + 1];
+    const size_t partLen = snprintf(part, sizeof(part), STREAM_PART, len);
+
+    frame->data = frame->buffer.data() + STREAM_PART_HEADROOM - partLen;
+    frame->size = partLen + len;
+    frame->jpg = (const char *)frame->buffer.jpg();
+    frame->len = len;
+    memcpy((char *)frame->data, part, partLen);
+
+    // Server messages are not masked, the length is given in the shortest of the three forms
+    char *head = frame->wsHead;
+    head[0] = WS_FIN | WS_OPCODE_BINARY;
+    if (len < 126) {
+        head[1] = len;
+        frame->wsHeadLen = 2;
+    } else if (len <= 0xFFFF) {
+        head[1] = 126;
+        head[2] = len >> 8;
+        head[3] = len;
+        frame->wsHeadLen = 4;
+    } else {
+        head[1] = 127;
+        memset(head + 2, 0, 4);
+        head[6] = len >> 24;
+        head[7] = len >> 16;
+        head[8] = len >> 8;
+        head[9] = len;
+        frame->wsHeadLen = 10;
+    }
+
+    return true;
+}
+
+static StreamFrame *findFreeFrame() {
+    for (size_t i = 0; i < NUMELEMS(frames); ++i) {
+        if (!frames[i].refs) {
+            return &frames[i];
+        }
+    }
+    return NULL;
+}
+
+// Copies (or converts) the broker frame, which is released right away
+static StreamFrame *copyFrame(SharedFrame *shared) {
+    StreamFrame *frame = findFreeFrame();
+    const bool res = frame && fillFrame(frame, shared->fb);
+
+    frameBrokerRelease(shared);
+
+    if (!res) {
+        return NULL;
+    }
+
+    frame->refs = 1;
+    return frame;
+}
+
+// Formats the changed fields of the status, or all of them, as an event
+static StreamFrame *eventFrame(bool all) {
+    StreamFrame *frame = findFreeFrame();
+    if (!frame || !frame->buffer.reserve(STREAM_EVENT_SIZE)) {
+        return NULL;
+    }
+
+    frame->size = statusEventsFormat(frame->buffer.data(), STREAM_EVENT_SIZE, all);
+    if (!frame->size) {
+        return NULL;
+    }
+
+    frame->data = frame->buffer.data();
+    frame->refs = 1;
+    return frame;
+}
+
+static void closeClient(StreamClient *client) {
+    if (client->frame) {
+        releaseFrame(client->frame);
+        client->frame = NULL;
+    }
+    if (client->next) {
+        releaseFrame(client->next);
+        client->next = NULL;
+    }
+    if (client->state == CLIENT_STREAMING && client->type == STREAM_EVENTS) {
+        --eventClients;
+        ESP_LOGI(TAG, "Client %d left the events", client->fd);
+    } else if (client->state == CLIENT_STREAMING) {
+        --streamingClients;
+        ESP_LOGI(TAG, "Client %d left: %u frames sent (send latency %lld us average, %lld us max), %u frames skipped",
+                 client->fd, client->sentFrames, client->sentFrames ? client->totalLatencyUs / client->sentFrames : 0,
+                 client->maxLatencyUs, client->skippedFrames);
+    }
+
+    close(client->fd);
+    client->fd = -1;
+    client->state = CLIENT_FREE;
+
+    if (!streamingClients && !eventClients) {
+        releaseFrameBuffers();
+    }
+}
+
+static inline bool hasPendingData(const StreamClient *client) {
+    return client->headSent < client->headLen || client->frame;
+}
+
+// Starts sending the frame, the caller passes its reference on to the client
+static void startFrame(StreamClient *client, StreamFrame *frame, int64_t now) {
+    client->frame = frame;
+    client->frameSent = 0;
+    client->lastFrameUs = now;
+
+    if (client->type == STREAM_WEBSOCKET) {
+        memcpy(client->head, frame->wsHead, frame->wsHeadLen);
+        client->headLen = frame->wsHeadLen;
+        client->headSent = 0;
+        client->frameData = frame->jpg;
+        client->frameSize = frame->len;
+        ++client->unacked;
+    } else {
+        client->frameData = frame->data;
+        client->frameSize = frame->size;
+    }
+}
+
+// Hands a waiting pong, or else the waiting frame, to a WebSocket client once it is done with the last one
+// and the window has room
+static inline void startNextFrame(StreamClient *client, int64_t now) {
+    if (hasPendingData(client)) {
+        return;
+    }
+
+    if (client->pongLen) {
+        memcpy(client->head, client->pong, client->pongLen);
+        client->headLen = client->pongLen;
+        client->headSent = 0;
+        client->pongLen = 0;
+    } else if (client->next && client->unacked < client->window) {
+        StreamFrame *next = client->next;
+        client->next = NULL;
+        startFrame(client, next, now);
+    }
+}
+
+// Sends as much as the socket takes without blocking, returns false if the client was closed
+static bool sendPending(StreamClient *client) {
+    while (hasPendingData(client)) {
+        // The header and the frame go out together, the header is empty for the parts of a multipart stream
+        struct iovec iov[2];
+        int count = 0;
+
+        if (client->headSent < client->headLen) {
+            iov[count].iov_base = client->head + client->headSent;
+            iov[count].iov_len = client->headLen - client->headSent;
+            ++count;
+        }
+        if (client->frame) {
+            iov[count].iov_base = (void *)(client->frameData + client->frameSent);
+            iov[count].iov_len = client->frameSize - client->frameSent;
+            ++count;
+        }
+
+        int res = writev(client->fd, iov, count);
+        if (res < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            closeClient(client);
+            return false;
+        }
+
+        const size_t headBytes = MINEQ((size_t)res, client->headLen - client->headSent);
+        client->headSent += headBytes;
+        client->frameSent += res - headBytes;
+        client->lastProgressUs = esp_timer_get_time();
+
+        if (client->frame && client->frameSent == client->frameSize) {
+            if (client->type != STREAM_EVENTS) {
+                const int64_t latencyUs = client->lastProgressUs - client->lastFrameUs;
+                ++client->sentFrames;
+                client->totalLatencyUs += latencyUs;
+                client->maxLatencyUs = MAXEQ(client->maxLatencyUs, latencyUs);
+                averageLatencyUs += (latencyUs - averageLatencyUs) >> STREAM_LATENCY_SHIFT;
+            }
+
+            releaseFrame(client->frame);
+            client->frame = NULL;
+        }
+
+        // Also picks up a pong or a frame which waited for the handshake or the last message
+        startNextFrame(client, client->lastProgressUs);
+    }
+
+    return true;
+}
+
+static void respondAndClose(StreamClient *client, const char *response, size_t len) {
+    // The socket is fresh, so the short response fits into its send buffer
+    send(client->fd, response, len, 0);
+    closeClient(client);
+}
+
+// Sec-WebSocket-Accept is the base64 encoded SHA-1 of the key and the fixed GUID
+static bool acceptKey(const char *key, char *accept, size_t size) {
+    char input[WS_KEY_SIZE + CONST_STR_LEN(WS_GUID)];
+    const size_t keyLen = strlen(key);
+    memcpy(input, key, keyLen);
+    memcpy(input + keyLen, WS_GUID, CONST_STR_LEN(WS_GUID));
+
+    unsigned char hash[20];
+    size_t len = 0;
+    return !mbedtls_sha1_ret((const unsigned char *)input, keyLen + CONST_STR_LEN(WS_GUID), hash) &&
+           !mbedtls_base64_encode((unsigned char *)accept, size, &len, hash, sizeof(hash));
+}
+
+static void handleRequest(StreamClient *client) {
+    char *path = client->target;
+    char *query = strchr(path, '?');
+    if (query) {
+        *query++ = '\0';
+    }
+
+    if (!strcmp(path, "/stream")) {
+        client->type = STREAM_MJPEG;
+    } else if (!strcmp(path, "/ws")) {
+        client->type = STREAM_WEBSOCKET;
+    } else if (!strcmp(path, "/events")) {
+        client->type = STREAM_EVENTS;
+    } else {
+        respondAndClose(client, STREAM_NOT_FOUND, CONST_STR_LEN(STREAM_NOT_FOUND));
+        return;
+    }
+
+    QueryParam params[2];
+    const size_t count = query ? parse_query(query, params, NUMELEMS(params)) : 0;
+    const int fps = query_int(params, count, "fps", 0);
+    client->minIntervalUs = fps > 0 ? 1000000LL / fps : 0;
+
+    if (client->type == STREAM_WEBSOCKET) {
+        char accept[32];
+        if (!client->upgrade || !client->wsKey[0] || !acceptKey(client->wsKey, accept, sizeof(accept))) {
+            respondAndClose(client, STREAM_BAD_REQUEST, CONST_STR_LEN(STREAM_BAD_REQUEST));
+            return;
+        }
+
+        const int window = query_int(params, count, "window", 0);
+        client->window = window > 0 ? MINEQ(window, WS_MAX_WINDOW) : WS_DEFAULT_WINDOW;
+        client->headLen = snprintf(client->head, sizeof(client->head), WS_RESPONSE, accept);
+    } else if (client->type == STREAM_EVENTS) {
+        memcpy(client->head, STREAM_EVENTS_RESPONSE, CONST_STR_LEN(STREAM_EVENTS_RESPONSE));
+        client->headLen = CONST_STR_LEN(STREAM_EVENTS_RESPONSE);
+    } else {
+        memcpy(client->head, STREAM_RESPONSE, CONST_STR_LEN(STREAM_RESPONSE));
+        client->headLen = CONST_STR_LEN(STREAM_RESPONSE);
+    }
+
+    client->headSent = 0;
+    client->requestLen = 0;
+    client->skipLen = 0;
+    client->unacked = 0;
+    client->skippedFrames = 0;
+    client->sentFrames = 0;
+    client->totalLatencyUs = 0;
+    client->maxLatencyUs = 0;
+    client->lastFrameUs = 0;
+    client->eventsSynced = false;
+    client->lastProgressUs = esp_timer_get_time();
+    client->state = CLIENT_STREAMING;
+
+    if (client->type == STREAM_EVENTS) {
+        ++eventClients;
+        ESP_LOGI(TAG, "Client %d listens to the events", client->fd);
+    } else {
+        ++streamingClients;
+        ESP_LOGI(TAG, "Client %d streams%s", client->fd, client->type == STREAM_WEBSOCKET ? " via WebSocket" : "");
+    }
+
+    sendPending(client);
+}
+
+// The request line and the few headers of interest, everything else is ignored
+static void handleLine(StreamClient *client, char *line) {
+    if (!client->target[0]) {
+        // GET /stream?fps=N HTTP/1.1
+        const bool get = !strncmp(line, "GET ", CONST_STR_LEN("GET "));
+        const char *target = line + CONST_STR_LEN("GET ");
+        const size_t targetLen = get ? strcspn(target, " ") : 0;
+        if (!targetLen || targetLen >= sizeof(client->target)) {
+            respondAndClose(client, STREAM_NOT_FOUND, CONST_STR_LEN(STREAM_NOT_FOUND));
+            return;
+        }
+        memcpy(client->target, target, targetLen);
+        client->target[targetLen] = '\0';
+    } else if (!line[0]) {
+        handleRequest(client);
+    } else if (!strncasecmp(line, "Upgrade:", CONST_STR_LEN("Upgrade:"))) {
+        client->upgrade = strcasestr(line, "websocket") != NULL;
+    } else if (!strncasecmp(line, "Sec-WebSocket-Key:", CONST_STR_LEN("Sec-WebSocket-Key:"))) {
+        const char *key = line + CONST_STR_LEN("Sec-WebSocket-Key:");
+        key += strspn(key, " ");
+        snprintf(client->wsKey, sizeof(client->wsKey), "%s", key);
+    }
+}
+
+static void readRequest(StreamClient *client) {
+    for (;;) {
+        char *end = (char *)memchr(client->request, '\n', client->requestLen);
+        if (!end) {
+            // The rest of a line which does not fit is dropped, it is of no interest anyway
+            if (client->requestLen == sizeof(client->request) - 1) {
+                if (!client->target[0]) {
+                    respondAndClose(client, STREAM_NOT_FOUND, CONST_STR_LEN(STREAM_NOT_FOUND));
+                    return;
+                }
+                client->requestLen = 0;
+                client->skipLine = true;
+            }
+            return;
+        }
+
+        const size_t lineLen = end + 1 - client->request;
+        *end = '\0';
+        if (end > client->request && end[-1] == '\r') {
+            end[-1] = '\0';
+        }
+
+        if (!client->skipLine) {
+            handleLine(client, client->request);
+            if (client->state != CLIENT_REQUEST) {
+                return;
+            }
+        }
+        client->skipLine = false;
+
+        client->requestLen -= lineLen;
+        memmove(client->request, client->request + lineLen, client->requestLen);
+    }
+}
+
+static void acknowledgeFrame(StreamClient *client) {
+    if (client->unacked) {
+        --client->unacked;
+    }
+    startNextFrame(client, esp_timer_get_time());
+}
+
+// Parses the frames of the client, every complete text or binary message acknowledges a frame
+static void readMessages(StreamClient *client) {
+    const uint8_t *buf = (const uint8_t *)client->request;
+
+    while (client->requestLen) {
+        if (client->skipLen) {
+            const size_t skipped = MINEQ(client->skipLen, client->requestLen);
+            client->skipLen -= skipped;
+            client->requestLen -= skipped;
+            memmove(client->request, client->request + skipped, client->requestLen);
+            continue;
+        }
+
+        if (client->requestLen < 2) {
+            return;
+        }
+
+        const uint8_t opcode = buf[0] & 0x0F;
+        const bool fin = buf[0] & WS_FIN;
+        uint64_t payloadLen = buf[1] & 0x7F;
+        size_t headerLen = 2;
+
+        // Clients have to mask their frames
+        if (!(buf[1] & WS_MASK)) {
+            closeClient(client);
+            return;
+        }
+
+        if (payloadLen == 126) {
+            headerLen += 2;
+        } else if (payloadLen == 127) {
+            headerLen += 8;
+        }
+        headerLen += 4;
+        if (client->requestLen < headerLen) {
+            return;
+        }
+
+        if (payloadLen == 126) {
+            payloadLen = (buf[2] << 8) | buf[3];
+        } else if (payloadLen == 127) {
+            payloadLen = 0;
+            for (size_t i = 2; i < 10; ++i) {
+                payloadLen = (payloadLen << 8) | buf[i];
+            }
+        }
+
+        size_t consumed = headerLen;
+
+        if (opcode >= WS_OPCODE_CLOSE) {
+            // Control frames are short and never fragmented
+            if (payloadLen > WS_MAX_CONTROL_PAYLOAD) {
+                closeClient(client);
+                return;
+            }
+            if (client->requestLen < headerLen + payloadLen) {
+                return;
+            }
+
+            // The close frame can not be put in the middle of a message, the connection is just closed then
+            if (opcode == WS_OPCODE_CLOSE) {
+                const char closeFrame[] = {(char)(WS_FIN | WS_OPCODE_CLOSE), 0};
+                if (hasPendingData(client)) {
+                    closeClient(client);
+                } else {
+                    respondAndClose(client, closeFrame, sizeof(closeFrame));
+                }
+                return;
+            }
+
+            // A pong is only possible between two messages, it waits for the current one. Only the latest ping is answered.
+            if (opcode == WS_OPCODE_PING) {
+                const uint8_t *mask = buf + headerLen - 4;
+                client->pong[0] = WS_FIN | WS_OPCODE_PONG;
+                client->pong[1] = payloadLen;
+                for (size_t i = 0; i < payloadLen; ++i) {
+                    client->pong[2 + i] = buf[headerLen + i] ^ mask[i % 4];
+                }
+                client->pongLen = 2 + payloadLen;
+                startNextFrame(client, esp_timer_get_time());
+            }
+            consumed += payloadLen;
+        } else {
+            // The content of data messages does not matter, only that they arrived
+            if (fin && (opcode == WS_OPCODE_TEXT || opcode == WS_OPCODE_BINARY || opcode == WS_OPCODE_CONTINUATION)) {
+                acknowledgeFrame(client);
+            }
+            client->skipLen = payloadLen;
+        }
+
+        client->requestLen -= consumed;
+        memmove(client->request, client->request + consumed, client->requestLen);
+    }
+}
+
+static void readClient(StreamClient *client) {
+    char discard[64];
+    char *buf = discard;
+    size_t size = sizeof(discard);
+
+    if (client->state == CLIENT_REQUEST || client->type == STREAM_WEBSOCKET) {
+        buf = client->request + client->requestLen;
+        size = sizeof(client->request) - 1 - client->requestLen;
+    }
+
+    const int res = recv(client->fd, buf, size, 0);
+    if (res == 0 || (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        closeClient(client);
+        return;
+    }
+
+    if (res > 0 && buf != discard) {
+        client->requestLen += res;
+
+        if (client->state == CLIENT_REQUEST) {
+            readRequest(client);
+        } else {
+            readMessages(client);
+        }
+
+        if (client->state == CLIENT_STREAMING && hasPendingData(client)) {
+            sendPending(client);
+        }
+    }
+}
+
+static void acceptClient() {
+    const int fd = accept(listenFd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    // The frames are sent in large pieces anyway, the part headers should not wait for them
+    const int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    for (size_t i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+        StreamClient *client = &clients[i];
+        if (client->state == CLIENT_FREE) {
+            client->fd = fd;
+            client->state = CLIENT_REQUEST;
+            client->type = STREAM_MJPEG;
+            client->requestLen = 0;
+            client->skipLine = false;
+            client->target[0] = '\0';
+            client->upgrade = false;
+            client->wsKey[0] = '\0';
+            client->headLen = client->headSent = 0;
+            client->frame = NULL;
+            client->next = NULL;
+            client->pongLen = 0;
+            client->lastProgressUs = esp_timer_get_time();
+            return;
+        }
+    }
+
+    ESP_LOGW(TAG, "Too many stream clients!");
+    send(fd, STREAM_BUSY, CONST_STR_LEN(STREAM_BUSY), 0);
+    close(fd);
+}
+
+// Hands the frame to every client which is done with its last one and not limited by its frame rate.
+// WebSocket clients with a full window keep it until an acknowledgement arrives, replacing any older one.
+static void distributeFrame(SharedFrame *shared) {
+    StreamFrame *frame = copyFrame(shared);
+    if (!frame) {
+        return;
+    }
+
+    const int64_t now = esp_timer_get_time();
+
+    for (size_t i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+        StreamClient *client = &clients[i];
+        if (client->state != CLIENT_STREAMING || client->type == STREAM_EVENTS ||
+            now - client->lastFrameUs < client->minIntervalUs) {
+            continue;
+        }
+
+        if (client->type == STREAM_WEBSOCKET && (hasPendingData(client) || client->unacked >= client->window)) {
+            if (client->next) {
+                releaseFrame(client->next);
+                ++client->skippedFrames;
+            }
+            ++frame->refs;
+            client->next = frame;
+            continue;
+        }
+
+        if (hasPendingData(client)) {
+            ++client->skippedFrames;
+            continue;
+        }
+
+        ++frame->refs;
+        startFrame(client, frame, now);
+
+        sendPending(client);
+    }
+
+    releaseFrame(frame);
+}
+
+/*
+    Sends the changed fields to every event client which is done with the last event. Clients which are still
+    busy miss the change and get all fields once they are done, so no client is held up by a slow one.
+*/
+static void distributeEvents() {
+    const int64_t now = esp_timer_get_time();
+    const bool changed = statusEventsUpdate(now);
+    StreamFrame *changes = NULL;
+    StreamFrame *snapshot = NULL;
+
+    for (size_t i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+        StreamClient *client = &clients[i];
+        if (client->state != CLIENT_STREAMING || client->type != STREAM_EVENTS) {
+            continue;
+        }
+
+        if (hasPendingData(client)) {
+            client->eventsSynced &= !changed;
+            continue;
+        }
+
+        StreamFrame *frame = NULL;
+        if (!client->eventsSynced) {
+            frame = snapshot = snapshot ? snapshot : eventFrame(true);
+            client->eventsSynced = frame != NULL;
+        } else if (changed) {
+            frame = changes = changes ? changes : eventFrame(false);
+            client->eventsSynced = frame != NULL;
+        }
+
+        if (frame) {
+            ++frame->refs;
+            startFrame(client, frame, now);
+        } else if (now - client->lastFrameUs > STREAM_EVENT_KEEPALIVE_US) {
+            memcpy(client->head, STREAM_EVENTS_KEEPALIVE, CONST_STR_LEN(STREAM_EVENTS_KEEPALIVE));
+            client->headLen = CONST_STR_LEN(STREAM_EVENTS_KEEPALIVE);
+            client->headSent = 0;
+            client->lastFrameUs = now;
+        } else {
+            continue;
+        }
+
+        sendPending(client);
+    }
+
+    if (changes) {
+        releaseFrame(changes);
+    }
+    if (snapshot) {
+        releaseFrame(snapshot);
+    }
+}
+
+static void streamTaskRoutine(void *arg) {
+    for (;;) {
+        fd_set readSet;
+        fd_set writeSet;
+        FD_ZERO(&readSet);
+        FD_ZERO(&writeSet);
+        FD_SET(listenFd, &readSet);
+        int maxFd = listenFd;
+
+        for (size_t i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+            const StreamClient *client = &clients[i];
+            if (client->state != CLIENT_FREE) {
+                FD_SET(client->fd, &readSet);
+                if (hasPendingData(client)) {
+                    FD_SET(client->fd, &writeSet);
+                }
+                maxFd = MAXEQ(maxFd, client->fd);
+            }
+        }
+
+        struct timeval timeout = {0, STREAM_POLL_INTERVAL_MS * 1000};
+        if (select(maxFd + 1, &readSet, &writeSet, NULL, &timeout) < 0) {
+            ESP_LOGE(TAG, "select failed: %d", errno);
+            vTaskDelay(pdMS_TO_TICKS(STREAM_POLL_INTERVAL_MS));
+            continue;
+        }
+
+        const int64_t now = esp_timer_get_time();
+
+        for (size_t i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+            StreamClient *client = &clients[i];
+            if (client->state == CLIENT_FREE) {
+                continue;
+            }
+
+            if (FD_ISSET(client->fd, &readSet)) {
+                readClient(client);
+            }
+            if (client->state != CLIENT_FREE && FD_ISSET(client->fd, &writeSet)) {
+                sendPending(client);
+            }
+
+            if ((client->state == CLIENT_REQUEST && now - client->lastProgressUs > STREAM_REQUEST_TIMEOUT_US) ||
+                (client->state == CLIENT_STREAMING && hasPendingData(client) && now - client->lastProgressUs > STREAM_SEND_TIMEOUT_US)) {
+                ESP_LOGW(TAG, "Client %d timed out", client->fd);
+                closeClient(client);
+            }
+        }
+
+        if (FD_ISSET(listenFd, &readSet)) {
+            acceptClient();
+        }
+
+        // The broker only captures for the stream while someone watches
+        if (streamingClients && !subscriber) {
+            subscriber = frameBrokerSubscribe(1, FRAME_DROP_OLDEST, true);
+        } else if (!streamingClients && subscriber) {
+            frameBrokerUnsubscribe(subscriber);
+            subscriber = NULL;
+        }
+
+        SharedFrame *shared;
+        if (subscriber && (shared = frameBrokerReceive(subscriber, 0))) {
+            distributeFrame(shared);
+        }
+
+        if (eventClients) {
+            distributeEvents();
+        }
+    }
+}
+
+void startStreamServer(uint16_t port) {
+    listenFd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listenFd < 0) {
+        ESP_LOGE(TAG, "Could not create the stream socket!");
+        return;
+    }
+
+    const int reuse = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenFd, STREAM_MAX_CLIENTS) < 0) {
+        ESP_LOGE(TAG, "Could not listen on port %u!", port);
+        close(listenFd);
+        listenFd = -1;
+        return;
+    }
+    fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL, 0) | O_NONBLOCK);
+
+    for (size_t i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+        clients[i].fd = -1;
+        clients[i].state = CLIENT_FREE;
+    }
+
+    ESP_LOGI(TAG, "Starting stream server on port: '%u'", port);
+
+    xTaskCreatePinnedToCore(
+        streamTaskRoutine,
+        "StreamServer",
+        4096,
+        NULL,
+        5,
+        NULL,
+#if HTTP_STREAM_TASK_CORE0
+        0
+#elif HTTP_STREAM_TASK_CORE1
+        1
+#else
+        -1
+#endif
+    );
+}
@@ -1,70 +1,97 @@
 #include "esp_http_server.h"
+#include <stdlib.h>
+#include <string.h>
+
 #include "web_utils.h"
 
-static inline unsigned char h2int(char c) {
+static inline int h2int(char c) {
     if (c >= '0' && c <= '9') {
-        return ((unsigned char)c - '0');
+        return c - '0';
     }
     if (c >= 'a' && c <= 'f') {
-        return ((unsigned char)c - 'a' + 10);
+        return c - 'a' + 10;
     }
     if (c >= 'A' && c <= 'F') {
-        return ((unsigned char)c - 'A' + 10);
+        return c - 'A' + 10;
     }
-    return '\0';
+    return -1;
 }
 
-bool urldecode(char *str, size_t length) {
-    size_t resIdx = 0;
-    for (size_t i = 0; i < length; i++) {
-        char c = str[i];
-        if (c == '+') {
-            c = ' ';
-        } else if (c == '%') {
-            if (i + 2 >= length) {
-                // Invalid encoding abort!
-                str[resIdx] = '\0';
-                return false;
-            }
-            char code0 = str[++i];
-            char code1 = str[++i];
-            c = (h2int(code0) << 4) | h2int(code1);
-        }
-        str[resIdx++] = c;
+esp_err_t read_query(httpd_req_t *req, char *buf, size_t size) {
+    const size_t len = httpd_req_get_url_query_len(req);
+    if (len >= size) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Query too long");
+        return ESP_FAIL;
+    }
+    if (!len || httpd_req_get_url_query_str(req, buf, size) != ESP_OK) {
+        httpd_resp_send_404(req);
+        return ESP_FAIL;
     }
-    str[resIdx] = '\0';
-    return true;
+    return ESP_OK;
 }
 
-esp_err_t parse_get(httpd_req_t *req, char **obuf) {
-    char *buf = NULL;
-    size_t buf_len = 0;
+size_t parse_query(char *query, QueryParam *params, size_t size) {
+    size_t count = 0;
+    const char *in = query;
+    // The decoded form is never longer, so every pair is written over the space it occupied
+    char *out = query;
 
-    buf_len = httpd_req_get_url_query_len(req) + 1;
-    if (buf_len > 1) {
-        buf = (char *)malloc(buf_len);
-        if (!buf) {
-            httpd_resp_send_500(req);
-            return ESP_FAIL;
+    while (*in && count < size) {
+        char *key = out;
+        char *value = NULL;
+
+        for (; *in && *in != '&'; ++in) {
+            char c = *in;
+            int high, low;
+            if (c == '=' && !value) {
+                *out++ = '\0';
+                value = out;
+                continue;
+            }
+            if (c == '+') {
+                c = ' ';
+            } else if (c == '%' && (high = h2int(in[1])) >= 0 && (low = h2int(in[2])) >= 0) {
+                // An incomplete escape is kept as it is
+                c = (char)(high << 4 | low);
+                in += 2;
+            }
+            *out++ = c;
+        }
+        if (*in) {
+            ++in;
         }
-        if (httpd_req_get_url_query_str(req, buf, buf_len) == ESP_OK) {
-            *obuf = buf;
-            return ESP_OK;
+
+        // Empty pairs like in "a=1&&b=2"
+        if (out == key) {
+            continue;
         }
-        free(buf);
+        *out++ = '\0';
+        params[count].key = key;
+        params[count].value = value ? value : "";
+        ++count;
     }
-    httpd_resp_send_404(req);
-    return ESP_FAIL;
+
+    return count;
 }
 
-int parse_get_var(char *buf, const char *key, int def) {
-    char _int[16];
-    if (httpd_query_key_value(buf, key, _int, sizeof(_int)) != ESP_OK) {
-        return def;
+const char *query_value(const QueryParam *params, size_t count, const char *key) {
+    for (size_t i = 0; i < count; ++i) {
+        if (!strcmp(params[i].key, key)) {
+            return params[i].value;
+        }
     }
-    return atoi(_int);
+    return NULL;
 }
 
-#ifdef __cplusplus
+int query_int(const QueryParam *params, size_t count, const char *key, int def) {
+    const char *value = query_value(params, count, key);
+    return value ? atoi(value) : def;
+}
+
+bool query_bool(const QueryParam *params, size_t count, const char *key, bool def) {
+    const char *value = query_value(params, count, key);
+    if (!value) {
+        return def;
+    }
+    return !strcmp(value, "1") || !strcmp(value, "true");
 }
-#endif
\ No newline at end of file